@@ -1,53 +1,15 @@
 #include "Tree.h"
+#include "tree_internal.h"
 #include "HashMap.h"
 #include "path_utils.h"
 #include "safe_allocations.h"
+#include "tree_trace.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
-
-#define READER 1
-#define WRITER 0
-
-/** Generic success code **/
-#define SUCCESS 0
-/** Error code for when an ancestor is being moved to its descendant **/
-#define EMOVINGANCESTOR (-1)
-
-/** Checks if the directory represents the root **/
-#define IS_ROOT(path) (strcmp(path, "/") == 0)
-
-/** Checks whether the result of a pthread_* function is 0 (SUCCESS) **/
-#define PTHREAD_CHECK(x)                                                          \
-    do {                                                                          \
-        int err = (x);                                                            \
-        if (err != SUCCESS) {                                                     \
-            fprintf(stderr, "Runtime error: %s returned %d in %s at %s:%d\n%s\n", \
-                #x, err, __func__, __FILE__, __LINE__, strerror(err));            \
-            exit(EXIT_FAILURE);                                                   \
-        }                                                                         \
-    } while (0)
-
-/** Performs a block of code under the node's mutex **/
-#define UNDER_MUTEX(mutex, code_block)           \
-do {                                             \
-    PTHREAD_CHECK(pthread_mutex_lock(mutex));    \
-    code_block;                                  \
-    PTHREAD_CHECK(pthread_mutex_unlock(mutex));  \
-} while(0);
-
-struct Tree {
-    Tree* parent;                            /** Parent directory. NULL for the root **/
-    HashMap* subdirectories;                 /** HashMap of (name, node) pairs, where node is of type Tree **/
-    pthread_mutex_t var_protection;          /** Mutual exclusion for variable access **/
-    pthread_cond_t reader_cond;              /** Condition to hang readers **/
-    pthread_cond_t writer_cond;              /** Condition to hang writers **/
-    pthread_cond_t subtree_cond;             /** Condition to wait on until all subtree operations finish **/
-    size_t r_count, w_count, r_wait, w_wait; /** Counters of active and waiting readers/writers **/
-    size_t refcount;                         /** Reference count of operations currently performed in the subtree **/
-};
+#include <unistd.h>
 
 /**
  * Removes and returns a subdirectory of the `tree` with the specified name.
@@ -70,30 +32,160 @@ static inline size_t subdir_count(Tree* tree) {
     return hmap_size(tree->subdirectories);
 }
 
+/** Gets the fairness policy of the node's tree **/
+static inline TreeLockPolicy lock_policy(Tree* tree) {
+    return tree->context->options.lock_policy;
+}
+
+/** Shortest spin before parking, in `cpu_relax` rounds **/
+#define SPIN_MIN 16
+/** Longest spin before parking, in `cpu_relax` rounds **/
+#define SPIN_MAX 4096
+/** Longest pause between two looks at the lock, in `cpu_relax` rounds **/
+#define BACKOFF_MAX 64
+
+/** Number of threads currently spinning on the nodes of any tree in the process **/
+static atomic_size_t spinners;
+
 /**
- * Called by a read-type operation to lock the tree for reading.
- * Waits if there are other active or waiting writers.
- * @param tree : file tree
+ * Counts the writers waiting for a node, whether parked or still spinning.
+ * Must be called with `var_protection` held.
+ * @param tree : node being locked
+ * @return : number of waiting writers
  */
-static void reader_lock(Tree* tree) {
-    UNDER_MUTEX(&tree->var_protection,
-        if (tree->w_wait || tree->w_count) {
-            tree->r_wait++;
-            do {
-                PTHREAD_CHECK(pthread_cond_wait(&tree->reader_cond, &tree->var_protection));
-            } while (tree->w_count > 0);
-            tree->r_wait--;
+static inline size_t writers_waiting(Tree* tree) {
+    return tree->w_wait + tree->w_spin;
+}
+
+/**
+ * Checks if an arriving reader has to wait. Must be called with `var_protection` held.
+ * @param tree : node being locked
+ * @return : whether the reader has to wait
+ */
+static bool reader_blocked(Tree* tree) {
+    switch (lock_policy(tree)) {
+        case TREE_LOCK_READER_PREFERENCE:
+            return tree->w_count > 0;
+        case TREE_LOCK_BOUNDED_BYPASS: {
+            size_t limit = tree->context->options.bypass_limit;
+            return tree->w_count > 0 || (writers_waiting(tree) > 0 && tree->bypass >= (limit ? limit : TREE_DEFAULT_BYPASS_LIMIT));
         }
-        assert(tree->w_count == 0);
-        tree->r_count++;
-    );
+        default:
+            return tree->w_count > 0 || writers_waiting(tree) > 0;
+    }
 }
 
 /**
- * Called by a read-type operation to unlock the tree from reading.
- * @param tree : file tree
+ * Checks if an arriving writer has to wait. Must be called with `var_protection` held.
+ * @param tree : node being locked
+ * @return : whether the writer has to wait
  */
-static void reader_unlock(Tree* tree) {
+static bool writer_blocked(Tree* tree) {
+    return tree->r_count || tree->w_count || tree->r_grant;
+}
+
+/**
+ * Checks if a reader woken up may proceed. Must be called with `var_protection` held.
+ * Under phase-fairness only readers admitted by a finishing writer may, which makes them
+ * immune to writers barging in before they wake up.
+ * @param tree : node being locked
+ * @return : whether the reader may proceed
+ */
+static bool reader_may_proceed(Tree* tree) {
+    switch (lock_policy(tree)) {
+        case TREE_LOCK_PHASE_FAIR:
+            if (tree->r_grant == 0)
+                return false;
+            tree->r_grant--;
+            return true;
+        case TREE_LOCK_WRITER_PREFERENCE:
+            return tree->w_count == 0 && writers_waiting(tree) == 0;
+        default:
+            return tree->w_count == 0;
+    }
+}
+
+/**
+ * Locks `var_protection` of a node, first spinning until `blocked` turns false if it isn't already.
+ * The spin is bounded by twice the node's recent successful spins and backs off exponentially
+ * between looks at the node. Nobody spins when the spinners of all trees would occupy all CPUs,
+ * as they would then only delay the threads they are waiting for. A spinning writer counts
+ * as waiting in `w_spin`, so that the lock policy holds arriving readers back for it as for a parked one.
+ * @param tree : node being locked
+ * @param blocked : predicate telling whether the caller would have to park
+ * @param writer : whether the caller is a writer
+ * @return : when the caller found the node blocked, from `WAIT_CLOCK`, 0 if it didn't
+ */
+static uint64_t spin_then_lock(Tree* tree, bool (*blocked)(Tree*), bool writer) {
+    TreeContext* context = tree->context;
+    PTHREAD_CHECK(pthread_mutex_lock(&tree->var_protection));
+    if (!blocked(tree))
+        return 0;
+    uint64_t since = WAIT_CLOCK();
+    if (context->options.park_immediately)
+        return since;
+    if (atomic_fetch_add(&spinners, 1) + 1 >= context->cpus) {
+        atomic_fetch_sub(&spinners, 1);
+        return since; // Oversubscribed
+    }
+    if (writer)
+        tree->w_spin++;
+
+    size_t limit = 2 * tree->spin_estimate + SPIN_MIN, spins = 0, backoff = 1;
+    if (limit > SPIN_MAX)
+        limit = SPIN_MAX;
+    do {
+        PTHREAD_CHECK(pthread_mutex_unlock(&tree->var_protection));
+        for (size_t i = 0; i < backoff; i++)
+            cpu_relax();
+        spins += backoff;
+        if (backoff < BACKOFF_MAX)
+            backoff *= 2;
+        PTHREAD_CHECK(pthread_mutex_lock(&tree->var_protection));
+    } while (blocked(tree) && spins < limit);
+    if (writer)
+        tree->w_spin--; // Either takes the lock or parks as a waiting writer without letting go of the mutex
+    atomic_fetch_sub(&spinners, 1);
+
+    if (blocked(tree))
+        tree->spin_estimate -= tree->spin_estimate / 4; // The lock is held for longer than it's worth spinning
+    else
+        tree->spin_estimate = (7 * tree->spin_estimate + spins) / 8;
+    return since;
+}
+
+int reader_lock_until(Tree* tree, const struct timespec* deadline) {
+    uint64_t since = spin_then_lock(tree, reader_blocked, false);
+    if (reader_blocked(tree)) {
+        tree->r_wait++;
+        while (true) {
+            int err = cond_wait_until(&tree->reader_cond, &tree->var_protection, deadline);
+            if (reader_may_proceed(tree))
+                break;
+            if (err == ETIMEDOUT) {
+                tree->r_wait--;
+                PTHREAD_CHECK(pthread_mutex_unlock(&tree->var_protection));
+                return ETIMEDOUT;
+            }
+        }
+        tree->r_wait--;
+    }
+    else if (writers_waiting(tree) > 0) {
+        tree->bypass++;
+    }
+    assert(tree->w_count == 0);
+    tree->r_count++;
+    PTHREAD_CHECK(pthread_mutex_unlock(&tree->var_protection));
+    STATS_ACQUIRED(tree, since);
+    EVENT_WAITED(since, EVENT_LOCK_WAIT, event_depth());
+    return SUCCESS;
+}
+
+void reader_lock(Tree* tree) {
+    reader_lock_until(tree, NULL);
+}
+
+void reader_unlock(Tree* tree) {
     UNDER_MUTEX(&tree->var_protection,
         assert(tree->r_count > 0);
         assert(tree->w_count == 0);
@@ -104,127 +196,337 @@ static void reader_unlock(Tree* tree) {
     );
 }
 
-/**
- * Called by a write-type operation to lock the tree for writing.
- * Waits if there are other active readers or writers.
- * @param tree : file tree
- */
-static void writer_lock(Tree* tree) {
-    UNDER_MUTEX(&tree->var_protection,
-        while (tree->r_count || tree->w_count) {
-            tree->w_wait++;
-            PTHREAD_CHECK(pthread_cond_wait(&tree->writer_cond, &tree->var_protection));
-            tree->w_wait--;
+int writer_lock_until(Tree* tree, const struct timespec* deadline) {
+    uint64_t since = spin_then_lock(tree, writer_blocked, true);
+    while (writer_blocked(tree)) {
+        tree->w_wait++;
+        int err = cond_wait_until(&tree->writer_cond, &tree->var_protection, deadline);
+        tree->w_wait--;
+        if (err == ETIMEDOUT && writer_blocked(tree)) {
+            if (tree->w_count == 0 && writers_waiting(tree) == 0 && tree->r_wait > 0) {
+                // Readers held back for this writer would otherwise wait for a write phase that never comes
+                if (lock_policy(tree) == TREE_LOCK_PHASE_FAIR)
+                    tree->r_grant = tree->r_wait;
+                PTHREAD_CHECK(pthread_cond_broadcast(&tree->reader_cond));
+            }
+            PTHREAD_CHECK(pthread_mutex_unlock(&tree->var_protection));
+            return ETIMEDOUT;
         }
-        assert(tree->r_count == 0);
-        assert(tree->w_count == 0);
-        tree->w_count++;
-    );
+    }
+    assert(tree->r_count == 0);
+    assert(tree->w_count == 0);
+    tree->w_count++;
+    tree->bypass = 0;
+    PTHREAD_CHECK(pthread_mutex_unlock(&tree->var_protection));
+    STATS_ACQUIRED(tree, since);
+    EVENT_WAITED(since, EVENT_LOCK_WAIT, event_depth());
+    EXCLUSIVE_BEGIN(tree);
+    return SUCCESS;
 }
 
-/**
- * Called by a write-type operation to unlock the tree from writing.
- * @param tree : file tree
- */
-static void writer_unlock(Tree* tree) {
+void writer_lock(Tree* tree) {
+    writer_lock_until(tree, NULL);
+}
+
+void writer_unlock(Tree* tree) {
+    EXCLUSIVE_END(tree);
     UNDER_MUTEX(&tree->var_protection,
         assert(tree->w_count == 1);
         assert(tree->r_count == 0);
         tree->w_count--;
 
-        if (tree->r_wait > 0)
+        if (lock_policy(tree) == TREE_LOCK_WRITER_PREFERENCE && tree->w_wait > 0) {
+            PTHREAD_CHECK(pthread_cond_signal(&tree->writer_cond));
+        }
+        else if (tree->r_wait > 0) {
+            if (lock_policy(tree) == TREE_LOCK_PHASE_FAIR)
+                tree->r_grant = tree->r_wait; // Opens a read phase for everybody waiting
             PTHREAD_CHECK(pthread_cond_broadcast(&tree->reader_cond));
-        else
+        }
+        else {
             PTHREAD_CHECK(pthread_cond_signal(&tree->writer_cond));
+        }
     );
 }
 
-/**
- * Waits for all operations to finish in the subtree of the `node`.
- * @param node : node in a file tree
- */
-static void wait_until_subtree_activity_ceases(Tree* node) {
-    UNDER_MUTEX(&node->var_protection, // This is only to satisfy `pthread_cond_wait`
-        while (node->refcount > 0)     // Wait if necessary
-            PTHREAD_CHECK(pthread_cond_wait(&node->subtree_cond, &node->var_protection));
-    );
+void propagate_size(Tree* node, ssize_t delta) {
+    if (delta == 0)
+        return;
+
+    PTHREAD_CHECK(pthread_mutex_lock(&node->var_protection));
+    while (node) {
+        node->descendants += delta;
+        Tree* parent = node->parent;
+        if (parent)
+            PTHREAD_CHECK(pthread_mutex_lock(&parent->var_protection));
+        PTHREAD_CHECK(pthread_mutex_unlock(&node->var_protection));
+        node = parent;
+    }
 }
 
-/**
- * Performs a cleanup along the path - decrements reference counters from `start` to `end` inclusive.
- * @param start : first node on the path
- * @param end : last node on the path
- */
-static void unwind_path(Tree *start, Tree *end) {
-    Tree* next = NULL;
-    while (start != end){
-        UNDER_MUTEX(&start->var_protection,
-            next = start->parent;
-            start->refcount--;
-            if (start->refcount == 0)
-                PTHREAD_CHECK(pthread_cond_signal(&start->subtree_cond));
-        );
-        start = next;
+bool path_moved(Tree* node, uint64_t epoch) {
+    if (move_epoch(node) == epoch)
+        return false; // Nothing has been moved at all
+
+    bool moved = false;
+    PTHREAD_CHECK(pthread_mutex_lock(&node->var_protection));
+    while (node && !moved) {
+        moved = node->moved_at > epoch;
+        Tree* parent = moved ? NULL : node->parent;
+        if (parent)
+            PTHREAD_CHECK(pthread_mutex_lock(&parent->var_protection));
+        PTHREAD_CHECK(pthread_mutex_unlock(&node->var_protection));
+        node = parent;
     }
+    return moved;
 }
 
-/**
- * Gets a pointer to the directory in the `tree` specified by the `path`.
- * Locks the directory according to the `reader` flag.
- * Doesn't lock the node it starts the search from if `lock_start` is false.
- * @param tree : file tree
- * @param path : file path
- * @param start_locked : flag for locking the start node
- * @param reader : flag for locking the directory as a reader or as a writer
- * @return : pointer to the requested directory
- */
-static Tree* get_node(Tree* tree, const char* path, bool start_locked, const bool reader) {
+int publish_begin(Tree* node, uint64_t epoch, bool move, PublishMode* published) {
+    TreeContext* context = node->context;
+    PublishGate* gate = &context->publish_gate;
+    *published = PUBLISH_NONE;
+    if (!context->journal && !watch_active(context->watches))
+        return SUCCESS;
+
+    PTHREAD_CHECK(pthread_mutex_lock(&gate->mutex));
+    if (move) {
+        gate->waiting++;
+        while (gate->exclusive || gate->shared > 0)
+            PTHREAD_CHECK(pthread_cond_wait(&gate->changed, &gate->mutex));
+        gate->waiting--;
+        gate->exclusive = true;
+    }
+    else {
+        // Waiting moves go first, or a steady stream of other modifications could hold them off forever
+        while (gate->exclusive || gate->waiting > 0)
+            PTHREAD_CHECK(pthread_cond_wait(&gate->changed, &gate->mutex));
+        gate->shared++;
+    }
+    PTHREAD_CHECK(pthread_mutex_unlock(&gate->mutex));
+    *published = move ? PUBLISH_EXCLUSIVE : PUBLISH_SHARED;
+
+    if (path_moved(node, epoch)) {
+        publish_end(node, *published);
+        *published = PUBLISH_NONE;
+        return EPATHMOVED;
+    }
+    return SUCCESS;
+}
+
+void publish_end(Tree* node, PublishMode published) {
+    PublishGate* gate = &node->context->publish_gate;
+    if (published == PUBLISH_NONE)
+        return;
+    UNDER_MUTEX(&gate->mutex,
+        if (published == PUBLISH_EXCLUSIVE)
+            gate->exclusive = false;
+        else
+            gate->shared--;
+        if (!gate->exclusive && gate->shared == 0)
+            PTHREAD_CHECK(pthread_cond_broadcast(&gate->changed));
+    );
+}
+
+/** Performs `get_node_until` **/
+static int lock_path_until(Tree* tree, const char* path, bool start_locked, const bool reader,
+                           const struct timespec* deadline, Tree** result) {
     char child_name[MAX_FOLDER_NAME_LENGTH + 1];
-    Tree* end = NULL;
+    unsigned depth = 0;
+    int err = SUCCESS;
 
+    EVENT_DEPTH(depth);
     if (!start_locked) {
         if (IS_ROOT(path) && !reader)
-            writer_lock(tree);
+            err = writer_lock_until(tree, deadline);
         else
-            reader_lock(tree);
-
-        UNDER_MUTEX(&tree->var_protection, tree->refcount++);
-        end = tree->parent;
+            err = reader_lock_until(tree, deadline);
+        if (err != SUCCESS)
+            return err;
     }
 
     while ((path = split_path(path, child_name))) {
         Tree* subtree = hmap_get(tree->subdirectories, child_name);
         if (subtree == NULL) {
-            unwind_path(tree, end);
             if (!start_locked)
                 reader_unlock(tree);
-            return NULL;
+            return ENOENT;
         }
+        EVENT_DEPTH(++depth);
         if (IS_ROOT(path) && !reader) // Last node in the path
-            writer_lock(subtree);
+            err = writer_lock_until(subtree, deadline);
         else
-            reader_lock(subtree);
-        UNDER_MUTEX(&subtree->var_protection, subtree->refcount++);
+            err = reader_lock_until(subtree, deadline);
         if (!start_locked)
             reader_unlock(tree);
         else
             start_locked = false;
+        if (err != SUCCESS)
+            return err;
         tree = subtree;
     }
-    return tree;
+    *result = tree;
+    return SUCCESS;
 }
 
-Tree* tree_new() {
+int get_node_since(Tree* tree, const char* path, const bool reader, const struct timespec* deadline,
+                   uint64_t* epoch, Tree** result) {
+    EVENT_BEGIN(started);
+    int err;
+    while (true) {
+        *epoch = move_epoch(tree);
+        if ((err = lock_path_until(tree, path, false, reader, deadline, result)) != SUCCESS)
+            break;
+        if (!path_moved(*result, *epoch))
+            break;
+        // The path led here through a directory moved since, so it may lead elsewhere now
+        if (reader)
+            reader_unlock(*result);
+        else
+            writer_unlock(*result);
+    }
+    EVENT_END(started, EVENT_PATH_WALK, 0);
+    return err;
+}
+
+int get_node_until(Tree* tree, const char* path, bool start_locked, const bool reader,
+                   const struct timespec* deadline, Tree** result) {
+    if (!start_locked) {
+        uint64_t epoch = 0;
+        return get_node_since(tree, path, reader, deadline, &epoch, result);
+    }
+    // Nothing below the locked start can be moved before the walk passes it
+    EVENT_BEGIN(started);
+    int err = lock_path_until(tree, path, start_locked, reader, deadline, result);
+    EVENT_END(started, EVENT_PATH_WALK, 0);
+    return err;
+}
+
+Tree* get_node(Tree* tree, const char* path, bool start_locked, const bool reader) {
+    Tree* node = NULL;
+    get_node_until(tree, path, start_locked, reader, NULL, &node);
+    return node;
+}
+
+Tree* lock_subtree(Tree* tree, const char* path) {
+    if (USES_INTENTION_LOCKS(tree)) {
+        Tree* node = NULL;
+        intention_lock_path(tree, path, LOCK_S, NULL, &node);
+        return node;
+    }
+    return get_node(tree, path, false, READER);
+}
+
+void unlock_subtree(Tree* node) {
+    if (USES_INTENTION_LOCKS(node))
+        intention_unlock_path(node, LOCK_S);
+    else
+        reader_unlock(node);
+}
+
+void subtree_lock(Tree* node) {
+    if (!USES_INTENTION_LOCKS(node)) // Covered by the subtree's S lock otherwise
+        reader_lock(node);
+}
+
+void subtree_unlock(Tree* node) {
+    if (!USES_INTENTION_LOCKS(node))
+        reader_unlock(node);
+}
+
+/** A directory whose subdirectories are being expanded by `tree_walk` **/
+typedef struct WalkFrame {
+    Tree* node;          /** Reader-locked directory **/
+    HashMapIterator it;  /** Position among the directory's subdirectories **/
+    size_t path_len;     /** Length of the directory's path **/
+} WalkFrame;
+
+void walk_subtree(Tree* start, const char* path, NodeVisitor visitor, void* ctx) {
+    size_t path_capacity = MAX_PATH_LENGTH + 1, stack_capacity = 16 * sizeof(WalkFrame), depth = 0;
+    char* buff = safe_malloc(path_capacity);
+    WalkFrame* stack = safe_malloc(stack_capacity);
+    const char* name = NULL;
+    void* value = NULL;
+
+    strcpy(buff, path);
+    stack[0] = (WalkFrame) {start, hmap_iterator(start->subdirectories), strlen(path)};
+    while (true) {
+        WalkFrame* top = &stack[depth];
+        if (!hmap_next(top->node->subdirectories, &top->it, &name, &value)) {
+            if (depth == 0)
+                break;
+            subtree_unlock(top->node);
+            depth--;
+            buff[stack[depth].path_len] = '\0';
+            continue;
+        }
+        Tree* child = value;
+        subtree_lock(child);
+        if (!visitor(buff, name, child, ctx)) {
+            subtree_unlock(child);
+            break;
+        }
+
+        size_t name_len = strlen(name), child_len = top->path_len + name_len + 1;
+        reserve_buffer((void**) &buff, &path_capacity, child_len + 1);
+        memcpy(buff + top->path_len, name, name_len);
+        buff[child_len - 1] = '/';
+        buff[child_len] = '\0';
+
+        reserve_buffer((void**) &stack, &stack_capacity, (depth + 2) * sizeof(WalkFrame));
+        stack[++depth] = (WalkFrame) {child, hmap_iterator(child->subdirectories), child_len};
+    }
+    while (depth > 0)
+        subtree_unlock(stack[depth--].node);
+
+    free(stack);
+    free(buff);
+}
+
+/**
+ * Allocates and initializes an empty, unlinked directory.
+ * @param parent : parent directory, NULL for the root
+ * @param context : state shared by the whole tree
+ * @return : pointer to the new directory
+ */
+static Tree* node_alloc(Tree* parent, TreeContext* context) {
     Tree* tree = safe_calloc(1, sizeof(Tree));
+    tree->parent = parent;
+    tree->context = context;
     tree->subdirectories = hmap_new();
     PTHREAD_CHECK(pthread_mutex_init(&tree->var_protection, NULL));
-    PTHREAD_CHECK(pthread_cond_init(&tree->reader_cond, NULL));
-    PTHREAD_CHECK(pthread_cond_init(&tree->writer_cond, NULL));
-    PTHREAD_CHECK(pthread_cond_init(&tree->subtree_cond, NULL));
+    cond_init_monotonic(&tree->reader_cond);
+    cond_init_monotonic(&tree->writer_cond);
+    ilock_init(&tree->intention);
 
     return tree;
 }
 
+Tree* node_new(Tree* parent) {
+    return node_alloc(parent, parent->context);
+}
+
+Tree* tree_new() {
+    return tree_new_with_options(NULL);
+}
+
+Tree* tree_new_with_options(const TreeOptions* options) {
+    TreeContext* context = safe_calloc(1, sizeof(TreeContext));
+    if (options)
+        context->options = *options;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    context->cpus = online > 0 ? (size_t) online : 1;
+    atomic_init(&context->moves, 0);
+    PTHREAD_CHECK(pthread_mutex_init(&context->publish_gate.mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&context->publish_gate.changed, NULL));
+    context->snapshots = cow_new();
+    context->watches = watch_new();
+#ifdef TREE_STATS
+    PTHREAD_CHECK(pthread_mutex_init(&context->retired_lock, NULL));
+#endif
+
+    return node_alloc(NULL, context);
+}
+
 void tree_free(Tree* tree) {
     const char* key = NULL;
     void* value = NULL;
@@ -236,95 +538,217 @@ void tree_free(Tree* tree) {
     }
 
     hmap_free(tree->subdirectories);
+    cow_forget(tree);
+    if (!tree->parent) {
+        cow_free(tree->context->snapshots);
+        watch_free(tree->context->watches);
+        PTHREAD_CHECK(pthread_cond_destroy(&tree->context->publish_gate.changed));
+        PTHREAD_CHECK(pthread_mutex_destroy(&tree->context->publish_gate.mutex));
+#ifdef TREE_STATS
+        PTHREAD_CHECK(pthread_mutex_destroy(&tree->context->retired_lock));
+#endif
+        free(tree->context); // Only the root owns the context
+    }
+    else {
+        STATS_RETIRE(tree);
+    }
+    ilock_destroy(&tree->intention);
     PTHREAD_CHECK(pthread_cond_destroy(&tree->writer_cond));
     PTHREAD_CHECK(pthread_cond_destroy(&tree->reader_cond));
-    PTHREAD_CHECK(pthread_cond_destroy(&tree->subtree_cond));
     PTHREAD_CHECK(pthread_mutex_destroy(&tree->var_protection));
     free(tree);
     tree = NULL;
 }
 
-char* tree_list(Tree* tree, const char* path) {
+/** Performs `tree_list_timed` **/
+static int list_until(Tree* tree, const char* path, const struct timespec* deadline, char** result) {
     if (!is_valid_path(path))
-        return NULL;
+        return EINVAL; // Invalid path
+    if (USES_INTENTION_LOCKS(tree))
+        return intention_list(tree, path, deadline, result);
 
-    char* result = NULL;
-    Tree* dir = get_node(tree, path, false, READER);
-    if (!dir) {
-        return NULL; // The directory doesn't exist
+    Tree* dir = NULL;
+    int err = get_node_until(tree, path, false, READER, deadline, &dir);
+    if (err != SUCCESS) {
+        return err; // The directory doesn't exist or the deadline passed
     }
 
-    result = make_map_contents_string(dir->subdirectories); // The read
+    EVENT_BEGIN(listing);
+    *result = make_map_contents_string(dir->subdirectories); // The read
+    EVENT_END(listing, EVENT_LISTING, 0);
 
-    unwind_path(dir, NULL);
     reader_unlock(dir);
+    return SUCCESS;
+}
+
+char* tree_list(Tree* tree, const char* path) {
+    char* result = NULL;
+    tree_list_timed(tree, path, NULL, &result);
     return result;
 }
 
-int tree_create(Tree* tree, const char* path) {
+int tree_list_timed(Tree* tree, const char* path, const struct timespec* deadline, char** result) {
+    TRACE_BEGIN(started);
+    EVENT_BEGIN(span);
+    int err = list_until(tree, path, deadline, result);
+    EVENT_END(span, EVENT_LIST, 0);
+    TRACE_END(started, TRACE_LIST, path, NULL, err);
+    return err;
+}
+
+/** Performs `tree_create_timed` **/
+static int create_until(Tree* tree, const char* path, const struct timespec* deadline) {
     if (!is_valid_path(path))
         return EINVAL; // Invalid path
     if (IS_ROOT(path))
         return EEXIST; // The root always exists
+    if (USES_INTENTION_LOCKS(tree))
+        return intention_create(tree, path, deadline);
 
     char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
     make_path_to_parent(path, child_name, parent_path);
 
-    Tree* parent = get_node(tree, parent_path, false, WRITER);
-    if (!parent) {
-        return ENOENT; // The directory's parent doesn't exist
+    Tree* parent = NULL;
+    uint64_t epoch = 0;
+    PublishMode published = PUBLISH_NONE;
+    int err = get_node_since(tree, parent_path, WRITER, deadline, &epoch, &parent);
+    if (err != SUCCESS) {
+        return err; // The directory's parent doesn't exist or the deadline passed
+    }
+    if (publish_begin(parent, epoch, false, &published) != SUCCESS) {
+        writer_unlock(parent);
+        return EPATHMOVED; // The parent was moved since it was found
+    }
+    if (cow_enter(tree, deadline) != SUCCESS) {
+        publish_end(parent, published);
+        writer_unlock(parent);
+        return ETIMEDOUT; // A snapshot being taken held the modification off until the deadline
     }
 
-    Tree* child = tree_new();
-    child->parent = parent;
-    if (!hmap_insert(parent->subdirectories, child_name, child)) {
-        unwind_path(parent, NULL);
+    bool inserted = false;
+    Tree* child = node_new(parent);
+    UNDER_MUTEX(&parent->var_protection,
+        cow_preserve(parent);
+        inserted = hmap_insert(parent->subdirectories, child_name, child);
+    );
+    cow_leave(tree);
+    if (!inserted) {
+        publish_end(parent, published);
         writer_unlock(parent);
         tree_free(child);
         return EEXIST; // The directory already exists
     }
 
-    unwind_path(parent, NULL);
+    propagate_size(parent, 1);
+    journal_append(parent, JOURNAL_CREATE, path, NULL);
+    watch_notify(parent, JOURNAL_CREATE, path, NULL);
+    publish_end(parent, published);
     writer_unlock(parent);
     return SUCCESS;
 }
 
-int tree_remove(Tree* tree, const char* path) {
+int tree_create(Tree* tree, const char* path) {
+    return tree_create_timed(tree, path, NULL);
+}
+
+int tree_create_timed(Tree* tree, const char* path, const struct timespec* deadline) {
+    TRACE_BEGIN(started);
+    EVENT_BEGIN(span);
+    int err;
+    do {
+        err = create_until(tree, path, deadline);
+    } while (err == EPATHMOVED);
+    if (err == SUCCESS)
+        err = journal_wait(); // After releasing every lock, so that others can join the same batch
+    EVENT_END(span, EVENT_CREATE, 0);
+    TRACE_END(started, TRACE_CREATE, path, NULL, err);
+    return err;
+}
+
+/** Performs `tree_remove_timed` **/
+static int remove_until(Tree* tree, const char* path, const struct timespec* deadline) {
     if (IS_ROOT(path))
         return EBUSY; // Cannot remove the root
+    if (USES_INTENTION_LOCKS(tree))
+        return intention_remove(tree, path, deadline);
 
     char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
     make_path_to_parent(path, child_name, parent_path);
 
-    Tree* parent = get_node(tree, parent_path, false, WRITER);
-    if (!parent) {
-        return ENOENT; // The directory's parent doesn't exist
+    Tree* parent = NULL;
+    uint64_t epoch = 0;
+    PublishMode published = PUBLISH_NONE;
+    int err = get_node_since(tree, parent_path, WRITER, deadline, &epoch, &parent);
+    if (err != SUCCESS) {
+        return err; // The directory's parent doesn't exist or the deadline passed
     }
 
     Tree* child = hmap_get(parent->subdirectories, child_name);
     if (!child) {
-        unwind_path(parent, NULL);
         writer_unlock(parent);
         return ENOENT; // The directory doesn't exist
     }
-    writer_lock(child);
+    uint64_t since = WAIT_CLOCK();
+    if (writer_lock_until(child, deadline) != SUCCESS) {
+        writer_unlock(parent);
+        return ETIMEDOUT;
+    }
+    STATS_STALLED(child, since); // Operations still running inside the directory
+    EVENT_WAITED(since, EVENT_DRAIN_WAIT, 0);
 
     if (subdir_count(child) > 0) {
         writer_unlock(child);
-        unwind_path(parent, NULL);
         writer_unlock(parent);
         return ENOTEMPTY; // The directory is not empty
     }
-    pop_subdir(parent, child_name); // The removal
+    if (publish_begin(parent, epoch, false, &published) != SUCCESS) {
+        writer_unlock(child);
+        writer_unlock(parent);
+        return EPATHMOVED; // The parent was moved since it was found
+    }
+    if (cow_enter(tree, deadline) != SUCCESS) {
+        publish_end(parent, published);
+        writer_unlock(child);
+        writer_unlock(parent);
+        return ETIMEDOUT; // A snapshot being taken held the modification off until the deadline
+    }
+    UNDER_MUTEX(&parent->var_protection,
+        cow_preserve(parent);
+        pop_subdir(parent, child_name); // The removal
+        cow_unlinked(child);
+    );
+    cow_leave(tree);
+    journal_append(parent, JOURNAL_REMOVE, path, NULL);
+    watch_notify(parent, JOURNAL_REMOVE, path, NULL);
+    publish_end(parent, published);
 
     writer_unlock(child);
-    unwind_path(parent, NULL);
+    propagate_size(parent, -1);
     writer_unlock(parent);
-    tree_free(child);
+    cow_retire(child);
     return SUCCESS;
 }
 
-int tree_move(Tree* tree, const char* s_path, const char* t_path) {
+int tree_remove(Tree* tree, const char* path) {
+    return tree_remove_timed(tree, path, NULL);
+}
+
+int tree_remove_timed(Tree* tree, const char* path, const struct timespec* deadline) {
+    TRACE_BEGIN(started);
+    EVENT_BEGIN(span);
+    int err;
+    do {
+        err = remove_until(tree, path, deadline);
+    } while (err == EPATHMOVED);
+    if (err == SUCCESS)
+        err = journal_wait(); // After releasing every lock, so that others can join the same batch
+    EVENT_END(span, EVENT_REMOVE, 0);
+    TRACE_END(started, TRACE_REMOVE, path, NULL, err);
+    return err;
+}
+
+/** Performs `tree_move_timed` **/
+static int move_until(Tree* tree, const char* s_path, const char* t_path, const struct timespec* deadline) {
     if (!is_valid_path(s_path) || !is_valid_path(t_path))
         return EINVAL; // Invalid path names
     if (IS_ROOT(s_path))
@@ -333,9 +757,14 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
         return EEXIST; // Can't assign a new root
     if (is_ancestor(s_path, t_path))
         return EMOVINGANCESTOR; // No directory can be moved to its descendant
+    if (USES_INTENTION_LOCKS(tree))
+        return intention_move(tree, s_path, t_path, deadline);
 
-    int cmp;
+    int cmp, err;
+    uint64_t epoch = 0;
+    PublishMode published = PUBLISH_NONE;
     size_t index_after_lca;
+    ssize_t moved = 0; // Size of the moved subtree, including its root
     char s_name[MAX_FOLDER_NAME_LENGTH + 1], t_name[MAX_FOLDER_NAME_LENGTH + 1];
     char s_parent_path[MAX_PATH_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1], lca_path[MAX_PATH_LENGTH + 1];
     Tree *s_dir = NULL, *s_parent = NULL, *t_parent = NULL, *lca = NULL;
@@ -343,38 +772,31 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
     make_path_to_parent(t_path, t_name, t_parent_path);
     make_path_to_LCA(s_path, t_path, lca_path);
     // Get the LCA of both directories
-    if (!(lca = get_node(tree, lca_path, false, WRITER))) {
-        return ENOENT; // Non-existent paths
+    if ((err = get_node_since(tree, lca_path, WRITER, deadline, &epoch, &lca)) != SUCCESS) {
+        return err; // Non-existent paths or the deadline passed
     }
     index_after_lca = strlen(lca_path) - 1;
     // Determine whether to lock two nodes
     cmp = strcmp(s_parent_path, t_parent_path);
     if (cmp != 0) {
-        #define CLEANUP()                       \
-            do {                                \
-                if (s_parent != lca) {          \
-                    unwind_path(s_parent, lca); \
-                    writer_unlock(s_parent);    \
-                }                               \
-                if (t_parent != lca) {          \
-                    unwind_path(t_parent, lca); \
-                    writer_unlock(t_parent);    \
-                }                               \
-                unwind_path(lca, NULL);         \
-                writer_unlock(lca);             \
+        #define CLEANUP()                    \
+            do {                             \
+                if (s_parent != lca)         \
+                    writer_unlock(s_parent); \
+                if (t_parent != lca)         \
+                    writer_unlock(t_parent); \
+                writer_unlock(lca);          \
             } while (0)
 
-        if (!(s_parent = get_node(lca, s_parent_path + index_after_lca, true, WRITER))) {
+        if ((err = get_node_until(lca, s_parent_path + index_after_lca, true, WRITER, deadline, &s_parent)) != SUCCESS) {
             writer_unlock(lca);
-            return ENOENT; // The source's parent doesn't exist
+            return err; // The source's parent doesn't exist or the deadline passed
         }
-        if (!(t_parent = get_node(lca, t_parent_path + index_after_lca, true, WRITER))) {
-            if (s_parent != lca) {
-                unwind_path(s_parent, lca);
+        if ((err = get_node_until(lca, t_parent_path + index_after_lca, true, WRITER, deadline, &t_parent)) != SUCCESS) {
+            if (s_parent != lca)
                 writer_unlock(s_parent);
-            }
             writer_unlock(lca);
-            return ENOENT; // The source's parent doesn't exist
+            return err; // The target's parent doesn't exist or the deadline passed
         }
         // Find source
         if (!(s_dir = hmap_get(s_parent->subdirectories, s_name))) {
@@ -390,29 +812,50 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
             CLEANUP();
             return EEXIST; // There already exists a directory with the same name as the target
         }
-        wait_until_subtree_activity_ceases(s_dir);
-        // Pop and insert the source
-        pop_subdir(s_parent, s_name);
-        s_dir->parent = t_parent;
-        hmap_insert(t_parent->subdirectories, t_name, s_dir);
+        if (publish_begin(lca, epoch, true, &published) != SUCCESS) {
+            CLEANUP();
+            return EPATHMOVED; // The LCA was moved since it was found
+        }
+        if (cow_enter(tree, deadline) != SUCCESS) {
+            publish_end(lca, published);
+            CLEANUP();
+            return ETIMEDOUT; // A snapshot being taken held the move off until the deadline
+        }
+        // Pop and insert the source. Operations still running inside it carry on,
+        // and the ones that have passed it on their way start over from the root
+        UNDER_MUTEX(&s_parent->var_protection,
+            cow_preserve(s_parent);
+            pop_subdir(s_parent, s_name);
+        );
+        UNDER_MUTEX(&t_parent->var_protection,
+            cow_preserve(t_parent);
+            hmap_insert(t_parent->subdirectories, t_name, s_dir);
+        );
+        UNDER_MUTEX(&s_dir->var_protection,
+            moved = s_dir->descendants + 1;
+            s_dir->parent = t_parent;
+            mark_moved(s_dir);
+        );
+        cow_leave(tree);
+        propagate_size(s_parent, -moved);
+        propagate_size(t_parent, moved);
+        journal_append(lca, JOURNAL_MOVE, s_path, t_path);
+        watch_notify(lca, JOURNAL_MOVE, s_path, t_path);
+        publish_end(lca, published);
         CLEANUP();
         #undef CLEANUP
     }
     else {
-        #define CLEANUP()                       \
-            do {                                \
-                if (s_parent != lca) {          \
-                    unwind_path(s_parent, lca); \
-                    writer_unlock(s_parent);    \
-                }                               \
-                unwind_path(lca, NULL);         \
-                writer_unlock(lca);             \
+        #define CLEANUP()                    \
+            do {                             \
+                if (s_parent != lca)         \
+                    writer_unlock(s_parent); \
+                writer_unlock(lca);          \
             } while (0)
 
-        if (!(s_parent = get_node(lca, s_parent_path + index_after_lca, true, WRITER))) {
-            unwind_path(lca, NULL);
+        if ((err = get_node_until(lca, s_parent_path + index_after_lca, true, WRITER, deadline, &s_parent)) != SUCCESS) {
             writer_unlock(lca);
-            return ENOENT; // The source's parent doesn't exist
+            return err; // The source's parent doesn't exist or the deadline passed
         }
         t_parent = s_parent;
         // Find source
@@ -433,12 +876,175 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
             CLEANUP();
             return EEXIST; // There already exists a directory with the same name as the target
         }
-        wait_until_subtree_activity_ceases(s_dir);
+        if (publish_begin(lca, epoch, true, &published) != SUCCESS) {
+            CLEANUP();
+            return EPATHMOVED; // The LCA was moved since it was found
+        }
+        if (cow_enter(tree, deadline) != SUCCESS) {
+            publish_end(lca, published);
+            CLEANUP();
+            return ETIMEDOUT; // A snapshot being taken held the move off until the deadline
+        }
         // Pop and insert the source
-        s_dir = pop_subdir(s_parent, s_name);
-        hmap_insert(t_parent->subdirectories, t_name, s_dir);
-        s_dir->parent = t_parent;
+        UNDER_MUTEX(&s_parent->var_protection,
+            cow_preserve(s_parent);
+            s_dir = pop_subdir(s_parent, s_name);
+            hmap_insert(t_parent->subdirectories, t_name, s_dir);
+        );
+        UNDER_MUTEX(&s_dir->var_protection, mark_moved(s_dir)); // Renamed
+        cow_leave(tree);
+        journal_append(lca, JOURNAL_MOVE, s_path, t_path);
+        watch_notify(lca, JOURNAL_MOVE, s_path, t_path);
+        publish_end(lca, published);
         CLEANUP();
+        #undef CLEANUP
+    }
+    return SUCCESS;
+}
+
+int tree_move(Tree* tree, const char* s_path, const char* t_path) {
+    return tree_move_timed(tree, s_path, t_path, NULL);
+}
+
+int tree_move_timed(Tree* tree, const char* s_path, const char* t_path, const struct timespec* deadline) {
+    TRACE_BEGIN(started);
+    EVENT_BEGIN(span);
+    int err;
+    do {
+        err = move_until(tree, s_path, t_path, deadline);
+    } while (err == EPATHMOVED);
+    if (err == SUCCESS)
+        err = journal_wait(); // After releasing every lock, so that others can join the same batch
+    EVENT_END(span, EVENT_MOVE, 0);
+    TRACE_END(started, TRACE_MOVE, s_path, t_path, err);
+    return err;
+}
+
+/**
+ * Locks a directory for reading its own state, leaving its subtree open to modifications:
+ * in LOCK_IS with intention locks, which only conflicts with removing or moving the directory itself,
+ * and read-locked otherwise. Its subdirectory map has to be read under `var_protection`.
+ * @param tree : file tree
+ * @param path : valid file path
+ * @return : pointer to the locked directory, NULL if it doesn't exist
+ */
+static Tree* lock_shared(Tree* tree, const char* path) {
+    if (USES_INTENTION_LOCKS(tree)) {
+        Tree* node = NULL;
+        intention_lock_path(tree, path, LOCK_IS, NULL, &node);
+        return node;
     }
+    return get_node(tree, path, false, READER);
+}
+
+/**
+ * Releases a directory locked by `lock_shared`.
+ * @param node : locked directory
+ */
+static void unlock_shared(Tree* node) {
+    if (USES_INTENTION_LOCKS(node))
+        intention_unlock_path(node, LOCK_IS);
+    else
+        reader_unlock(node);
+}
+
+int tree_stat(Tree* tree, const char* path, TreeStat* stat) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+
+    Tree* dir = lock_shared(tree, path);
+    if (!dir) {
+        return ENOENT; // The directory doesn't exist
+    }
+
+    UNDER_MUTEX(&dir->var_protection,
+        stat->subdirectories = subdir_count(dir);
+        stat->descendants = dir->descendants;
+    );
+
+    unlock_shared(dir);
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Adds the bytes used by a single directory, without its subdirectories.
+ * The map's layout is private to HashMap.c, so its size and the size of its entries are estimated.
+ * @param node : locked directory
+ * @param usage : counters to add to
+ */
+static void count_node_memory(Tree* node, TreeMemoryUsage* usage) {
+    const char* name = NULL;
+    void* value = NULL;
+    UNDER_MUTEX(&node->var_protection,
+        HashMapIterator it = hmap_iterator(node->subdirectories);
+        while (hmap_next(node->subdirectories, &it, &name, &value))
+            usage->keys += strlen(name) + 1;
+        usage->pairs += hmap_size(node->subdirectories) * PAIR_MEMORY;
+        usage->versions += cow_version_memory(node);
+    );
+    usage->nodes += sizeof(Tree);
+    usage->maps += MAP_MEMORY;
+}
+
+/** Counts the memory of a directory visited by `walk_subtree` or `intention_walk_shared` **/
+static bool visit_memory(const char* path, const char* name, Tree* node, void* ctx) {
+    (void) path;
+    (void) name;
+    count_node_memory(node, ctx);
+    return true;
+}
+
+int tree_memory_usage(Tree* tree, const char* path, TreeMemoryUsage* usage) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+
+    // With intention locks the walk holds LOCK_IS, so that it doesn't keep writers out of the whole subtree
+    bool shared = USES_INTENTION_LOCKS(tree);
+    Tree* dir = shared ? lock_shared(tree, path) : lock_subtree(tree, path);
+    if (!dir) {
+        return ENOENT; // The directory doesn't exist
+    }
+
+    *usage = (TreeMemoryUsage) {0};
+    if (IS_ROOT(path))
+        usage->nodes += sizeof(TreeContext);
+    count_node_memory(dir, usage);
+    if (shared) {
+        intention_walk_shared(dir, path, visit_memory, usage);
+        unlock_shared(dir);
+    } else {
+        walk_subtree(dir, path, visit_memory, usage);
+        unlock_subtree(dir);
+    }
+    usage->total = usage->nodes + usage->maps + usage->pairs + usage->keys + usage->versions;
+    return SUCCESS;
+}
+
+/* A `TreeVisitor` with its context, adapted to `walk_subtree`. */
+typedef struct UserVisitor {
+    TreeVisitor visitor; /** Callback of `tree_walk` **/
+    void* ctx;           /** Its context **/
+} UserVisitor;
+
+/** Passes a directory visited by `walk_subtree` on to the user's callback **/
+static bool visit_user(const char* path, const char* name, Tree* node, void* ctx) {
+    (void) node;
+    UserVisitor* user = ctx;
+    return user->visitor(path, name, user->ctx);
+}
+
+int tree_walk(Tree* tree, const char* path, TreeVisitor visitor, void* ctx) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+
+    Tree* dir = lock_subtree(tree, path);
+    if (!dir) {
+        return ENOENT; // The directory doesn't exist
+    }
+
+    UserVisitor user = {visitor, ctx};
+    walk_subtree(dir, path, visit_user, &user);
+
+    unlock_subtree(dir);
+    return SUCCESS;
+}
@@ -1,14 +1,81 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 /* Let "Tree" mean the same as "struct Tree". */
 typedef struct Tree Tree;
 
+/* Size information about a directory, as returned by `tree_stat`. */
+typedef struct TreeStat {
+    size_t subdirectories; /** Number of immediate subdirectories **/
+    size_t descendants;    /** Number of directories in the whole subtree, excluding the directory itself **/
+} TreeStat;
+
+/*
+ * Memory used by a subtree, as returned by `tree_memory_usage`. Allocator overhead is not included.
+ * The sizes of the maps and their entries are estimates, as their layout is private to the map's implementation.
+ */
+typedef struct TreeMemoryUsage {
+    size_t nodes;    /** `Tree` nodes of the directories **/
+    size_t maps;     /** `HashMap` structures of their subdirectories **/
+    size_t pairs;    /** Entries of those maps **/
+    size_t keys;     /** Names of the subdirectories, stored as the maps' keys **/
+    size_t versions; /** Earlier maps of the directories, with their entries and names, kept for snapshots **/
+    size_t total;    /** Sum of the above **/
+} TreeMemoryUsage;
+
+/**
+ * Callback invoked by `tree_walk` for every directory of the walked subtree.
+ * Both strings are only valid for the duration of the call.
+ * The callback runs under the tree's reader locks and must not modify the tree.
+ * @param path : path of the directory's parent
+ * @param name : name of the directory
+ * @param ctx : user context passed to `tree_walk`
+ * @return : true to continue the walk, false to stop it
+ */
+typedef bool (*TreeVisitor)(const char* path, const char* name, void* ctx);
+
+/* Concurrency control schemes a tree can be created with. */
+typedef enum TreeEngine {
+    TREE_ENGINE_RW = 0,    /** Per-node reader/writer locks taken hand-over-hand **/
+    TREE_ENGINE_INTENTION, /** Hierarchical IS/IX/S/SIX/X locks held along the whole path **/
+} TreeEngine;
+
+/* Fairness policies of the per-node reader/writer locks used by TREE_ENGINE_RW. */
+typedef enum TreeLockPolicy {
+    TREE_LOCK_PHASE_FAIR = 0,     /** Read and write phases alternate: a finishing writer admits all waiting readers,
+                                      readers arriving while a writer waits are left for the next read phase **/
+    TREE_LOCK_READER_PREFERENCE,  /** Readers only wait for an active writer. Writers may starve **/
+    TREE_LOCK_WRITER_PREFERENCE,  /** Readers wait while any writer is active or waiting. Readers may starve **/
+    TREE_LOCK_BOUNDED_BYPASS,     /** As reader preference, but at most `bypass_limit` readers may get ahead
+                                      of a waiting writer **/
+} TreeLockPolicy;
+
+/** Bypass limit used by TREE_LOCK_BOUNDED_BYPASS when none is given **/
+#define TREE_DEFAULT_BYPASS_LIMIT 32
+
+/* Settings fixed when a tree is created. Zero-initialized options select the defaults. */
+typedef struct TreeOptions {
+    TreeEngine engine;          /** Concurrency control scheme **/
+    TreeLockPolicy lock_policy; /** Fairness of the reader/writer locks, ignored by TREE_ENGINE_INTENTION **/
+    size_t bypass_limit;        /** Limit for TREE_LOCK_BOUNDED_BYPASS, 0 for TREE_DEFAULT_BYPASS_LIMIT **/
+    bool park_immediately;      /** Waits for a busy reader/writer lock without spinning first **/
+} TreeOptions;
+
 /**
  * Tree constructor.
  * @return : pointer to the newly created tree
  */
 Tree* tree_new();
 
+/**
+ * Tree constructor with explicit settings.
+ * @param options : settings of the tree, NULL for the defaults
+ * @return : pointer to the newly created tree
+ */
+Tree* tree_new_with_options(const TreeOptions* options);
+
 /**
  * Tree destructor. Deallocates all memory belonging to the tree.
  */
@@ -46,3 +113,91 @@ int tree_remove(Tree* tree, const char* path);
   * @return : error code / success
   */
 int tree_move(Tree *tree, const char *s_path, const char *t_path);
+
+/*
+ * On a tree journaled with `tree_journal_open`, the modifications return once their records are on disk.
+ * If the journal fails to write them, they return its error instead, e.g. EIO, though they took effect,
+ * see `tree_journal.h`.
+ */
+
+/*
+ * Deadline-bounded variants of the operations above. The `deadline` is an absolute CLOCK_MONOTONIC time;
+ * NULL waits indefinitely. An operation that can't get all of its locks in time releases the ones
+ * it holds, leaves the tree unchanged and returns ETIMEDOUT.
+ */
+
+/**
+ * Lists the contents of the directory, as `tree_list`, giving up at the `deadline`.
+ * @param tree : file tree
+ * @param path : file path
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at
+ * @param result : where to store the list of the path's contents
+ * @return : error code / success
+ */
+int tree_list_timed(Tree* tree, const char* path, const struct timespec* deadline, char** result);
+
+/**
+ * Creates a new directory, as `tree_create`, giving up at the `deadline`.
+ * @param tree : file tree
+ * @param path : file path
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at
+ * @return : error code / success
+ */
+int tree_create_timed(Tree* tree, const char* path, const struct timespec* deadline);
+
+/**
+ * Removes a directory, as `tree_remove`, giving up at the `deadline`.
+ * @param tree : file tree
+ * @param path : file path
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at
+ * @return : error code / success
+ */
+int tree_remove_timed(Tree* tree, const char* path, const struct timespec* deadline);
+
+/**
+ * Moves a directory, as `tree_move`, giving up at the `deadline`.
+ * @param tree : file tree
+ * @param s_path : source directory
+ * @param t_path : target directory
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at
+ * @return : error code / success
+ */
+int tree_move_timed(Tree* tree, const char* s_path, const char* t_path, const struct timespec* deadline);
+
+/**
+ * Reads the size of the subtree rooted at `path`.
+ * The sizes are maintained incrementally by the mutating operations, so this takes time
+ * proportional to the depth of `path`, not to the size of its subtree. With intention locks the
+ * directory is held in IS, so modifications inside its subtree don't wait for the read.
+ * @param tree : file tree
+ * @param path : file path
+ * @param stat : where to store the result
+ * @return : error code / success
+ */
+int tree_stat(Tree* tree, const char* path, TreeStat* stat);
+
+/**
+ * Counts the bytes used by the subtree rooted at `path`, including the directory itself.
+ * The subtree is walked in time proportional to its size. With reader/writer locks the directories
+ * on the current path are read-locked; with intention locks they are held in IS, so modifications
+ * inside the subtree go on during the walk and the result may mix states from before and after them.
+ * For the root, the state shared by the whole tree is counted among the nodes.
+ * The maps a directory keeps for live snapshots are counted until its next change after they're released.
+ * Removed directories kept only for snapshots are no longer part of any subtree, so they aren't counted.
+ * @param tree : file tree
+ * @param path : file path
+ * @param usage : where to store the result
+ * @return : error code / success
+ */
+int tree_memory_usage(Tree* tree, const char* path, TreeMemoryUsage* usage);
+
+/**
+ * Streams every directory of the subtree rooted at `path` to `visitor` in depth-first pre-order.
+ * The subtree is traversed in a single pass, in time proportional to its size.
+ * @param tree : file tree
+ * @param path : root of the walked subtree (not reported itself)
+ * @param visitor : callback receiving the visited directories
+ * @param ctx : user context passed to `visitor`
+ * @return : error code / success
+ */
+int tree_walk(Tree* tree, const char* path, TreeVisitor visitor, void* ctx);
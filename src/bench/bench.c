@@ -0,0 +1,139 @@
+#include "workload.h"
+#include "../tree_trace.h"
+#include "../tree_events.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Throughput and latency benchmark of a single configuration. */
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t, --threads N        number of client threads (default 1)\n"
+            "  -d, --duration SEC     length of the measurement (default 5)\n"
+            "  -D, --depth N          depth of the pre-populated tree (default 3)\n"
+            "  -F, --fanout N         fan-out of the pre-populated tree (default 8)\n"
+            "  -m, --mix L:C:R:M      weights of list/create/remove/move (default 70:10:10:10)\n"
+            "  -S, --subtrees PCT     percentage of the moves which carry a pre-populated subtree\n"
+            "                         away and back (default 0)\n"
+            "  -z, --zipf THETA       Zipfian directory popularity with skew THETA (default uniform)\n"
+            "  -e, --engine NAME      rw or intention (default rw)\n"
+            "  -p, --policy NAME      phase-fair, reader, writer or bypass (default phase-fair)\n"
+            "  -b, --bypass N         bypass limit of the bypass policy\n"
+            "  -n, --no-spin          park on busy locks without spinning first\n"
+            "  -s, --seed N           seed of the clients' generators (default 1)\n"
+            "  -r, --record FILE      save a trace of the run, including the tree's population,\n"
+            "                         for file_tree_replay (needs a build with TREE_TRACE)\n"
+            "  -E, --events FILE      save a Chrome trace of the operations' phases, viewable in Perfetto\n"
+            "                         (needs a build with TREE_EVENTS)\n",
+            program);
+}
+
+/**
+ * Prints the throughput and latency percentiles of every operation type and of all of them together.
+ * @param config : parameters of the run
+ * @param result : measurements of the run
+ */
+static void report(const BenchConfig* config, const BenchResult* result) {
+    LatencyHistogram all = {0};
+    uint64_t failures = 0;
+
+    printf("threads %zu, depth %zu, fan-out %zu, %s popularity, %.2f s\n",
+           config->threads, config->depth, config->fanout, config->zipf_theta > 0 ? "zipfian" : "uniform",
+           result->elapsed);
+    printf("%-8s %12s %12s %10s %10s %10s %10s %10s\n",
+           "op", "ops", "ops/sec", "failed", "p50 us", "p99 us", "p999 us", "max us");
+    for (int op = 0; op <= BENCH_OPS; op++) {
+        const LatencyHistogram* latency = op < BENCH_OPS ? &result->latency[op] : &all;
+        uint64_t failed = op < BENCH_OPS ? result->failures[op] : failures;
+        if (op < BENCH_OPS) {
+            if (config->mix[op] == 0)
+                continue;
+            histogram_merge(&all, latency);
+            failures += failed;
+        }
+        printf("%-8s %12lu %12.0f %10lu %10.2f %10.2f %10.2f %10.2f\n",
+               op < BENCH_OPS ? bench_op_names[op] : "total",
+               (unsigned long) latency->samples, latency->samples / result->elapsed, (unsigned long) failed,
+               histogram_percentile(latency, 0.5) / 1e3, histogram_percentile(latency, 0.99) / 1e3,
+               histogram_percentile(latency, 0.999) / 1e3, latency->max / 1e3);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"depth", required_argument, NULL, 'D'},
+        {"fanout", required_argument, NULL, 'F'},
+        {"mix", required_argument, NULL, 'm'},
+        {"subtrees", required_argument, NULL, 'S'},
+        {"zipf", required_argument, NULL, 'z'},
+        {"engine", required_argument, NULL, 'e'},
+        {"policy", required_argument, NULL, 'p'},
+        {"bypass", required_argument, NULL, 'b'},
+        {"no-spin", no_argument, NULL, 'n'},
+        {"seed", required_argument, NULL, 's'},
+        {"record", required_argument, NULL, 'r'},
+        {"events", required_argument, NULL, 'E'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    BenchConfig config;
+    bench_config_default(&config);
+    const char* trace = NULL;
+    const char* events = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:d:D:F:m:S:z:e:p:b:ns:r:E:h", long_options, NULL)) != -1) {
+        bool valid = true;
+        switch (opt) {
+            case 't': valid = (config.threads = strtoul(optarg, NULL, 10)) > 0; break;
+            case 'd': valid = (config.duration = strtod(optarg, NULL)) > 0; break;
+            case 'D': config.depth = strtoul(optarg, NULL, 10); break;
+            case 'F': valid = (config.fanout = strtoul(optarg, NULL, 10)) > 0; break;
+            case 'm': valid = bench_parse_mix(optarg, config.mix); break;
+            case 'S': valid = (config.subtree_moves = strtoul(optarg, NULL, 10)) <= 100; break;
+            case 'z': valid = (config.zipf_theta = strtod(optarg, NULL)) >= 0; break;
+            case 'e': valid = bench_parse_engine(optarg, &config.options.engine); break;
+            case 'p': valid = bench_parse_policy(optarg, &config.options.lock_policy); break;
+            case 'b': config.options.bypass_limit = strtoul(optarg, NULL, 10); break;
+            case 'n': config.options.park_immediately = true; break;
+            case 's': config.seed = strtoull(optarg, NULL, 10); break;
+            case 'r': trace = optarg; break;
+            case 'E': events = optarg; break;
+            default: valid = false;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    BenchResult result;
+    if (trace)
+        tree_trace_start();
+    if (events)
+        tree_events_start();
+    bench_run(&config, &result);
+    if (trace) {
+        tree_trace_stop();
+        int err = tree_trace_dump(trace);
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", trace, strerror(err));
+            return EXIT_FAILURE;
+        }
+    }
+    if (events) {
+        tree_events_stop();
+        int err = tree_events_dump(events);
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", events, strerror(err));
+            return EXIT_FAILURE;
+        }
+    }
+    report(&config, &result);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+#include "workload.h"
+#include "trace_file.h"
+#include "../tree_trace.h"
+#include "../safe_allocations.h"
+#include "../sync_utils.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Replays a trace recorded by `tree_trace_dump` against a fresh tree. Calls of every recorded
+ * thread go to the same replaying thread in their original order; with more recorded threads than
+ * replaying ones, several recorded threads share one, interleaved by time. Calls are issued at their original offsets
+ * from the start of the trace divided by the speed-up, or back to back with speed-up 0.
+ */
+
+/* State of a single replaying thread. */
+typedef struct Player {
+    Tree* tree;              /** Tree the trace is replayed against **/
+    Call** calls;            /** Calls assigned to the thread, in order **/
+    size_t count;            /** Size of `calls` **/
+    uint64_t trace_start;    /** Timestamp of the earliest recorded call **/
+    uint64_t replay_start;   /** Time the replay started at **/
+    double speedup;          /** Divisor of the recorded offsets, 0 for no waiting **/
+    BenchResult result;      /** Latencies of the replayed calls **/
+    uint64_t mismatches;     /** Calls whose result differs from the recorded one **/
+} Player;
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options] TRACE\n"
+            "  -t, --threads N     number of replaying threads (default: one per recorded thread)\n"
+            "  -s, --speedup X     divide the recorded timing by X, 0 for no waiting (default 1)\n"
+            "  -e, --engine NAME   rw or intention (default rw)\n"
+            "  -p, --policy NAME   phase-fair, reader, writer or bypass (default phase-fair)\n",
+            program);
+}
+
+/**
+ * Orders calls by their timestamps, keeping the order of the trace for equal ones.
+ * @param a : pointer to the first call's pointer
+ * @param b : pointer to the second call's pointer
+ * @return : negative, zero or positive like `strcmp`
+ */
+static int compare_calls(const void* a, const void* b) {
+    const Call* x = *(Call* const*) a;
+    const Call* y = *(Call* const*) b;
+    if (x->record.timestamp != y->record.timestamp)
+        return x->record.timestamp < y->record.timestamp ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Replaying thread: issues its calls at their scheduled times and checks their results.
+ * @param data : the player
+ * @return : NULL
+ */
+static void* player_run(void* data) {
+    Player* player = data;
+    for (size_t i = 0; i < player->count; i++) {
+        Call* call = player->calls[i];
+        if (player->speedup > 0) {
+            uint64_t due = player->replay_start + (uint64_t) ((call->record.timestamp - player->trace_start) / player->speedup);
+            struct timespec at = {(time_t) (due / 1000000000ULL), (long) (due % 1000000000ULL)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR);
+        }
+
+        int result = 0;
+        uint64_t start = trace_clock();
+        switch (call->record.op) {
+            case TRACE_LIST: {
+                char* listing = NULL;
+                result = tree_list_timed(player->tree, call->path, NULL, &listing);
+                free(listing);
+                break;
+            }
+            case TRACE_CREATE:
+                result = tree_create(player->tree, call->path);
+                break;
+            case TRACE_REMOVE:
+                result = tree_remove(player->tree, call->path);
+                break;
+            default:
+                result = tree_move(player->tree, call->path, call->target);
+                break;
+        }
+        histogram_record(&player->result.latency[call->record.op], trace_clock() - start);
+        if (result != 0)
+            player->result.failures[call->record.op]++;
+        if (result != call->record.result)
+            player->mismatches++;
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"speedup", required_argument, NULL, 's'},
+        {"engine", required_argument, NULL, 'e'},
+        {"policy", required_argument, NULL, 'p'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    size_t num_players = 0;
+    double speedup = 1;
+    TreeOptions options = {0};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:s:e:p:h", long_options, NULL)) != -1) {
+        bool valid = true;
+        switch (opt) {
+            case 't': num_players = strtoul(optarg, NULL, 10); break;
+            case 's': valid = (speedup = strtod(optarg, NULL)) >= 0; break;
+            case 'e': valid = bench_parse_engine(optarg, &options.engine); break;
+            case 'p': valid = bench_parse_policy(optarg, &options.lock_policy); break;
+            default: valid = false;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Call* calls = NULL;
+    size_t count = 0;
+    if (!load_trace(argv[optind], &calls, &count)) {
+        fprintf(stderr, "%s: cannot read the trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t trace_start = UINT64_MAX;
+    uint32_t recorded_threads = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (calls[i].record.timestamp < trace_start)
+            trace_start = calls[i].record.timestamp;
+        if (calls[i].record.thread_id >= recorded_threads)
+            recorded_threads = calls[i].record.thread_id + 1;
+    }
+    if (num_players == 0)
+        num_players = recorded_threads > 0 ? recorded_threads : 1;
+
+    Tree* tree = tree_new_with_options(&options);
+    Player* players = safe_calloc(num_players, sizeof(Player));
+    for (size_t i = 0; i < count; i++)
+        players[calls[i].record.thread_id % num_players].count++;
+    for (size_t p = 0; p < num_players; p++) {
+        players[p].calls = safe_malloc((players[p].count + 1) * sizeof(Call*));
+        players[p].count = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        Player* player = &players[calls[i].record.thread_id % num_players];
+        player->calls[player->count++] = &calls[i];
+    }
+    // Interleaves the recorded threads sharing a replaying thread; a single one is already in order
+    for (size_t p = 0; p < num_players; p++)
+        qsort(players[p].calls, players[p].count, sizeof(Call*), compare_calls);
+
+    uint64_t replay_start = trace_clock();
+    pthread_t* threads = safe_malloc(num_players * sizeof(pthread_t));
+    for (size_t p = 0; p < num_players; p++) {
+        players[p].tree = tree;
+        players[p].trace_start = trace_start;
+        players[p].replay_start = replay_start;
+        players[p].speedup = speedup;
+        PTHREAD_CHECK(pthread_create(&threads[p], NULL, player_run, &players[p]));
+    }
+
+    BenchResult result = {0};
+    uint64_t mismatches = 0;
+    for (size_t p = 0; p < num_players; p++) {
+        PTHREAD_CHECK(pthread_join(threads[p], NULL));
+        for (int op = 0; op < BENCH_OPS; op++) {
+            histogram_merge(&result.latency[op], &players[p].result.latency[op]);
+            result.failures[op] += players[p].result.failures[op];
+        }
+        mismatches += players[p].mismatches;
+        free(players[p].calls);
+    }
+    result.elapsed = (trace_clock() - replay_start) / 1e9;
+
+    printf("%zu calls of %u recorded threads on %zu threads in %.2f s, %lu results differ from the trace\n",
+           count, recorded_threads, num_players, result.elapsed, (unsigned long) mismatches);
+    printf("%-8s %12s %12s %10s %10s %10s %10s\n", "op", "calls", "calls/sec", "failed", "p50 us", "p99 us", "p999 us");
+    for (int op = 0; op < BENCH_OPS; op++) {
+        const LatencyHistogram* latency = &result.latency[op];
+        printf("%-8s %12lu %12.0f %10lu %10.2f %10.2f %10.2f\n", bench_op_names[op],
+               (unsigned long) latency->samples, latency->samples / result.elapsed, (unsigned long) result.failures[op],
+               histogram_percentile(latency, 0.5) / 1e3, histogram_percentile(latency, 0.99) / 1e3,
+               histogram_percentile(latency, 0.999) / 1e3);
+    }
+
+    free_trace(calls, count);
+    free(threads);
+    free(players);
+    tree_free(tree);
+    return EXIT_SUCCESS;
+}
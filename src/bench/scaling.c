@@ -0,0 +1,162 @@
+#include "workload.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Thread-count scalability sweep. Every operation mix is run on a few fixed tree shapes with
+ * 1, 2, 4, ... threads; the throughput is compared to the single-threaded one. A point whose
+ * parallel efficiency (speedup divided by the thread count) falls below the threshold fails the sweep.
+ */
+
+/* A fixed tree shape of the sweep. */
+typedef struct Shape {
+    const char* name;  /** Name in the report **/
+    size_t depth;      /** Depth of the pre-populated tree **/
+    size_t fanout;     /** Fan-out of the pre-populated tree **/
+    double zipf_theta; /** Skew of the directory popularity **/
+} Shape;
+
+/* An operation mix of the sweep. */
+typedef struct Mix {
+    const char* name;        /** Name in the report **/
+    unsigned mix[BENCH_OPS]; /** Weights of list/create/remove/move **/
+} Mix;
+
+static const Shape shapes[] = {
+    {"wide-shallow", 2, 128, 0},
+    {"deep-narrow", 12, 2, 0},
+    {"realistic", 4, 10, 0.9},
+};
+
+static const Mix mixes[] = {
+    {"list", {100, 0, 0, 0}},
+    {"create-remove", {0, 50, 50, 0}},
+    {"move", {0, 0, 0, 100}},
+    {"mixed", {70, 10, 10, 10}},
+};
+
+#define COUNT_OF(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/**
+ * Gets the next thread count of the sweep: powers of two, then the maximum itself.
+ * @param threads : current thread count
+ * @param max_threads : largest thread count of the sweep
+ * @return : next thread count, above `max_threads` once the sweep is over
+ */
+static size_t next_thread_count(size_t threads, size_t max_threads) {
+    if (threads < max_threads && threads * 2 > max_threads)
+        return max_threads;
+    return threads * 2;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -T, --max-threads N       largest thread count of the sweep (default: online CPUs)\n"
+            "  -d, --duration SEC        length of every measurement (default 1)\n"
+            "  -E, --min-efficiency X    fail if any point's efficiency is below X, e.g. 0.5 (default 0)\n"
+            "  -S, --shape NAME          only sweep one of wide-shallow, deep-narrow, realistic\n"
+            "  -M, --mix NAME            only sweep one of list, create-remove, move, mixed\n"
+            "  -e, --engine NAME         rw or intention (default rw)\n"
+            "  -p, --policy NAME         phase-fair, reader, writer or bypass (default phase-fair)\n"
+            "  -o, --output FILE         write the CSV there instead of the standard output\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"max-threads", required_argument, NULL, 'T'},
+        {"duration", required_argument, NULL, 'd'},
+        {"min-efficiency", required_argument, NULL, 'E'},
+        {"shape", required_argument, NULL, 'S'},
+        {"mix", required_argument, NULL, 'M'},
+        {"engine", required_argument, NULL, 'e'},
+        {"policy", required_argument, NULL, 'p'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = online > 0 ? (size_t) online : 1;
+    double duration = 1.0, min_efficiency = 0;
+    const char *only_shape = NULL, *only_mix = NULL, *output = NULL;
+    TreeOptions options = {0};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "T:d:E:S:M:e:p:o:h", long_options, NULL)) != -1) {
+        bool valid = true;
+        switch (opt) {
+            case 'T': valid = (max_threads = strtoul(optarg, NULL, 10)) > 0; break;
+            case 'd': valid = (duration = strtod(optarg, NULL)) > 0; break;
+            case 'E': min_efficiency = strtod(optarg, NULL); break;
+            case 'S': only_shape = optarg; break;
+            case 'M': only_mix = optarg; break;
+            case 'e': valid = bench_parse_engine(optarg, &options.engine); break;
+            case 'p': valid = bench_parse_policy(optarg, &options.lock_policy); break;
+            case 'o': output = optarg; break;
+            default: valid = false;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    FILE* csv = output ? fopen(output, "w") : stdout;
+    if (!csv) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    fprintf(csv, "shape,mix,threads,ops_per_sec,speedup,efficiency,p99_us\n");
+
+    size_t violations = 0;
+    for (size_t s = 0; s < COUNT_OF(shapes); s++) {
+        if (only_shape && strcmp(only_shape, shapes[s].name) != 0)
+            continue;
+        for (size_t m = 0; m < COUNT_OF(mixes); m++) {
+            if (only_mix && strcmp(only_mix, mixes[m].name) != 0)
+                continue;
+
+            double baseline = 0;
+            for (size_t threads = 1; threads <= max_threads; threads = next_thread_count(threads, max_threads)) {
+                BenchConfig config;
+                bench_config_default(&config);
+                config.threads = threads;
+                config.duration = duration;
+                config.depth = shapes[s].depth;
+                config.fanout = shapes[s].fanout;
+                config.zipf_theta = shapes[s].zipf_theta;
+                config.options = options;
+                memcpy(config.mix, mixes[m].mix, sizeof(config.mix));
+
+                BenchResult result;
+                bench_run(&config, &result);
+                LatencyHistogram all = {0};
+                for (int op = 0; op < BENCH_OPS; op++)
+                    histogram_merge(&all, &result.latency[op]);
+
+                double throughput = bench_total_ops(&result) / result.elapsed;
+                if (threads == 1)
+                    baseline = throughput;
+                double speedup = baseline > 0 ? throughput / baseline : 0;
+                double efficiency = speedup / threads;
+                fprintf(csv, "%s,%s,%zu,%.0f,%.3f,%.3f,%.2f\n", shapes[s].name, mixes[m].name, threads,
+                        throughput, speedup, efficiency, histogram_percentile(&all, 0.99) / 1e3);
+                fflush(csv);
+
+                if (efficiency < min_efficiency) {
+                    fprintf(stderr, "%s/%s: efficiency %.3f with %zu threads is below %.3f\n",
+                            shapes[s].name, mixes[m].name, efficiency, threads, min_efficiency);
+                    violations++;
+                }
+            }
+        }
+    }
+
+    if (output)
+        fclose(csv);
+    return violations > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
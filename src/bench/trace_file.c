@@ -0,0 +1,75 @@
+#include "trace_file.h"
+#include "../safe_allocations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Makes a NUL-terminated copy of a path stored in a trace.
+ * @param bytes : the path's bytes
+ * @param length : length of the path
+ * @return : the copy
+ */
+static char* copy_path(const unsigned char* bytes, size_t length) {
+    char* path = safe_malloc(length + 1);
+    memcpy(path, bytes, length);
+    path[length] = '\0';
+    return path;
+}
+
+bool load_trace(const char* filename, Call** calls, size_t* count) {
+    *calls = NULL;
+    *count = 0;
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = safe_malloc(size > 0 ? size : 1);
+    bool ok = size >= (long) strlen(TRACE_MAGIC) && fread(data, 1, size, file) == (size_t) size
+              && memcmp(data, TRACE_MAGIC, strlen(TRACE_MAGIC)) == 0;
+    fclose(file);
+
+    size_t capacity = 1024, pos = strlen(TRACE_MAGIC);
+    *calls = safe_malloc(capacity * sizeof(Call));
+    while (ok && pos < (size_t) size) {
+        Call call;
+        if (pos + sizeof(TraceRecord) > (size_t) size) {
+            ok = false;
+            break;
+        }
+        memcpy(&call.record, data + pos, sizeof(TraceRecord));
+        pos += sizeof(TraceRecord);
+        if (call.record.op >= TRACE_OPS || pos + call.record.path_len + call.record.target_len > (size_t) size) {
+            ok = false;
+            break;
+        }
+        call.path = copy_path(data + pos, call.record.path_len);
+        pos += call.record.path_len;
+        call.target = call.record.op == TRACE_MOVE ? copy_path(data + pos, call.record.target_len) : NULL;
+        pos += call.record.target_len;
+
+        if (*count == capacity) {
+            capacity *= 2;
+            *calls = safe_realloc(*calls, capacity * sizeof(Call));
+        }
+        (*calls)[(*count)++] = call;
+    }
+    free(data);
+    if (!ok) {
+        free_trace(*calls, *count);
+        *calls = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+void free_trace(Call* calls, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(calls[i].path);
+        free(calls[i].target);
+    }
+    free(calls);
+}
+
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../tree_trace.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Reading of the trace files written by `tree_trace_dump`, shared by the replay and the tests. */
+
+/* A recorded call to replay. */
+typedef struct Call {
+    TraceRecord record; /** The recorded call **/
+    char* path;         /** Path argument **/
+    char* target;       /** Move target, NULL for other operations **/
+} Call;
+
+/**
+ * Reads all calls of a trace file.
+ * @param filename : path of the trace file
+ * @param calls : where to store the array of calls, to be freed by `free_trace`, NULL if reading fails
+ * @param count : where to store its size
+ * @return : false if the file can't be read or isn't a trace
+ */
+bool load_trace(const char* filename, Call** calls, size_t* count);
+
+/**
+ * Frees the calls read by `load_trace`.
+ * @param calls : array of calls
+ * @param count : its size
+ */
+void free_trace(Call* calls, size_t count);
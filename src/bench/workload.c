@@ -0,0 +1,461 @@
+#include "workload.h"
+#include "../err.h"
+#include "../path_utils.h"
+#include "../safe_allocations.h"
+#include "../sync_utils.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/** Largest pre-populated tree, in directories **/
+#define MAX_BENCH_NODES (1 << 22)
+/** Number of extra leaf names available under every directory **/
+#define SCRATCH_NAMES 26
+
+const char* const bench_op_names[BENCH_OPS] = {"list", "create", "remove", "move"};
+
+/* Pre-populated directories and the popularity distribution over them. */
+typedef struct Population {
+    char** paths;     /** Paths of all pre-populated directories, the root included **/
+    size_t count;     /** Size of `paths` **/
+    double* cdf;      /** Cumulative popularity of the directories by rank, NULL for a uniform distribution **/
+    size_t* by_rank;  /** Index into `paths` of the directory of each popularity rank **/
+} Population;
+
+/* Releases all clients at once, after each of them has started. */
+typedef struct StartGate {
+    pthread_mutex_t mutex;  /** Protects the fields below **/
+    pthread_cond_t changed; /** Signalled when a client arrives and broadcast on the release **/
+    size_t ready;           /** Number of clients waiting for the release **/
+    bool released;          /** Set once the measurement starts **/
+} StartGate;
+
+/* State of a single client thread. */
+typedef struct Client {
+    const BenchConfig* config;     /** Parameters of the run **/
+    const Population* population;  /** Directories to pick from **/
+    Tree* tree;                    /** Benchmarked tree **/
+    atomic_bool* stop;             /** Set when the measurement ends **/
+    StartGate* start;              /** Releases all clients at once **/
+    size_t id;                     /** Index of the client, naming its parked subtree **/
+    uint64_t rng;                  /** State of the client's generator **/
+    BenchResult result;            /** Measurements of the client's operations **/
+} Client;
+
+/** Advances a xorshift64* generator **/
+static inline uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/** Gets a uniformly distributed double in [0, 1) **/
+static inline double next_unit(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Gets the histogram bucket of a value: values below 2^HISTOGRAM_SUB_BITS get their own buckets,
+ * every higher power of two is split into 2^HISTOGRAM_SUB_BITS equal buckets.
+ * @param value : recorded value
+ * @return : index of the bucket
+ */
+static inline size_t histogram_index(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((size_t) (shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/** Gets the largest value falling into a histogram bucket **/
+static inline uint64_t histogram_bucket_top(size_t index) {
+    if (index < (1 << HISTOGRAM_SUB_BITS))
+        return index;
+    int shift = (int) (index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = index & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1 << HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void histogram_record(LatencyHistogram* histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->samples++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+void histogram_merge(LatencyHistogram* into, const LatencyHistogram* from) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->samples += from->samples;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+uint64_t histogram_percentile(const LatencyHistogram* histogram, double quantile) {
+    if (histogram->samples == 0)
+        return 0;
+    uint64_t rank = (uint64_t) ceil(quantile * histogram->samples), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t top = histogram_bucket_top(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+uint64_t bench_total_ops(const BenchResult* result) {
+    uint64_t total = 0;
+    for (int op = 0; op < BENCH_OPS; op++)
+        total += result->latency[op].samples;
+    return total;
+}
+
+void bench_config_default(BenchConfig* config) {
+    memset(config, 0, sizeof(BenchConfig));
+    config->threads = 1;
+    config->duration = 5.0;
+    config->depth = 3;
+    config->fanout = 8;
+    config->mix[BENCH_LIST] = 70;
+    config->mix[BENCH_CREATE] = 10;
+    config->mix[BENCH_REMOVE] = 10;
+    config->mix[BENCH_MOVE] = 10;
+    config->seed = 1;
+}
+
+bool bench_parse_mix(const char* text, unsigned mix[BENCH_OPS]) {
+    unsigned weights[BENCH_OPS];
+    int consumed = 0;
+    if (sscanf(text, "%u:%u:%u:%u%n", &weights[0], &weights[1], &weights[2], &weights[3], &consumed) != BENCH_OPS
+        || text[consumed] != '\0')
+        return false;
+    if (weights[0] + weights[1] + weights[2] + weights[3] == 0)
+        return false;
+    memcpy(mix, weights, sizeof(weights));
+    return true;
+}
+
+bool bench_parse_engine(const char* text, TreeEngine* engine) {
+    if (strcmp(text, "rw") == 0)
+        *engine = TREE_ENGINE_RW;
+    else if (strcmp(text, "intention") == 0)
+        *engine = TREE_ENGINE_INTENTION;
+    else
+        return false;
+    return true;
+}
+
+bool bench_parse_policy(const char* text, TreeLockPolicy* policy) {
+    if (strcmp(text, "phase-fair") == 0)
+        *policy = TREE_LOCK_PHASE_FAIR;
+    else if (strcmp(text, "reader") == 0)
+        *policy = TREE_LOCK_READER_PREFERENCE;
+    else if (strcmp(text, "writer") == 0)
+        *policy = TREE_LOCK_WRITER_PREFERENCE;
+    else if (strcmp(text, "bypass") == 0)
+        *policy = TREE_LOCK_BOUNDED_BYPASS;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Writes the name of the `index`-th child of a pre-populated directory: its base-16 digits
+ * spelled with the letters 'a'-'p', so they never clash with the extra leaves' names starting with 'z'.
+ * @param index : index of the child
+ * @param width : number of digits of every name
+ * @param name : buffer of at least `width + 1` bytes
+ */
+static void child_name(size_t index, size_t width, char* name) {
+    for (size_t i = width; i > 0; i--) {
+        name[i - 1] = (char) ('a' + index % 16);
+        index /= 16;
+    }
+    name[width] = '\0';
+}
+
+/**
+ * Creates the pre-populated directories level by level and prepares the popularity distribution.
+ * @param config : parameters of the run
+ * @param tree : empty tree to populate
+ * @param population : where to store the directories
+ */
+static void populate(const BenchConfig* config, Tree* tree, Population* population) {
+    size_t count = 1, level = 1, width = 1;
+    for (size_t d = 0; d < config->depth; d++) {
+        level *= config->fanout;
+        count += level;
+        if (count > MAX_BENCH_NODES)
+            fatal("a tree of depth %zu and fan-out %zu is too large", config->depth, config->fanout);
+    }
+    for (size_t span = 16; span < config->fanout; span *= 16)
+        width++;
+    if (config->depth * (width + 1) + 4 > MAX_PATH_LENGTH)
+        fatal("a tree of depth %zu has too long paths", config->depth);
+
+    population->paths = safe_malloc(count * sizeof(char*));
+    population->count = 0;
+    population->paths[population->count++] = strcpy(safe_malloc(2), "/");
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    size_t level_start = 0, level_end = 1;
+    for (size_t d = 0; d < config->depth; d++) {
+        for (size_t parent = level_start; parent < level_end; parent++) {
+            size_t parent_len = strlen(population->paths[parent]);
+            for (size_t i = 0; i < config->fanout; i++) {
+                child_name(i, width, name);
+                char* path = safe_malloc(parent_len + width + 2);
+                sprintf(path, "%s%s/", population->paths[parent], name);
+                if (tree_create(tree, path) != 0)
+                    fatal("cannot create %s", path);
+                population->paths[population->count++] = path;
+            }
+        }
+        level_start = level_end;
+        level_end = population->count;
+    }
+
+    population->cdf = NULL;
+    population->by_rank = NULL;
+    if (config->zipf_theta > 0) {
+        uint64_t rng = config->seed ^ 0x9E3779B97F4A7C15ULL;
+        population->cdf = safe_malloc(count * sizeof(double));
+        population->by_rank = safe_malloc(count * sizeof(size_t));
+        double sum = 0;
+        for (size_t rank = 0; rank < count; rank++) {
+            sum += 1.0 / pow((double) (rank + 1), config->zipf_theta);
+            population->cdf[rank] = sum;
+            population->by_rank[rank] = rank;
+        }
+        for (size_t rank = 0; rank < count; rank++)
+            population->cdf[rank] /= sum;
+        for (size_t rank = count - 1; rank > 0; rank--) { // Hot directories anywhere in the tree, not only at the top
+            size_t other = next_random(&rng) % (rank + 1), swap = population->by_rank[rank];
+            population->by_rank[rank] = population->by_rank[other];
+            population->by_rank[other] = swap;
+        }
+    }
+}
+
+static void population_free(Population* population) {
+    for (size_t i = 0; i < population->count; i++)
+        free(population->paths[i]);
+    free(population->paths);
+    free(population->cdf);
+    free(population->by_rank);
+}
+
+/**
+ * Draws a pre-populated directory according to the popularity distribution.
+ * @param population : the directories
+ * @param rng : state of the caller's generator
+ * @return : path of the directory
+ */
+static const char* pick_directory(const Population* population, uint64_t* rng) {
+    if (!population->cdf)
+        return population->paths[next_random(rng) % population->count];
+
+    double u = next_unit(rng);
+    size_t low = 0, high = population->count - 1;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (population->cdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return population->paths[population->by_rank[low]];
+}
+
+/**
+ * Writes the path of a random extra leaf under a random directory.
+ * @param client : the client
+ * @param path : buffer of at least MAX_PATH_LENGTH + 1 bytes
+ */
+static void pick_leaf(Client* client, char* path) {
+    const char* parent = pick_directory(client->population, &client->rng);
+    sprintf(path, "%sz%c/", parent, (char) ('a' + next_random(&client->rng) % SCRATCH_NAMES));
+}
+
+/**
+ * Times an operation and records its latency and failure.
+ * @param client : the client
+ * @param op : type of the operation
+ * @param start : time the operation started at
+ * @param err : its result
+ */
+static void record(Client* client, BenchOp op, uint64_t start, int err) {
+    histogram_record(&client->result.latency[op], monotonic_ns() - start);
+    if (err != 0)
+        client->result.failures[op]++;
+}
+
+/**
+ * Moves a random pre-populated subtree to the client's parking spot under the root and puts it back,
+ * retrying the way back until it succeeds so the population is whole again afterwards.
+ * Both moves are recorded. Parked subtrees are directly under the root, out of reach of the other clients'
+ * moves, so the shallowest parked subtree can always return and no client waits for another forever.
+ * @param client : the client
+ * @param path : buffer of at least MAX_PATH_LENGTH + 1 bytes
+ * @param target : buffer of at least MAX_PATH_LENGTH + 1 bytes
+ */
+static void move_subtree(Client* client, char* path, char* target) {
+    const char* source;
+    do {
+        source = pick_directory(client->population, &client->rng);
+    } while (source[1] == '\0'); // Not the root, the population has more directories when this is called
+    strcpy(path, source);
+    size_t length = 0;
+    target[length++] = '/';
+    target[length++] = 'y'; // Never clashes with the pre-populated directories nor the extra leaves
+    for (size_t id = client->id; length == 2 || id > 0; id /= 26)
+        target[length++] = (char) ('a' + id % 26);
+    target[length++] = '/';
+    target[length] = '\0';
+
+    uint64_t start = monotonic_ns();
+    int err = tree_move(client->tree, path, target);
+    record(client, BENCH_MOVE, start, err);
+    if (err != 0)
+        return;
+    do { // Another client may have parked an ancestor of the subtree, wait until it puts it back
+        start = monotonic_ns();
+        err = tree_move(client->tree, target, path);
+        record(client, BENCH_MOVE, start, err);
+        if (err != 0)
+            sched_yield();
+    } while (err != 0);
+}
+
+static BenchOp pick_op(Client* client) {
+    const unsigned* mix = client->config->mix;
+    unsigned total = mix[0] + mix[1] + mix[2] + mix[3];
+    unsigned roll = next_random(&client->rng) % total;
+    int op = 0;
+    while (roll >= mix[op]) {
+        roll -= mix[op];
+        op++;
+    }
+    return op;
+}
+
+/**
+ * Client thread: performs random operations until the measurement ends, timing each of them.
+ * @param data : the client
+ * @return : NULL
+ */
+static void* client_run(void* data) {
+    Client* client = data;
+    char path[MAX_PATH_LENGTH + 1], target[MAX_PATH_LENGTH + 1];
+
+    StartGate* gate = client->start;
+    UNDER_MUTEX(&gate->mutex,
+        gate->ready++;
+        PTHREAD_CHECK(pthread_cond_broadcast(&gate->changed));
+        while (!gate->released)
+            PTHREAD_CHECK(pthread_cond_wait(&gate->changed, &gate->mutex));
+    );
+
+    while (!atomic_load_explicit(client->stop, memory_order_relaxed)) {
+        BenchOp op = pick_op(client);
+        int err = 0;
+        uint64_t start = 0;
+
+        switch (op) {
+            case BENCH_LIST: {
+                const char* dir = pick_directory(client->population, &client->rng);
+                start = monotonic_ns();
+                char* listing = tree_list(client->tree, dir);
+                err = listing ? 0 : -1;
+                free(listing);
+                break;
+            }
+            case BENCH_CREATE:
+                pick_leaf(client, path);
+                start = monotonic_ns();
+                err = tree_create(client->tree, path);
+                break;
+            case BENCH_REMOVE:
+                pick_leaf(client, path);
+                start = monotonic_ns();
+                err = tree_remove(client->tree, path);
+                break;
+            default:
+                if (client->population->count > 1 && next_random(&client->rng) % 100 < client->config->subtree_moves) {
+                    move_subtree(client, path, target);
+                    continue;
+                }
+                pick_leaf(client, path);
+                pick_leaf(client, target);
+                start = monotonic_ns();
+                err = tree_move(client->tree, path, target);
+                break;
+        }
+        record(client, op, start, err);
+    }
+    return NULL;
+}
+
+void bench_run(const BenchConfig* config, BenchResult* result) {
+    Tree* tree = tree_new_with_options(&config->options);
+    Population population;
+    populate(config, tree, &population);
+
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    StartGate start = {.ready = 0, .released = false};
+    PTHREAD_CHECK(pthread_mutex_init(&start.mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&start.changed, NULL));
+
+    Client* clients = safe_calloc(config->threads, sizeof(Client));
+    pthread_t* threads = safe_malloc(config->threads * sizeof(pthread_t));
+    for (size_t i = 0; i < config->threads; i++) {
+        clients[i].config = config;
+        clients[i].population = &population;
+        clients[i].tree = tree;
+        clients[i].stop = &stop;
+        clients[i].start = &start;
+        clients[i].id = i;
+        clients[i].rng = config->seed + 0x9E3779B97F4A7C15ULL * (i + 1); // Never zero for small seeds
+        if (pthread_create(&threads[i], NULL, client_run, &clients[i]) != 0)
+            syserr("pthread_create");
+    }
+
+    UNDER_MUTEX(&start.mutex,
+        while (start.ready < config->threads)
+            PTHREAD_CHECK(pthread_cond_wait(&start.changed, &start.mutex));
+        start.released = true;
+        PTHREAD_CHECK(pthread_cond_broadcast(&start.changed));
+    );
+    uint64_t begin = monotonic_ns();
+    struct timespec duration = {(time_t) config->duration, (long) ((config->duration - (time_t) config->duration) * 1e9)};
+    while (nanosleep(&duration, &duration) != 0);
+    atomic_store(&stop, true);
+    for (size_t i = 0; i < config->threads; i++)
+        pthread_join(threads[i], NULL);
+
+    memset(result, 0, sizeof(BenchResult));
+    result->elapsed = (monotonic_ns() - begin) / 1e9;
+    for (size_t i = 0; i < config->threads; i++) {
+        for (int op = 0; op < BENCH_OPS; op++) {
+            histogram_merge(&result->latency[op], &clients[i].result.latency[op]);
+            result->failures[op] += clients[i].result.failures[op];
+        }
+    }
+
+    PTHREAD_CHECK(pthread_cond_destroy(&start.changed));
+    PTHREAD_CHECK(pthread_mutex_destroy(&start.mutex));
+    free(threads);
+    free(clients);
+    population_free(&population);
+    tree_free(tree);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "../Tree.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Synthetic workloads shared by the benchmark drivers. */
+
+/* Operation types of a workload. */
+typedef enum BenchOp {
+    BENCH_LIST = 0,
+    BENCH_CREATE,
+    BENCH_REMOVE,
+    BENCH_MOVE,
+
+    BENCH_OPS
+} BenchOp;
+
+/** Sub-buckets per power of two in a latency histogram, giving about 6% precision **/
+#define HISTOGRAM_SUB_BITS 4
+/** Number of buckets in a latency histogram, enough for any 64-bit value **/
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/* Log-linear histogram of latencies in nanoseconds. */
+typedef struct LatencyHistogram {
+    uint64_t counts[HISTOGRAM_BUCKETS]; /** Number of samples in each bucket **/
+    uint64_t samples;                   /** Total number of samples **/
+    uint64_t max;                       /** Largest sample **/
+} LatencyHistogram;
+
+/* Parameters of a single benchmark run. */
+typedef struct BenchConfig {
+    size_t threads;            /** Number of client threads **/
+    double duration;           /** Length of the measurement in seconds **/
+    size_t depth;              /** Depth of the pre-populated tree **/
+    size_t fanout;             /** Number of subdirectories of every inner directory of the pre-populated tree **/
+    unsigned mix[BENCH_OPS];   /** Relative weights of the operation types **/
+    double zipf_theta;         /** Skew of the directory popularity, 0 for a uniform distribution **/
+    unsigned subtree_moves;    /** Percentage of the moves which carry a pre-populated subtree away and back **/
+    uint64_t seed;             /** Seed of the clients' generators **/
+    TreeOptions options;       /** Settings of the benchmarked tree **/
+} BenchConfig;
+
+/* Measurements of a single benchmark run. */
+typedef struct BenchResult {
+    double elapsed;                       /** Wall time of the measurement in seconds **/
+    LatencyHistogram latency[BENCH_OPS];  /** Latencies of each operation type **/
+    uint64_t failures[BENCH_OPS];         /** Operations which returned an error, e.g. EEXIST for a taken name **/
+} BenchResult;
+
+/** Names of the operation types, indexed by `BenchOp` **/
+extern const char* const bench_op_names[BENCH_OPS];
+
+/**
+ * Fills in the default configuration: one thread, 5 seconds, depth 3 with fan-out 8,
+ * a read-mostly mix, uniform popularity and the default tree options.
+ * @param config : configuration to fill in
+ */
+void bench_config_default(BenchConfig* config);
+
+/**
+ * Parses an operation mix given as "list:create:remove:move" weights, e.g. "70:10:10:10".
+ * @param text : the mix
+ * @param mix : where to store the weights
+ * @return : false if the text is malformed or all weights are zero
+ */
+bool bench_parse_mix(const char* text, unsigned mix[BENCH_OPS]);
+
+/**
+ * Parses a concurrency control scheme: "rw" or "intention".
+ * @param text : name of the scheme
+ * @param engine : where to store the scheme
+ * @return : false if the name is unknown
+ */
+bool bench_parse_engine(const char* text, TreeEngine* engine);
+
+/**
+ * Parses a lock fairness policy: "phase-fair", "reader", "writer" or "bypass".
+ * @param text : name of the policy
+ * @param policy : where to store the policy
+ * @return : false if the name is unknown
+ */
+bool bench_parse_policy(const char* text, TreeLockPolicy* policy);
+
+/**
+ * Builds a tree of the configured shape and hammers it with the configured mix.
+ * The pre-populated directories are never removed: creations and removals work on extra leaves
+ * with names outside of the pre-populated ones, and moves shuffle those leaves between directories.
+ * The configured share of the moves takes a pre-populated subtree instead, parks it under the root
+ * and puts it back, so operations on the directories inside it fail with ENOENT in the meantime.
+ * Every client puts its subtree back before the run ends.
+ * @param config : parameters of the run
+ * @param result : where to store the measurements
+ */
+void bench_run(const BenchConfig* config, BenchResult* result);
+
+/**
+ * Records a sample in a histogram.
+ * @param histogram : latency histogram
+ * @param value : latency in nanoseconds
+ */
+void histogram_record(LatencyHistogram* histogram, uint64_t value);
+
+/**
+ * Adds the samples of one histogram to another.
+ * @param into : histogram to add to
+ * @param from : histogram to add
+ */
+void histogram_merge(LatencyHistogram* into, const LatencyHistogram* from);
+
+/**
+ * Gets a percentile of the recorded latencies, precise up to the bucket width.
+ * @param histogram : latency histogram
+ * @param quantile : quantile in [0, 1], e.g. 0.99
+ * @return : the percentile in nanoseconds, 0 if there are no samples
+ */
+uint64_t histogram_percentile(const LatencyHistogram* histogram, double quantile);
+
+/**
+ * Counts the operations of all types performed in a run.
+ * @param result : measurements of the run
+ * @return : total number of operations
+ */
+uint64_t bench_total_ops(const BenchResult* result);
@@ -0,0 +1,162 @@
+#include "intention_lock.h"
+#include "sync_utils.h"
+#include <assert.h>
+#include <errno.h>
+
+/** compatible[requested][held] tells whether the two modes may be granted together **/
+static const bool compatible[LOCK_MODES][LOCK_MODES] = {
+    /*            IS     IX     S      SIX    X     */
+    /* IS  */ {true,  true,  true,  true,  false},
+    /* IX  */ {true,  true,  false, false, false},
+    /* S   */ {true,  false, true,  false, false},
+    /* SIX */ {true,  false, false, false, false},
+    /* X   */ {false, false, false, false, false},
+};
+
+/**
+ * Checks whether a mode can be granted alongside the modes granted so far.
+ * Has to be called under the lock's mutex.
+ * @param lock : lock in question
+ * @param mode : requested mode
+ * @return : whether the mode is compatible with all holders
+ */
+static bool grantable(IntentionLock* lock, LockMode mode) {
+    for (int held = 0; held < LOCK_MODES; held++) {
+        if (lock->granted[held] > 0 && !compatible[mode][held])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Grants waiting requests from the head of the queue for as long as they are compatible.
+ * Has to be called under the lock's mutex.
+ * @param lock : lock in question
+ */
+static void grant_waiting(IntentionLock* lock) {
+    bool woken = false;
+    while (lock->head && grantable(lock, lock->head->mode)) {
+        LockRequest* request = lock->head;
+        lock->head = request->next;
+        if (!lock->head)
+            lock->tail = NULL;
+        lock->granted[request->mode]++;
+        request->granted = true;
+        woken = true;
+    }
+    if (woken)
+        PTHREAD_CHECK(pthread_cond_broadcast(&lock->cond));
+}
+
+/**
+ * Checks whether a retired lock has no holders and no waiting requests left.
+ * Has to be called under the lock's mutex.
+ * @param lock : lock in question
+ * @return : whether the node can be freed
+ */
+static bool abandoned(IntentionLock* lock) {
+    if (!lock->retired || lock->head)
+        return false;
+    for (int held = 0; held < LOCK_MODES; held++) {
+        if (lock->granted[held] > 0)
+            return false;
+    }
+    return true;
+}
+
+void ilock_init(IntentionLock* lock) {
+    PTHREAD_CHECK(pthread_mutex_init(&lock->mutex, NULL));
+    cond_init_monotonic(&lock->cond);
+    for (int mode = 0; mode < LOCK_MODES; mode++)
+        lock->granted[mode] = 0;
+    lock->head = lock->tail = NULL;
+    lock->version = 0;
+    lock->retired = false;
+}
+
+void ilock_destroy(IntentionLock* lock) {
+    assert(!lock->head);
+    PTHREAD_CHECK(pthread_cond_destroy(&lock->cond));
+    PTHREAD_CHECK(pthread_mutex_destroy(&lock->mutex));
+}
+
+bool ilock_request(IntentionLock* lock, LockRequest* request, LockMode mode) {
+    bool granted = false;
+    request->mode = mode;
+    request->granted = false;
+    request->next = NULL;
+    UNDER_MUTEX(&lock->mutex,
+        request->version = lock->version;
+        if (!lock->head && grantable(lock, mode)) {
+            lock->granted[mode]++;
+            request->granted = granted = true;
+        }
+        else {
+            if (lock->tail)
+                lock->tail->next = request;
+            else
+                lock->head = request;
+            lock->tail = request;
+        }
+    );
+    return granted;
+}
+
+int ilock_wait(IntentionLock* lock, LockRequest* request, const struct timespec* deadline) {
+    int result = 0;
+    UNDER_MUTEX(&lock->mutex,
+        while (!request->granted && result == 0)
+            result = cond_wait_until(&lock->cond, &lock->mutex, deadline);
+        if (request->granted)
+            result = (!lock->retired && request->version == lock->version) ? 0 : EAGAIN;
+    );
+    return result;
+}
+
+bool ilock_release(IntentionLock* lock, LockMode mode) {
+    bool last = false;
+    UNDER_MUTEX(&lock->mutex,
+        assert(lock->granted[mode] > 0);
+        lock->granted[mode]--;
+        grant_waiting(lock);
+        last = abandoned(lock);
+    );
+    return last;
+}
+
+bool ilock_cancel(IntentionLock* lock, LockRequest* request) {
+    bool last = false;
+    UNDER_MUTEX(&lock->mutex,
+        if (request->granted) {
+            lock->granted[request->mode]--; // Granted after the deadline passed
+        }
+        else {
+            LockRequest* prev = NULL;
+            for (LockRequest* it = lock->head; it != request; it = it->next)
+                prev = it;
+            if (prev)
+                prev->next = request->next;
+            else
+                lock->head = request->next;
+            if (lock->tail == request)
+                lock->tail = prev;
+        }
+        grant_waiting(lock); // The request may have held back younger ones
+        last = abandoned(lock);
+    );
+    return last;
+}
+
+void ilock_bump_version(IntentionLock* lock) {
+    UNDER_MUTEX(&lock->mutex,
+        assert(lock->granted[LOCK_X] == 1);
+        lock->version++;
+    );
+}
+
+void ilock_retire(IntentionLock* lock) {
+    UNDER_MUTEX(&lock->mutex,
+        assert(lock->granted[LOCK_X] == 1);
+        lock->retired = true;
+    );
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Lock modes of the multiple granularity locking protocol. */
+typedef enum LockMode {
+    LOCK_IS = 0, /** Intention to read somewhere below the node **/
+    LOCK_IX,     /** Intention to modify somewhere below the node **/
+    LOCK_S,      /** Reads the node and its whole subtree **/
+    LOCK_SIX,    /** Reads the whole subtree, intending to modify somewhere below **/
+    LOCK_X,      /** Exclusive access to the node and its whole subtree **/
+
+    LOCK_MODES
+} LockMode;
+
+typedef struct LockRequest LockRequest;
+
+/* A pending lock request, queued in FIFO order. Lives on the requester's stack. */
+struct LockRequest {
+    LockMode mode;     /** Requested mode **/
+    bool granted;      /** Set once the request has been granted **/
+    size_t version;    /** Version of the lock when the request was queued **/
+    LockRequest* next; /** Next request in the queue **/
+};
+
+/* A hierarchical lock attached to a single node. */
+typedef struct IntentionLock {
+    pthread_mutex_t mutex;      /** Mutual exclusion for the fields below **/
+    pthread_cond_t cond;        /** Condition to hang waiting requests **/
+    size_t granted[LOCK_MODES]; /** Number of holders in each mode **/
+    LockRequest* head;          /** Oldest waiting request **/
+    LockRequest* tail;          /** Newest waiting request **/
+    size_t version;             /** Bumped whenever the node is re-parented **/
+    bool retired;               /** Set once the node is unlinked from the tree **/
+} IntentionLock;
+
+/**
+ * Initializes an unlocked lock.
+ * @param lock : lock to initialize
+ */
+void ilock_init(IntentionLock* lock);
+
+/**
+ * Destroys a lock that nobody holds or waits for.
+ * @param lock : lock to destroy
+ */
+void ilock_destroy(IntentionLock* lock);
+
+/**
+ * Queues a request without waiting for it. Requests are granted in FIFO order, each one
+ * as soon as it is compatible with all granted modes and no older request is waiting.
+ * The caller may still hold the latch which protects the node from being unlinked.
+ * @param lock : requested lock
+ * @param request : request to fill in and queue
+ * @param mode : requested mode
+ * @return : true if the request was granted right away
+ */
+bool ilock_request(IntentionLock* lock, LockRequest* request, LockMode mode);
+
+/**
+ * Waits until a queued request is granted.
+ * @param lock : requested lock
+ * @param request : request queued by `ilock_request`
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : 0 once granted,
+ *           EAGAIN if the node was unlinked or re-parented since the request was queued,
+ *           in which case the lock is held anyway and has to be released,
+ *           ETIMEDOUT if the deadline passed, in which case the request has to be withdrawn by `ilock_cancel`
+ */
+int ilock_wait(IntentionLock* lock, LockRequest* request, const struct timespec* deadline);
+
+/**
+ * Releases a granted lock.
+ * @param lock : held lock
+ * @param mode : mode the lock is held in
+ * @return : true if the node is retired and this was its last user - the caller then frees it
+ */
+bool ilock_release(IntentionLock* lock, LockMode mode);
+
+/**
+ * Withdraws a request whose wait timed out, releasing it if it got granted in the meantime.
+ * @param lock : requested lock
+ * @param request : request queued by `ilock_request`
+ * @return : true if the node is retired and this was its last user - the caller then frees it
+ */
+bool ilock_cancel(IntentionLock* lock, LockRequest* request);
+
+/**
+ * Marks the node as re-parented. Has to be called with the lock held in LOCK_X.
+ * @param lock : lock of the moved node
+ */
+void ilock_bump_version(IntentionLock* lock);
+
+/**
+ * Marks the node as unlinked from the tree. Has to be called with the lock held in LOCK_X.
+ * @param lock : lock of the removed node
+ */
+void ilock_retire(IntentionLock* lock);
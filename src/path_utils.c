@@ -138,6 +138,9 @@ void make_path_to_LCA(const char* path1, const char* path2, char lca_path[MAX_PA
     }
 
     if (path1[i] && path2[i]) {
+        // The paths may diverge in the middle of a component - drop its common prefix
+        while (buff[i - 1] != SEPARATOR)
+            buff[--i] = '\0';
         strcpy(lca_path, buff);
     }
     else {
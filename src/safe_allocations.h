@@ -58,3 +58,20 @@ static inline void *safe_calloc(size_t nmemb, size_t size)
     CHECK_POINTER(ptr);
     return ptr;
 }
+
+/**
+ * Powiększa bufor dwukrotnie, aż zmieści co najmniej `size` bajtów.
+ * Zakańcza działanie programu przy braku pamięci.
+ *
+ * @param[in, out] buffer : zaalokowany na stercie bufor
+ * @param[in, out] capacity : obecny rozmiar bufora w bajtach, niezerowy
+ * @param[in] size : wymagany rozmiar w bajtach
+ */
+static inline void reserve_buffer(void **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+        return;
+    while (*capacity < size)
+        *capacity *= 2;
+    *buffer = safe_realloc(*buffer, *capacity);
+}
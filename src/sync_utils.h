@@ -0,0 +1,97 @@
+#pragma once
+
+#include "safe_allocations.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Helpers for calling the pthread API. */
+
+/** Checks whether the result of a pthread_* function is 0 (SUCCESS) **/
+#define PTHREAD_CHECK(x)                                                          \
+    do {                                                                          \
+        int err = (x);                                                            \
+        if (err != 0) {                                                           \
+            fprintf(stderr, "Runtime error: %s returned %d in %s at %s:%d\n%s\n", \
+                #x, err, __func__, __FILE__, __LINE__, strerror(err));            \
+            exit(EXIT_FAILURE);                                                   \
+        }                                                                         \
+    } while (0)
+
+/** Performs a block of code under the node's mutex **/
+#define UNDER_MUTEX(mutex, code_block)           \
+do {                                             \
+    PTHREAD_CHECK(pthread_mutex_lock(mutex));    \
+    code_block;                                  \
+    PTHREAD_CHECK(pthread_mutex_unlock(mutex));  \
+} while(0);
+
+/** Initializes a condition variable whose timed waits take CLOCK_MONOTONIC deadlines **/
+static inline void cond_init_monotonic(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    PTHREAD_CHECK(pthread_condattr_init(&attr));
+    PTHREAD_CHECK(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+    PTHREAD_CHECK(pthread_cond_init(cond, &attr));
+    PTHREAD_CHECK(pthread_condattr_destroy(&attr));
+}
+
+/**
+ * Waits on a condition variable initialized by `cond_init_monotonic`.
+ * @param cond : condition to wait on
+ * @param mutex : mutex held by the caller
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : 0, or ETIMEDOUT if the deadline passed
+ */
+static inline int cond_wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    if (!deadline) {
+        PTHREAD_CHECK(pthread_cond_wait(cond, mutex));
+        return 0;
+    }
+    int result = pthread_cond_timedwait(cond, mutex, deadline);
+    if (result != ETIMEDOUT)
+        PTHREAD_CHECK(result);
+    return result;
+}
+
+/** Reads CLOCK_MONOTONIC in nanoseconds **/
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Runs a routine on each of `count` arguments in parallel: on the first one in the calling thread
+ * and on the others in threads of their own, then waits for all of them.
+ * @param routine : routine to run
+ * @param args : first argument
+ * @param count : number of arguments
+ * @param stride : distance in bytes between consecutive arguments, 0 to pass `args` to every run
+ */
+static inline void run_parallel(void* (*routine)(void*), void* args, size_t count, size_t stride) {
+    if (count == 0)
+        return;
+    // Allocated rather than on the stack, as the number of threads is up to the caller
+    pthread_t* threads = safe_malloc(count * sizeof(pthread_t));
+    for (size_t i = 1; i < count; i++)
+        PTHREAD_CHECK(pthread_create(&threads[i], NULL, routine, (char*) args + i * stride));
+    routine(args);
+    for (size_t i = 1; i < count; i++)
+        PTHREAD_CHECK(pthread_join(threads[i], NULL));
+    free(threads);
+}
+
+/** Hints the CPU that the thread is busy-waiting **/
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
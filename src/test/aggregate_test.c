@@ -0,0 +1,71 @@
+#include "feature_test.h"
+#include "tree_parallel.h"
+#include <errno.h>
+#include <string.h>
+
+/** Subdirectories of /c/, enough to land in the open-ended last bucket of the histogram **/
+#define AGGREGATE_WIDE (1 << (TREE_FANOUT_BUCKETS - 2))
+
+/**
+ * Compares a reduction with the expected one.
+ * @param got : computed reduction
+ * @param expected : expected reduction
+ * @return : whether they are equal
+ */
+static bool aggregate_equals(const TreeAggregate* got, const TreeAggregate* expected) {
+    bool equal = got->node_count == expected->node_count && got->max_depth == expected->max_depth
+        && memcmp(got->fanout_histogram, expected->fanout_histogram, sizeof(got->fanout_histogram)) == 0;
+    if (!equal) {
+        fprintf(stderr, "%zu directories, depth %zu, histogram", got->node_count, got->max_depth);
+        for (size_t i = 0; i < TREE_FANOUT_BUCKETS; i++)
+            fprintf(stderr, " %zu", got->fanout_histogram[i]);
+        fprintf(stderr, "\n");
+    }
+    return equal;
+}
+
+void test_aggregate_counts(void) {
+    for (TreeEngine engine = TREE_ENGINE_RW; engine <= TREE_ENGINE_INTENTION; engine++) {
+        TreeOptions options = {.engine = engine};
+        Tree* tree = tree_new_with_options(&options);
+        const char* paths[] = {"/a/", "/b/", "/c/", "/a/x/", "/a/x/p/", "/a/x/q/", "/a/x/r/", "/a/x/s/", "/a/x/t/"};
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+            CHECK(tree_create(tree, paths[i]) == 0);
+        char path[16];
+        for (size_t i = 0; i < AGGREGATE_WIDE; i++) {
+            snprintf(path, sizeof(path), "/c/%c%c%c/", (char) ('a' + i / 676), (char) ('a' + i / 26 % 26),
+                     (char) ('a' + i % 26));
+            CHECK(tree_create(tree, path) == 0);
+        }
+
+        // The root has 3 subdirectories, /a/ has 1, /a/x/ has 5 and /c/ the most; everything else is a leaf
+        TreeAggregate whole = {.node_count = 10 + AGGREGATE_WIDE, .max_depth = 3};
+        whole.fanout_histogram[0] = 6 + AGGREGATE_WIDE;
+        whole.fanout_histogram[1] = 1;
+        whole.fanout_histogram[2] = 1;
+        whole.fanout_histogram[3] = 1;
+        whole.fanout_histogram[TREE_FANOUT_BUCKETS - 1] = 1;
+        TreeAggregate below_a = {.node_count = 7, .max_depth = 2};
+        below_a.fanout_histogram[0] = 5;
+        below_a.fanout_histogram[1] = 1;
+        below_a.fanout_histogram[3] = 1;
+        TreeAggregate leaf = {.node_count = 1, .max_depth = 0};
+        leaf.fanout_histogram[0] = 1;
+
+        // Any number of workers, 0 meaning one per CPU, splits the work without changing the result
+        for (size_t threads = 0; threads <= 8; threads += threads ? threads : 1) {
+            TreeAggregate result;
+            CHECK(tree_aggregate(tree, "/", threads, &result) == 0);
+            CHECK(aggregate_equals(&result, &whole));
+            CHECK(tree_aggregate(tree, "/a/", threads, &result) == 0);
+            CHECK(aggregate_equals(&result, &below_a));
+            CHECK(tree_aggregate(tree, "/b/", threads, &result) == 0);
+            CHECK(aggregate_equals(&result, &leaf));
+        }
+
+        TreeAggregate result;
+        CHECK(tree_aggregate(tree, "/d/", 2, &result) == ENOENT);
+        CHECK(tree_aggregate(tree, "/a", 2, &result) == EINVAL);
+        tree_free(tree);
+    }
+}
@@ -0,0 +1,74 @@
+#include "feature_test.h"
+#include "tree_async.h"
+#include <errno.h>
+#include <string.h>
+
+/** Number of directories created through the pool **/
+#define ASYNC_DIRECTORIES 500
+
+/**
+ * Names a directory by a number, in letters as directory names have to be.
+ * @param path : where to store the path of the directory below the root
+ * @param number : the number
+ */
+static void numbered_path(char path[32], size_t number) {
+    size_t length = 0;
+    path[length++] = '/';
+    do {
+        path[length++] = (char) ('a' + number % 26);
+        number /= 26;
+    } while (number > 0);
+    path[length++] = '/';
+    path[length] = '\0';
+}
+
+void test_async_round_trip(void) {
+    Tree* tree = tree_new();
+    TreeAsync* async = tree_async_new(tree, 4, 64);
+    TreeCompletion completion;
+    CHECK(!tree_async_reap(async, &completion, false)); // Nothing submitted yet
+
+    char path[32];
+    size_t submitted = 0, reaped = 0, created = 0;
+    while (reaped < ASYNC_DIRECTORIES) {
+        if (submitted < ASYNC_DIRECTORIES) {
+            numbered_path(path, submitted);
+            TreeSubmission submission = {.op = TREE_OP_CREATE, .path = path, .user_data = submitted};
+            if (tree_async_submit(async, &submission)) {
+                submitted++;
+                continue;
+            }
+        }
+        // Full, or everything submitted - wait for a result
+        CHECK(tree_async_reap(async, &completion, true));
+        CHECK(completion.user_data < submitted);
+        CHECK(completion.listing == NULL);
+        created += completion.result == 0;
+        reaped++;
+    }
+    CHECK(created == ASYNC_DIRECTORIES);
+    CHECK(!tree_async_reap(async, &completion, false));
+
+    numbered_path(path, 7);
+    TreeSubmission list = {.op = TREE_OP_LIST, .path = path, .user_data = 7};
+    TreeSubmission missing = {.op = TREE_OP_REMOVE, .path = "/nothing/", .user_data = 8};
+    CHECK(tree_async_submit(async, &list));
+    CHECK(tree_async_submit(async, &missing));
+    for (size_t i = 0; i < 2; i++) {
+        CHECK(tree_async_reap(async, &completion, true));
+        if (completion.user_data == 7) {
+            CHECK(completion.result == 0);
+            CHECK(completion.listing && strcmp(completion.listing, "") == 0);
+            free(completion.listing);
+        }
+        else {
+            CHECK(completion.user_data == 8 && completion.result == ENOENT);
+        }
+    }
+
+    tree_async_free(async);
+    TreeStat stat;
+    CHECK(tree_stat(tree, "/", &stat) == 0);
+    CHECK(stat.subdirectories == ASYNC_DIRECTORIES);
+    tree_free(tree);
+}
@@ -0,0 +1,88 @@
+#include "feature_test.h"
+#include "tree_bulk.h"
+#include <errno.h>
+#include <string.h>
+
+/** Fan-out of the loaded tree **/
+#define BULK_FANOUT 4
+/** Depth of the loaded tree **/
+#define BULK_DEPTH 4
+
+/* Paths of a full tree in pre-order. */
+typedef struct BulkList {
+    char* paths[1 << (2 * BULK_DEPTH + 1)];
+    size_t count;
+} BulkList;
+
+/**
+ * Lists the subdirectories of a directory of a full tree and their descendants in pre-order,
+ * which with names in alphabetical order is also the order of `strcmp`.
+ * @param list : list to append to
+ * @param path : the directory
+ * @param depth : levels left below it
+ */
+static void list_full_tree(BulkList* list, const char* path, size_t depth) {
+    if (depth == 0)
+        return;
+    size_t length = strlen(path);
+    for (size_t i = 0; i < BULK_FANOUT; i++) {
+        char* child = malloc(length + 3);
+        sprintf(child, "%s%c/", path, (char) ('a' + i));
+        list->paths[list->count++] = child;
+        list_full_tree(list, child, depth - 1);
+    }
+}
+
+static void bulk_list_free(BulkList* list) {
+    for (size_t i = 0; i < list->count; i++)
+        free(list->paths[i]);
+}
+
+void test_bulk_load_counts(void) {
+    BulkList list = {.count = 0};
+    list_full_tree(&list, "/", BULK_DEPTH);
+    size_t below_top = 0; // Descendants of every subdirectory of the root
+    for (size_t level = 1, width = BULK_FANOUT; level < BULK_DEPTH; level++, width *= BULK_FANOUT)
+        below_top += width;
+
+    Tree* tree = tree_new();
+    CHECK(tree_bulk_load(tree, (const char* const*) list.paths, list.count, 3) == 0);
+    TreeStat stat;
+    CHECK(tree_stat(tree, "/", &stat) == 0);
+    CHECK(stat.subdirectories == BULK_FANOUT && stat.descendants == list.count);
+    CHECK(tree_stat(tree, "/c/", &stat) == 0);
+    CHECK(stat.subdirectories == BULK_FANOUT && stat.descendants == below_top);
+    CHECK(tree_stat(tree, "/d/a/b/c/", &stat) == 0);
+    CHECK(stat.subdirectories == 0 && stat.descendants == 0);
+    CHECK_LIST(tree, "/b/d/", "a,b,c,d");
+
+    // The counts stay right for the modifications after the load
+    CHECK(tree_stat(tree, "/a/b/", &stat) == 0);
+    size_t moved = stat.descendants + 1;
+    CHECK(tree_move(tree, "/a/b/", "/d/e/") == 0);
+    CHECK(tree_stat(tree, "/d/", &stat) == 0);
+    CHECK(stat.subdirectories == BULK_FANOUT + 1 && stat.descendants == below_top + moved);
+    CHECK(tree_stat(tree, "/a/", &stat) == 0);
+    CHECK(stat.subdirectories == BULK_FANOUT - 1 && stat.descendants == below_top - moved);
+    CHECK(tree_bulk_load(tree, (const char* const*) list.paths, list.count, 1) == ENOTEMPTY);
+    tree_free(tree);
+    bulk_list_free(&list);
+}
+
+void test_bulk_load_rejects(void) {
+    const char* unsorted[] = {"/b/", "/a/"};
+    const char* orphan[] = {"/a/", "/b/c/"};
+    const char* repeated[] = {"/a/", "/a/"};
+    const char* invalid[] = {"/a/", "/a1/"};
+
+    Tree* tree = tree_new();
+    CHECK(tree_bulk_load(tree, unsorted, 2, 1) == EINVAL);
+    CHECK(tree_bulk_load(tree, orphan, 2, 1) == ENOENT);
+    CHECK(tree_bulk_load(tree, repeated, 2, 1) == EEXIST);
+    CHECK(tree_bulk_load(tree, invalid, 2, 1) == EINVAL);
+    CHECK_LIST(tree, "/", ""); // Nothing gets built from a rejected list
+    TreeStat stat;
+    CHECK(tree_stat(tree, "/", &stat) == 0);
+    CHECK(stat.descendants == 0);
+    tree_free(tree);
+}
@@ -0,0 +1,122 @@
+#include "feature_test.h"
+#include <string.h>
+
+/* A named test case. */
+typedef struct FeatureTest {
+    const char* name;  /** Name the case is run by **/
+    void (*run)(void); /** The case **/
+} FeatureTest;
+
+static const FeatureTest tests[] = {
+    {"move_during_create", test_move_during_create},
+    {"rename_during_create", test_rename_during_create},
+    {"spinning_writer_holds_readers", test_spinning_writer_holds_readers},
+    {"timed_rw", test_timed_rw},
+    {"timed_intention", test_timed_intention},
+    {"async_round_trip", test_async_round_trip},
+    {"journal_replay_rw", test_journal_replay_rw},
+    {"journal_replay_intention", test_journal_replay_intention},
+    {"journal_txn_group", test_journal_txn_group},
+    {"bulk_load_counts", test_bulk_load_counts},
+    {"bulk_load_rejects", test_bulk_load_rejects},
+    {"import_counts", test_import_counts},
+    {"snapshot_isolation", test_snapshot_isolation},
+    {"snapshot_point_in_time", test_snapshot_point_in_time},
+    {"snapshot_blocked_writer", test_snapshot_blocked_writer},
+    {"txn_rollback_rw", test_txn_rollback_rw},
+    {"txn_rollback_intention", test_txn_rollback_intention},
+    {"watch_coalescing", test_watch_coalescing},
+    {"watch_overflow", test_watch_overflow},
+    {"watch_recursive_direct", test_watch_recursive_direct},
+    {"find_patterns", test_find_patterns},
+    {"find_parallel", test_find_parallel},
+    {"shm_processes", test_shm_processes},
+    {"shm_owner_dead", test_shm_owner_dead},
+    {"aggregate_counts", test_aggregate_counts},
+    {"memory_usage", test_memory_usage},
+    {"image_round_trip", test_image_round_trip},
+    {"image_rejects", test_image_rejects},
+#ifdef TREE_TRACE
+    {"trace_round_trip", test_trace_round_trip},
+#endif
+#ifdef TREE_STATS
+    {"stats_top_contended", test_stats_top_contended},
+    {"stats_retired_totals", test_stats_retired_totals},
+#endif
+};
+
+/** Compares two names by `strcmp`, for `qsort` **/
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Sorts the names of a comma-separated listing in place.
+ * @param listing : the listing
+ */
+static void sort_listing(char* listing) {
+    size_t count = 0, length = strlen(listing);
+    char** names = malloc((length / 2 + 1) * sizeof(char*));
+    for (char* name = strtok(listing, ","); name; name = strtok(NULL, ","))
+        names[count++] = name;
+    qsort(names, count, sizeof(char*), compare_names);
+
+    char* sorted = malloc(length + 1);
+    sorted[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0)
+            strcat(sorted, ",");
+        strcat(sorted, names[i]);
+    }
+    strcpy(listing, sorted);
+    free(sorted);
+    free(names);
+}
+
+struct timespec deadline_after(long ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    return deadline;
+}
+
+bool list_equals(Tree* tree, const char* path, const char* expected) {
+    return listing_equals(path, tree_list(tree, path), expected);
+}
+
+bool listing_equals(const char* path, char* listing, const char* expected) {
+    if (!listing || !expected) {
+        free(listing);
+        return !listing && !expected;
+    }
+    char* wanted = strdup(expected);
+    sort_listing(listing);
+    sort_listing(wanted);
+    bool equal = strcmp(listing, wanted) == 0;
+    if (!equal)
+        fprintf(stderr, "%s lists \"%s\", expected \"%s\"\n", path, listing, wanted);
+    free(wanted);
+    free(listing);
+    return equal;
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = sizeof(tests) / sizeof(tests[0]), run = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (argc > 1 && strcmp(argv[1], tests[i].name) != 0)
+            continue;
+        tests[i].run();
+        printf("%s: passed\n", tests[i].name);
+        run++;
+    }
+    if (run == 0) {
+        fprintf(stderr, "No case named %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Tree.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Behaviour tests of the features built on top of the file tree, run by ctest one case at a time.
+ * A case is a function that returns if it passes and exits the process with a failure otherwise.
+ */
+
+/** Fails the running case if the condition doesn't hold **/
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(EXIT_FAILURE);                                                           \
+        }                                                                                 \
+    } while (0)
+
+/** Fails the running case unless the directory lists exactly the comma-separated names, in any order **/
+#define CHECK_LIST(tree, path, expected) CHECK(list_equals(tree, path, expected))
+
+/**
+ * Computes a deadline for the timed operations.
+ * @param ms : milliseconds from now
+ * @return : absolute CLOCK_MONOTONIC time
+ */
+struct timespec deadline_after(long ms);
+
+/**
+ * Compares the listing of a directory with the expected one, ignoring the order of the names.
+ * @param tree : file tree
+ * @param path : listed directory
+ * @param expected : comma-separated names, NULL if the directory shouldn't exist
+ * @return : whether the listing matches
+ */
+bool list_equals(Tree* tree, const char* path, const char* expected);
+
+/**
+ * As `list_equals`, but for a listing obtained in another way, e.g. from a snapshot.
+ * @param path : listed directory, for the message on a mismatch
+ * @param listing : the listing, freed by the call, NULL if the directory doesn't exist
+ * @param expected : comma-separated names, NULL if the directory shouldn't exist
+ * @return : whether the listing matches
+ */
+bool listing_equals(const char* path, char* listing, const char* expected);
+
+/* Cases, grouped by the feature they cover. */
+
+void test_move_during_create(void);
+void test_rename_during_create(void);
+
+void test_spinning_writer_holds_readers(void);
+
+void test_timed_rw(void);
+void test_timed_intention(void);
+
+void test_async_round_trip(void);
+
+void test_journal_replay_rw(void);
+void test_journal_replay_intention(void);
+void test_journal_txn_group(void);
+
+void test_bulk_load_counts(void);
+void test_bulk_load_rejects(void);
+
+void test_import_counts(void);
+
+void test_snapshot_isolation(void);
+void test_snapshot_point_in_time(void);
+void test_snapshot_blocked_writer(void);
+
+void test_txn_rollback_rw(void);
+void test_txn_rollback_intention(void);
+
+void test_watch_coalescing(void);
+void test_watch_overflow(void);
+void test_watch_recursive_direct(void);
+
+void test_find_patterns(void);
+void test_find_parallel(void);
+
+void test_shm_processes(void);
+void test_shm_owner_dead(void);
+
+void test_aggregate_counts(void);
+
+void test_memory_usage(void);
+
+void test_image_round_trip(void);
+void test_image_rejects(void);
+
+// Built only into the executables compiled with the instrumentation they cover
+#ifdef TREE_TRACE
+void test_trace_round_trip(void);
+#endif
+#ifdef TREE_STATS
+void test_stats_top_contended(void);
+void test_stats_retired_totals(void);
+#endif
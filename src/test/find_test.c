@@ -0,0 +1,124 @@
+#include "feature_test.h"
+#include "tree_find.h"
+#include "path_utils.h"
+#include <errno.h>
+#include <string.h>
+
+/** Letters naming the directories of every level of the three-level tree the parallel case searches **/
+#define FIND_FANOUT 5
+
+/* Paths reported by a search, as a comma-separated listing. */
+typedef struct Found {
+    char* listing;
+    size_t length;
+    size_t visits;
+    size_t stop_after; /** Visits after which the visitor asks to stop, 0 to never stop **/
+} Found;
+
+static bool found_visitor(const char* path, const char* name, void* ctx) {
+    Found* found = ctx;
+    size_t extra = strlen(path) + strlen(name) + 2;
+    found->listing = realloc(found->listing, found->length + extra + 1);
+    found->length += sprintf(found->listing + found->length, "%s%s%s/", found->visits ? "," : "", path, name);
+    found->visits++;
+    return found->stop_after == 0 || found->visits < found->stop_after;
+}
+
+/**
+ * Searches a tree for a pattern and compares the found paths with the expected ones.
+ * @param tree : file tree
+ * @param pattern : glob pattern
+ * @param num_threads : threads of `tree_find_parallel`, 1 to use `tree_find`
+ * @param expected : comma-separated paths, in any order, "" if nothing matches
+ * @return : whether the search succeeded and found exactly these paths
+ */
+static bool find_equals(Tree* tree, const char* pattern, size_t num_threads, const char* expected) {
+    Found found = {.listing = strdup(""), .length = 0, .visits = 0, .stop_after = 0};
+    int err = num_threads == 1 ? tree_find(tree, pattern, found_visitor, &found)
+                               : tree_find_parallel(tree, pattern, num_threads, found_visitor, &found);
+    if (err != 0) {
+        fprintf(stderr, "searching %s failed with %d\n", pattern, err);
+        free(found.listing);
+        return false;
+    }
+    return listing_equals(pattern, found.listing, expected);
+}
+
+/** Fails the running case unless `tree_find` finds exactly the comma-separated paths **/
+#define CHECK_FIND(tree, pattern, expected) CHECK(find_equals(tree, pattern, 1, expected))
+
+void test_find_patterns(void) {
+    Tree* tree = tree_new();
+    const char* paths[] = {"/a/", "/a/ab/", "/a/ab/l/", "/a/ax/", "/a/ax/l/", "/a/xa/", "/a/xa/l/",
+                           "/a/b/", "/a/abc/", "/a/abc/l/", "/b/", "/b/ab/"};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+        CHECK(tree_create(tree, paths[i]) == 0);
+
+    CHECK_FIND(tree, "/a/*/", "/a/ab/,/a/ax/,/a/xa/,/a/b/,/a/abc/");
+    CHECK_FIND(tree, "/a/?/", "/a/b/");
+    CHECK_FIND(tree, "/a/a*/", "/a/ab/,/a/ax/,/a/abc/");
+    CHECK_FIND(tree, "/a/*c/", "/a/abc/");
+    CHECK_FIND(tree, "/a/a*b*c/", "/a/abc/"); // The first star has to give letters back to the second
+    CHECK_FIND(tree, "/a/**x/", "/a/ax/");
+    CHECK_FIND(tree, "/a/[a-b]?/", "/a/ab/,/a/ax/");
+    CHECK_FIND(tree, "/a/[xb]*/", "/a/xa/,/a/b/");
+    CHECK_FIND(tree, "/a/[!x]?/l/", "/a/ab/l/,/a/ax/l/");
+    CHECK_FIND(tree, "/*/ab/", "/a/ab/,/b/ab/");
+    CHECK_FIND(tree, "/*/", "/a/,/b/"); // The root itself is never reported
+    CHECK_FIND(tree, "/a/ab/l/", "/a/ab/l/");
+    CHECK_FIND(tree, "/a/zz/", "");
+    CHECK_FIND(tree, "/c/*/", ""); // A missing literal prefix matches nothing
+    CHECK_FIND(tree, "/a/ab/l/*/", "");
+
+    const char* invalid[] = {"", "/", "a/", "/a", "/a//", "/A/", "/a1/", "/a/[b/", "/[]/", "/[!]/", "/[z-a]/",
+                             "/[a-Z]/"};
+    Found found = {.listing = NULL, .length = 0, .visits = 0, .stop_after = 0};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        CHECK(tree_find(tree, invalid[i], found_visitor, &found) == EINVAL);
+        CHECK(tree_find_parallel(tree, invalid[i], 2, found_visitor, &found) == EINVAL);
+    }
+    char too_long[MAX_FOLDER_NAME_LENGTH + 4] = "/";
+    memset(too_long + 1, 'a', MAX_FOLDER_NAME_LENGTH + 1);
+    strcpy(too_long + MAX_FOLDER_NAME_LENGTH + 2, "/"); // No directory can have the name
+    CHECK(tree_find(tree, too_long, found_visitor, &found) == EINVAL);
+    CHECK(found.visits == 0);
+    tree_free(tree);
+}
+
+void test_find_parallel(void) {
+    Tree* tree = tree_new();
+    char path[16];
+    for (size_t i = 0; i < FIND_FANOUT * FIND_FANOUT * FIND_FANOUT; i++) {
+        char a = (char) ('a' + i / (FIND_FANOUT * FIND_FANOUT)), b = (char) ('a' + i / FIND_FANOUT % FIND_FANOUT);
+        char c = (char) ('a' + i % FIND_FANOUT);
+        snprintf(path, sizeof(path), "/%c/", a);
+        tree_create(tree, path); // EEXIST for all but the first of its subdirectories
+        snprintf(path, sizeof(path), "/%c/%c/", a, b);
+        tree_create(tree, path);
+        snprintf(path, sizeof(path), "/%c/%c/%c/", a, b, c);
+        CHECK(tree_create(tree, path) == 0);
+    }
+
+    // Every thread count finds the same as the serial search, whether it splits at the first level or deeper
+    const char* patterns[] = {"/?/[!b]*/[a-c]/", "/c/*/[de]/", "/[bd]/a/*/", "/*/*/*/", "/e/?/"};
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        Found serial = {.listing = strdup(""), .length = 0, .visits = 0, .stop_after = 0};
+        CHECK(tree_find(tree, patterns[i], found_visitor, &serial) == 0);
+        for (size_t threads = 0; threads <= 8; threads += threads ? threads : 2)
+            CHECK(find_equals(tree, patterns[i], threads, serial.listing));
+        free(serial.listing);
+    }
+
+    // A visitor asking to stop gets no further calls, even from other threads
+    for (size_t threads = 1; threads <= 4; threads++) {
+        Found stopped = {.listing = NULL, .length = 0, .visits = 0, .stop_after = 3};
+        CHECK(tree_find_parallel(tree, "/*/*/*/", threads, found_visitor, &stopped) == 0);
+        CHECK(stopped.visits == 3);
+        free(stopped.listing);
+    }
+    Found stopped = {.listing = NULL, .length = 0, .visits = 0, .stop_after = 1};
+    CHECK(tree_find(tree, "/*/", found_visitor, &stopped) == 0);
+    CHECK(stopped.visits == 1);
+    free(stopped.listing);
+    tree_free(tree);
+}
@@ -0,0 +1,206 @@
+#include "feature_test.h"
+#include "tree_snapshot.h"
+#include "path_utils.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Room for the hand-made images of the rejection case **/
+#define IMAGE_BUFFER 256
+
+/* Paths of the directories reached by a walk, as a comma-separated listing. */
+typedef struct Walked {
+    char* listing;
+    size_t length;
+} Walked;
+
+static bool walked_visitor(const char* path, const char* name, void* ctx) {
+    Walked* walked = ctx;
+    size_t extra = strlen(path) + strlen(name) + 2;
+    walked->listing = realloc(walked->listing, walked->length + extra + 1);
+    walked->length += sprintf(walked->listing + walked->length, "%s%s%s/", walked->length ? "," : "", path, name);
+    return true;
+}
+
+/**
+ * Lists every directory of a tree.
+ * @param tree : file tree
+ * @return : comma-separated paths, in no particular order
+ */
+static char* walk_all(Tree* tree) {
+    Walked walked = {strdup(""), 0};
+    CHECK(tree_walk(tree, "/", walked_visitor, &walked) == 0);
+    return walked.listing;
+}
+
+/**
+ * Replaces the contents of a file, leaving its offset at the start.
+ * @param fd : descriptor of the file
+ * @param bytes : new contents
+ * @param size : their size
+ */
+static void rewrite(int fd, const void* bytes, size_t size) {
+    CHECK(ftruncate(fd, 0) == 0);
+    CHECK(pwrite(fd, bytes, size, 0) == (ssize_t) size);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+}
+
+/**
+ * Writes an image by hand: the header, then the given records.
+ * @param image : buffer of IMAGE_BUFFER bytes
+ * @param count : number of directories stored in the header
+ * @param records : the directories' records
+ * @param records_size : their size
+ * @return : size of the image
+ */
+static size_t make_image(unsigned char* image, uint64_t count, const char* records, size_t records_size) {
+    uint64_t position = 0;
+    size_t size = strlen(SNAPSHOT_MAGIC);
+    memcpy(image, SNAPSHOT_MAGIC, size);
+    memcpy(image + size, &count, sizeof(count));
+    size += sizeof(count);
+    memcpy(image + size, &position, sizeof(position));
+    size += sizeof(position);
+    memcpy(image + size, records, records_size);
+    return size + records_size;
+}
+
+/**
+ * Loads an image from a file, checking the result.
+ * @param fd : descriptor of the file
+ * @param expected : expected error code / success
+ * @return : whether loading returned it, freeing the tree if it succeeded
+ */
+static bool load_returns(int fd, int expected) {
+    Tree* tree = NULL;
+    int err = tree_load(fd, NULL, &tree);
+    if (err == 0)
+        tree_free(tree);
+    if (err != expected)
+        fprintf(stderr, "loading returned %d, expected %d\n", err, expected);
+    return err == expected;
+}
+
+/** Position stored in the images of the round trip case **/
+static uint64_t image_position(void* ctx) {
+    (void) ctx;
+    return 42;
+}
+
+void test_image_round_trip(void) {
+    for (TreeEngine engine = TREE_ENGINE_RW; engine <= TREE_ENGINE_INTENTION; engine++) {
+        TreeOptions options = {.engine = engine};
+        Tree* tree = tree_new_with_options(&options);
+        const char* paths[] = {"/a/", "/a/b/", "/a/b/c/", "/a/b/c/d/", "/a/e/", "/f/", "/f/gh/", "/ijk/"};
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+            CHECK(tree_create(tree, paths[i]) == 0);
+        char long_path[MAX_PATH_LENGTH + 1] = "/";
+        for (size_t length = 1; length + 2 <= MAX_PATH_LENGTH; length += 2) {
+            strcat(long_path, "z/"); // As deep as a path gets
+            CHECK(tree_create(tree, long_path) == 0);
+        }
+
+        FILE* file = tmpfile();
+        CHECK(file);
+        int fd = fileno(file);
+        CHECK(snapshot_save(tree, fd, image_position, NULL) == 0);
+        Tree* loaded = NULL;
+        uint64_t position = 0;
+        CHECK(snapshot_load(fd, &options, &loaded, &position) == 0);
+        CHECK(position == 42);
+
+        // The loaded tree has the same directories and counts, and takes modifications as usual
+        char* expected = walk_all(tree);
+        CHECK(listing_equals("/", walk_all(loaded), expected));
+        free(expected);
+        TreeStat original, copy;
+        CHECK(tree_stat(tree, "/a/", &original) == 0 && tree_stat(loaded, "/a/", &copy) == 0);
+        CHECK(copy.subdirectories == original.subdirectories && copy.descendants == original.descendants);
+        CHECK(tree_stat(tree, "/", &original) == 0 && tree_stat(loaded, "/", &copy) == 0);
+        CHECK(copy.subdirectories == original.subdirectories && copy.descendants == original.descendants);
+        CHECK(tree_remove(loaded, "/a/b/c/d/") == 0);
+        CHECK(tree_create(loaded, "/f/gh/l/") == 0);
+        CHECK_LIST(loaded, "/a/b/c/", "");
+        CHECK_LIST(loaded, "/f/gh/", "l");
+        CHECK(tree_stat(loaded, "/", &copy) == 0 && copy.descendants == original.descendants);
+
+        // An empty tree makes the smallest image
+        Tree* empty = tree_new();
+        rewrite(fd, "", 0);
+        CHECK(tree_save(empty, fd) == 0);
+        tree_free(empty);
+        CHECK(tree_load(fd, &options, &empty) == 0);
+        CHECK_LIST(empty, "/", "");
+        tree_free(empty);
+
+        fclose(file);
+        tree_free(loaded);
+        tree_free(tree);
+    }
+}
+
+void test_image_rejects(void) {
+    FILE* file = tmpfile();
+    CHECK(file);
+    int fd = fileno(file);
+    unsigned char image[IMAGE_BUFFER];
+
+    // The root with /a/ and /b/, as the control the broken images are made from
+    const char valid[] = "\0\2" "\1a\0" "\1b\0";
+    size_t size = make_image(image, 3, valid, sizeof(valid) - 1);
+    rewrite(fd, image, size);
+    Tree* tree = NULL;
+    CHECK(tree_load(fd, NULL, &tree) == 0);
+    CHECK_LIST(tree, "/", "a,b");
+    tree_free(tree);
+
+    // Every truncation is rejected, whether it cuts the header, a name or a count
+    for (size_t cut = 0; cut < size; cut++) {
+        rewrite(fd, image, cut);
+        CHECK(load_returns(fd, EINVAL));
+    }
+    unsigned char longer[IMAGE_BUFFER];
+    memcpy(longer, image, size);
+    longer[size] = 0;
+    rewrite(fd, longer, size + 1);
+    CHECK(load_returns(fd, EINVAL)); // A byte after the last record
+
+    // A name repeated in a directory
+    const char duplicate[] = "\0\2" "\1a\0" "\1a\0";
+    rewrite(fd, image, make_image(image, 3, duplicate, sizeof(duplicate) - 1));
+    CHECK(load_returns(fd, EINVAL));
+    const char nested[] = "\0\2" "\1a\1" "\1a\0" "\1b\0"; // The same name one level down is fine
+    rewrite(fd, image, make_image(image, 4, nested, sizeof(nested) - 1));
+    CHECK(load_returns(fd, 0));
+
+    // Counts that disagree with the records
+    const size_t wrong_totals[] = {0, 2, 4};
+    for (size_t i = 0; i < sizeof(wrong_totals) / sizeof(wrong_totals[0]); i++) {
+        rewrite(fd, image, make_image(image, wrong_totals[i], valid, sizeof(valid) - 1));
+        CHECK(load_returns(fd, EINVAL));
+    }
+    const char too_many[] = "\0\3" "\1a\0" "\1b\0";
+    rewrite(fd, image, make_image(image, 3, too_many, sizeof(too_many) - 1));
+    CHECK(load_returns(fd, EINVAL));
+    const char too_few[] = "\0\1" "\1a\0" "\1b\0";
+    rewrite(fd, image, make_image(image, 3, too_few, sizeof(too_few) - 1));
+    CHECK(load_returns(fd, EINVAL));
+    const char huge[] = "\0\xff\xff\xff\xff\xff\xff\xff\xff\xff\1" "\1a\0";
+    rewrite(fd, image, make_image(image, 2, huge, sizeof(huge) - 1));
+    CHECK(load_returns(fd, EINVAL));
+
+    // Names no directory can have, and a named root
+    const char* bad_names[] = {"\0\1" "\0\0", "\0\1" "\1A\0", "\0\1" "\1" "1\0", "\1r\0"};
+    const size_t bad_sizes[] = {4, 5, 5, 3};
+    for (size_t i = 0; i < sizeof(bad_names) / sizeof(bad_names[0]); i++) {
+        rewrite(fd, image, make_image(image, i < 3 ? 2 : 1, bad_names[i], bad_sizes[i]));
+        CHECK(load_returns(fd, EINVAL));
+    }
+
+    // Another magic
+    size = make_image(image, 3, valid, sizeof(valid) - 1);
+    image[0] = 'X';
+    rewrite(fd, image, size);
+    CHECK(load_returns(fd, EINVAL));
+    fclose(file);
+}
@@ -0,0 +1,83 @@
+#include "feature_test.h"
+#include "tree_import.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Host directories of the imported hierarchy, parents first **/
+static const char* const host_directories[] = {"a", "a/b", "a/c", "a/c/e", "d", "d/f", "Bad", "Bad/g"};
+#define HOST_DIRECTORIES (sizeof(host_directories) / sizeof(host_directories[0]))
+
+/** Counts the problems reported by `tree_import` by their kind **/
+static void count_problem(const char* host_path, TreeImportProblem problem, void* ctx) {
+    (void) host_path;
+    ((size_t*) ctx)[problem]++;
+}
+
+/**
+ * Builds a host hierarchy with a directory whose name the tree can't hold, a regular file
+ * and a symbolic link, neither of which gets imported.
+ * @param root : existing empty host directory
+ */
+static void build_host(const char* root) {
+    char path[128];
+    for (size_t i = 0; i < HOST_DIRECTORIES; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, host_directories[i]);
+        CHECK(mkdir(path, 0755) == 0);
+    }
+    snprintf(path, sizeof(path), "%s/a/file", root);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    CHECK(fd >= 0);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/link", root);
+    CHECK(symlink("a", path) == 0);
+}
+
+static void remove_host(const char* root) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/a/file", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/link", root);
+    unlink(path);
+    for (size_t i = HOST_DIRECTORIES; i > 0; i--) {
+        snprintf(path, sizeof(path), "%s/%s", root, host_directories[i - 1]);
+        rmdir(path);
+    }
+    rmdir(root);
+}
+
+void test_import_counts(void) {
+    char root[] = "/tmp/import_testXXXXXX";
+    CHECK(mkdtemp(root));
+    build_host(root);
+
+    Tree* tree = tree_new();
+    CHECK(tree_create(tree, "/t/") == 0);
+    CHECK(tree_create(tree, "/t/d/") == 0);
+    size_t problems[TREE_IMPORT_EXISTS + 1] = {0};
+    TreeImportResult result;
+    CHECK(tree_import(tree, "/t/", root, 3, count_problem, problems, &result) == 0);
+
+    // a, a/b, a/c and a/c/e, but not d, which the tree has already, nor Bad and its contents
+    CHECK(result.imported == 4);
+    CHECK(result.problems == 2);
+    CHECK(problems[TREE_IMPORT_INVALID_NAME] == 1 && problems[TREE_IMPORT_EXISTS] == 1);
+    CHECK(problems[TREE_IMPORT_TOO_LONG] == 0 && problems[TREE_IMPORT_UNREADABLE] == 0);
+    CHECK_LIST(tree, "/t/", "a,d");
+    CHECK_LIST(tree, "/t/a/", "b,c");
+    CHECK_LIST(tree, "/t/a/c/", "e");
+    CHECK_LIST(tree, "/t/d/", ""); // Left as it was
+    TreeStat stat;
+    CHECK(tree_stat(tree, "/", &stat) == 0);
+    CHECK(stat.descendants == 6);
+    CHECK(tree_stat(tree, "/t/a/", &stat) == 0);
+    CHECK(stat.subdirectories == 2 && stat.descendants == 3);
+
+    CHECK(tree_import(tree, "/x/", root, 1, NULL, NULL, NULL) == ENOENT);
+    CHECK(tree_import(tree, "/t/a/b/", "/nonexistent/import/host", 1, NULL, NULL, NULL) == ENOENT);
+    CHECK_LIST(tree, "/t/a/b/", "");
+    tree_free(tree);
+    remove_host(root);
+}
@@ -0,0 +1,247 @@
+#include "feature_test.h"
+#include "tree_journal.h"
+#include "tree_txn.h"
+#include "sync_utils.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Modifications performed by every thread of the replay case **/
+#define JOURNAL_OPS 3000
+/** Threads modifying the journaled tree **/
+#define JOURNAL_THREADS 4
+
+/* A thread modifying the journaled tree at random. */
+typedef struct JournalClient {
+    Tree* tree;
+    uint64_t rng;
+} JournalClient;
+
+/* Paths of every directory of a tree. */
+typedef struct TreeDump {
+    char** paths;
+    size_t count, capacity;
+} TreeDump;
+
+/** Advances a xorshift64 generator **/
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Draws a path of one to three levels over a three-letter alphabet, so that the modifications
+ * keep running into each other's directories.
+ * @param rng : state of the caller's generator
+ * @param path : buffer of at least 8 bytes
+ */
+static void random_path(uint64_t* rng, char* path) {
+    size_t depth = 1 + next_random(rng) % 3, length = 0;
+    path[length++] = '/';
+    for (size_t i = 0; i < depth; i++) {
+        path[length++] = (char) ('a' + next_random(rng) % 3);
+        path[length++] = '/';
+    }
+    path[length] = '\0';
+}
+
+static void* journal_client_run(void* arg) {
+    JournalClient* client = arg;
+    char path[8], target[8];
+    for (size_t i = 0; i < JOURNAL_OPS; i++) {
+        random_path(&client->rng, path);
+        switch (next_random(&client->rng) % 3) {
+            case 0:
+                tree_create(client->tree, path);
+                break;
+            case 1:
+                tree_remove(client->tree, path);
+                break;
+            default:
+                random_path(&client->rng, target);
+                tree_move(client->tree, path, target);
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* A checkpoint taken while the clients run. */
+typedef struct PendingCheckpoint {
+    TreeJournal* journal;
+    const char* snapshot;
+    int result;
+} PendingCheckpoint;
+
+static void* checkpoint_run(void* arg) {
+    PendingCheckpoint* checkpoint = arg;
+    checkpoint->result = tree_journal_checkpoint(checkpoint->journal, checkpoint->snapshot);
+    return NULL;
+}
+
+static bool dump_visitor(const char* path, const char* name, void* ctx) {
+    TreeDump* dump = ctx;
+    if (dump->count == dump->capacity) {
+        dump->capacity = dump->capacity ? dump->capacity * 2 : 16;
+        dump->paths = realloc(dump->paths, dump->capacity * sizeof(char*));
+    }
+    char* full = malloc(strlen(path) + strlen(name) + 2);
+    sprintf(full, "%s%s/", path, name);
+    dump->paths[dump->count++] = full;
+    return true;
+}
+
+/** Compares two paths by `strcmp`, for `qsort` **/
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Lists every directory of a tree.
+ * @param tree : file tree
+ * @param dump : where to store the sorted paths
+ */
+static void dump_tree(Tree* tree, TreeDump* dump) {
+    memset(dump, 0, sizeof(TreeDump));
+    CHECK(tree_walk(tree, "/", dump_visitor, dump) == 0);
+    qsort(dump->paths, dump->count, sizeof(char*), compare_paths);
+}
+
+static void dump_free(TreeDump* dump) {
+    for (size_t i = 0; i < dump->count; i++)
+        free(dump->paths[i]);
+    free(dump->paths);
+}
+
+/**
+ * Journals concurrent creations, removals and moves over a handful of names while taking a checkpoint,
+ * and checks that the tree recovered from the journal and the image is the same as the original.
+ * @param engine : concurrency control scheme of the tree
+ */
+static void check_journal_replay(TreeEngine engine) {
+    char directory[] = "/tmp/journal_testXXXXXX", journal_path[64], snapshot_path[64];
+    CHECK(mkdtemp(directory));
+    snprintf(journal_path, sizeof(journal_path), "%s/journal", directory);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot", directory);
+
+    TreeOptions options = {.engine = engine};
+    Tree* tree = tree_new_with_options(&options);
+    TreeJournal* journal = NULL;
+    CHECK(tree_journal_open(tree, journal_path, &journal) == 0);
+
+    JournalClient clients[JOURNAL_THREADS];
+    for (size_t i = 0; i < JOURNAL_THREADS; i++)
+        clients[i] = (JournalClient) {tree, 0x9E3779B97F4A7C15ULL * (i + 1)};
+    PendingCheckpoint checkpoint = {journal, snapshot_path, -1};
+    pthread_t checkpointer;
+    PTHREAD_CHECK(pthread_create(&checkpointer, NULL, checkpoint_run, &checkpoint));
+    run_parallel(journal_client_run, clients, JOURNAL_THREADS, sizeof(JournalClient));
+    PTHREAD_CHECK(pthread_join(checkpointer, NULL));
+    CHECK(checkpoint.result == 0);
+    tree_journal_close(journal);
+
+    Tree* recovered = NULL;
+    CHECK(tree_recover(snapshot_path, journal_path, &options, &recovered) == 0);
+    TreeDump original, replayed;
+    dump_tree(tree, &original);
+    dump_tree(recovered, &replayed);
+    CHECK(original.count == replayed.count);
+    for (size_t i = 0; i < original.count; i++)
+        CHECK(strcmp(original.paths[i], replayed.paths[i]) == 0);
+
+    dump_free(&original);
+    dump_free(&replayed);
+    tree_free(recovered);
+    tree_free(tree);
+    unlink(journal_path);
+    unlink(snapshot_path);
+    rmdir(directory);
+}
+
+void test_journal_replay_rw(void) {
+    check_journal_replay(TREE_ENGINE_RW);
+}
+
+void test_journal_replay_intention(void) {
+    check_journal_replay(TREE_ENGINE_INTENTION);
+}
+
+/**
+ * Writes the first bytes of a journal to a file, as a crash in the middle of writing it would leave them.
+ * @param filename : path of the file, replaced if it exists
+ * @param data : contents of the whole journal
+ * @param size : number of bytes to keep
+ */
+static void write_prefix(const char* filename, const char* data, size_t size) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(write(fd, data, size) == (ssize_t) size);
+    close(fd);
+}
+
+void test_journal_txn_group(void) {
+    char directory[] = "/tmp/journal_testXXXXXX", journal_path[64], torn_path[64];
+    CHECK(mkdtemp(directory));
+    snprintf(journal_path, sizeof(journal_path), "%s/journal", directory);
+    snprintf(torn_path, sizeof(torn_path), "%s/torn", directory);
+
+    Tree* tree = tree_new();
+    TreeJournal* journal = NULL;
+    CHECK(tree_journal_open(tree, journal_path, &journal) == 0);
+    CHECK(tree_create(tree, "/a/") == 0);
+    TreeTxn* txn = tree_txn_begin(tree);
+    CHECK(tree_txn_create(txn, "/b/") == 0);
+    CHECK(tree_txn_create(txn, "/b/c/") == 0);
+    CHECK(tree_txn_move(txn, "/a/", "/b/a/") == 0);
+    CHECK(tree_txn_commit(txn, NULL) == 0);
+    CHECK(tree_create(tree, "/e/") == 0);
+    tree_journal_close(journal);
+    tree_free(tree);
+
+    char data[4096];
+    int fd = open(journal_path, O_RDONLY);
+    CHECK(fd >= 0);
+    ssize_t size = read(fd, data, sizeof(data));
+    close(fd);
+    CHECK(size > 0 && size < (ssize_t) sizeof(data));
+
+    // Every prefix of the journal recovers the tree before or after the whole transaction, never in between
+    bool before = false, after = false;
+    for (ssize_t length = sizeof(JOURNAL_MAGIC) - 1 + sizeof(uint64_t); length <= size; length++) {
+        write_prefix(torn_path, data, length);
+        Tree* recovered = NULL;
+        CHECK(tree_recover(NULL, torn_path, NULL, &recovered) == 0);
+        char* root = tree_list(recovered, "/");
+        if (strcmp(root, "a") == 0) {
+            before = true;
+        }
+        else if (strcmp(root, "") != 0) {
+            CHECK(strcmp(root, "b") == 0 || strcmp(root, "b,e") == 0 || strcmp(root, "e,b") == 0);
+            CHECK_LIST(recovered, "/b/", "a,c");
+            after = true;
+        }
+        free(root);
+        tree_free(recovered);
+    }
+    CHECK(before && after);
+
+    // Opening a journal cut in the middle of a transaction drops its records, and journaling goes on after them
+    write_prefix(torn_path, data, size - sizeof(JournalRecord) - strlen("/e/") - 1);
+    Tree* recovered = NULL;
+    CHECK(tree_recover(NULL, torn_path, NULL, &recovered) == 0);
+    CHECK_LIST(recovered, "/", "a");
+    CHECK(tree_journal_open(recovered, torn_path, &journal) == 0);
+    CHECK(tree_create(recovered, "/f/") == 0);
+    tree_journal_close(journal);
+    tree_free(recovered);
+    CHECK(tree_recover(NULL, torn_path, NULL, &recovered) == 0);
+    CHECK_LIST(recovered, "/", "a,f");
+    CHECK_LIST(recovered, "/a/", "");
+    tree_free(recovered);
+
+    unlink(journal_path);
+    unlink(torn_path);
+    rmdir(directory);
+}
@@ -0,0 +1,31 @@
+#include "feature_test.h"
+#include "tree_internal.h"
+#include <errno.h>
+
+/**
+ * Lists a directory while a writer spins for its lock, with a deadline shortly ahead.
+ * @param policy : lock policy of the tree
+ * @return : result of the listing
+ */
+static int list_past_spinning_writer(TreeLockPolicy policy) {
+    TreeOptions options = {.lock_policy = policy};
+    Tree* tree = tree_new_with_options(&options);
+    CHECK(tree_create(tree, "/a/") == 0);
+    Tree* a = hmap_get(tree->subdirectories, "a");
+    UNDER_MUTEX(&a->var_protection, a->w_spin++); // As a writer in `spin_then_lock` would
+
+    struct timespec deadline = deadline_after(20);
+    char* listing = NULL;
+    int err = tree_list_timed(tree, "/a/", &deadline, &listing);
+    free(listing);
+
+    UNDER_MUTEX(&a->var_protection, a->w_spin--);
+    tree_free(tree);
+    return err;
+}
+
+void test_spinning_writer_holds_readers(void) {
+    CHECK(list_past_spinning_writer(TREE_LOCK_PHASE_FAIR) == ETIMEDOUT);
+    CHECK(list_past_spinning_writer(TREE_LOCK_WRITER_PREFERENCE) == ETIMEDOUT);
+    CHECK(list_past_spinning_writer(TREE_LOCK_READER_PREFERENCE) == 0);
+}
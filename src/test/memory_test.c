@@ -0,0 +1,75 @@
+#include "feature_test.h"
+#include "tree_internal.h"
+#include <errno.h>
+
+/**
+ * Compares a usage with the one expected of a subtree of the given shape.
+ * @param got : computed usage
+ * @param nodes : number of directories, including the subtree's root
+ * @param pairs : number of directories below the subtree's root
+ * @param keys : bytes of their names, with the terminating characters
+ * @param versions : expected size of the preserved maps
+ * @param context : whether the state shared by the whole tree is expected among the nodes
+ * @return : whether the usage is the expected one
+ */
+static bool usage_equals(const TreeMemoryUsage* got, size_t nodes, size_t pairs, size_t keys, size_t versions,
+                         bool context) {
+    bool equal = got->nodes == nodes * sizeof(Tree) + (context ? sizeof(TreeContext) : 0)
+        && got->maps == nodes * MAP_MEMORY && got->pairs == pairs * PAIR_MEMORY && got->keys == keys
+        && got->versions == versions
+        && got->total == got->nodes + got->maps + got->pairs + got->keys + got->versions;
+    if (!equal)
+        fprintf(stderr, "nodes %zu, maps %zu, pairs %zu, keys %zu, versions %zu, total %zu\n", got->nodes, got->maps,
+                got->pairs, got->keys, got->versions, got->total);
+    return equal;
+}
+
+void test_memory_usage(void) {
+    for (TreeEngine engine = TREE_ENGINE_RW; engine <= TREE_ENGINE_INTENTION; engine++) {
+        TreeOptions options = {.engine = engine};
+        Tree* tree = tree_new_with_options(&options);
+        TreeMemoryUsage usage;
+        CHECK(tree_memory_usage(tree, "/", &usage) == 0);
+        CHECK(usage_equals(&usage, 1, 0, 0, 0, true));
+
+        const char* paths[] = {"/a/", "/a/bc/", "/a/bc/d/", "/ef/"};
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+            CHECK(tree_create(tree, paths[i]) == 0);
+        CHECK(tree_memory_usage(tree, "/", &usage) == 0);
+        CHECK(usage_equals(&usage, 5, 4, 10, 0, true));
+        CHECK(tree_memory_usage(tree, "/a/", &usage) == 0);
+        CHECK(usage_equals(&usage, 3, 2, 5, 0, false));
+        CHECK(tree_memory_usage(tree, "/a/bc/d/", &usage) == 0);
+        CHECK(usage_equals(&usage, 1, 0, 0, 0, false));
+
+        // A change under a snapshot keeps the earlier map of the directory, once per snapshot
+        TreeSnapshot *first = NULL, *second = NULL;
+        CHECK(tree_snapshot(tree, "/", &first) == 0);
+        CHECK(tree_create(tree, "/a/g/") == 0);
+        CHECK(tree_create(tree, "/a/h/") == 0);
+        CHECK(tree_memory_usage(tree, "/a/", &usage) == 0);
+        size_t one_version = usage.versions; // The map holding bc
+        CHECK(one_version > MAP_MEMORY + PAIR_MEMORY + 3);
+        CHECK(usage_equals(&usage, 5, 4, 9, one_version, false));
+        CHECK(tree_snapshot(tree, "/", &second) == 0);
+        CHECK(tree_remove(tree, "/a/h/") == 0);
+        CHECK(tree_memory_usage(tree, "/", &usage) == 0);
+        size_t two_versions = 2 * one_version + 2 * PAIR_MEMORY + 4; // And the map holding bc, g and h
+        CHECK(usage_equals(&usage, 6, 5, 12, two_versions, true));
+        CHECK(tree_memory_usage(tree, "/ef/", &usage) == 0);
+        CHECK(usage_equals(&usage, 1, 0, 0, 0, false));
+
+        // The maps are counted until the directory's next change drops them
+        tree_snapshot_release(first);
+        tree_snapshot_release(second);
+        CHECK(tree_memory_usage(tree, "/a/", &usage) == 0);
+        CHECK(usage_equals(&usage, 4, 3, 7, two_versions, false));
+        CHECK(tree_create(tree, "/a/i/") == 0);
+        CHECK(tree_memory_usage(tree, "/", &usage) == 0);
+        CHECK(usage_equals(&usage, 7, 6, 14, 0, true));
+
+        CHECK(tree_memory_usage(tree, "/zz/", &usage) == ENOENT);
+        CHECK(tree_memory_usage(tree, "a/", &usage) == EINVAL);
+        tree_free(tree);
+    }
+}
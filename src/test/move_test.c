@@ -0,0 +1,135 @@
+#include "feature_test.h"
+#include "tree_internal.h"
+#include <errno.h>
+#include <sched.h>
+
+/* A walk held up on its first directory until released, keeping its locks on the way there. */
+typedef struct StalledWalk {
+    Tree* tree;
+    const char* path;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    bool entered, released;
+    pthread_t thread;
+} StalledWalk;
+
+/* A creation running in its own thread. */
+typedef struct PendingCreate {
+    Tree* tree;
+    const char* path;
+    int result;
+    pthread_t thread;
+} PendingCreate;
+
+/** Holds the walk up in its first directory until `release_walk` **/
+static bool stall_visitor(const char* path, const char* name, void* ctx) {
+    StalledWalk* walk = ctx;
+    (void) path;
+    (void) name;
+    UNDER_MUTEX(&walk->mutex,
+        walk->entered = true;
+        PTHREAD_CHECK(pthread_cond_broadcast(&walk->changed));
+        while (!walk->released)
+            PTHREAD_CHECK(pthread_cond_wait(&walk->changed, &walk->mutex));
+    );
+    return false;
+}
+
+static void* walk_run(void* arg) {
+    StalledWalk* walk = arg;
+    CHECK(tree_walk(walk->tree, walk->path, stall_visitor, walk) == 0);
+    return NULL;
+}
+
+static void* create_run(void* arg) {
+    PendingCreate* create = arg;
+    create->result = tree_create(create->tree, create->path);
+    return NULL;
+}
+
+/**
+ * Starts a walk of a directory with a subdirectory, and returns once it holds the directory's reader lock.
+ * @param walk : the walk, with `tree` and `path` set
+ */
+static void stall_walk(StalledWalk* walk) {
+    PTHREAD_CHECK(pthread_mutex_init(&walk->mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&walk->changed, NULL));
+    walk->entered = walk->released = false;
+    PTHREAD_CHECK(pthread_create(&walk->thread, NULL, walk_run, walk));
+    UNDER_MUTEX(&walk->mutex,
+        while (!walk->entered)
+            PTHREAD_CHECK(pthread_cond_wait(&walk->changed, &walk->mutex));
+    );
+}
+
+/**
+ * Lets a walk started by `stall_walk` finish.
+ * @param walk : the walk
+ */
+static void release_walk(StalledWalk* walk) {
+    UNDER_MUTEX(&walk->mutex,
+        walk->released = true;
+        PTHREAD_CHECK(pthread_cond_broadcast(&walk->changed));
+    );
+    PTHREAD_CHECK(pthread_join(walk->thread, NULL));
+    PTHREAD_CHECK(pthread_cond_destroy(&walk->changed));
+    PTHREAD_CHECK(pthread_mutex_destroy(&walk->mutex));
+}
+
+/**
+ * Waits until a writer waits for the lock of a directory.
+ * @param node : the directory
+ */
+static void await_writer(Tree* node) {
+    size_t waiting = 0;
+    while (waiting == 0) {
+        sched_yield();
+        UNDER_MUTEX(&node->var_protection, waiting = node->w_wait);
+    }
+}
+
+/**
+ * Runs a creation of /a/b/c/ that has passed /a/ and waits for /a/b/, held by a walk,
+ * while /a/ is moved to `target`. The creation has to fail as if it ran after the move,
+ * rather than create the directory through the path that no longer exists.
+ * @param t_parent : existing parent of the target, NULL for the root
+ * @param target : where /a/ is moved
+ * @param moved_b : path of /a/b/ after the move
+ */
+static void check_move_during_create(const char* t_parent, const char* target, const char* moved_b) {
+    // Readers get past the waiting creation, so the moved directory can be listed meanwhile
+    TreeOptions options = {.lock_policy = TREE_LOCK_READER_PREFERENCE, .park_immediately = true};
+    Tree* tree = tree_new_with_options(&options);
+    CHECK(tree_create(tree, "/a/") == 0);
+    CHECK(tree_create(tree, "/a/b/") == 0);
+    CHECK(tree_create(tree, "/a/b/d/") == 0);
+    if (t_parent)
+        CHECK(tree_create(tree, t_parent) == 0);
+    Tree* a = hmap_get(tree->subdirectories, "a");
+    Tree* b = hmap_get(a->subdirectories, "b");
+
+    StalledWalk walk = {.tree = tree, .path = "/a/b/"};
+    stall_walk(&walk);
+    PendingCreate create = {.tree = tree, .path = "/a/b/c/"};
+    PTHREAD_CHECK(pthread_create(&create.thread, NULL, create_run, &create));
+    await_writer(b);
+
+    // The move doesn't wait for the operations inside the moved directory
+    CHECK(tree_move(tree, "/a/", target) == 0);
+    CHECK_LIST(tree, moved_b, "d");
+
+    release_walk(&walk);
+    PTHREAD_CHECK(pthread_join(create.thread, NULL));
+    CHECK(create.result == ENOENT);
+    CHECK_LIST(tree, moved_b, "d");
+    CHECK_LIST(tree, "/a/", NULL);
+    tree_free(tree);
+}
+
+void test_move_during_create(void) {
+    check_move_during_create("/x/", "/x/y/", "/x/y/b/");
+}
+
+void test_rename_during_create(void) {
+    check_move_during_create(NULL, "/x/", "/x/b/");
+}
@@ -0,0 +1,246 @@
+#include "feature_test.h"
+#include "tree_shm.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Size of the shared regions of the cases **/
+#define SHM_TEST_SIZE (4 << 20)
+/** Directories shuffled between /p/ and /q/ by the processes **/
+#define SHM_SHUFFLED 8
+/** Processes modifying the tree at once **/
+#define SHM_PROCESSES 4
+/** Directories every process creates, removing every other one **/
+#define SHM_CREATES 300
+/** Moves every process performs between its creations **/
+#define SHM_MOVES 4
+/** Processes killed in the middle of their modifications **/
+#define SHM_KILLS 40
+
+/** Advances a xorshift64 generator **/
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Writes a two-letter name numbered `number`.
+ * @param name : buffer of at least 3 characters
+ * @param number : below 26 * 26
+ */
+static void numbered_name(char* name, size_t number) {
+    name[0] = (char) ('a' + number / 26);
+    name[1] = (char) ('a' + number % 26);
+    name[2] = '\0';
+}
+
+/**
+ * Creates /p/ with the shuffled directories, each holding /z/, and an empty /q/.
+ * @param shm : handle of an empty tree
+ */
+static void build_shuffled(TreeShm* shm) {
+    char path[16];
+    CHECK(tree_shm_create(shm, "/p/") == 0);
+    CHECK(tree_shm_create(shm, "/q/") == 0);
+    for (size_t i = 0; i < SHM_SHUFFLED; i++) {
+        snprintf(path, sizeof(path), "/p/%c/", (char) ('a' + i));
+        CHECK(tree_shm_create(shm, path) == 0);
+        snprintf(path, sizeof(path), "/p/%c/z/", (char) ('a' + i));
+        CHECK(tree_shm_create(shm, path) == 0);
+    }
+}
+
+/**
+ * Moves a random shuffled directory to the other of /p/ and /q/.
+ * @param shm : handle of the tree
+ * @param rng : state of the generator
+ */
+static void shuffle_one(TreeShm* shm, uint64_t* rng) {
+    char source[8], target[8];
+    uint64_t random = next_random(rng);
+    char name = (char) ('a' + random % SHM_SHUFFLED);
+    bool to_q = (random >> 32) & 1;
+    snprintf(source, sizeof(source), "/%c/%c/", to_q ? 'p' : 'q', name);
+    snprintf(target, sizeof(target), "/%c/%c/", to_q ? 'q' : 'p', name);
+    int err = tree_shm_move(shm, source, target);
+    if (err != 0 && err != ENOENT) // ENOENT if it's on the other side already
+        exit(EXIT_FAILURE);
+}
+
+/**
+ * Counts the shuffled directories, checking that each still holds its subdirectory.
+ * @param shm : handle of the tree
+ * @return : number of the shuffled directories in /p/ and /q/
+ */
+static size_t count_shuffled(TreeShm* shm) {
+    char path[8];
+    size_t count = 0;
+    for (size_t i = 0; i < 2 * SHM_SHUFFLED; i++) {
+        snprintf(path, sizeof(path), "/%c/%c/", i < SHM_SHUFFLED ? 'p' : 'q', (char) ('a' + i % SHM_SHUFFLED));
+        char* listing = tree_shm_list(shm, path);
+        if (listing) {
+            CHECK(strcmp(listing, "z") == 0);
+            count++;
+        }
+        free(listing);
+    }
+    return count;
+}
+
+/**
+ * Process of the concurrent case: attaches to the tree, creates /k/<letter>/ and numbered directories in it,
+ * removing the even ones, and shuffles directories in between.
+ * @param fd : descriptor of the region, inherited from the parent
+ * @param letter : name of the process's directory
+ */
+static void modify_run(int fd, char letter) {
+    TreeShm* shm = NULL;
+    CHECK(tree_shm_attach(fd, &shm) == 0);
+    uint64_t rng = (uint64_t) letter * 0x9E3779B97F4A7C15ULL;
+    char path[16], name[3];
+    snprintf(path, sizeof(path), "/k/%c/", letter);
+    CHECK(tree_shm_create(shm, path) == 0);
+    for (size_t i = 0; i < SHM_CREATES; i++) {
+        numbered_name(name, i);
+        snprintf(path, sizeof(path), "/k/%c/%s/", letter, name);
+        CHECK(tree_shm_create(shm, path) == 0);
+        for (size_t j = 0; j < SHM_MOVES; j++)
+            shuffle_one(shm, &rng);
+        if (i % 2 == 1) {
+            numbered_name(name, i - 1);
+            snprintf(path, sizeof(path), "/k/%c/%s/", letter, name);
+            CHECK(tree_shm_remove(shm, path) == 0);
+        }
+    }
+    tree_shm_close(shm);
+}
+
+void test_shm_processes(void) {
+    TreeShm* shm = NULL;
+    CHECK(tree_shm_new(NULL, SHM_TEST_SIZE, &shm) == 0);
+    build_shuffled(shm);
+    CHECK(tree_shm_create(shm, "/k/") == 0);
+
+    pid_t children[SHM_PROCESSES];
+    fflush(NULL);
+    for (size_t i = 0; i < SHM_PROCESSES; i++) {
+        children[i] = fork();
+        CHECK(children[i] >= 0);
+        if (children[i] == 0) {
+            modify_run(tree_shm_fd(shm), (char) ('a' + i));
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    for (size_t i = 0; i < SHM_PROCESSES; i++) {
+        int status;
+        CHECK(waitpid(children[i], &status, 0) == children[i]);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    // Every process sees the others' changes, and no move is lost nor duplicated
+    CHECK(count_shuffled(shm) == SHM_SHUFFLED);
+    char expected[SHM_CREATES * 3 + 1] = "", name[3];
+    for (size_t i = 1; i < SHM_CREATES; i += 2) {
+        numbered_name(name, i);
+        if (i > 1)
+            strcat(expected, ",");
+        strcat(expected, name);
+    }
+    char path[16];
+    for (size_t i = 0; i < SHM_PROCESSES; i++) {
+        snprintf(path, sizeof(path), "/k/%c/", (char) ('a' + i));
+        CHECK(listing_equals(path, tree_shm_list(shm, path), expected));
+    }
+    tree_shm_close(shm);
+}
+
+/**
+ * Process of the killed case: attaches to the tree, reports through the pipe that it did,
+ * and modifies the tree until killed.
+ * @param fd : descriptor of the region, inherited from the parent
+ * @param ready : writing end of the pipe
+ * @param seed : seed of the random modifications
+ */
+static void modify_until_killed(int fd, int ready, uint64_t seed) {
+    TreeShm* shm = NULL;
+    CHECK(tree_shm_attach(fd, &shm) == 0);
+    CHECK(write(ready, "", 1) == 1);
+    char path[16], name[3];
+    for (uint64_t rng = seed;;) {
+        shuffle_one(shm, &rng);
+        numbered_name(name, next_random(&rng) % 26);
+        snprintf(path, sizeof(path), "/k/%s/", name);
+        if (tree_shm_create(shm, path) == EEXIST)
+            tree_shm_remove(shm, path);
+    }
+}
+
+void test_shm_owner_dead(void) {
+    TreeShm* shm = NULL;
+    CHECK(tree_shm_new(NULL, SHM_TEST_SIZE, &shm) == 0);
+    build_shuffled(shm);
+    CHECK(tree_shm_create(shm, "/k/") == 0);
+
+    uint64_t rng = 42;
+    for (size_t round = 0; round < SHM_KILLS; round++) {
+        int ready[2];
+        CHECK(pipe(ready) == 0);
+        fflush(NULL);
+        pid_t child = fork();
+        CHECK(child >= 0);
+        if (child == 0) {
+            close(ready[0]);
+            modify_until_killed(tree_shm_fd(shm), ready[1], round + 1);
+        }
+        close(ready[1]);
+        char byte;
+        CHECK(read(ready[0], &byte, 1) == 1);
+        close(ready[0]);
+
+        // The process spends nearly all its time holding some directory's mutex, so it most likely dies holding one
+        struct timespec pause = {0, (long) (next_random(&rng) % 2000) * 1000};
+        nanosleep(&pause, NULL);
+        CHECK(kill(child, SIGKILL) == 0);
+        int status;
+        CHECK(waitpid(child, &status, 0) == child);
+        CHECK(WIFSIGNALED(status));
+
+        // Whatever it held is taken over and repaired by the next operations instead of blocking them
+        shuffle_one(shm, &rng);
+        CHECK(tree_shm_create(shm, "/k/zz/") == 0);
+        CHECK(tree_shm_remove(shm, "/k/zz/") == 0);
+    }
+
+    // Only a move interrupted between unlinking and relinking its directory may lose it
+    size_t shuffled = count_shuffled(shm);
+    CHECK(shuffled <= SHM_SHUFFLED && shuffled + SHM_KILLS >= SHM_SHUFFLED);
+
+    // The repaired counters let every directory be emptied and removed
+    char* listing = tree_shm_list(shm, "/k/");
+    CHECK(listing);
+    char path[16];
+    for (char* name = strtok(listing, ","); name; name = strtok(NULL, ",")) {
+        snprintf(path, sizeof(path), "/k/%s/", name);
+        CHECK(tree_shm_remove(shm, path) == 0);
+    }
+    free(listing);
+    CHECK(tree_shm_remove(shm, "/k/") == 0);
+    for (size_t i = 0; i < 2 * SHM_SHUFFLED; i++) {
+        char parent = i < SHM_SHUFFLED ? 'p' : 'q', name = (char) ('a' + i % SHM_SHUFFLED);
+        snprintf(path, sizeof(path), "/%c/%c/z/", parent, name);
+        if (tree_shm_remove(shm, path) == ENOENT)
+            continue; // On the other side, or lost
+        snprintf(path, sizeof(path), "/%c/%c/", parent, name);
+        CHECK(tree_shm_remove(shm, path) == 0);
+    }
+    CHECK(tree_shm_remove(shm, "/p/") == 0);
+    CHECK(tree_shm_remove(shm, "/q/") == 0);
+    CHECK(listing_equals("/", tree_shm_list(shm, "/"), ""));
+    tree_shm_close(shm);
+}
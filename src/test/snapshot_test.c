@@ -0,0 +1,191 @@
+#include "feature_test.h"
+#include "tree_cow.h"
+#include "sync_utils.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+/** Directories shuffled between two parents while snapshots are taken **/
+#define SHUFFLED 8
+/** Threads shuffling them **/
+#define SHUFFLERS 3
+/** Snapshots checked while they shuffle **/
+#define SHUFFLE_SNAPSHOTS 200
+
+/** Fails the running case unless the directory of the snapshot lists exactly the given names, as `CHECK_LIST` **/
+#define CHECK_SNAPSHOT_LIST(snapshot, path, expected) \
+    CHECK(listing_equals(path, tree_snapshot_list(snapshot, path), expected))
+
+/* A thread moving directories between /p/ and /q/ until stopped. */
+typedef struct Shuffler {
+    Tree* tree;
+    atomic_bool* stop;
+    uint64_t rng;
+} Shuffler;
+
+static void* shuffle_run(void* arg) {
+    Shuffler* shuffler = arg;
+    char source[8], target[8];
+    while (!atomic_load(shuffler->stop)) {
+        shuffler->rng = shuffler->rng * 6364136223846793005ULL + 1442695040888963407ULL;
+        char name = (char) ('a' + (shuffler->rng >> 33) % SHUFFLED);
+        bool to_q = (shuffler->rng >> 40) & 1;
+        snprintf(source, sizeof(source), "/%c/%c/", to_q ? 'p' : 'q', name);
+        snprintf(target, sizeof(target), "/%c/%c/", to_q ? 'q' : 'p', name);
+        tree_move(shuffler->tree, source, target); // ENOENT if it's on the other side already
+    }
+    return NULL;
+}
+
+/**
+ * Counts the names of a listing.
+ * @param listing : comma-separated names, may be NULL
+ * @return : number of names, 0 for NULL
+ */
+static size_t count_names(const char* listing) {
+    if (!listing || !*listing)
+        return 0;
+    size_t count = 1;
+    for (const char* c = listing; *c; c++)
+        count += *c == ',';
+    return count;
+}
+
+void test_snapshot_isolation(void) {
+    Tree* tree = tree_new();
+    CHECK(tree_create(tree, "/a/") == 0);
+    CHECK(tree_create(tree, "/a/b/") == 0);
+    CHECK(tree_create(tree, "/a/c/") == 0);
+    CHECK(tree_create(tree, "/d/") == 0);
+
+    TreeSnapshot *before = NULL, *subtree = NULL, *after = NULL;
+    CHECK(tree_snapshot(tree, "/", &before) == 0);
+    CHECK(tree_snapshot(tree, "/a/", &subtree) == 0);
+    CHECK(tree_create(tree, "/a/e/") == 0);
+    CHECK(tree_remove(tree, "/a/c/") == 0);
+    CHECK(tree_move(tree, "/d/", "/a/b/d/") == 0);
+    CHECK(tree_create(tree, "/a/b/d/x/") == 0);
+    CHECK(tree_snapshot(tree, "/", &after) == 0);
+    CHECK(tree_remove(tree, "/a/b/d/x/") == 0);
+
+    // Every snapshot keeps the state from when it was taken, whatever happened since
+    CHECK_SNAPSHOT_LIST(before, "/", "a,d");
+    CHECK_SNAPSHOT_LIST(before, "/a/", "b,c");
+    CHECK_SNAPSHOT_LIST(before, "/a/b/", "");
+    CHECK_SNAPSHOT_LIST(before, "/a/c/", "");
+    CHECK_SNAPSHOT_LIST(before, "/d/", "");
+    CHECK_SNAPSHOT_LIST(before, "/a/e/", NULL);
+    CHECK_SNAPSHOT_LIST(subtree, "/", "b,c");
+    CHECK_SNAPSHOT_LIST(subtree, "/b/d/", NULL);
+    CHECK_SNAPSHOT_LIST(after, "/", "a");
+    CHECK_SNAPSHOT_LIST(after, "/a/", "b,e");
+    CHECK_SNAPSHOT_LIST(after, "/a/b/d/", "x");
+    CHECK_SNAPSHOT_LIST(after, "/a/c/", NULL);
+
+    // The live tree is unaffected by the snapshots
+    CHECK_LIST(tree, "/", "a");
+    CHECK_LIST(tree, "/a/", "b,e");
+    CHECK_LIST(tree, "/a/b/d/", "");
+    tree_snapshot_release(subtree);
+    tree_snapshot_release(after);
+    CHECK_LIST(tree, "/a/", "b,e");
+    tree_snapshot_release(before);
+    tree_free(tree);
+}
+
+void test_snapshot_point_in_time(void) {
+    Tree* tree = tree_new();
+    char path[8];
+    CHECK(tree_create(tree, "/p/") == 0);
+    CHECK(tree_create(tree, "/q/") == 0);
+    for (size_t i = 0; i < SHUFFLED; i++) {
+        snprintf(path, sizeof(path), "/p/%c/", (char) ('a' + i));
+        CHECK(tree_create(tree, path) == 0);
+    }
+
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    Shuffler shufflers[SHUFFLERS];
+    pthread_t threads[SHUFFLERS];
+    for (size_t i = 0; i < SHUFFLERS; i++) {
+        shufflers[i] = (Shuffler) {tree, &stop, i + 1};
+        PTHREAD_CHECK(pthread_create(&threads[i], NULL, shuffle_run, &shufflers[i]));
+    }
+
+    // A moved directory is in exactly one of the parents at any point in time, and so in every snapshot
+    for (size_t i = 0; i < SHUFFLE_SNAPSHOTS; i++) {
+        TreeSnapshot* snapshot = NULL;
+        CHECK(tree_snapshot(tree, "/", &snapshot) == 0);
+        char* p = tree_snapshot_list(snapshot, "/p/");
+        char* q = tree_snapshot_list(snapshot, "/q/");
+        CHECK(count_names(p) + count_names(q) == SHUFFLED);
+        char* again = tree_snapshot_list(snapshot, "/p/");
+        CHECK(strcmp(p, again) == 0); // Reading the snapshot again gives the same
+        free(again);
+        free(p);
+        free(q);
+        tree_snapshot_release(snapshot);
+    }
+
+    atomic_store(&stop, true);
+    for (size_t i = 0; i < SHUFFLERS; i++)
+        PTHREAD_CHECK(pthread_join(threads[i], NULL));
+    char* p = tree_list(tree, "/p/");
+    char* q = tree_list(tree, "/q/");
+    CHECK(count_names(p) + count_names(q) == SHUFFLED);
+    free(p);
+    free(q);
+    tree_free(tree);
+}
+
+/* A creation started while a walk holds its parent, and what it returned. */
+typedef struct BlockedCreate {
+    Tree* tree;
+    pthread_t thread;
+    bool started;
+    int result;
+} BlockedCreate;
+
+static void* blocked_create_run(void* arg) {
+    BlockedCreate* create = arg;
+    struct timespec deadline = deadline_after(2000);
+    create->result = tree_create_timed(create->tree, "/a/b/", &deadline);
+    return NULL;
+}
+
+/** Starts a creation below the visited directory, which the walk holds, and takes a snapshot meanwhile **/
+static bool snapshot_visitor(const char* path, const char* name, void* ctx) {
+    (void) path;
+    (void) name;
+    BlockedCreate* create = ctx;
+    if (create->started)
+        return true;
+    create->started = true;
+    PTHREAD_CHECK(pthread_create(&create->thread, NULL, blocked_create_run, create));
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    nanosleep(&pause, NULL); // Let it queue up for its lock
+
+    // The creation doesn't hold the snapshot up before it gets its lock, so this doesn't wait for the walk
+    struct timespec limit = deadline_after(1000), now;
+    TreeSnapshot* snapshot = NULL;
+    CHECK(tree_snapshot(create->tree, "/", &snapshot) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CHECK(now.tv_sec < limit.tv_sec || (now.tv_sec == limit.tv_sec && now.tv_nsec < limit.tv_nsec));
+    CHECK_SNAPSHOT_LIST(snapshot, "/a/", "");
+    tree_snapshot_release(snapshot);
+    return true;
+}
+
+void test_snapshot_blocked_writer(void) {
+    for (TreeEngine engine = TREE_ENGINE_RW; engine <= TREE_ENGINE_INTENTION; engine++) {
+        TreeOptions options = {.engine = engine};
+        Tree* tree = tree_new_with_options(&options);
+        CHECK(tree_create(tree, "/a/") == 0);
+        BlockedCreate create = {.tree = tree, .started = false, .result = -1};
+        CHECK(tree_walk(tree, "/", snapshot_visitor, &create) == 0);
+        PTHREAD_CHECK(pthread_join(create.thread, NULL));
+        CHECK(create.result == 0);
+        CHECK_LIST(tree, "/a/", "b");
+        tree_free(tree);
+    }
+}
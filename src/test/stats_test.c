@@ -0,0 +1,130 @@
+#include "feature_test.h"
+#include "tree_stats.h"
+#include "sync_utils.h"
+#include <string.h>
+#include <time.h>
+
+/** Listings of the directory whose counters outlive it **/
+#define STATS_LISTS 100
+
+/* A creation started while a walk holds its parent, kept waiting for a while. */
+typedef struct HeldCreate {
+    Tree* tree;
+    const char* path; /** Directory to create **/
+    long hold_ms;     /** Time the walk holds the parent after starting the creation **/
+    pthread_t thread;
+    bool started;
+    int result;
+} HeldCreate;
+
+static void* held_create_run(void* arg) {
+    HeldCreate* create = arg;
+    create->result = tree_create(create->tree, create->path);
+    return NULL;
+}
+
+/** Starts the creation below the walked directory, which the walk holds until the visitor returns **/
+static bool hold_visitor(const char* path, const char* name, void* ctx) {
+    (void) path;
+    (void) name;
+    HeldCreate* create = ctx;
+    if (!create->started) {
+        create->started = true;
+        PTHREAD_CHECK(pthread_create(&create->thread, NULL, held_create_run, create));
+        struct timespec pause = {create->hold_ms / 1000, create->hold_ms % 1000 * 1000 * 1000};
+        nanosleep(&pause, NULL);
+    }
+    return true;
+}
+
+/**
+ * Makes a creation wait for a directory's lock for about the given time.
+ * @param tree : file tree
+ * @param parent : directory with at least one subdirectory
+ * @param path : directory to create in it
+ * @param hold_ms : time the creation waits
+ */
+static void contend(Tree* tree, const char* parent, const char* path, long hold_ms) {
+    HeldCreate create = {.tree = tree, .path = path, .hold_ms = hold_ms, .started = false, .result = -1};
+    CHECK(tree_walk(tree, parent, hold_visitor, &create) == 0);
+    CHECK(create.started);
+    PTHREAD_CHECK(pthread_join(create.thread, NULL));
+    CHECK(create.result == 0);
+}
+
+/** Frees the paths of the directories reported by `tree_stats` **/
+static void free_top(TreeContention* top, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        free(top[i].path);
+}
+
+void test_stats_top_contended(void) {
+    for (TreeEngine engine = TREE_ENGINE_RW; engine <= TREE_ENGINE_INTENTION; engine++) {
+        TreeOptions options = {.engine = engine};
+        Tree* tree = tree_new_with_options(&options);
+        const char* paths[] = {"/p/", "/p/z/", "/q/", "/q/z/", "/r/", "/r/z/", "/s/"};
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+            CHECK(tree_create(tree, paths[i]) == 0);
+        contend(tree, "/q/", "/q/n/", 30);
+        contend(tree, "/p/", "/p/n/", 90);
+        contend(tree, "/r/", "/r/n/", 60);
+
+        // The directories come most contended first, and only those which were waited for
+        TreeLockStats total;
+        TreeContention top[4];
+        size_t count = 0;
+        CHECK(tree_stats(tree, &total, top, 4, &count) == 0);
+        CHECK(count == 3);
+        const char* expected[] = {"/p/", "/r/", "/q/"};
+        uint64_t waited = 0;
+        for (size_t i = 0; i < count; i++) {
+            CHECK(strcmp(top[i].path, expected[i]) == 0);
+            CHECK(top[i].stats.contended == 1 && top[i].stats.acquisitions > 1);
+            CHECK(i == 0 || top[i].stats.wait_ns < top[i - 1].stats.wait_ns);
+            waited += top[i].stats.wait_ns;
+        }
+        CHECK(top[0].stats.wait_ns >= 45 * 1000 * 1000);
+        CHECK(total.contended == 3 && total.wait_ns == waited && total.max_wait_ns == top[0].stats.max_wait_ns);
+        free_top(top, count);
+
+        // A smaller heap keeps the most contended ones
+        CHECK(tree_stats(tree, NULL, top, 2, &count) == 0);
+        CHECK(count == 2 && strcmp(top[0].path, "/p/") == 0 && strcmp(top[1].path, "/r/") == 0);
+        free_top(top, count);
+        CHECK(tree_stats(tree, NULL, top, 0, &count) == 0);
+        CHECK(count == 0);
+        tree_free(tree);
+    }
+}
+
+void test_stats_retired_totals(void) {
+    for (TreeEngine engine = TREE_ENGINE_RW; engine <= TREE_ENGINE_INTENTION; engine++) {
+        TreeOptions options = {.engine = engine};
+        Tree* tree = tree_new_with_options(&options);
+        CHECK(tree_create(tree, "/a/") == 0);
+        CHECK(tree_create(tree, "/a/b/") == 0);
+        CHECK(tree_create(tree, "/a/b/c/") == 0);
+        for (size_t i = 0; i < STATS_LISTS; i++)
+            CHECK_LIST(tree, "/a/b/", "c");
+        contend(tree, "/a/b/", "/a/b/n/", 20);
+
+        TreeLockStats before, after;
+        TreeContention top[1];
+        size_t count = 0;
+        CHECK(tree_stats(tree, &before, top, 1, &count) == 0);
+        CHECK(count == 1 && strcmp(top[0].path, "/a/b/") == 0);
+        CHECK(before.acquisitions >= STATS_LISTS && before.contended == 1);
+        free_top(top, count);
+
+        // The totals keep the counters of the removed directories, while the heap no longer reports them
+        CHECK(tree_remove(tree, "/a/b/c/") == 0);
+        CHECK(tree_remove(tree, "/a/b/n/") == 0);
+        CHECK(tree_remove(tree, "/a/b/") == 0);
+        CHECK(tree_stats(tree, &after, top, 1, &count) == 0);
+        CHECK(count == 0);
+        CHECK(after.acquisitions > before.acquisitions && after.acquisitions < before.acquisitions + STATS_LISTS);
+        CHECK(after.contended == before.contended && after.wait_ns == before.wait_ns);
+        CHECK(after.max_wait_ns == before.max_wait_ns);
+        tree_free(tree);
+    }
+}
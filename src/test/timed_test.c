@@ -0,0 +1,57 @@
+#include "feature_test.h"
+#include "tree_internal.h"
+#include <errno.h>
+
+/**
+ * Runs every timed operation that needs /a/ while /a/ is held exclusively, then again once it's released.
+ * @param engine : concurrency control scheme of the tree
+ */
+static void check_timeouts(TreeEngine engine) {
+    TreeOptions options = {.engine = engine};
+    Tree* tree = tree_new_with_options(&options);
+    CHECK(tree_create(tree, "/a/") == 0);
+    CHECK(tree_create(tree, "/c/") == 0);
+
+    Tree* a = NULL;
+    if (engine == TREE_ENGINE_INTENTION)
+        CHECK(intention_lock_path(tree, "/a/", LOCK_X, NULL, &a) == 0);
+    else
+        CHECK(get_node_until(tree, "/a/", false, WRITER, NULL, &a) == 0);
+
+    char* listing = NULL;
+    struct timespec deadline = deadline_after(20);
+    CHECK(tree_list_timed(tree, "/a/", &deadline, &listing) == ETIMEDOUT);
+    CHECK(listing == NULL);
+    deadline = deadline_after(20);
+    CHECK(tree_create_timed(tree, "/a/b/", &deadline) == ETIMEDOUT);
+    deadline = deadline_after(20);
+    CHECK(tree_remove_timed(tree, "/a/", &deadline) == ETIMEDOUT);
+    deadline = deadline_after(20);
+    CHECK(tree_move_timed(tree, "/c/", "/a/c/", &deadline) == ETIMEDOUT);
+    // Operations elsewhere don't wait for /a/
+    deadline = deadline_after(1000);
+    CHECK(tree_create_timed(tree, "/d/", &deadline) == 0);
+
+    if (engine == TREE_ENGINE_INTENTION)
+        intention_unlock_path(a, LOCK_X);
+    else
+        writer_unlock(a);
+
+    // The timed out operations left nothing behind
+    CHECK_LIST(tree, "/", "a,c,d");
+    CHECK_LIST(tree, "/a/", "");
+    deadline = deadline_after(1000);
+    CHECK(tree_move_timed(tree, "/c/", "/a/c/", &deadline) == 0);
+    deadline = deadline_after(1000);
+    CHECK(tree_create_timed(tree, "/a/b/", &deadline) == 0);
+    CHECK_LIST(tree, "/a/", "b,c");
+    tree_free(tree);
+}
+
+void test_timed_rw(void) {
+    check_timeouts(TREE_ENGINE_RW);
+}
+
+void test_timed_intention(void) {
+    check_timeouts(TREE_ENGINE_INTENTION);
+}
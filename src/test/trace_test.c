@@ -0,0 +1,96 @@
+#include "feature_test.h"
+#include "tree_trace.h"
+#include "bench/trace_file.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A call the case makes while recording, with its expected result. */
+typedef struct TracedCall {
+    TraceOp op;
+    const char* path;
+    const char* target; /** Move target, NULL for other operations **/
+    int result;
+} TracedCall;
+
+/**
+ * Makes a call on the tree.
+ * @param tree : file tree
+ * @param call : the call
+ * @return : error code / success returned by the call
+ */
+static int make_call(Tree* tree, const TracedCall* call) {
+    char* listing = NULL;
+    int err = 0;
+    switch (call->op) {
+        case TRACE_LIST: err = tree_list_timed(tree, call->path, NULL, &listing); break;
+        case TRACE_CREATE: err = tree_create(tree, call->path); break;
+        case TRACE_REMOVE: err = tree_remove(tree, call->path); break;
+        default: err = tree_move(tree, call->path, call->target); break;
+    }
+    free(listing);
+    return err;
+}
+
+void test_trace_round_trip(void) {
+    const TracedCall calls[] = {
+        {TRACE_CREATE, "/a/", NULL, 0},
+        {TRACE_CREATE, "/a/b/", NULL, 0},
+        {TRACE_LIST, "/a/", NULL, 0},
+        {TRACE_MOVE, "/a/b/", "/c/", 0},
+        {TRACE_CREATE, "/a/", NULL, EEXIST},
+        {TRACE_LIST, "/a/b/", NULL, ENOENT},
+        {TRACE_REMOVE, "/c/", NULL, 0},
+        {TRACE_MOVE, "/zz/", "/y/", ENOENT},
+        {TRACE_CREATE, "a/", NULL, EINVAL},
+    };
+    size_t count = sizeof(calls) / sizeof(calls[0]);
+    Tree* tree = tree_new();
+    CHECK(tree_create(tree, "/x/") == 0); // Before the recording
+    tree_trace_start();
+    for (size_t i = 0; i < count; i++)
+        CHECK(make_call(tree, &calls[i]) == calls[i].result);
+    tree_trace_stop();
+    CHECK(tree_create(tree, "/y/") == 0); // After it
+    tree_free(tree);
+
+    char filename[] = "/tmp/file_tree_trace_XXXXXX";
+    int fd = mkstemp(filename);
+    CHECK(fd >= 0);
+    close(fd);
+    CHECK(tree_trace_dump(filename) == 0);
+
+    // The file holds exactly the recorded calls, in the order of the single thread that made them
+    Call* loaded = NULL;
+    size_t loaded_count = 0;
+    CHECK(load_trace(filename, &loaded, &loaded_count));
+    CHECK(loaded_count == count);
+    long size = (long) strlen(TRACE_MAGIC);
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord* record = &loaded[i].record;
+        CHECK(record->op == calls[i].op && record->result == calls[i].result);
+        CHECK(record->thread_id == loaded[0].record.thread_id);
+        CHECK(i == 0 || record->timestamp >= loaded[i - 1].record.timestamp);
+        CHECK(strcmp(loaded[i].path, calls[i].path) == 0);
+        CHECK(calls[i].target ? loaded[i].target && strcmp(loaded[i].target, calls[i].target) == 0 : !loaded[i].target);
+        size += (long) (sizeof(TraceRecord) + record->path_len + record->target_len);
+    }
+
+    // Replayed against a fresh tree, the calls give the recorded results again
+    Tree* replayed = tree_new();
+    CHECK(tree_create(replayed, "/x/") == 0);
+    for (size_t i = 0; i < loaded_count; i++) {
+        TracedCall call = {loaded[i].record.op, loaded[i].path, loaded[i].target, loaded[i].record.result};
+        CHECK(make_call(replayed, &call) == call.result);
+    }
+    CHECK_LIST(replayed, "/", "a,x");
+    tree_free(replayed);
+    free_trace(loaded, loaded_count);
+
+    // A trace cut inside its last record is rejected
+    CHECK(truncate(filename, size - 1) == 0);
+    CHECK(!load_trace(filename, &loaded, &loaded_count));
+    CHECK(!loaded && loaded_count == 0);
+    unlink(filename);
+    CHECK(!load_trace(filename, &loaded, &loaded_count));
+}
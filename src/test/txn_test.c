@@ -0,0 +1,102 @@
+#include "feature_test.h"
+#include "tree_txn.h"
+#include <errno.h>
+#include <stdint.h>
+
+/** Modifications of the transaction the rollback cases fail at every position of **/
+#define TXN_OPS 4
+
+/**
+ * Records the `index`-th modification of a transaction that creates /a/x/, moves /a/b/ into /c/,
+ * creates a directory inside it at its new place and removes /a/x/ again.
+ * @param txn : transaction
+ * @param index : position of the modification
+ * @param failing : whether to record a creation whose parent doesn't exist in its place
+ */
+static void record_op(TreeTxn* txn, size_t index, bool failing) {
+    if (failing) {
+        CHECK(tree_txn_create(txn, "/z/q/") == 0);
+        return;
+    }
+    switch (index) {
+        case 0: CHECK(tree_txn_create(txn, "/a/x/") == 0); break;
+        case 1: CHECK(tree_txn_move(txn, "/a/b/", "/c/b/") == 0); break;
+        case 2: CHECK(tree_txn_create(txn, "/c/b/y/") == 0); break;
+        default: CHECK(tree_txn_remove(txn, "/a/x/") == 0); break;
+    }
+}
+
+/**
+ * Checks that the tree is as the transactions of `record_op` found it.
+ * @param tree : file tree
+ */
+static void check_untouched(Tree* tree) {
+    CHECK_LIST(tree, "/", "a,c");
+    CHECK_LIST(tree, "/a/", "b");
+    CHECK_LIST(tree, "/a/b/", "d");
+    CHECK_LIST(tree, "/c/", "");
+    TreeStat stat;
+    CHECK(tree_stat(tree, "/", &stat) == 0);
+    CHECK(stat.descendants == 4);
+    CHECK(tree_stat(tree, "/a/", &stat) == 0);
+    CHECK(stat.descendants == 2);
+}
+
+/**
+ * Fails a transaction at each of its modifications in turn, checking that the failed one is reported
+ * and that the ones before it are undone, then commits it whole.
+ * @param engine : concurrency control scheme of the tree
+ */
+static void check_rollback(TreeEngine engine) {
+    TreeOptions options = {.engine = engine};
+    Tree* tree = tree_new_with_options(&options);
+    CHECK(tree_create(tree, "/a/") == 0);
+    CHECK(tree_create(tree, "/a/b/") == 0);
+    CHECK(tree_create(tree, "/a/b/d/") == 0);
+    CHECK(tree_create(tree, "/c/") == 0);
+
+    for (size_t k = 0; k < TXN_OPS; k++) {
+        TreeTxn* txn = tree_txn_begin(tree);
+        for (size_t i = 0; i < TXN_OPS; i++)
+            record_op(txn, i, i == k);
+        size_t failed = SIZE_MAX;
+        CHECK(tree_txn_commit(txn, &failed) == ENOENT);
+        CHECK(failed == k);
+        check_untouched(tree);
+    }
+
+    TreeTxn* txn = tree_txn_begin(tree);
+    for (size_t i = 0; i < TXN_OPS; i++)
+        record_op(txn, i, false);
+    size_t failed = SIZE_MAX;
+    CHECK(tree_txn_commit(txn, &failed) == 0);
+    CHECK(failed == SIZE_MAX); // Left as is on success
+    CHECK_LIST(tree, "/", "a,c");
+    CHECK_LIST(tree, "/a/", "");
+    CHECK_LIST(tree, "/c/", "b");
+    CHECK_LIST(tree, "/c/b/", "d,y");
+    TreeStat stat;
+    CHECK(tree_stat(tree, "/c/", &stat) == 0);
+    CHECK(stat.descendants == 3);
+
+    // A failure in the middle with an error other than ENOENT undoes a move and a creation inside it
+    txn = tree_txn_begin(tree);
+    CHECK(tree_txn_move(txn, "/c/b/", "/a/b/") == 0);
+    CHECK(tree_txn_create(txn, "/a/b/z/") == 0);
+    CHECK(tree_txn_remove(txn, "/a/") == 0);
+    CHECK(tree_txn_create(txn, "/e/") == 0);
+    CHECK(tree_txn_commit(txn, &failed) == ENOTEMPTY);
+    CHECK(failed == 2);
+    CHECK_LIST(tree, "/a/", "");
+    CHECK_LIST(tree, "/c/b/", "d,y");
+    CHECK_LIST(tree, "/e/", NULL);
+    tree_free(tree);
+}
+
+void test_txn_rollback_rw(void) {
+    check_rollback(TREE_ENGINE_RW);
+}
+
+void test_txn_rollback_intention(void) {
+    check_rollback(TREE_ENGINE_INTENTION);
+}
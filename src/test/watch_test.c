@@ -0,0 +1,135 @@
+#include "feature_test.h"
+#include "tree_watch.h"
+#include <errno.h>
+#include <string.h>
+
+/** Room for the events of a single poll **/
+#define WATCH_BATCH 16
+
+/**
+ * Polls a watch and checks the events it delivered.
+ * @param watch : the watch
+ * @param expected : kinds of the expected events, oldest first
+ * @param paths : their paths, NULL for an overflow
+ * @param count : number of expected events
+ * @return : whether the watch delivered exactly these events
+ */
+static bool poll_equals(TreeWatch* watch, const TreeWatchKind* expected, const char* const* paths, size_t count) {
+    TreeWatchEvent events[WATCH_BATCH];
+    size_t polled = tree_watch_poll(watch, events, WATCH_BATCH);
+    bool equal = polled == count;
+    for (size_t i = 0; i < polled; i++) {
+        if (equal && (events[i].kind != expected[i] || (paths[i] ? !events[i].path || strcmp(events[i].path, paths[i]) != 0
+                                                                 : events[i].path != NULL)))
+            equal = false;
+        if (!equal)
+            fprintf(stderr, "event %zu: kind %d, path %s\n", i, events[i].kind, events[i].path ? events[i].path : "-");
+        free(events[i].path);
+    }
+    if (polled != count)
+        fprintf(stderr, "polled %zu events, expected %zu\n", polled, count);
+    return equal;
+}
+
+/** Fails the running case unless polling the watch gives exactly the listed kinds and paths **/
+#define CHECK_POLL(watch, kinds, paths) \
+    CHECK(poll_equals(watch, kinds, paths, sizeof(kinds) / sizeof(kinds[0])))
+
+/** Fails the running case unless the watch has nothing to deliver **/
+#define CHECK_POLL_EMPTY(watch) CHECK(poll_equals(watch, NULL, NULL, 0))
+
+void test_watch_coalescing(void) {
+    Tree* tree = tree_new();
+    CHECK(tree_create(tree, "/w/") == 0);
+    CHECK(tree_create(tree, "/x/") == 0);
+    TreeWatch* watch = NULL;
+    CHECK(tree_watch(tree, "/w/", true, 0, &watch) == 0);
+
+    // Changes undone within one batch disappear, with everything that happened below them meanwhile
+    CHECK(tree_create(tree, "/w/a/") == 0);
+    CHECK(tree_create(tree, "/w/a/b/") == 0);
+    CHECK(tree_remove(tree, "/w/a/b/") == 0);
+    CHECK(tree_remove(tree, "/w/a/") == 0);
+    CHECK(tree_move(tree, "/x/", "/w/x/") == 0);
+    CHECK(tree_move(tree, "/w/x/", "/x/") == 0);
+    CHECK_POLL_EMPTY(watch);
+
+    // A path taken again after being freed keeps its last event
+    CHECK(tree_create(tree, "/w/c/") == 0);
+    CHECK(tree_remove(tree, "/w/c/") == 0);
+    CHECK(tree_create(tree, "/w/c/") == 0);
+    const TreeWatchKind recreated[] = {TREE_WATCH_CREATED};
+    const char* const recreated_paths[] = {"/w/c/"};
+    CHECK_POLL(watch, recreated, recreated_paths);
+
+    // Nothing is coalesced across batches, nor when the directory changed in between
+    CHECK(tree_remove(tree, "/w/c/") == 0);
+    CHECK(tree_move(tree, "/x/", "/w/x/") == 0);
+    CHECK(tree_create(tree, "/w/x/d/") == 0);
+    CHECK(tree_move(tree, "/w/x/", "/x/") == 0);
+    const TreeWatchKind changed[] = {TREE_WATCH_REMOVED, TREE_WATCH_MOVED_IN, TREE_WATCH_CREATED, TREE_WATCH_MOVED_OUT};
+    const char* const changed_paths[] = {"/w/c/", "/w/x/", "/w/x/d/", "/w/x/"};
+    CHECK_POLL(watch, changed, changed_paths);
+
+    tree_unwatch(watch);
+    tree_free(tree);
+}
+
+void test_watch_overflow(void) {
+    Tree* tree = tree_new();
+    TreeWatch* watch = NULL;
+    CHECK(tree_watch(tree, "/", false, 2, &watch) == 0);
+    struct timespec deadline = deadline_after(10);
+    CHECK(tree_watch_wait(watch, &deadline) == ETIMEDOUT);
+
+    CHECK(tree_create(tree, "/a/") == 0);
+    CHECK(tree_create(tree, "/b/") == 0);
+    CHECK(tree_create(tree, "/c/") == 0); // Dropped, the ring holds two events
+    CHECK(tree_create(tree, "/d/") == 0);
+    CHECK(tree_watch_wait(watch, NULL) == 0);
+    const TreeWatchKind overflowed[] = {TREE_WATCH_CREATED, TREE_WATCH_CREATED, TREE_WATCH_OVERFLOW};
+    const char* const overflowed_paths[] = {"/a/", "/b/", NULL};
+    CHECK_POLL(watch, overflowed, overflowed_paths);
+    CHECK_POLL_EMPTY(watch); // The overflow is reported once
+
+    // The ring is usable again once emptied
+    CHECK(tree_remove(tree, "/d/") == 0);
+    const TreeWatchKind removed[] = {TREE_WATCH_REMOVED};
+    const char* const removed_paths[] = {"/d/"};
+    CHECK_POLL(watch, removed, removed_paths);
+
+    tree_unwatch(watch);
+    tree_free(tree);
+}
+
+void test_watch_recursive_direct(void) {
+    Tree* tree = tree_new();
+    TreeWatch *direct = NULL, *recursive = NULL;
+    CHECK(tree_watch(tree, "/d/", false, 0, &direct) == 0); // Not created yet
+    CHECK(tree_watch(tree, "/d/", true, 0, &recursive) == 0);
+
+    CHECK(tree_create(tree, "/d/") == 0); // The watched directory itself isn't reported
+    CHECK(tree_create(tree, "/d/a/") == 0);
+    CHECK(tree_create(tree, "/d/a/b/") == 0);
+    CHECK(tree_create(tree, "/e/") == 0);
+    CHECK(tree_move(tree, "/d/a/", "/e/a/") == 0);
+    CHECK(tree_move(tree, "/e/a/", "/d/z/") == 0); // Reported once for the whole moved subtree
+
+    const TreeWatchKind direct_kinds[] = {TREE_WATCH_CREATED, TREE_WATCH_MOVED_OUT, TREE_WATCH_MOVED_IN};
+    const char* const direct_paths[] = {"/d/a/", "/d/a/", "/d/z/"};
+    CHECK_POLL(direct, direct_kinds, direct_paths);
+    const TreeWatchKind recursive_kinds[] = {TREE_WATCH_CREATED, TREE_WATCH_CREATED, TREE_WATCH_MOVED_OUT, TREE_WATCH_MOVED_IN};
+    const char* const recursive_paths[] = {"/d/a/", "/d/a/b/", "/d/a/", "/d/z/"};
+    CHECK_POLL(recursive, recursive_kinds, recursive_paths);
+
+    // Only the recursive watch sees below the subdirectories
+    CHECK(tree_create(tree, "/d/z/b/c/") == 0);
+    CHECK_POLL_EMPTY(direct);
+    const TreeWatchKind deep_kinds[] = {TREE_WATCH_CREATED};
+    const char* const deep_paths[] = {"/d/z/b/c/"};
+    CHECK_POLL(recursive, deep_kinds, deep_paths);
+
+    tree_unwatch(direct);
+    tree_unwatch(recursive);
+    tree_free(tree);
+}
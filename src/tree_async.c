@@ -0,0 +1,357 @@
+#include "tree_async.h"
+#include "tree_internal.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Both rings are bounded multi-producer multi-consumer queues in the style of D. Vyukov's:
+ * every cell carries a sequence number telling producers and consumers whose turn it is,
+ * so a push or a pop only contends on a single CAS of the ring's position.
+ * Counters of the entries let idle workers and reapers sleep on a condition variable instead of spinning,
+ * while a push or a pop that finds somebody to wake or nothing to take still goes without a lock.
+ * The number of operations in flight never exceeds the capacity of the rings,
+ * so a push can only find its cell taken while a pop of the previous lap is finishing.
+ */
+
+/** A queued operation, the same entry carrying it there and its result back **/
+typedef struct Entry {
+    TreeOpCode op;            /** Operation to perform **/
+    char* path;               /** Owned copy of the submitted path **/
+    char* target;             /** Owned copy of the submitted target, NULL if none **/
+    struct timespec deadline; /** As submitted **/
+    uint64_t user_data;       /** As submitted **/
+    int result;               /** Error code / success of the finished operation **/
+    char* listing;            /** Result of TREE_OP_LIST **/
+} Entry;
+
+/** A slot of a ring **/
+typedef struct Cell {
+    atomic_size_t sequence; /** Position the cell is ready to be pushed to if equal to it, popped from if one above **/
+    Entry entry;            /** Stored entry **/
+} Cell;
+
+/** Number of entries in a ring that can be waited for **/
+typedef struct Counter {
+    atomic_size_t count;    /** Entries pushed and not yet claimed (plus wake-ups on shutdown) **/
+    atomic_size_t sleepers; /** Threads waiting on `nonzero` **/
+    pthread_mutex_t mutex;  /** For waiting on `nonzero` **/
+    pthread_cond_t nonzero; /** Signalled when `count` is raised while somebody sleeps **/
+} Counter;
+
+/** Bounded MPMC queue of entries **/
+typedef struct Ring {
+    Cell* cells;                           /** Array of `mask + 1` cells **/
+    size_t mask;                           /** Capacity minus one, the capacity being a power of two **/
+    _Alignas(64) atomic_size_t push_pos;   /** Next position to push to **/
+    _Alignas(64) atomic_size_t pop_pos;    /** Next position to pop from **/
+} Ring;
+
+struct TreeAsync {
+    Tree* tree;                /** Tree the operations run against **/
+    Ring submissions;          /** Operations waiting for a worker **/
+    Ring completions;          /** Finished operations waiting to be reaped **/
+    Counter submitted;         /** Counts entries pushed to `submissions` (plus wake-ups on shutdown) **/
+    Counter completed;         /** Counts entries pushed to `completions` **/
+    atomic_size_t in_flight;   /** Operations submitted, but not yet reaped **/
+    atomic_bool stopping;      /** Set when the pool is being freed **/
+    size_t num_workers;        /** Size of `workers` **/
+    pthread_t* workers;        /** Worker threads **/
+};
+
+static void ring_init(Ring* ring, size_t capacity) {
+    ring->cells = safe_malloc(capacity * sizeof(Cell));
+    ring->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++)
+        atomic_init(&ring->cells[i].sequence, i);
+    atomic_init(&ring->push_pos, 0);
+    atomic_init(&ring->pop_pos, 0);
+}
+
+static void ring_destroy(Ring* ring) {
+    free(ring->cells);
+}
+
+static void counter_init(Counter* counter) {
+    atomic_init(&counter->count, 0);
+    atomic_init(&counter->sleepers, 0);
+    PTHREAD_CHECK(pthread_mutex_init(&counter->mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&counter->nonzero, NULL));
+}
+
+static void counter_destroy(Counter* counter) {
+    PTHREAD_CHECK(pthread_cond_destroy(&counter->nonzero));
+    PTHREAD_CHECK(pthread_mutex_destroy(&counter->mutex));
+}
+
+/**
+ * Counts a new entry, waking a sleeping thread if there is one.
+ * @param counter : the counter
+ */
+static void counter_post(Counter* counter) {
+    atomic_fetch_add(&counter->count, 1);
+    // Either a thread going to sleep sees the entry, or we see it sleeping
+    if (atomic_load(&counter->sleepers) > 0)
+        UNDER_MUTEX(&counter->mutex, PTHREAD_CHECK(pthread_cond_signal(&counter->nonzero)));
+}
+
+/**
+ * Claims an entry if there is one.
+ * @param counter : the counter
+ * @return : false if there was no entry
+ */
+static bool counter_try_take(Counter* counter) {
+    size_t count = atomic_load(&counter->count);
+    while (count > 0) {
+        if (atomic_compare_exchange_weak(&counter->count, &count, count - 1))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Claims an entry, sleeping until there is one.
+ * @param counter : the counter
+ */
+static void counter_take(Counter* counter) {
+    if (counter_try_take(counter))
+        return;
+    PTHREAD_CHECK(pthread_mutex_lock(&counter->mutex));
+    atomic_fetch_add(&counter->sleepers, 1);
+    while (!counter_try_take(counter))
+        PTHREAD_CHECK(pthread_cond_wait(&counter->nonzero, &counter->mutex));
+    atomic_fetch_sub(&counter->sleepers, 1);
+    PTHREAD_CHECK(pthread_mutex_unlock(&counter->mutex));
+}
+
+/**
+ * Pushes an entry to the ring.
+ * @param ring : the ring
+ * @param entry : entry to push
+ * @return : false if the ring is full
+ */
+static bool ring_push(Ring* ring, const Entry* entry) {
+    Cell* cell;
+    size_t pos = atomic_load_explicit(&ring->push_pos, memory_order_relaxed);
+    while (true) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->push_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            return false; // The cell still holds an entry from the previous lap
+        }
+        else {
+            pos = atomic_load_explicit(&ring->push_pos, memory_order_relaxed);
+        }
+    }
+    cell->entry = *entry;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Pops the oldest entry from the ring.
+ * @param ring : the ring
+ * @param entry : where to store the entry
+ * @return : false if the ring is empty, or its oldest entry is still being pushed
+ */
+static bool ring_pop(Ring* ring, Entry* entry) {
+    Cell* cell;
+    size_t pos = atomic_load_explicit(&ring->pop_pos, memory_order_relaxed);
+    while (true) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->pop_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&ring->pop_pos, memory_order_relaxed);
+        }
+    }
+    *entry = cell->entry;
+    atomic_store_explicit(&cell->sequence, pos + ring->mask + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Pushes an entry known to fit, as counted by `in_flight`. The consumer of the previous lap's
+ * entry in the same cell may still be finishing the pop, which takes a few instructions.
+ * @param ring : the ring
+ * @param entry : entry to push
+ */
+static void ring_push_counted(Ring* ring, const Entry* entry) {
+    while (!ring_push(ring, entry))
+        cpu_relax();
+}
+
+/**
+ * Pops an entry known to be there, as claimed from its `Counter`. Its producer may still be
+ * finishing the push, which takes a few instructions.
+ * @param ring : the ring
+ * @param entry : where to store the entry
+ */
+static void ring_pop_counted(Ring* ring, Entry* entry) {
+    while (!ring_pop(ring, entry))
+        cpu_relax();
+}
+
+/** Makes an owned copy of a string, NULL staying NULL **/
+static char* copy_string(const char* string) {
+    if (!string)
+        return NULL;
+    char* copy = safe_malloc(strlen(string) + 1);
+    strcpy(copy, string);
+    return copy;
+}
+
+/**
+ * Runs a submitted operation, storing its result in the entry.
+ * @param tree : file tree
+ * @param entry : the operation
+ */
+static void execute(Tree* tree, Entry* entry) {
+    bool has_deadline = entry->deadline.tv_sec != 0 || entry->deadline.tv_nsec != 0;
+    const struct timespec* deadline = has_deadline ? &entry->deadline : NULL;
+    entry->listing = NULL;
+
+    if (!entry->path || (entry->op == TREE_OP_MOVE && !entry->target)) {
+        entry->result = EINVAL;
+        return;
+    }
+    switch (entry->op) {
+        case TREE_OP_LIST:
+            entry->result = tree_list_timed(tree, entry->path, deadline, &entry->listing);
+            break;
+        case TREE_OP_CREATE:
+            entry->result = tree_create_timed(tree, entry->path, deadline);
+            break;
+        case TREE_OP_REMOVE:
+            entry->result = tree_remove_timed(tree, entry->path, deadline);
+            break;
+        case TREE_OP_MOVE:
+            entry->result = tree_move_timed(tree, entry->path, entry->target, deadline);
+            break;
+        default:
+            entry->result = EINVAL;
+    }
+}
+
+/**
+ * Worker thread: executes submissions until the pool stops and none are left.
+ * @param data : the pool
+ * @return : NULL
+ */
+static void* worker_run(void* data) {
+    TreeAsync* async = data;
+    Entry entry;
+
+    while (true) {
+        counter_take(&async->submitted);
+        if (!ring_pop(&async->submissions, &entry)) {
+            if (atomic_load(&async->stopping))
+                break; // A wake-up from `tree_async_free`, with everything submitted already taken
+            ring_pop_counted(&async->submissions, &entry);
+        }
+
+        execute(async->tree, &entry);
+        free(entry.path);
+        free(entry.target);
+        entry.path = entry.target = NULL;
+
+        ring_push_counted(&async->completions, &entry);
+        counter_post(&async->completed);
+    }
+    return NULL;
+}
+
+TreeAsync* tree_async_new(Tree* tree, size_t num_workers, size_t capacity) {
+    if (num_workers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = online > 0 ? (size_t) online : 1;
+    }
+    size_t rounded = 1;
+    while (rounded < capacity)
+        rounded *= 2;
+
+    TreeAsync* async = safe_calloc(1, sizeof(TreeAsync));
+    async->tree = tree;
+    ring_init(&async->submissions, rounded);
+    ring_init(&async->completions, rounded);
+    counter_init(&async->submitted);
+    counter_init(&async->completed);
+    atomic_init(&async->in_flight, 0);
+    atomic_init(&async->stopping, false);
+
+    async->num_workers = num_workers;
+    async->workers = safe_malloc(num_workers * sizeof(pthread_t));
+    for (size_t i = 0; i < num_workers; i++)
+        PTHREAD_CHECK(pthread_create(&async->workers[i], NULL, worker_run, async));
+    return async;
+}
+
+void tree_async_free(TreeAsync* async) {
+    atomic_store(&async->stopping, true);
+    for (size_t i = 0; i < async->num_workers; i++)
+        counter_post(&async->submitted);
+    for (size_t i = 0; i < async->num_workers; i++)
+        PTHREAD_CHECK(pthread_join(async->workers[i], NULL));
+
+    Entry entry;
+    while (ring_pop(&async->completions, &entry))
+        free(entry.listing);
+
+    counter_destroy(&async->completed);
+    counter_destroy(&async->submitted);
+    ring_destroy(&async->completions);
+    ring_destroy(&async->submissions);
+    free(async->workers);
+    free(async);
+}
+
+bool tree_async_submit(TreeAsync* async, const TreeSubmission* submission) {
+    size_t in_flight = atomic_load(&async->in_flight);
+    do {
+        if (in_flight > async->submissions.mask)
+            return false; // Full
+    } while (!atomic_compare_exchange_weak(&async->in_flight, &in_flight, in_flight + 1));
+
+    Entry entry = {
+        .op = submission->op,
+        .path = copy_string(submission->path),
+        .target = submission->op == TREE_OP_MOVE ? copy_string(submission->target) : NULL,
+        .deadline = submission->deadline,
+        .user_data = submission->user_data,
+    };
+    ring_push_counted(&async->submissions, &entry);
+    counter_post(&async->submitted);
+    return true;
+}
+
+bool tree_async_reap(TreeAsync* async, TreeCompletion* completion, bool wait) {
+    if (wait)
+        counter_take(&async->completed);
+    else if (!counter_try_take(&async->completed))
+        return false;
+
+    Entry entry;
+    ring_pop_counted(&async->completions, &entry);
+    atomic_fetch_sub(&async->in_flight, 1);
+
+    completion->user_data = entry.user_data;
+    completion->result = entry.result;
+    completion->listing = entry.listing;
+    return true;
+}
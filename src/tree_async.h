@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Tree.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Let "TreeAsync" mean the same as "struct TreeAsync". */
+typedef struct TreeAsync TreeAsync;
+
+/* Operations which can be submitted to a `TreeAsync`. */
+typedef enum TreeOpCode {
+    TREE_OP_LIST = 0, /** `tree_list` of `path` **/
+    TREE_OP_CREATE,   /** `tree_create` of `path` **/
+    TREE_OP_REMOVE,   /** `tree_remove` of `path` **/
+    TREE_OP_MOVE,     /** `tree_move` from `path` to `target` **/
+} TreeOpCode;
+
+/* Descriptor of a submitted operation. The strings are copied on submission. */
+typedef struct TreeSubmission {
+    TreeOpCode op;            /** Operation to perform **/
+    const char* path;         /** Path the operation works on, the source for TREE_OP_MOVE **/
+    const char* target;       /** Target of TREE_OP_MOVE, ignored otherwise **/
+    struct timespec deadline; /** Absolute CLOCK_MONOTONIC time to give up at, all zeros for none **/
+    uint64_t user_data;       /** Passed back unchanged in the completion **/
+} TreeSubmission;
+
+/* Result of a finished operation. */
+typedef struct TreeCompletion {
+    uint64_t user_data; /** As given in the submission **/
+    int result;         /** Error code / success, as returned by the matching `tree_*_timed` **/
+    char* listing;      /** Result of a successful TREE_OP_LIST, to be freed by the caller. NULL otherwise **/
+} TreeCompletion;
+
+/**
+ * Starts a pool of workers executing operations submitted for the `tree`.
+ * Submissions and completions travel through bounded lock-free rings, so neither submitting
+ * nor reaping ever waits for the tree's locks.
+ * @param tree : file tree, has to outlive the pool
+ * @param num_workers : number of worker threads. 0 means one per online CPU
+ * @param capacity : maximum number of operations submitted but not yet reaped, rounded up to a power of two
+ * @return : pointer to the new pool
+ */
+TreeAsync* tree_async_new(Tree* tree, size_t num_workers, size_t capacity);
+
+/**
+ * Stops the pool after all submitted operations have finished. Unreaped completions are discarded.
+ * Nobody may submit or reap concurrently.
+ * @param async : the pool
+ */
+void tree_async_free(TreeAsync* async);
+
+/**
+ * Queues an operation without waiting for it. Safe to call from any number of threads.
+ * @param async : the pool
+ * @param submission : descriptor of the operation
+ * @return : false if `capacity` operations are already in flight - reap some first
+ */
+bool tree_async_submit(TreeAsync* async, const TreeSubmission* submission);
+
+/**
+ * Takes the result of a finished operation. Operations finish in no particular order.
+ * Safe to call from any number of threads.
+ * @param async : the pool
+ * @param completion : where to store the result
+ * @param wait : whether to wait for an operation to finish if none has
+ * @return : false if nothing had finished and `wait` was not set
+ */
+bool tree_async_reap(TreeAsync* async, TreeCompletion* completion, bool wait);
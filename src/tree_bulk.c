@@ -0,0 +1,167 @@
+#include "tree_bulk.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <unistd.h>
+
+/* A directory on the path from the root to the one being built. */
+typedef struct BulkFrame {
+    Tree* node;       /** The directory, NULL while checking the list **/
+    const char* path; /** Its path **/
+    size_t length;    /** Length of its path **/
+} BulkFrame;
+
+/* Paths of whole subtrees of the root's subdirectories, built by one thread. */
+typedef struct BulkChunk {
+    Tree* root;                /** Root of the tree being populated **/
+    const char* const* paths;  /** The whole list **/
+    size_t begin, end;         /** Range of the list to build, starting with a subdirectory of the root **/
+    Tree** tops;               /** Where to store the built subdirectories of the root, in list order **/
+} BulkChunk;
+
+/**
+ * Pops the frames of the directories that aren't ancestors of a path.
+ * @param stack : frames from the root, which stays
+ * @param depth : index of the top frame, updated
+ * @param path : next path in pre-order
+ * @param length : its length
+ */
+static void pop_finished(BulkFrame* stack, size_t* depth, const char* path, size_t length) {
+    while (*depth > 0 && (stack[*depth].length >= length || strncmp(path, stack[*depth].path, stack[*depth].length) != 0)) {
+        BulkFrame* finished = &stack[(*depth)--];
+        // The root's count is set once all threads are done
+        if (finished->node && *depth > 0)
+            stack[*depth].node->descendants += finished->node->descendants + 1;
+    }
+}
+
+/**
+ * Checks the list and finds the root's subdirectories in it.
+ * @param paths : the list
+ * @param n : its length
+ * @param tops : array of `n` indices to store the positions of the root's subdirectories in
+ * @param top_count : where to store their number
+ * @return : error code / success, as `tree_bulk_load`
+ */
+static int check_paths(const char* const* paths, size_t n, size_t* tops, size_t* top_count) {
+    BulkFrame* stack = safe_malloc((MAX_PATH_LENGTH / 2 + 1) * sizeof(BulkFrame));
+    size_t depth = 0;
+    int err = SUCCESS;
+    stack[0] = (BulkFrame) {NULL, "/", 1};
+    *top_count = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const char* path = paths[i];
+        if (!is_valid_path(path)) {
+            err = EINVAL; // Invalid path
+            break;
+        }
+        int cmp = i > 0 ? strcmp(paths[i - 1], path) : -1;
+        if (IS_ROOT(path) || cmp == 0) {
+            err = EEXIST; // The root or a repeated path
+            break;
+        }
+        if (cmp > 0) {
+            err = EINVAL; // Not sorted
+            break;
+        }
+
+        size_t length = strlen(path);
+        pop_finished(stack, &depth, path, length);
+        const char* rest = path + stack[depth].length;
+        if (strchr(rest, '/') != path + length - 1) {
+            err = ENOENT; // The parent isn't in the list
+            break;
+        }
+        if (depth == 0)
+            tops[(*top_count)++] = i;
+        stack[++depth] = (BulkFrame) {NULL, path, length};
+    }
+
+    free(stack);
+    return err;
+}
+
+/**
+ * Builds the directories of a chunk.
+ * @param arg : the chunk
+ * @return : NULL
+ */
+static void* build_chunk(void* arg) {
+    BulkChunk* chunk = arg;
+    BulkFrame* stack = safe_malloc((MAX_PATH_LENGTH / 2 + 1) * sizeof(BulkFrame));
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    size_t depth = 0, top = 0;
+    stack[0] = (BulkFrame) {chunk->root, "/", 1};
+
+    for (size_t i = chunk->begin; i < chunk->end; i++) {
+        const char* path = chunk->paths[i];
+        size_t length = strlen(path);
+        pop_finished(stack, &depth, path, length);
+
+        BulkFrame* parent = &stack[depth];
+        size_t name_length = length - parent->length - 1;
+        memcpy(name, path + parent->length, name_length);
+        name[name_length] = '\0';
+        Tree* node = node_new(parent->node);
+        if (depth > 0)
+            hmap_insert(parent->node->subdirectories, name, node);
+        else
+            chunk->tops[top++] = node; // Linked to the root by the calling thread
+        stack[++depth] = (BulkFrame) {node, path, length};
+    }
+    pop_finished(stack, &depth, "", 0);
+
+    free(stack);
+    return NULL;
+}
+
+int tree_bulk_load(Tree* tree, const char* const* paths, size_t n, size_t num_threads) {
+    if (hmap_size(tree->subdirectories) > 0)
+        return ENOTEMPTY; // Only empty trees can be populated
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t) online : 1;
+    }
+
+    size_t* top_index = safe_malloc((n > 0 ? n : 1) * sizeof(size_t));
+    size_t top_count = 0;
+    int err = check_paths(paths, n, top_index, &top_count);
+    if (err != SUCCESS) {
+        free(top_index);
+        return err;
+    }
+
+    // Cut the list between subtrees of the root into chunks of similar numbers of paths
+    if (num_threads > top_count)
+        num_threads = top_count > 0 ? top_count : 1;
+    BulkChunk* chunks = safe_calloc(num_threads, sizeof(BulkChunk));
+    Tree** tops = safe_malloc((top_count > 0 ? top_count : 1) * sizeof(Tree*));
+    size_t used = 0, share = (n + num_threads - 1) / num_threads;
+    for (size_t t = 0; t < top_count; t++) {
+        size_t end = t + 1 < top_count ? top_index[t + 1] : n;
+        // Start a new chunk once the current one has its share of the paths
+        if (used == 0 || (chunks[used - 1].end - chunks[used - 1].begin >= share && used < num_threads))
+            chunks[used++] = (BulkChunk) {tree, paths, top_index[t], end, tops + t};
+        else
+            chunks[used - 1].end = end;
+    }
+
+    run_parallel(build_chunk, chunks, used, sizeof(BulkChunk));
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    for (size_t t = 0; t < top_count; t++) {
+        const char* path = paths[top_index[t]];
+        size_t name_length = strlen(path) - 2;
+        memcpy(name, path + 1, name_length);
+        name[name_length] = '\0';
+        hmap_insert(tree->subdirectories, name, tops[t]);
+    }
+    tree->descendants = n;
+
+    free(tops);
+    free(chunks);
+    free(top_index);
+    return SUCCESS;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Tree.h"
+#include <stddef.h>
+
+/**
+ * Populates an empty tree that isn't shared yet from a list of paths, faster than creating
+ * the directories one by one: nodes are built in a single pass without any locking or path lookups.
+ * Each directory's map is still filled one insertion at a time, and an insertion into a `HashMap`
+ * scans the entries of its bucket, of which there are a fixed few. Loading a directory with `k`
+ * subdirectories therefore takes O(k^2) time, as creating them does, and very wide directories
+ * dominate the load.
+ * The paths have to be sorted by `strcmp`, which lists every directory before its descendants,
+ * and every directory's parent has to be the root or appear in the list. The list is checked
+ * before anything is built, so on error the tree stays empty.
+ * The subtrees of the root's subdirectories can be built by several threads at once.
+ * The directories aren't recorded by a journal attached to the tree, take a checkpoint afterwards.
+ * @param tree : empty file tree
+ * @param paths : sorted paths of the directories to create
+ * @param n : number of paths
+ * @param num_threads : number of builders, including the calling thread. 0 means one per online CPU
+ * @return : error code / success: ENOTEMPTY if the tree isn't empty, EINVAL if a path is invalid
+ *           or the list isn't sorted, EEXIST if a path repeats or is the root, ENOENT if a parent is missing
+ */
+int tree_bulk_load(Tree* tree, const char* const* paths, size_t n, size_t num_threads);
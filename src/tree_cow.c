@@ -0,0 +1,434 @@
+#include "tree_cow.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+
+/** Number of counters the admitted modifications are spread over, to keep them off each other's cache lines **/
+#define GATE_STRIPES 32
+
+/* Counter of the modifications admitted by some of the threads. */
+typedef struct GateStripe {
+    _Alignas(64) atomic_size_t admitted;
+} GateStripe;
+
+struct NodeVersion {
+    uint64_t epoch;          /** Epoch of the modification that preserved it **/
+    HashMap* subdirectories; /** Copy of the directory's map from before that modification, sharing the nodes **/
+    NodeVersion* older;      /** Version preserved in an earlier epoch, NULL for the oldest one **/
+};
+
+struct TreeSnapshot {
+    Tree* tree;                 /** Root of the whole tree **/
+    Tree* root;                 /** Root of the snapshot's subtree **/
+    uint64_t epoch;             /** Epoch the snapshot started **/
+    TreeSnapshot *prev, *next;  /** Neighbours in the list of live snapshots **/
+};
+
+struct TreeSnapshots {
+    GateStripe stripes[GATE_STRIPES]; /** Modifications currently admitted, see `cow_enter` **/
+    atomic_bool closed;               /** Set while a snapshot waits for the admitted modifications to finish **/
+    atomic_uint_fast64_t epoch;       /** Epoch of the latest snapshot, 0 before the first one **/
+    atomic_size_t live;               /** Number of snapshots not released yet **/
+    atomic_uint_fast64_t oldest;      /** Epoch of the oldest live snapshot, UINT64_MAX if there is none **/
+    pthread_mutex_t taking;           /** Serializes taking snapshots **/
+    pthread_mutex_t mutex;            /** Protects the fields below and waiting for `closed` to change **/
+    pthread_cond_t changed;           /** Signalled when the gate opens, and when a modification leaves a closed gate **/
+    TreeSnapshot *first, *last;       /** Live snapshots, oldest first **/
+    Tree** retired;                   /** Removed directories still reachable from some live snapshot **/
+    size_t retired_count, retired_capacity;
+};
+
+/* State of the calling thread's pass through the gate of a tree. */
+typedef struct GatePass {
+    uint64_t epoch; /** Epoch the modification was admitted in **/
+    bool active;    /** Whether there were live snapshots then, so that its changes have to be preserved **/
+} GatePass;
+
+static _Thread_local GatePass local_pass = {0, false};
+/** Stripe of the calling thread + 1, 0 until it first passes a gate **/
+static _Thread_local size_t local_stripe = 0;
+/** Source of the threads' stripes **/
+static atomic_size_t next_stripe = 0;
+
+TreeSnapshots* cow_new(void) {
+    TreeSnapshots* snapshots = safe_calloc(1, sizeof(TreeSnapshots));
+    for (size_t i = 0; i < GATE_STRIPES; i++)
+        atomic_init(&snapshots->stripes[i].admitted, 0);
+    atomic_init(&snapshots->closed, false);
+    atomic_init(&snapshots->epoch, 0);
+    atomic_init(&snapshots->live, 0);
+    atomic_init(&snapshots->oldest, UINT64_MAX);
+    PTHREAD_CHECK(pthread_mutex_init(&snapshots->taking, NULL));
+    PTHREAD_CHECK(pthread_mutex_init(&snapshots->mutex, NULL));
+    cond_init_monotonic(&snapshots->changed);
+    return snapshots;
+}
+
+void cow_free(TreeSnapshots* snapshots) {
+    for (size_t i = 0; i < snapshots->retired_count; i++)
+        tree_free(snapshots->retired[i]);
+    free(snapshots->retired);
+    PTHREAD_CHECK(pthread_cond_destroy(&snapshots->changed));
+    PTHREAD_CHECK(pthread_mutex_destroy(&snapshots->mutex));
+    PTHREAD_CHECK(pthread_mutex_destroy(&snapshots->taking));
+    free(snapshots);
+}
+
+/** Gets the gate counter of the calling thread **/
+static inline atomic_size_t* own_stripe(TreeSnapshots* snapshots) {
+    if (local_stripe == 0)
+        local_stripe = atomic_fetch_add(&next_stripe, 1) % GATE_STRIPES + 1;
+    return &snapshots->stripes[local_stripe - 1].admitted;
+}
+
+int cow_enter(Tree* tree, const struct timespec* deadline) {
+    TreeSnapshots* snapshots = tree->context->snapshots;
+    atomic_size_t* stripe = own_stripe(snapshots);
+
+    atomic_fetch_add(stripe, 1);
+    while (atomic_load(&snapshots->closed)) {
+        // Step back and wait for the snapshot to be taken
+        bool open = false;
+        atomic_fetch_sub(stripe, 1);
+        UNDER_MUTEX(&snapshots->mutex,
+            PTHREAD_CHECK(pthread_cond_broadcast(&snapshots->changed));
+            while (atomic_load(&snapshots->closed)
+                   && cond_wait_until(&snapshots->changed, &snapshots->mutex, deadline) != ETIMEDOUT);
+            open = !atomic_load(&snapshots->closed);
+        );
+        if (!open)
+            return ETIMEDOUT;
+        atomic_fetch_add(stripe, 1);
+    }
+    // The epoch can't change until the modification leaves
+    local_pass.epoch = atomic_load(&snapshots->epoch);
+    local_pass.active = atomic_load(&snapshots->live) > 0;
+    return SUCCESS;
+}
+
+void cow_leave(Tree* tree) {
+    TreeSnapshots* snapshots = tree->context->snapshots;
+    atomic_fetch_sub(own_stripe(snapshots), 1);
+    if (atomic_load(&snapshots->closed))
+        UNDER_MUTEX(&snapshots->mutex, PTHREAD_CHECK(pthread_cond_broadcast(&snapshots->changed)));
+    local_pass.active = false;
+}
+
+/** Counts the modifications admitted by the gate **/
+static size_t admitted(TreeSnapshots* snapshots) {
+    size_t count = 0;
+    for (size_t i = 0; i < GATE_STRIPES; i++)
+        count += atomic_load(&snapshots->stripes[i].admitted);
+    return count;
+}
+
+/**
+ * Frees the versions of a directory from before an epoch.
+ * @param node : directory, its `var_protection` held unless it's being freed
+ * @param epoch : epoch of the oldest version to keep
+ */
+static void drop_versions(Tree* node, uint64_t epoch) {
+    NodeVersion** link = &node->versions;
+    while (*link && (*link)->epoch >= epoch)
+        link = &(*link)->older;
+    NodeVersion* version = *link;
+    *link = NULL;
+    while (version) {
+        NodeVersion* older = version->older;
+        hmap_free(version->subdirectories);
+        free(version);
+        version = older;
+    }
+}
+
+void cow_preserve(Tree* node) {
+    if (!local_pass.active) {
+        // No snapshot needs the map, and none of the versions left by the released ones is read anymore
+        drop_versions(node, UINT64_MAX);
+        return;
+    }
+    if (node->versions && node->versions->epoch >= local_pass.epoch)
+        return; // It's been preserved in this epoch already
+
+    // Versions older than every live snapshot are no longer read
+    drop_versions(node, atomic_load(&node->context->snapshots->oldest));
+    NodeVersion* version = safe_malloc(sizeof(NodeVersion));
+    version->epoch = local_pass.epoch;
+    version->subdirectories = hmap_new();
+    version->older = node->versions;
+
+    const char* name = NULL;
+    void* value = NULL;
+    HashMapIterator it = hmap_iterator(node->subdirectories);
+    while (hmap_next(node->subdirectories, &it, &name, &value))
+        hmap_insert(version->subdirectories, name, value);
+    node->versions = version;
+}
+
+void cow_unlinked(Tree* node) {
+    node->removed_at = local_pass.active ? local_pass.epoch : 0;
+}
+
+void cow_retire(Tree* node) {
+    TreeSnapshots* snapshots = node->context->snapshots;
+    bool kept = false;
+    if (node->removed_at != 0) {
+        UNDER_MUTEX(&snapshots->mutex,
+            // Snapshots taken after the removal can't reach the directory
+            kept = atomic_load(&snapshots->oldest) <= node->removed_at;
+            if (kept) {
+                if (snapshots->retired_count == snapshots->retired_capacity) {
+                    snapshots->retired_capacity = snapshots->retired_capacity ? 2 * snapshots->retired_capacity : 16;
+                    snapshots->retired = safe_realloc(snapshots->retired, snapshots->retired_capacity * sizeof(Tree*));
+                }
+                snapshots->retired[snapshots->retired_count++] = node;
+            }
+        );
+    }
+    if (!kept)
+        tree_free(node);
+}
+
+void cow_forget(Tree* node) {
+    drop_versions(node, UINT64_MAX);
+}
+
+size_t cow_version_memory(Tree* node) {
+    size_t bytes = 0;
+    const char* name = NULL;
+    void* value = NULL;
+    for (NodeVersion* version = node->versions; version; version = version->older) {
+        bytes += sizeof(NodeVersion) + MAP_MEMORY + hmap_size(version->subdirectories) * PAIR_MEMORY;
+        HashMapIterator it = hmap_iterator(version->subdirectories);
+        while (hmap_next(version->subdirectories, &it, &name, &value))
+            bytes += strlen(name) + 1;
+    }
+    return bytes;
+}
+
+/**
+ * Picks the map of a directory as it was when a snapshot started: the oldest one preserved since,
+ * or the current one if there is none. Has to be called under the directory's `var_protection`.
+ * @param node : directory reachable from the snapshot
+ * @param epoch : epoch of the snapshot
+ * @return : the map
+ */
+static HashMap* map_at(Tree* node, uint64_t epoch) {
+    HashMap* map = node->subdirectories;
+    for (NodeVersion* version = node->versions; version && version->epoch >= epoch; version = version->older)
+        map = version->subdirectories;
+    return map;
+}
+
+/**
+ * Finds a subdirectory of a directory as it was when a snapshot started.
+ * @param node : directory reachable from the snapshot
+ * @param epoch : epoch of the snapshot
+ * @param name : name of the subdirectory
+ * @return : the subdirectory, NULL if there was none
+ */
+static Tree* child_at(Tree* node, uint64_t epoch, const char* name) {
+    Tree* child = NULL;
+    UNDER_MUTEX(&node->var_protection, child = hmap_get(map_at(node, epoch), name));
+    return child;
+}
+
+/**
+ * Finds a directory as it was when a snapshot started.
+ * @param start : directory reachable from the snapshot
+ * @param epoch : epoch of the snapshot
+ * @param path : valid path relative to `start`
+ * @return : the directory, NULL if it didn't exist
+ */
+static Tree* find_at(Tree* start, uint64_t epoch, const char* path) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    Tree* node = start;
+    while (node && (path = split_path(path, name)))
+        node = child_at(node, epoch, name);
+    return node;
+}
+
+/**
+ * Unlinks a snapshot from the live ones and frees the removed directories no other snapshot can reach.
+ * @param snapshots : bookkeeping of the tree
+ * @param snapshot : snapshot to release
+ */
+static void unregister(TreeSnapshots* snapshots, TreeSnapshot* snapshot) {
+    size_t freed = 0;
+    Tree** unreachable = NULL;
+    UNDER_MUTEX(&snapshots->mutex,
+        *(snapshot->prev ? &snapshot->prev->next : &snapshots->first) = snapshot->next;
+        *(snapshot->next ? &snapshot->next->prev : &snapshots->last) = snapshot->prev;
+        uint64_t oldest = snapshots->first ? snapshots->first->epoch : UINT64_MAX;
+        atomic_store(&snapshots->oldest, oldest);
+        atomic_fetch_sub(&snapshots->live, 1);
+
+        // Keep the directories the remaining snapshots can reach
+        size_t kept = 0;
+        unreachable = safe_malloc((snapshots->retired_count + 1) * sizeof(Tree*));
+        for (size_t i = 0; i < snapshots->retired_count; i++) {
+            Tree* node = snapshots->retired[i];
+            if (node->removed_at < oldest)
+                unreachable[freed++] = node;
+            else
+                snapshots->retired[kept++] = node;
+        }
+        snapshots->retired_count = kept;
+    );
+    for (size_t i = 0; i < freed; i++)
+        tree_free(unreachable[i]);
+    free(unreachable);
+}
+
+int tree_snapshot(Tree* tree, const char* path, TreeSnapshot** result) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+
+    TreeSnapshots* snapshots = tree->context->snapshots;
+    TreeSnapshot* snapshot = safe_calloc(1, sizeof(TreeSnapshot));
+    snapshot->tree = tree;
+
+    PTHREAD_CHECK(pthread_mutex_lock(&snapshots->taking));
+    UNDER_MUTEX(&snapshots->mutex,
+        // Hold off new changes and wait for the ones being made to finish, which hold all their locks already
+        atomic_store(&snapshots->closed, true);
+        while (admitted(snapshots) > 0)
+            PTHREAD_CHECK(pthread_cond_wait(&snapshots->changed, &snapshots->mutex));
+
+        snapshot->epoch = atomic_load(&snapshots->epoch) + 1;
+        snapshot->prev = snapshots->last;
+        *(snapshots->last ? &snapshots->last->next : &snapshots->first) = snapshot;
+        snapshots->last = snapshot;
+        atomic_store(&snapshots->oldest, snapshots->first->epoch);
+        atomic_fetch_add(&snapshots->live, 1);
+        atomic_store(&snapshots->epoch, snapshot->epoch);
+
+        atomic_store(&snapshots->closed, false);
+        PTHREAD_CHECK(pthread_cond_broadcast(&snapshots->changed));
+    );
+    PTHREAD_CHECK(pthread_mutex_unlock(&snapshots->taking));
+
+    if (!(snapshot->root = find_at(tree, snapshot->epoch, path))) {
+        tree_snapshot_release(snapshot);
+        return ENOENT; // The directory doesn't exist
+    }
+    *result = snapshot;
+    return SUCCESS;
+}
+
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path) {
+    if (!is_valid_path(path))
+        return NULL; // Invalid path
+    Tree* dir = find_at(snapshot->root, snapshot->epoch, path);
+    if (!dir)
+        return NULL; // The directory didn't exist
+
+    char* result = NULL;
+    UNDER_MUTEX(&dir->var_protection, result = make_map_contents_string(map_at(dir, snapshot->epoch)));
+    return result;
+}
+
+/* A directory on the current path of `tree_snapshot_walk`, with a copy of its map from the snapshot. */
+typedef struct SnapshotFrame {
+    Tree** children;  /** Its subdirectories **/
+    char* names;      /** Their names, one after another **/
+    const char* name; /** Name of the next subdirectory to visit **/
+    size_t count;     /** Number of subdirectories **/
+    size_t next;      /** Index of the next subdirectory to visit **/
+    size_t path_len;  /** Length of the directory's path **/
+} SnapshotFrame;
+
+/**
+ * Copies the subdirectories of a directory as they were when a snapshot started, so that the walk
+ * doesn't hold the directory's mutex while visiting them.
+ * @param node : directory reachable from the snapshot
+ * @param epoch : epoch of the snapshot
+ * @param path_len : length of the directory's path
+ * @return : frame of the directory
+ */
+static SnapshotFrame read_frame(Tree* node, uint64_t epoch, size_t path_len) {
+    SnapshotFrame frame = {NULL, NULL, NULL, 0, 0, path_len};
+    const char* name = NULL;
+    void* value = NULL;
+    size_t names_len = 0;
+
+    PTHREAD_CHECK(pthread_mutex_lock(&node->var_protection));
+    HashMap* map = map_at(node, epoch);
+    HashMapIterator it = hmap_iterator(map);
+    while (hmap_next(map, &it, &name, &value))
+        names_len += strlen(name) + 1;
+    frame.children = safe_malloc((hmap_size(map) + 1) * sizeof(Tree*));
+    frame.names = safe_malloc(names_len + 1);
+    char* end = frame.names;
+    it = hmap_iterator(map);
+    while (hmap_next(map, &it, &name, &value)) {
+        frame.children[frame.count++] = value;
+        end = stpcpy(end, name) + 1;
+    }
+    PTHREAD_CHECK(pthread_mutex_unlock(&node->var_protection));
+
+    frame.name = frame.names;
+    return frame;
+}
+
+int tree_snapshot_walk(TreeSnapshot* snapshot, const char* path, TreeVisitor visitor, void* ctx) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    Tree* dir = find_at(snapshot->root, snapshot->epoch, path);
+    if (!dir)
+        return ENOENT; // The directory didn't exist
+
+    size_t path_capacity = MAX_PATH_LENGTH + 1, stack_capacity = 16, depth = 0;
+    char* buff = safe_malloc(path_capacity);
+    SnapshotFrame* stack = safe_malloc(stack_capacity * sizeof(SnapshotFrame));
+    strcpy(buff, path);
+    stack[0] = read_frame(dir, snapshot->epoch, strlen(path));
+
+    bool stopped = false;
+    while (true) {
+        SnapshotFrame* top = &stack[depth];
+        if (top->next == top->count) {
+            free(top->children);
+            free(top->names);
+            if (depth == 0)
+                break;
+            depth--;
+            buff[stack[depth].path_len] = '\0';
+            continue;
+        }
+        Tree* child = top->children[top->next++];
+        const char* name = top->name;
+        top->name += strlen(name) + 1;
+        if (!visitor(buff, name, ctx)) {
+            stopped = true;
+            break;
+        }
+
+        size_t name_len = strlen(name), child_len = top->path_len + name_len + 1;
+        reserve_buffer((void**) &buff, &path_capacity, child_len + 1);
+        memcpy(buff + top->path_len, name, name_len);
+        buff[child_len - 1] = '/';
+        buff[child_len] = '\0';
+
+        if (depth + 2 > stack_capacity) {
+            stack_capacity *= 2;
+            stack = safe_realloc(stack, stack_capacity * sizeof(SnapshotFrame));
+        }
+        stack[depth + 1] = read_frame(child, snapshot->epoch, child_len);
+        depth++;
+    }
+    for (size_t i = 0; stopped && i <= depth; i++) {
+        free(stack[i].children);
+        free(stack[i].names);
+    }
+
+    free(stack);
+    free(buff);
+    return SUCCESS;
+}
+
+void tree_snapshot_release(TreeSnapshot* snapshot) {
+    unregister(snapshot->tree->context->snapshots, snapshot);
+    free(snapshot);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Tree.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Point-in-time views of subtrees, kept up by copying on write.
+ *
+ * A modification passes the tree's gate once it holds all its locks, right before it first changes a map,
+ * and leaves it once it's done changing them. Taking a snapshot closes the gate, waits for the modifications
+ * in it to leave and bumps the tree's epoch, so every modification either happened entirely before
+ * the snapshot or entirely after it. Modifications still waiting for their locks don't hold a snapshot up,
+ * and the gate is only closed for as long as the changes being made take.
+ * The snapshot shares all the nodes with the live tree. A modification admitted while snapshots exist
+ * preserves the map of a directory before it first changes it in a new epoch, and a directory it removes
+ * is only freed once no snapshot can still reach it. Reading a directory through a snapshot picks the
+ * oldest map preserved after the snapshot was taken, or the live map if the directory hasn't changed since.
+ *
+ * Snapshot reads never take the tree's reader/writer or intention locks, so they neither wait for
+ * modifications nor hold them up; they only take the directory's own mutex for as long as a single
+ * map is being read, the same one modifications hold for the instant they change the map.
+ */
+
+typedef struct TreeSnapshot TreeSnapshot;
+
+/* Snapshot bookkeeping of a tree, owned by its context. */
+typedef struct TreeSnapshots TreeSnapshots;
+
+/* Map of a directory as it was before a modification, kept for the snapshots taken before it. */
+typedef struct NodeVersion NodeVersion;
+
+/**
+ * Takes a point-in-time view of a subtree. Waits for the modifications changing the tree at the moment
+ * to finish their changes, then finds the root of the subtree in time proportional to its depth.
+ * Meanwhile, modifications about to make their changes wait, holding their locks.
+ * @param tree : file tree
+ * @param path : root of the subtree
+ * @param result : where to store the snapshot, to be released with `tree_snapshot_release`
+ * @return : error code / success: EINVAL for an invalid path, ENOENT if the directory doesn't exist
+ */
+int tree_snapshot(Tree* tree, const char* path, TreeSnapshot** result);
+
+/**
+ * Lists the subdirectories of a directory as they were when the snapshot was taken.
+ * @param snapshot : snapshot of a subtree
+ * @param path : path relative to the root of the snapshot, "/" for the root itself
+ * @return : comma-separated names as in `tree_list`, NULL if the path is invalid or didn't exist
+ */
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path);
+
+/**
+ * Walks a subtree of the snapshot depth-first, as `tree_walk` walks the live tree.
+ * @param snapshot : snapshot of a subtree
+ * @param path : path relative to the root of the snapshot
+ * @param visitor : callback receiving the visited directories, with paths relative to the root of the snapshot
+ * @param ctx : user context passed to `visitor`
+ * @return : error code / success: EINVAL for an invalid path, ENOENT if the directory didn't exist
+ */
+int tree_snapshot_walk(TreeSnapshot* snapshot, const char* path, TreeVisitor visitor, void* ctx);
+
+/**
+ * Releases a snapshot, freeing whatever only it kept. All snapshots have to be released before the tree is freed.
+ * @param snapshot : snapshot to release
+ */
+void tree_snapshot_release(TreeSnapshot* snapshot);
+
+/**
+ * Creates the snapshot bookkeeping of a new tree.
+ * @return : bookkeeping without any snapshots
+ */
+TreeSnapshots* cow_new(void);
+
+/**
+ * Frees the snapshot bookkeeping of a tree being freed, together with the directories it kept.
+ * @param snapshots : bookkeeping of the tree
+ */
+void cow_free(TreeSnapshots* snapshots);
+
+/**
+ * Admits a modification of the tree, see the top of the file. Called once the modification holds all its locks,
+ * before it first calls `cow_preserve` and without holding any `var_protection`. The thread can't pass the gate
+ * of another tree before leaving it.
+ * @param tree : any directory of the tree
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : SUCCESS, or ETIMEDOUT if a snapshot being taken kept the gate closed until the deadline
+ */
+int cow_enter(Tree* tree, const struct timespec* deadline);
+
+/**
+ * Releases the gate passed by `cow_enter`, once the modification has made all its changes.
+ * @param tree : any directory of the tree
+ */
+void cow_leave(Tree* tree);
+
+/**
+ * Preserves the map of a directory for the snapshots that still need its current state, if there are any.
+ * Called by the modifications, holding the directory's `var_protection`, right before changing its map.
+ * @param node : directory about to change
+ */
+void cow_preserve(Tree* node);
+
+/**
+ * Notes that a directory has just been unlinked from its parent, so that it outlives the snapshots that can reach it.
+ * Called by the removals, holding the parent's `var_protection`.
+ * @param node : unlinked directory
+ */
+void cow_unlinked(Tree* node);
+
+/**
+ * Frees a removed directory once it's no longer in use by the live tree, or hands it over to the snapshot
+ * bookkeeping if a snapshot can still reach it.
+ * @param node : removed directory
+ */
+void cow_retire(Tree* node);
+
+/**
+ * Frees the preserved maps of a directory being freed.
+ * @param node : directory being freed
+ */
+void cow_forget(Tree* node);
+
+/**
+ * Estimates the bytes used by the maps of a directory preserved for snapshots, with their entries and keys.
+ * Has to be called under the directory's `var_protection`.
+ * @param node : directory
+ * @return : size of its preserved versions, 0 if there are none
+ */
+size_t cow_version_memory(Tree* node);
@@ -0,0 +1,171 @@
+#include "tree_events.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#if defined(TREE_EVENTS_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define EVENT_PROBE(kind, start, duration, arg) DTRACE_PROBE4(file_tree, span, kind, start, duration, arg)
+#endif
+#endif
+#ifndef EVENT_PROBE
+#define EVENT_PROBE(kind, start, duration, arg) do {} while (0)
+#endif
+
+/** Names of the spans in the dumps, indexed by `EventKind` **/
+static const char* const event_names[EVENT_KINDS] = {
+    "list", "create", "remove", "move", "path walk", "lock wait", "exclusive", "drain wait", "listing",
+};
+
+/* A recorded span. */
+typedef struct Event {
+    uint64_t start;    /** CLOCK_MONOTONIC start in nanoseconds **/
+    uint64_t duration; /** Length in nanoseconds **/
+    uint32_t kind;     /** Kind of the span, as `EventKind` **/
+    uint32_t arg;      /** Argument of the span **/
+} Event;
+
+typedef struct EventRing EventRing;
+
+/* Spans recorded by a single thread. Only the thread itself writes to it. */
+struct EventRing {
+    uint32_t thread_id;            /** Identifier of the thread in the dumps **/
+    atomic_size_t head;            /** Number of spans ever written since the last start **/
+    bool exited;                   /** Whether the thread has exited, so the ring can be reused after the next start **/
+    Event events[EVENT_RING_SIZE]; /** The latest spans, the one with number `n` at `n % EVENT_RING_SIZE` **/
+    EventRing* next;               /** Next ring in the registry or among the free ones **/
+};
+
+/** Rings of the threads that recorded a span since the last start, or are still running **/
+static EventRing* registry = NULL;
+/** Rings of exited threads, handed out to the threads recording their first span **/
+static EventRing* free_rings = NULL;
+/** Protects the rings' lists, their `exited` flags and `next_thread_id` **/
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_thread_id = 0;
+/** Key whose destructor notes that the thread owning a ring has exited **/
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+/** Whether spans are being recorded **/
+static atomic_bool recording = false;
+/** Ring of the calling thread, NULL until it records its first span **/
+static _Thread_local EventRing* local_ring = NULL;
+/** Depth reported by the calling thread's lock waits **/
+static _Thread_local unsigned local_depth = 0;
+
+/**
+ * Notes that the thread owning a ring has exited. Its spans stay in the dumps until the next start,
+ * which hands the ring over to another thread.
+ * @param ring : ring of the exiting thread
+ */
+static void release_ring(void* ring) {
+    UNDER_MUTEX(&registry_mutex, ((EventRing*) ring)->exited = true);
+    local_ring = NULL;
+}
+
+static void create_ring_key(void) {
+    PTHREAD_CHECK(pthread_key_create(&ring_key, release_ring));
+}
+
+/**
+ * Gets the calling thread's ring, registering a free or a new one on its first span.
+ * @return : the ring
+ */
+static EventRing* thread_ring(void) {
+    if (!local_ring) {
+        PTHREAD_CHECK(pthread_once(&ring_key_once, create_ring_key));
+        EventRing* ring = NULL;
+        UNDER_MUTEX(&registry_mutex,
+            if ((ring = free_rings))
+                free_rings = ring->next;
+            else
+                ring = safe_calloc(1, sizeof(EventRing));
+            atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+            ring->exited = false;
+            ring->thread_id = next_thread_id++;
+            ring->next = registry;
+            registry = ring;
+        );
+        PTHREAD_CHECK(pthread_setspecific(ring_key, ring));
+        local_ring = ring;
+    }
+    return local_ring;
+}
+
+void event_record(EventKind kind, uint64_t start, unsigned arg) {
+    if (!atomic_load_explicit(&recording, memory_order_relaxed))
+        return;
+
+    uint64_t duration = monotonic_ns() - start;
+    EVENT_PROBE(kind, start, duration, arg);
+    EventRing* ring = thread_ring();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->events[head % EVENT_RING_SIZE] = (Event) {start, duration, kind, arg};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void event_set_depth(unsigned depth) {
+    local_depth = depth;
+}
+
+unsigned event_depth(void) {
+    return local_depth;
+}
+
+void tree_events_start(void) {
+    UNDER_MUTEX(&registry_mutex,
+        for (EventRing** link = &registry; *link;) {
+            EventRing* ring = *link;
+            if (ring->exited) {
+                // Its spans are discarded anyway, so the ring can go to a new thread
+                *link = ring->next;
+                ring->next = free_rings;
+                free_rings = ring;
+                continue;
+            }
+            atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+            link = &ring->next;
+        }
+    );
+    atomic_store(&recording, true);
+}
+
+void tree_events_stop(void) {
+    atomic_store(&recording, false);
+}
+
+int tree_events_dump(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return errno;
+
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    UNDER_MUTEX(&registry_mutex,
+        for (EventRing* ring = registry; ring; ring = ring->next) {
+            size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            size_t n = head > EVENT_RING_SIZE ? head - EVENT_RING_SIZE : 0;
+            for (; n < head; n++) {
+                const Event* event = &ring->events[n % EVENT_RING_SIZE];
+                fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"tree\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                              "\"pid\":1,\"tid\":%u",
+                        first ? "" : ",", event_names[event->kind], event->start / 1e3, event->duration / 1e3,
+                        (unsigned) ring->thread_id);
+                if (event->kind == EVENT_LOCK_WAIT)
+                    fprintf(file, ",\"args\":{\"depth\":%u}", (unsigned) event->arg);
+                fputc('}', file);
+                first = false;
+            }
+        }
+    );
+    fprintf(file, "\n]}\n");
+
+    int err = ferror(file) ? EIO : 0;
+    if (fclose(file) != 0 && err == 0)
+        err = errno;
+    return err;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Timed spans of the phases of the tree's operations, for finding out why they wait: whole operations,
+ * path walks, contended lock waits with the depth of the node, exclusive holds of a directory,
+ * waits for the operations inside a moved or removed directory to drain, and listing construction.
+ * Lock waits are reported with the depth of the node below the directory the path walk started from,
+ * which is the root except for the second part of a move, which starts from the LCA of its paths.
+ * The spans are only recorded when the library is compiled with TREE_EVENTS defined; otherwise the hooks
+ * compile to nothing and dumps are empty. With TREE_EVENTS_USDT defined as well and <sys/sdt.h>
+ * available, every span also fires the `file_tree:span` static tracepoint for perf / bpftrace,
+ * with the kind, start, duration and argument of the span.
+ *
+ * Every thread writes to its own fixed-size ring without taking any locks, overwriting its oldest spans
+ * once the ring is full, so a dump holds the latest EVENT_RING_SIZE spans of every thread.
+ * The ring of an exited thread is kept for the dumps until the next `tree_events_start`, which passes it
+ * on to the next thread recording its first span, so the rings don't pile up with short-lived threads.
+ */
+
+/** Number of spans kept per thread **/
+#define EVENT_RING_SIZE 16384
+
+/* Kinds of spans. */
+typedef enum EventKind {
+    EVENT_LIST = 0,   /** Whole `tree_list` call **/
+    EVENT_CREATE,     /** Whole `tree_create` call **/
+    EVENT_REMOVE,     /** Whole `tree_remove` call **/
+    EVENT_MOVE,       /** Whole `tree_move` call **/
+    EVENT_PATH_WALK,  /** Locking the path to a directory **/
+    EVENT_LOCK_WAIT,  /** Contended lock acquisition, argument: levels of the node below the start of the walk **/
+    EVENT_EXCLUSIVE,  /** Directory held exclusively, i.e. the critical section of a modification **/
+    EVENT_DRAIN_WAIT, /** Removal or move waiting for the operations inside the directory to finish **/
+    EVENT_LISTING,    /** Building the result of `tree_list` **/
+
+    EVENT_KINDS
+} EventKind;
+
+/**
+ * Starts recording, discarding the spans recorded before.
+ */
+void tree_events_start(void);
+
+/**
+ * Stops recording. Spans already in progress may still be recorded.
+ */
+void tree_events_stop(void);
+
+/**
+ * Writes the recorded spans as a Chrome trace (JSON object format), viewable in Perfetto or chrome://tracing.
+ * Has to be called after `tree_events_stop`, once the traced operations are finished.
+ * @param filename : path of the JSON file
+ * @return : error code / success
+ */
+int tree_events_dump(const char* filename);
+
+/**
+ * Records a finished span. Used by the hooks in the operations.
+ * @param kind : kind of the span
+ * @param start : start of the span, from `monotonic_ns`
+ * @param arg : argument of the span, see `EventKind`
+ */
+void event_record(EventKind kind, uint64_t start, unsigned arg);
+
+/**
+ * Sets the depth reported by the following EVENT_LOCK_WAIT spans of the calling thread.
+ * @param depth : levels of the node about to be locked below the directory the path walk started from
+ */
+void event_set_depth(unsigned depth);
+
+/**
+ * Gets the depth set by `event_set_depth`.
+ * @return : depth of the node being locked
+ */
+unsigned event_depth(void);
+
+#ifdef TREE_EVENTS
+/** Notes the start of a span in a new variable `var` **/
+#define EVENT_BEGIN(var) uint64_t var = monotonic_ns()
+/** Records a span started by `EVENT_BEGIN(var)` **/
+#define EVENT_END(var, kind, arg) event_record(kind, var, arg)
+/** Records a span started at `since` unless it is 0, as returned by `WAIT_CLOCK` when nothing was waited for **/
+#define EVENT_WAITED(since, kind, arg)        \
+    do {                                      \
+        if ((since) != 0)                     \
+            event_record(kind, since, arg);   \
+    } while (0)
+/** Sets the depth of the node about to be locked, see `event_set_depth` **/
+#define EVENT_DEPTH(depth) event_set_depth(depth)
+#else
+#define EVENT_BEGIN(var) do {} while (0)
+#define EVENT_END(var, kind, arg) do {} while (0)
+#define EVENT_WAITED(since, kind, arg) ((void) (since))
+#define EVENT_DEPTH(depth) ((void) (depth))
+#endif
@@ -0,0 +1,334 @@
+#include "tree_find.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/** Token of a compiled component matching any run of letters **/
+#define FIND_STAR (UINT32_C(1) << 31)
+/** Token matching any single letter **/
+#define FIND_ANY ((UINT32_C(1) << ('z' - 'a' + 1)) - 1)
+
+/* A component of a pattern, compiled for matching the names of a single level. */
+typedef struct FindComponent {
+    uint32_t* tokens; /** Sets of letters, bit i standing for 'a' + i, one per matched letter, or FIND_STAR **/
+    size_t count;     /** Number of tokens **/
+    char* literal;    /** The name itself if the component has no wildcards, NULL otherwise **/
+} FindComponent;
+
+/* A compiled pattern and the state of a search for it. */
+typedef struct Finder {
+    FindComponent* components; /** Components of the pattern, one per level **/
+    size_t count;              /** Number of components **/
+    size_t prefix;             /** Leading components looked up directly, all of them except the last one if possible **/
+    TreeVisitor visitor;       /** Callback receiving the matches **/
+    void* ctx;                 /** Its context **/
+    pthread_mutex_t* serial;   /** Serializes the visitor calls of a parallel search, NULL otherwise **/
+    atomic_bool stopped;       /** Set once the visitor asks to stop **/
+} Finder;
+
+/**
+ * Compiles a single component of a pattern.
+ * @param source : the component, without the separators
+ * @param length : its length
+ * @param component : where to store the compiled component
+ * @return : false if the component is invalid
+ */
+static bool compile_component(const char* source, size_t length, FindComponent* component) {
+    bool literal = true;
+    component->tokens = safe_malloc(length * sizeof(uint32_t));
+    component->count = 0;
+    component->literal = NULL;
+    for (size_t i = 0; i < length; i++) {
+        char c = source[i];
+        if (c >= 'a' && c <= 'z') {
+            component->tokens[component->count++] = UINT32_C(1) << (c - 'a');
+            continue;
+        }
+        literal = false;
+        if (c == '*') {
+            if (component->count == 0 || component->tokens[component->count - 1] != FIND_STAR)
+                component->tokens[component->count++] = FIND_STAR; // Runs of stars match the same as one
+        }
+        else if (c == '?') {
+            component->tokens[component->count++] = FIND_ANY;
+        }
+        else if (c == '[') {
+            uint32_t set = 0;
+            bool negated = ++i < length && source[i] == '!', empty = true;
+            i += negated;
+            for (; i < length && source[i] != ']'; i++, empty = false) {
+                char low = source[i], high = low;
+                if (i + 2 < length && source[i + 1] == '-' && source[i + 2] != ']')
+                    high = source[i += 2];
+                if (low < 'a' || high > 'z' || low > high)
+                    return false; // Not a letter or an empty range
+                set |= ((UINT32_C(1) << (high - low + 1)) - 1) << (low - 'a');
+            }
+            if (i == length || empty)
+                return false; // Unterminated or empty set
+            component->tokens[component->count++] = negated ? FIND_ANY & ~set : set;
+        }
+        else {
+            return false; // Not a letter nor a wildcard
+        }
+    }
+    if (literal && length > MAX_FOLDER_NAME_LENGTH)
+        return false; // No directory can have the name
+    if (literal)
+        component->literal = strndup(source, length);
+    return true;
+}
+
+/**
+ * Frees the compiled components of a pattern.
+ * @param finder : the compiled pattern
+ */
+static void free_pattern(Finder* finder) {
+    for (size_t i = 0; i < finder->count; i++) {
+        free(finder->components[i].tokens);
+        free(finder->components[i].literal);
+    }
+    free(finder->components);
+}
+
+/**
+ * Compiles a pattern, see the top of `tree_find.h`.
+ * @param pattern : the pattern
+ * @param finder : where to store the compiled components
+ * @return : false if the pattern is invalid, in which case nothing has to be freed
+ */
+static bool compile_pattern(const char* pattern, Finder* finder) {
+    size_t length = strlen(pattern);
+    if (length < 2 || length > MAX_PATH_LENGTH || pattern[0] != '/' || pattern[length - 1] != '/')
+        return false; // Not shaped like a path, or the root, which is never reported
+
+    finder->count = 0;
+    for (size_t i = 1; i < length; i++)
+        finder->count += pattern[i] == '/';
+    finder->components = safe_calloc(finder->count, sizeof(FindComponent));
+    finder->prefix = 0;
+    const char* source = pattern + 1;
+    for (size_t i = 0; i < finder->count; i++) {
+        const char* end = strchr(source, '/');
+        if (end == source || !compile_component(source, end - source, &finder->components[i])) {
+            finder->count = i + 1; // Free the components compiled so far, and the failed one
+            free_pattern(finder);
+            return false; // Empty or invalid component
+        }
+        if (finder->prefix == i && i + 1 < finder->count && finder->components[i].literal)
+            finder->prefix++;
+        source = end + 1;
+    }
+    return true;
+}
+
+/**
+ * Matches a name against a compiled component, backtracking to the last star on a mismatch.
+ * @param component : compiled component
+ * @param name : name of a directory
+ * @return : whether the name matches
+ */
+static bool matches(const FindComponent* component, const char* name) {
+    size_t token = 0, star = SIZE_MAX, resumed = 0;
+    for (size_t i = 0; name[i];) {
+        if (token < component->count && component->tokens[token] == FIND_STAR) {
+            star = token++; // Let the star match nothing at first
+            resumed = i;
+        }
+        else if (token < component->count && (component->tokens[token] & (UINT32_C(1) << (name[i] - 'a')))) {
+            token++;
+            i++;
+        }
+        else if (star != SIZE_MAX) {
+            token = star + 1; // Let the star match one more letter
+            i = ++resumed;
+        }
+        else {
+            return false;
+        }
+    }
+    while (token < component->count && component->tokens[token] == FIND_STAR)
+        token++;
+    return token == component->count;
+}
+
+/**
+ * Passes a match on to the visitor.
+ * @param finder : the search
+ * @param path : path of the matching directory's parent
+ * @param name : name of the matching directory
+ * @return : false if the search has to stop
+ */
+static bool report(Finder* finder, const char* path, const char* name) {
+    bool go_on = false;
+    if (!finder->serial) {
+        go_on = finder->visitor(path, name, finder->ctx);
+    }
+    else {
+        UNDER_MUTEX(finder->serial,
+            go_on = !atomic_load(&finder->stopped) && finder->visitor(path, name, finder->ctx);
+        );
+    }
+    if (!go_on)
+        atomic_store(&finder->stopped, true);
+    return go_on;
+}
+
+static bool search_below(Finder* finder, Tree* node, size_t level, char* path, size_t length);
+
+/**
+ * Handles a directory matching its component: reports it if the component is the last one,
+ * and searches below it otherwise. The directory's parent has to be locked.
+ * @param finder : the search
+ * @param child : the matching directory
+ * @param name : its name
+ * @param level : index of the component it matches
+ * @param path : buffer holding the path of its parent
+ * @param length : length of that path
+ * @return : false if the search has to stop
+ */
+static bool search_match(Finder* finder, Tree* child, const char* name, size_t level, char* path, size_t length) {
+    if (atomic_load_explicit(&finder->stopped, memory_order_relaxed))
+        return false;
+    if (level + 1 == finder->count)
+        return report(finder, path, name); // The parent's lock keeps the name in place, no need to lock the match
+
+    size_t name_len = strlen(name);
+    memcpy(path + length, name, name_len);
+    path[length + name_len] = '/';
+    path[length + name_len + 1] = '\0';
+    subtree_lock(child);
+    bool go_on = search_below(finder, child, level + 1, path, length + name_len + 1);
+    subtree_unlock(child);
+    path[length] = '\0';
+    return go_on;
+}
+
+/**
+ * Searches the subdirectories of a locked directory for the matches of a component and the ones after it.
+ * @param finder : the search
+ * @param node : locked directory
+ * @param level : index of the component its subdirectories have to match
+ * @param path : buffer holding the directory's path, with room for any path of the tree
+ * @param length : length of the path
+ * @return : false if the search has to stop
+ */
+static bool search_below(Finder* finder, Tree* node, size_t level, char* path, size_t length) {
+    FindComponent* component = &finder->components[level];
+    if (component->literal) {
+        Tree* child = hmap_get(node->subdirectories, component->literal);
+        return !child || search_match(finder, child, component->literal, level, path, length);
+    }
+
+    const char* name = NULL;
+    void* value = NULL;
+    HashMapIterator it = hmap_iterator(node->subdirectories);
+    while (hmap_next(node->subdirectories, &it, &name, &value)) {
+        if (matches(component, name) && !search_match(finder, value, name, level, path, length))
+            return false;
+    }
+    return true;
+}
+
+/* Directories matching the component the parallel search is split at, shared by its threads. */
+typedef struct FindFanOut {
+    Finder* finder;        /** The search **/
+    const char* path;      /** Path of the directories' parent **/
+    size_t length;         /** Its length **/
+    Tree** nodes;          /** The matching directories **/
+    const char** names;    /** Their names **/
+    size_t count;          /** Number of the matching directories **/
+    atomic_size_t next;    /** Index of the first directory nobody took yet **/
+} FindFanOut;
+
+/**
+ * Searching thread of `tree_find_parallel`: takes the matching directories one by one until none are left.
+ * @param data : the fan-out
+ * @return : NULL
+ */
+static void* fan_out_run(void* data) {
+    FindFanOut* fan = data;
+    char path[MAX_PATH_LENGTH + 1];
+    memcpy(path, fan->path, fan->length + 1);
+    size_t i;
+    while ((i = atomic_fetch_add(&fan->next, 1)) < fan->count) {
+        if (!search_match(fan->finder, fan->nodes[i], fan->names[i], fan->finder->prefix, path, fan->length))
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * Performs `tree_find_parallel`, or `tree_find` with a single thread.
+ * @return : as `tree_find`
+ */
+static int find(Tree* tree, const char* pattern, size_t num_threads, TreeVisitor visitor, void* ctx) {
+    Finder finder = {.visitor = visitor, .ctx = ctx};
+    if (!compile_pattern(pattern, &finder))
+        return EINVAL; // Invalid pattern
+    atomic_init(&finder.stopped, false);
+
+    // Look up the directory below the literal prefix of the pattern
+    char path[MAX_PATH_LENGTH + 1];
+    size_t length = 1;
+    for (size_t i = 0; i < finder.prefix; i++)
+        length = strchr(pattern + length, '/') - pattern + 1;
+    memcpy(path, pattern, length);
+    path[length] = '\0';
+    Tree* start = lock_subtree(tree, path);
+    if (!start) {
+        free_pattern(&finder);
+        return SUCCESS; // The prefix doesn't exist, so nothing matches
+    }
+
+    FindComponent* component = &finder.components[finder.prefix];
+    if (num_threads <= 1 || component->literal) {
+        search_below(&finder, start, finder.prefix, path, length);
+    }
+    else {
+        // The start stays locked until all threads finish, keeping the matching directories in place
+        FindFanOut fan = {.finder = &finder, .path = path, .length = length};
+        size_t capacity = hmap_size(start->subdirectories);
+        fan.nodes = safe_malloc((capacity ? capacity : 1) * sizeof(Tree*));
+        fan.names = safe_malloc((capacity ? capacity : 1) * sizeof(char*));
+        atomic_init(&fan.next, 0);
+        const char* name = NULL;
+        void* value = NULL;
+        HashMapIterator it = hmap_iterator(start->subdirectories);
+        while (hmap_next(start->subdirectories, &it, &name, &value)) {
+            if (matches(component, name)) {
+                fan.nodes[fan.count] = value;
+                fan.names[fan.count++] = name;
+            }
+        }
+
+        pthread_mutex_t serial;
+        PTHREAD_CHECK(pthread_mutex_init(&serial, NULL));
+        finder.serial = &serial;
+        if (num_threads > fan.count)
+            num_threads = fan.count ? fan.count : 1;
+        run_parallel(fan_out_run, &fan, num_threads, 0);
+        PTHREAD_CHECK(pthread_mutex_destroy(&serial));
+        free(fan.nodes);
+        free(fan.names);
+    }
+
+    unlock_subtree(start);
+    free_pattern(&finder);
+    return SUCCESS;
+}
+
+int tree_find(Tree* tree, const char* pattern, TreeVisitor visitor, void* ctx) {
+    return find(tree, pattern, 1, visitor, ctx);
+}
+
+int tree_find_parallel(Tree* tree, const char* pattern, size_t num_threads, TreeVisitor visitor, void* ctx) {
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t) online : 1;
+    }
+    return find(tree, pattern, num_threads, visitor, ctx);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Tree.h"
+#include <stddef.h>
+
+/*
+ * Searches for the directories whose paths match a glob pattern.
+ *
+ * A pattern is shaped like a path, and each of its components matches the name of a single directory
+ * at that depth. Besides the letters a-z, a component may contain `*` matching any run of letters,
+ * `?` matching a single letter, and `[...]` matching a single letter from a set of letters and ranges
+ * like `[a-fx]`, or outside of it if the set starts with `!`. For example, "/tenants/[!x]?/logs/" matches
+ * the logs of the tenants with two-letter names not starting with x.
+ *
+ * The pattern is compiled before the search. The leading components without wildcards are looked up
+ * directly, as in `tree_list`, and the rest of the search only enters the directories matching their
+ * component, so the time depends on the directories matching the prefixes of the pattern rather than
+ * on the size of the tree. Directories are locked as in `tree_walk`.
+ */
+
+/**
+ * Reports every directory matching a pattern to the `visitor`, depth-first.
+ * @param tree : file tree
+ * @param pattern : glob pattern, see the top of the file
+ * @param visitor : callback receiving the matching directories, as in `tree_walk`
+ * @param ctx : user context passed to `visitor`
+ * @return : error code / success: EINVAL for an invalid pattern. A pattern matching nothing is not an error
+ */
+int tree_find(Tree* tree, const char* pattern, TreeVisitor visitor, void* ctx);
+
+/**
+ * As `tree_find`, but splits the search among a pool of threads at the first component with wildcards,
+ * every thread taking the next unsearched directory matching it. The visitor calls are serialized,
+ * but may come from any of the threads and in any order.
+ * @param num_threads : number of searching threads, including the calling thread. 0 means one per online CPU
+ */
+int tree_find_parallel(Tree* tree, const char* pattern, size_t num_threads, TreeVisitor visitor, void* ctx);
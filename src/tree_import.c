@@ -0,0 +1,311 @@
+#define _GNU_SOURCE // struct dirent64, getdents64
+
+#include "tree_import.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Size of the buffer for `getdents64`, large to list big directories in few calls **/
+#define IMPORT_BUFFER (256 * 1024)
+
+/* A host directory waiting to be listed. */
+typedef struct ImportTask {
+    Tree* node;       /** Its mirror in the subtree being built **/
+    char* host_path;  /** Its path on the host **/
+    size_t tree_len;  /** Length of its mirror's path in the tree **/
+} ImportTask;
+
+/* State shared by the importing threads. */
+typedef struct Importer {
+    pthread_mutex_t mutex;      /** Protects the fields below and serializes the reports **/
+    pthread_cond_t work;        /** Signalled when tasks are added or the import is finished **/
+    ImportTask* tasks;          /** Stack of directories waiting to be listed **/
+    size_t count, capacity;     /** Tasks on the stack and its allocated size **/
+    size_t busy;                /** Threads listing a directory, which may add more tasks **/
+    size_t problems;            /** Directories reported to the callback **/
+    TreeImportCallback report;  /** User callback for the directories left out, may be NULL **/
+    void* ctx;                  /** Its context **/
+} Importer;
+
+/**
+ * Reports a directory left out of the import. The caller has to hold the importer's mutex.
+ * @param importer : the import
+ * @param host_path : path of the directory on the host
+ * @param problem : why it was left out
+ */
+static void report_problem(Importer* importer, const char* host_path, TreeImportProblem problem) {
+    importer->problems++;
+    if (importer->report)
+        importer->report(host_path, problem, importer->ctx);
+}
+
+/**
+ * Checks whether a host name is a valid directory name in the tree.
+ * @param name : the name
+ * @return : whether it's made of 1 to MAX_FOLDER_NAME_LENGTH letters a-z
+ */
+static bool is_valid_name(const char* name) {
+    size_t length = 0;
+    for (; name[length]; length++) {
+        if (name[length] < 'a' || name[length] > 'z')
+            return false;
+    }
+    return length > 0 && length <= MAX_FOLDER_NAME_LENGTH;
+}
+
+/**
+ * Checks whether a directory entry is a directory, asking the file system if `getdents64` didn't say.
+ * @param fd : the listed directory
+ * @param entry : the entry
+ * @return : whether it's a directory, symbolic links excluded
+ */
+static bool is_directory(int fd, const struct dirent64* entry) {
+    if (entry->d_type != DT_UNKNOWN)
+        return entry->d_type == DT_DIR;
+    struct stat st;
+    return fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Lists a host directory and adds its valid subdirectories to its mirror, queueing them to be listed in turn.
+ * @param importer : the import
+ * @param task : the directory, its `host_path` is freed
+ */
+static void import_directory(Importer* importer, ImportTask* task) {
+    size_t host_len = strlen(task->host_path);
+    int fd = open(task->host_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        UNDER_MUTEX(&importer->mutex, report_problem(importer, task->host_path, TREE_IMPORT_UNREADABLE));
+        free(task->host_path);
+        return;
+    }
+
+    size_t children_capacity = 16, valid = 0;
+    ImportTask* children = safe_malloc(children_capacity * sizeof(ImportTask));
+    char* buffer = safe_malloc(IMPORT_BUFFER);
+    ssize_t n;
+    while ((n = getdents64(fd, buffer, IMPORT_BUFFER)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64* entry = (struct dirent64*) (buffer + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || !is_directory(fd, entry))
+                continue;
+
+            size_t name_len = strlen(name);
+            char* host_path = safe_malloc(host_len + name_len + 2);
+            memcpy(host_path, task->host_path, host_len);
+            host_path[host_len] = '/';
+            memcpy(host_path + host_len + 1, name, name_len + 1);
+
+            size_t tree_len = task->tree_len + name_len + 1;
+            bool valid_name = is_valid_name(name);
+            if (!valid_name || tree_len > MAX_PATH_LENGTH) {
+                UNDER_MUTEX(&importer->mutex,
+                    report_problem(importer, host_path, valid_name ? TREE_IMPORT_TOO_LONG : TREE_IMPORT_INVALID_NAME));
+                free(host_path);
+                continue;
+            }
+            Tree* child = node_new(task->node);
+            hmap_insert(task->node->subdirectories, name, child);
+            if (valid == children_capacity)
+                children = safe_realloc(children, (children_capacity *= 2) * sizeof(ImportTask));
+            children[valid++] = (ImportTask) {child, host_path, tree_len};
+        }
+    }
+    if (n < 0)
+        UNDER_MUTEX(&importer->mutex, report_problem(importer, task->host_path, TREE_IMPORT_UNREADABLE));
+    free(buffer);
+    close(fd);
+    free(task->host_path);
+
+    if (valid > 0) {
+        UNDER_MUTEX(&importer->mutex,
+            if (importer->count + valid > importer->capacity) {
+                importer->capacity = 2 * (importer->count + valid);
+                importer->tasks = safe_realloc(importer->tasks, importer->capacity * sizeof(ImportTask));
+            }
+            memcpy(importer->tasks + importer->count, children, valid * sizeof(ImportTask));
+            importer->count += valid;
+            PTHREAD_CHECK(pthread_cond_broadcast(&importer->work));
+        );
+    }
+    free(children);
+}
+
+/**
+ * Lists directories until there are none left and no thread can add more.
+ * @param arg : the importer
+ * @return : NULL
+ */
+static void* import_worker(void* arg) {
+    Importer* importer = arg;
+    PTHREAD_CHECK(pthread_mutex_lock(&importer->mutex));
+    while (true) {
+        if (importer->count == 0) {
+            if (importer->busy == 0)
+                break;
+            PTHREAD_CHECK(pthread_cond_wait(&importer->work, &importer->mutex));
+            continue;
+        }
+        ImportTask task = importer->tasks[--importer->count];
+        importer->busy++;
+        PTHREAD_CHECK(pthread_mutex_unlock(&importer->mutex));
+
+        import_directory(importer, &task);
+
+        PTHREAD_CHECK(pthread_mutex_lock(&importer->mutex));
+        importer->busy--;
+    }
+    PTHREAD_CHECK(pthread_cond_broadcast(&importer->work)); // Wake the others to finish too
+    PTHREAD_CHECK(pthread_mutex_unlock(&importer->mutex));
+    return NULL;
+}
+
+/**
+ * Fills in the `descendants` counters of a subtree nobody else can see yet.
+ * @param root : root of the subtree
+ * @return : number of directories in the subtree, excluding the root
+ */
+static size_t count_descendants(Tree* root) {
+    const char* name = NULL;
+    void* value = NULL;
+    HashMapIterator it = hmap_iterator(root->subdirectories);
+    root->descendants = 0;
+    while (hmap_next(root->subdirectories, &it, &name, &value))
+        root->descendants += count_descendants(value) + 1;
+    return root->descendants;
+}
+
+/**
+ * Journals the creation of every directory of an imported subtree, in pre-order.
+ * Used as a `NodeVisitor` over the subtree before it gets linked.
+ */
+static bool journal_imported(const char* path, const char* name, Tree* node, void* ctx) {
+    char child_path[MAX_PATH_LENGTH + 1];
+    (void) ctx;
+    snprintf(child_path, sizeof(child_path), "%s%s/", path, name);
+    journal_append(node, JOURNAL_CREATE, child_path, NULL);
+    return true;
+}
+
+/**
+ * Links the subdirectories of the built subtree's root below the target directory.
+ * @param tree : file tree
+ * @param path : target directory
+ * @param staging : root of the built subtree, left with the subdirectories the target already has
+ * @param imported : where to store the number of linked directories
+ * @return : error code / success
+ */
+static int attach(Tree* tree, const char* path, Tree* staging, size_t* imported) {
+    Tree* target = NULL;
+    uint64_t epoch = 0;
+    bool intention = USES_INTENTION_LOCKS(tree);
+    PublishMode published = PUBLISH_NONE;
+    int err = intention ? intention_lock_path(tree, path, LOCK_IX, NULL, &target)
+                        : get_node_since(tree, path, WRITER, NULL, &epoch, &target);
+    if (err == SUCCESS && !intention && (err = publish_begin(target, epoch, false, &published)) != SUCCESS)
+        writer_unlock(target);
+    if (err != SUCCESS) {
+        return err; // The target doesn't exist or was moved since it was found
+    }
+    cow_enter(tree, NULL);
+
+    // Split off the names the target doesn't have yet
+    const char* name = NULL;
+    void* value = NULL;
+    HashMapIterator it = hmap_iterator(staging->subdirectories);
+    HashMap *linked = hmap_new(), *conflicts = hmap_new();
+    PTHREAD_CHECK(pthread_mutex_lock(&target->var_protection));
+    while (hmap_next(staging->subdirectories, &it, &name, &value))
+        hmap_insert(hmap_get(target->subdirectories, name) ? conflicts : linked, name, value);
+    hmap_free(staging->subdirectories);
+    staging->subdirectories = linked;
+
+    // Journal everything before anybody can find it, then link it
+    *imported = count_descendants(staging);
+    walk_subtree(staging, path, journal_imported, NULL);
+    cow_preserve(target);
+    it = hmap_iterator(linked);
+    while (hmap_next(linked, &it, &name, &value)) {
+        char child_path[MAX_PATH_LENGTH + 1];
+        ((Tree*) value)->parent = target;
+        hmap_insert(target->subdirectories, name, value);
+        snprintf(child_path, sizeof(child_path), "%s%s/", path, name);
+        watch_notify(target, JOURNAL_CREATE, child_path, NULL); // Once for the whole imported subtree
+    }
+    PTHREAD_CHECK(pthread_mutex_unlock(&target->var_protection));
+    cow_leave(tree);
+    propagate_size(target, (ssize_t) *imported);
+    publish_end(target, published);
+
+    if (intention)
+        intention_unlock_path(target, LOCK_IX);
+    else
+        writer_unlock(target);
+
+    hmap_free(linked); // The linked directories now belong to the target
+    staging->subdirectories = conflicts;
+    return SUCCESS;
+}
+
+int tree_import(Tree* tree, const char* path, const char* directory, size_t num_threads,
+                TreeImportCallback report, void* ctx, TreeImportResult* result) {
+    TreeStat stat;
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (tree_stat(tree, path, &stat) != SUCCESS)
+        return ENOENT; // The target doesn't exist, checked again when linking the import
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return errno; // The host directory can't be listed
+    close(fd);
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t) online : 1;
+    }
+
+    // Build the mirror below a detached directory of the same tree
+    Tree* staging = node_new(tree);
+    Importer importer = {.capacity = 16, .report = report, .ctx = ctx};
+    PTHREAD_CHECK(pthread_mutex_init(&importer.mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&importer.work, NULL));
+    importer.tasks = safe_malloc(importer.capacity * sizeof(ImportTask));
+    importer.tasks[importer.count++] = (ImportTask) {staging, strdup(directory), strlen(path)};
+
+    run_parallel(import_worker, &importer, num_threads, 0);
+
+    size_t imported = 0;
+    int err;
+    do {
+        err = attach(tree, path, staging, &imported);
+    } while (err == EPATHMOVED);
+    if (err == SUCCESS) {
+        const char* name = NULL;
+        void* value = NULL;
+        HashMapIterator it = hmap_iterator(staging->subdirectories);
+        while (hmap_next(staging->subdirectories, &it, &name, &value)) {
+            size_t length = strlen(directory) + strlen(name) + 2;
+            char* host_path = safe_malloc(length);
+            snprintf(host_path, length, "%s/%s", directory, name);
+            report_problem(&importer, host_path, TREE_IMPORT_EXISTS); // No other importing thread is left
+            free(host_path);
+        }
+        err = journal_wait();
+    }
+    tree_free(staging);
+    if (result) {
+        result->imported = imported;
+        result->problems = importer.problems;
+    }
+
+    free(importer.tasks);
+    PTHREAD_CHECK(pthread_cond_destroy(&importer.work));
+    PTHREAD_CHECK(pthread_mutex_destroy(&importer.mutex));
+    return err;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Tree.h"
+#include <stddef.h>
+
+/* Problems with directories of the host, reported by `tree_import`. */
+typedef enum TreeImportProblem {
+    TREE_IMPORT_INVALID_NAME = 0, /** The name has characters other than a-z, the directory and its contents were skipped **/
+    TREE_IMPORT_TOO_LONG,         /** The directory's path in the tree would exceed MAX_PATH_LENGTH, it was skipped **/
+    TREE_IMPORT_UNREADABLE,       /** The directory couldn't be listed, it was imported empty **/
+    TREE_IMPORT_EXISTS,           /** The target directory already has a subdirectory of this name, it was skipped **/
+} TreeImportProblem;
+
+/**
+ * Callback invoked by `tree_import` for every directory it couldn't import fully.
+ * Calls are serialized, but may come from any of the importing threads.
+ * @param host_path : path of the directory on the host
+ * @param problem : what went wrong
+ * @param ctx : user context passed to `tree_import`
+ */
+typedef void (*TreeImportCallback)(const char* host_path, TreeImportProblem problem, void* ctx);
+
+/* Summary of an import. */
+typedef struct TreeImportResult {
+    size_t imported; /** Directories added to the tree **/
+    size_t problems; /** Directories reported to the callback, not counting the contents of skipped ones **/
+} TreeImportResult;
+
+/**
+ * Mirrors the subdirectories of a host directory into the tree, below an existing directory.
+ * A pool of threads lists the host directories with large `getdents64` reads and builds the mirrored
+ * subtree off to the side, without taking any of the tree's locks. The subtree is then linked below
+ * the target directory in a single modification, so other operations see the import all at once.
+ * Only directories are imported, other entries and symbolic links are ignored.
+ * @param tree : file tree
+ * @param path : target directory in the tree
+ * @param directory : host directory to import
+ * @param num_threads : number of crawling threads, including the calling thread. 0 means one per online CPU
+ * @param report : callback for the directories with problems, may be NULL
+ * @param ctx : user context passed to `report`
+ * @param result : where to store the summary, may be NULL
+ * @return : error code / success: EINVAL for an invalid path, ENOENT if the target doesn't exist,
+ *           or the error of opening the host directory
+ */
+int tree_import(Tree* tree, const char* path, const char* directory, size_t num_threads,
+                TreeImportCallback report, void* ctx, TreeImportResult* result);
@@ -0,0 +1,388 @@
+#include "tree_internal.h"
+#include "path_utils.h"
+#include <errno.h>
+
+/*
+ * Operations of the TREE_ENGINE_INTENTION engine.
+ *
+ * Every operation locks its whole path from the root down and holds it until it finishes:
+ * the directories it reads or modifies in IS/S/IX/X and their ancestors in the matching
+ * intention mode. Operations in disjoint branches only meet in compatible intention modes,
+ * so they never wait for each other at shared ancestors.
+ *
+ * Directories are looked up under the parent's `var_protection`, which serves as a short-term
+ * latch for the subdirectory map, and the lock request is queued before the latch is released.
+ * A directory can thus only be unlinked once everybody who found it is done with it. If it was
+ * moved or removed while the request was waiting, the operation restarts from the root.
+ */
+
+/**
+ * Gets the mode in which the ancestors of a directory locked in `mode` have to be held.
+ * @param mode : mode of the directory
+ * @return : matching intention mode
+ */
+static inline LockMode intention_for(LockMode mode) {
+    return (mode == LOCK_IS || mode == LOCK_S) ? LOCK_IS : LOCK_IX;
+}
+
+/**
+ * Releases the lock of a directory, freeing it if it was removed and this was its last user.
+ * @param node : locked directory
+ * @param mode : mode the directory is held in
+ */
+static void release_node(Tree* node, LockMode mode) {
+    if (mode == LOCK_X)
+        EXCLUSIVE_END(node);
+    if (ilock_release(&node->intention, mode))
+        cow_retire(node);
+}
+
+/**
+ * Releases a directory and its ancestors, up to `stop` exclusive.
+ * @param node : locked directory
+ * @param stop : first ancestor not to release, NULL to release up to the root
+ * @param mode : mode the directory is held in, its ancestors being held in the matching intention mode
+ */
+static void unlock_ascend(Tree* node, Tree* stop, LockMode mode) {
+    LockMode intent = intention_for(mode);
+    while (node != stop) {
+        Tree* parent = node->parent; // Stable, as moving the node requires LOCK_X on it
+        release_node(node, mode);
+        mode = intent;
+        node = parent;
+    }
+}
+
+/**
+ * Locks the directories on `path` below the already held `start`: the last one in `mode`,
+ * the ones before it in the matching intention mode. Releases everything it locked on failure.
+ * @param start : locked directory the path is relative to
+ * @param path : valid path relative to `start`
+ * @param mode : mode for the last directory on the path
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @param result : where to store the last directory on the path
+ * @return : SUCCESS, ENOENT if a directory doesn't exist,
+ *           EAGAIN if a directory was moved or removed while waiting for its lock,
+ *           ETIMEDOUT if the deadline passed
+ */
+static int lock_descend(Tree* start, const char* path, LockMode mode, const struct timespec* deadline, Tree** result) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
+    LockMode intent = intention_for(mode);
+    Tree* node = start;
+    unsigned depth = 0;
+
+    while ((path = split_path(path, child_name))) {
+        LockRequest request;
+        LockMode child_mode = IS_ROOT(path) ? mode : intent; // The last node on the path gets `mode`
+        Tree* child = NULL;
+        uint64_t since = 0;
+        UNDER_MUTEX(&node->var_protection,
+            child = hmap_get(node->subdirectories, child_name);
+            if (child && !ilock_request(&child->intention, &request, child_mode))
+                since = WAIT_CLOCK();
+        );
+        if (!child) {
+            unlock_ascend(node, start, intent);
+            return ENOENT;
+        }
+        int err = ilock_wait(&child->intention, &request, deadline);
+        if (err == ETIMEDOUT && ilock_cancel(&child->intention, &request))
+            cow_retire(child); // Removed while the request was waiting
+        else if (err == EAGAIN)
+            release_node(child, child_mode);
+        if (err != SUCCESS) {
+            unlock_ascend(node, start, intent);
+            return err;
+        }
+        STATS_ACQUIRED(child, since);
+        EVENT_DEPTH(++depth);
+        EVENT_WAITED(since, EVENT_LOCK_WAIT, event_depth());
+        if (child_mode == LOCK_X) {
+            STATS_STALLED(child, since); // Waited for the operations inside the directory to drain
+            EVENT_WAITED(since, EVENT_DRAIN_WAIT, 0);
+            EXCLUSIVE_BEGIN(child);
+        }
+        node = child;
+    }
+    *result = node;
+    return SUCCESS;
+}
+
+/** Performs `intention_lock_path` **/
+static int lock_path(Tree* tree, const char* path, LockMode mode, const struct timespec* deadline, Tree** result) {
+    LockMode root_mode = IS_ROOT(path) ? mode : intention_for(mode);
+    int err;
+
+    do {
+        LockRequest request;
+        uint64_t since = ilock_request(&tree->intention, &request, root_mode) ? 0 : WAIT_CLOCK();
+        if ((err = ilock_wait(&tree->intention, &request, deadline)) != SUCCESS) {
+            ilock_cancel(&tree->intention, &request); // The root is never unlinked
+            return err;
+        }
+        STATS_ACQUIRED(tree, since);
+        EVENT_DEPTH(0);
+        EVENT_WAITED(since, EVENT_LOCK_WAIT, 0);
+        err = lock_descend(tree, path, mode, deadline, result);
+        if (err != SUCCESS)
+            release_node(tree, root_mode);
+    } while (err == EAGAIN);
+    return err;
+}
+
+int intention_lock_path(Tree* tree, const char* path, LockMode mode, const struct timespec* deadline, Tree** result) {
+    EVENT_BEGIN(started);
+    int err = lock_path(tree, path, mode, deadline, result);
+    EVENT_END(started, EVENT_PATH_WALK, 0);
+    return err;
+}
+
+void intention_unlock_path(Tree* node, LockMode mode) {
+    unlock_ascend(node, NULL, mode);
+}
+
+/* State of `intention_walk_shared`. */
+typedef struct SharedWalk {
+    char* path;         /** Path of the directory being expanded **/
+    size_t capacity;    /** Size of the `path` buffer **/
+    NodeVisitor visitor;
+    void* ctx;
+} SharedWalk;
+
+/**
+ * Reports the subdirectories of a directory held in LOCK_IS, and their subtrees, to the walk's visitor.
+ * @param node : held directory, whose path of length `length` is in the walk's buffer
+ * @param length : length of the directory's path
+ * @param walk : state of the walk
+ * @return : whether the visitor wants to go on
+ */
+static bool walk_shared(Tree* node, size_t length, SharedWalk* walk) {
+    char* names = NULL;
+    UNDER_MUTEX(&node->var_protection, names = make_map_contents_string(node->subdirectories));
+    char relative[MAX_FOLDER_NAME_LENGTH + 3], *position = NULL;
+    bool go_on = true;
+    for (char* name = strtok_r(names, ",", &position); name && go_on; name = strtok_r(NULL, ",", &position)) {
+        Tree* child = NULL;
+        snprintf(relative, sizeof(relative), "/%s/", name);
+        if (lock_descend(node, relative, LOCK_IS, NULL, &child) != SUCCESS)
+            continue; // Removed or moved away since its name was copied
+        go_on = walk->visitor(walk->path, name, child, walk->ctx);
+        if (go_on) {
+            size_t child_length = length + strlen(name) + 1;
+            reserve_buffer((void**) &walk->path, &walk->capacity, child_length + 1);
+            memcpy(walk->path + length, relative + 1, child_length - length + 1);
+            go_on = walk_shared(child, child_length, walk);
+            walk->path[length] = '\0';
+        }
+        release_node(child, LOCK_IS);
+    }
+    free(names);
+    return go_on;
+}
+
+void intention_walk_shared(Tree* start, const char* path, NodeVisitor visitor, void* ctx) {
+    SharedWalk walk = {NULL, MAX_PATH_LENGTH + 1, visitor, ctx};
+    walk.path = safe_malloc(walk.capacity);
+    strcpy(walk.path, path);
+    walk_shared(start, strlen(path), &walk);
+    free(walk.path);
+}
+
+int intention_list(Tree* tree, const char* path, const struct timespec* deadline, char** result) {
+    Tree* dir = NULL;
+    int err = intention_lock_path(tree, path, LOCK_S, deadline, &dir);
+    if (err != SUCCESS) {
+        return err; // The directory doesn't exist or the deadline passed
+    }
+
+    EVENT_BEGIN(listing);
+    *result = make_map_contents_string(dir->subdirectories); // The read
+    EVENT_END(listing, EVENT_LISTING, 0);
+
+    intention_unlock_path(dir, LOCK_S);
+    return SUCCESS;
+}
+
+int intention_create(Tree* tree, const char* path, const struct timespec* deadline) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, child_name, parent_path);
+
+    Tree* parent = NULL;
+    int err = intention_lock_path(tree, parent_path, LOCK_IX, deadline, &parent);
+    if (err != SUCCESS) {
+        return err; // The directory's parent doesn't exist or the deadline passed
+    }
+
+    if (cow_enter(tree, deadline) != SUCCESS) {
+        intention_unlock_path(parent, LOCK_IX);
+        return ETIMEDOUT; // A snapshot being taken held the modification off until the deadline
+    }
+    bool inserted = false;
+    Tree* child = node_new(parent);
+    UNDER_MUTEX(&parent->var_protection,
+        cow_preserve(parent);
+        inserted = hmap_insert(parent->subdirectories, child_name, child);
+        if (inserted) {
+            journal_append(parent, JOURNAL_CREATE, path, NULL); // Before anybody can find the directory
+            watch_notify(parent, JOURNAL_CREATE, path, NULL);
+        }
+    );
+    cow_leave(tree);
+    if (!inserted) {
+        intention_unlock_path(parent, LOCK_IX);
+        tree_free(child);
+        return EEXIST; // The directory already exists
+    }
+
+    propagate_size(parent, 1);
+    intention_unlock_path(parent, LOCK_IX);
+    return SUCCESS;
+}
+
+/**
+ * Single attempt of `intention_remove`.
+ * @return : as `tree_remove`, or EAGAIN if the attempt has to be repeated
+ */
+static int try_remove(Tree* tree, const char* path, const struct timespec* deadline) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, child_name, parent_path);
+
+    Tree *parent = NULL, *child = NULL;
+    int err = intention_lock_path(tree, parent_path, LOCK_IX, deadline, &parent);
+    if (err != SUCCESS) {
+        return err; // The directory's parent doesn't exist or the deadline passed
+    }
+
+    err = lock_descend(parent, path + strlen(parent_path) - 1, LOCK_X, deadline, &child);
+    if (err != SUCCESS) {
+        intention_unlock_path(parent, LOCK_IX);
+        return err; // The directory doesn't exist, has to be looked up again or the deadline passed
+    }
+    if (hmap_size(child->subdirectories) > 0) {
+        release_node(child, LOCK_X);
+        intention_unlock_path(parent, LOCK_IX);
+        return ENOTEMPTY; // The directory is not empty
+    }
+    if (cow_enter(tree, deadline) != SUCCESS) {
+        release_node(child, LOCK_X);
+        intention_unlock_path(parent, LOCK_IX);
+        return ETIMEDOUT; // A snapshot being taken held the modification off until the deadline
+    }
+    UNDER_MUTEX(&parent->var_protection,
+        cow_preserve(parent);
+        hmap_remove(parent->subdirectories, child_name); // The removal
+        cow_unlinked(child);
+        journal_append(parent, JOURNAL_REMOVE, path, NULL); // Before the name can be taken again
+        watch_notify(parent, JOURNAL_REMOVE, path, NULL);
+    );
+    cow_leave(tree);
+    ilock_retire(&child->intention);
+
+    propagate_size(parent, -1);
+    release_node(child, LOCK_X); // Frees the directory unless somebody still waits for it
+    intention_unlock_path(parent, LOCK_IX);
+    return SUCCESS;
+}
+
+int intention_remove(Tree* tree, const char* path, const struct timespec* deadline) {
+    int err;
+    while ((err = try_remove(tree, path, deadline)) == EAGAIN);
+    return err;
+}
+
+/**
+ * Single attempt of `intention_move`. Locks the LCA and everything above it in LOCK_IX,
+ * both parents and the paths to them from the LCA in LOCK_IX and the source in LOCK_X.
+ * Only the source's own subtree is drained; other branches below the LCA stay available.
+ * @return : as `tree_move`, or EAGAIN if the attempt has to be repeated
+ */
+static int try_move(Tree* tree, const char* s_path, const char* t_path, const struct timespec* deadline) {
+    int err = SUCCESS;
+    bool exists = false;
+    ssize_t moved = 0; // Size of the moved subtree, including its root
+    char s_name[MAX_FOLDER_NAME_LENGTH + 1], t_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char s_parent_path[MAX_PATH_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1], lca_path[MAX_PATH_LENGTH + 1];
+    Tree *s_dir = NULL, *s_parent = NULL, *t_parent = NULL, *lca = NULL;
+    make_path_to_parent(s_path, s_name, s_parent_path);
+    make_path_to_parent(t_path, t_name, t_parent_path);
+    make_path_to_LCA(s_path, t_path, lca_path);
+
+    if ((err = intention_lock_path(tree, lca_path, LOCK_IX, deadline, &lca)) != SUCCESS) {
+        return err; // Non-existent paths or the deadline passed
+    }
+    size_t index_after_lca = strlen(lca_path) - 1;
+    const char* s_rel = s_parent_path + index_after_lca;
+    const char* t_rel = t_parent_path + index_after_lca;
+    const char* name_rel = s_path + strlen(s_parent_path) - 1;
+
+    // Lock in the pre-order of the tree, which for paths is their `strcmp` order, as '/' sorts before letters
+    if (strcmp(s_parent_path, t_parent_path) == 0) {
+        if ((err = lock_descend(lca, s_rel, LOCK_IX, deadline, &s_parent)) == SUCCESS)
+            t_parent = s_parent;
+    }
+    else if (strcmp(t_parent_path, s_parent_path) < 0) {
+        if ((err = lock_descend(lca, t_rel, LOCK_IX, deadline, &t_parent)) == SUCCESS)
+            err = lock_descend(lca, s_rel, LOCK_IX, deadline, &s_parent);
+    }
+    else if (strcmp(t_parent_path, s_path) < 0) {
+        if ((err = lock_descend(lca, s_rel, LOCK_IX, deadline, &s_parent)) == SUCCESS)
+            err = lock_descend(lca, t_rel, LOCK_IX, deadline, &t_parent);
+    }
+    else {
+        if ((err = lock_descend(lca, s_rel, LOCK_IX, deadline, &s_parent)) == SUCCESS
+            && (err = lock_descend(s_parent, name_rel, LOCK_X, deadline, &s_dir)) == SUCCESS)
+            err = lock_descend(lca, t_rel, LOCK_IX, deadline, &t_parent);
+    }
+    if (err == SUCCESS && !s_dir)
+        err = lock_descend(s_parent, name_rel, LOCK_X, deadline, &s_dir);
+    if (err == SUCCESS && cow_enter(tree, deadline) != SUCCESS)
+        err = ETIMEDOUT; // A snapshot being taken held the move off until the deadline
+
+    if (err == SUCCESS) {
+        // Check if target already exists and if not, link the source under it
+        UNDER_MUTEX(&t_parent->var_protection,
+            exists = hmap_get(t_parent->subdirectories, t_name) != NULL;
+            if (!exists) {
+                cow_preserve(t_parent);
+                hmap_insert(t_parent->subdirectories, t_name, s_dir);
+            }
+        );
+        if (exists) {
+            // The source and target may be the same - nothing to move then
+            err = strcmp(s_path, t_path) == 0 ? SUCCESS : EEXIST;
+        }
+        else {
+            UNDER_MUTEX(&s_parent->var_protection,
+                cow_preserve(s_parent);
+                hmap_remove(s_parent->subdirectories, s_name);
+                journal_append(s_parent, JOURNAL_MOVE, s_path, t_path); // Before the source's name can be taken again
+                watch_notify(s_parent, JOURNAL_MOVE, s_path, t_path);
+            );
+            if (s_parent != t_parent) {
+                UNDER_MUTEX(&s_dir->var_protection,
+                    moved = s_dir->descendants + 1;
+                    s_dir->parent = t_parent;
+                );
+                propagate_size(s_parent, -moved);
+                propagate_size(t_parent, moved);
+            }
+            ilock_bump_version(&s_dir->intention); // Sends whoever waits for the source back to the root
+        }
+        cow_leave(tree);
+    }
+
+    if (s_dir)
+        release_node(s_dir, LOCK_X);
+    if (s_parent)
+        unlock_ascend(s_parent, lca, LOCK_IX);
+    if (t_parent && t_parent != s_parent)
+        unlock_ascend(t_parent, lca, LOCK_IX);
+    intention_unlock_path(lca, LOCK_IX);
+    return err;
+}
+
+int intention_move(Tree* tree, const char* s_path, const char* t_path, const struct timespec* deadline) {
+    int err;
+    while ((err = try_move(tree, s_path, t_path, deadline)) == EAGAIN);
+    return err;
+}
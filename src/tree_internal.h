@@ -0,0 +1,361 @@
+#pragma once
+
+#include "Tree.h"
+#include "HashMap.h"
+#include "intention_lock.h"
+#include "tree_stats.h"
+#include "tree_events.h"
+#include "tree_journal.h"
+#include "tree_cow.h"
+#include "tree_watch.h"
+#include "sync_utils.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Internals of the file tree shared by the modules built on top of it. */
+
+#define READER 1
+#define WRITER 0
+
+/** Generic success code **/
+#define SUCCESS 0
+/** Error code for when an ancestor is being moved to its descendant **/
+#define EMOVINGANCESTOR (-1)
+/** Error code for when a directory on the path of a modification was moved after the modification passed it.
+ *  Never returned to the user: the modification releases its locks and starts over from the root **/
+#define EPATHMOVED (-2)
+
+/** Checks if the directory represents the root **/
+#define IS_ROOT(path) (strcmp(path, "/") == 0)
+
+/** Estimated size of a `HashMap`: its eight bucket heads and its entry count, as laid out by HashMap.c **/
+#define MAP_MEMORY (8 * sizeof(void*) + sizeof(size_t))
+/** Estimated size of a map entry: pointers to its key, its value and the next entry of the bucket **/
+#define PAIR_MEMORY (3 * sizeof(void*))
+
+#if defined(TREE_STATS) || defined(TREE_EVENTS)
+/** Notes when a thread found a lock busy, for the instrumentation. 0 means it didn't wait **/
+#define WAIT_CLOCK() monotonic_ns()
+#else
+#define WAIT_CLOCK() ((uint64_t) 0)
+#endif
+
+#ifdef TREE_STATS
+/* Lock counters of a single node, see `TreeLockStats`. */
+typedef struct NodeStats {
+    atomic_uint_fast64_t acquisitions, contended, wait_ns, max_wait_ns, stall_ns;
+} NodeStats;
+#endif
+
+/* How a modification takes part in the publications of an observed tree, see `publish_begin`. */
+typedef enum PublishMode {
+    PUBLISH_NONE,      /** Not published: the tree is neither journaled nor watched **/
+    PUBLISH_SHARED,    /** Published alongside the other modifications except moves **/
+    PUBLISH_EXCLUSIVE, /** Published alone, by a move **/
+} PublishMode;
+
+/* Admits the publications of an observed tree: any number of shared ones or a single exclusive one. */
+typedef struct PublishGate {
+    pthread_mutex_t mutex;  /** Protects the fields below **/
+    pthread_cond_t changed; /** Signalled when publications end **/
+    size_t shared;          /** Shared publications in progress **/
+    bool exclusive;         /** Whether an exclusive publication is in progress **/
+    size_t waiting;         /** Exclusive publications waiting, which hold new shared ones back **/
+} PublishGate;
+
+/* State shared by all nodes of a single tree. */
+typedef struct TreeContext {
+    TreeOptions options;          /** Settings the tree was created with **/
+    size_t cpus;                  /** Number of online CPUs when the tree was created **/
+    atomic_uint_fast64_t moves;   /** Number of directories moved so far, see `path_moved` **/
+    PublishGate publish_gate;     /** Orders the modifications while the tree is observed, see `publish_begin` **/
+    TreeJournal* journal;         /** Journal of the modifications, NULL if they aren't journaled **/
+    TreeSnapshots* snapshots;     /** Point-in-time views of the tree and what they keep alive **/
+    TreeWatches* watches;         /** Subscriptions to the changes of the tree **/
+#ifdef TREE_STATS
+    pthread_mutex_t retired_lock; /** Protects `retired` **/
+    TreeLockStats retired;        /** Counters of the directories freed so far **/
+#endif
+} TreeContext;
+
+struct Tree {
+    Tree* parent;                            /** Parent directory. NULL for the root **/
+    TreeContext* context;                    /** Shared by all nodes, owned by the root **/
+    HashMap* subdirectories;                 /** HashMap of (name, node) pairs, where node is of type Tree **/
+    pthread_mutex_t var_protection;          /** Mutual exclusion for variable access **/
+    pthread_cond_t reader_cond;              /** Condition to hang readers **/
+    pthread_cond_t writer_cond;              /** Condition to hang writers **/
+    size_t r_count, w_count, r_wait, w_wait; /** Counters of active and waiting readers/writers **/
+    size_t w_spin;                           /** Writers spinning before they park, which count as waiting for the policies **/
+    size_t r_grant;                          /** Waiting readers admitted by the last writer, for TREE_LOCK_PHASE_FAIR **/
+    size_t bypass;                           /** Readers that got ahead of a waiting writer, for TREE_LOCK_BOUNDED_BYPASS **/
+    size_t spin_estimate;                    /** Moving average of the spinning which recently sufficed to get the lock **/
+    size_t descendants;                      /** Number of directories in the subtree, excluding the node itself **/
+    IntentionLock intention;                 /** Lock used instead of the counters above by TREE_ENGINE_INTENTION **/
+    NodeVersion* versions;                   /** Maps preserved for snapshots, newest first, under `var_protection` **/
+    uint64_t removed_at;                     /** Epoch of the removal if snapshots had to be kept then, 0 otherwise **/
+    uint64_t moved_at;                       /** Value of the tree's `moves` after the last move of the directory, under `var_protection` **/
+#ifdef TREE_STATS
+    NodeStats stats;                         /** Contention of the node's locks **/
+#endif
+#ifdef TREE_EVENTS
+    uint64_t exclusive_since;                /** When the current exclusive holder got the node, 0 if there is none **/
+#endif
+};
+
+#ifdef TREE_EVENTS
+/** Notes that the node has just been locked exclusively **/
+#define EXCLUSIVE_BEGIN(node) ((node)->exclusive_since = monotonic_ns())
+/** Records the EVENT_EXCLUSIVE span of a node about to be released by its exclusive holder **/
+#define EXCLUSIVE_END(node)                                                \
+    do {                                                                   \
+        if ((node)->exclusive_since != 0)                                  \
+            event_record(EVENT_EXCLUSIVE, (node)->exclusive_since, 0);    \
+        (node)->exclusive_since = 0;                                       \
+    } while (0)
+#else
+#define EXCLUSIVE_BEGIN(node) do {} while (0)
+#define EXCLUSIVE_END(node) do {} while (0)
+#endif
+
+/** Checks whether the tree uses hierarchical intention locks **/
+#define USES_INTENTION_LOCKS(tree) ((tree)->context->options.engine == TREE_ENGINE_INTENTION)
+
+/**
+ * Called by a read-type operation to lock the tree for reading.
+ * Waits for writers as the tree's lock policy dictates, spinning for a while before parking.
+ * @param tree : file tree
+ */
+void reader_lock(Tree* tree);
+
+/**
+ * As `reader_lock`, but gives up waiting at the `deadline`.
+ * @param tree : file tree
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : SUCCESS, or ETIMEDOUT without the lock
+ */
+int reader_lock_until(Tree* tree, const struct timespec* deadline);
+
+/**
+ * Called by a read-type operation to unlock the tree from reading.
+ * @param tree : file tree
+ */
+void reader_unlock(Tree* tree);
+
+/**
+ * Called by a write-type operation to lock the tree for writing.
+ * Waits if there are other active readers or writers, or readers admitted ahead of it by the lock policy,
+ * spinning for a while before parking.
+ * @param tree : file tree
+ */
+void writer_lock(Tree* tree);
+
+/**
+ * As `writer_lock`, but gives up waiting at the `deadline`.
+ * @param tree : file tree
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : SUCCESS, or ETIMEDOUT without the lock
+ */
+int writer_lock_until(Tree* tree, const struct timespec* deadline);
+
+/**
+ * Called by a write-type operation to unlock the tree from writing.
+ * @param tree : file tree
+ */
+void writer_unlock(Tree* tree);
+
+/**
+ * Adds `delta` to the descendant counters of `node` and all of its ancestors.
+ * The node mutexes are taken hand-over-hand upwards, so a subtree re-parented concurrently
+ * either carries the delta along in its own counter or passes it up its new ancestors.
+ * @param node : first node to update
+ * @param delta : change in the number of directories below `node`
+ */
+void propagate_size(Tree* node, ssize_t delta);
+
+/*
+ * With reader/writer locks an operation holds a single directory at a time on its way down, so a directory
+ * it has already passed may be moved or renamed before it reaches its target. Every move counts itself
+ * in the tree's `moves` and stamps the moved directory's `moved_at`, and the operations compare those
+ * with the count they read before setting off, starting over if their path no longer leads where it did.
+ */
+
+/**
+ * Reads the number of moves in the tree, before an operation sets off from the root.
+ * @param tree : file tree
+ * @return : value for `path_moved` and `publish_begin`
+ */
+static inline uint64_t move_epoch(Tree* tree) {
+    return atomic_load(&tree->context->moves);
+}
+
+/**
+ * Stamps a directory as moved. Called by the moves with the directory's `var_protection` held,
+ * after relinking it and before releasing the locks of its old and new parents.
+ * @param node : moved directory
+ */
+static inline void mark_moved(Tree* node) {
+    node->moved_at = atomic_fetch_add(&node->context->moves, 1) + 1;
+}
+
+/**
+ * Checks whether the directory or any of its ancestors was moved since `epoch`, which would mean
+ * that the path the directory was found by may lead elsewhere now. The node mutexes are taken
+ * hand-over-hand upwards, as in `propagate_size`.
+ * @param node : directory locked by the caller
+ * @param epoch : value of `move_epoch` from before the directory was looked up
+ * @return : whether the path of the directory may have changed
+ */
+bool path_moved(Tree* node, uint64_t epoch);
+
+/**
+ * Starts publishing a modification using reader/writer locks, once it holds the locks of every directory
+ * it changes. While the tree is journaled or watched, modifications pass the tree's publication gate
+ * and check with `path_moved` that their paths are still valid: moves one at a time, the others together,
+ * as the writer locks of their directories already order the ones that depend on each other.
+ * No directory is then moved while a modification is being journaled under its old path, and the records
+ * and events of dependent modifications are in the order they took effect.
+ * Otherwise modifications, moves included, rely on their paths having been valid when they got
+ * their locks, as checked by `get_node_since`: a move holds the common ancestor of the directories
+ * it relinks, so no other modification can rearrange them meanwhile.
+ * @param node : locked directory the path of the modification leads to, its common ancestor for a move
+ * @param epoch : value of `move_epoch` from before `node` was looked up
+ * @param move : whether the modification moves directories
+ * @param published : where to store how `publish_end` has to end the publication
+ * @return : SUCCESS, or EPATHMOVED if the modification has to start over
+ */
+int publish_begin(Tree* node, uint64_t epoch, bool move, PublishMode* published);
+
+/**
+ * Ends the publication started by `publish_begin`, after journaling the modification.
+ * @param node : any directory of the tree
+ * @param published : as set by `publish_begin`
+ */
+void publish_end(Tree* node, PublishMode published);
+
+/**
+ * Gets a pointer to the directory in the `tree` specified by the `path`.
+ * Locks the directory according to the `reader` flag.
+ * Doesn't lock the node it starts the search from if `lock_start` is false.
+ * @param tree : file tree
+ * @param path : file path
+ * @param start_locked : flag for locking the start node
+ * @param reader : flag for locking the directory as a reader or as a writer
+ * @return : pointer to the requested directory
+ */
+Tree* get_node(Tree* tree, const char* path, bool start_locked, const bool reader);
+
+/**
+ * As `get_node`, but gives up waiting for any lock at the `deadline`.
+ * Whatever it locked is released on failure, except for the start node if `start_locked` is set.
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @param result : where to store the locked directory
+ * @return : SUCCESS, ENOENT if the directory doesn't exist, ETIMEDOUT if the deadline passed
+ */
+int get_node_until(Tree* tree, const char* path, bool start_locked, const bool reader,
+                   const struct timespec* deadline, Tree** result);
+
+/**
+ * As `get_node_until` from the root of the `tree`, also storing the `move_epoch` read before the walk
+ * that found the directory, for `publish_begin`.
+ * @param epoch : where to store the number of moves
+ */
+int get_node_since(Tree* tree, const char* path, const bool reader, const struct timespec* deadline,
+                   uint64_t* epoch, Tree** result);
+
+/**
+ * Creates an empty directory belonging to the same tree as `parent`. Doesn't link it to the parent.
+ * @param parent : future parent of the directory
+ * @return : pointer to the new directory
+ */
+Tree* node_new(Tree* parent);
+
+/**
+ * Locks the directory specified by the `path` for reading its whole subtree,
+ * according to the tree's engine. With reader/writer locks only the directory itself is locked
+ * and the caller has to lock its descendants with `subtree_lock` on the way down.
+ * @param tree : file tree
+ * @param path : valid file path
+ * @return : pointer to the locked directory, NULL if it doesn't exist
+ */
+Tree* lock_subtree(Tree* tree, const char* path);
+
+/**
+ * Releases a directory locked by `lock_subtree`.
+ * @param node : locked directory
+ */
+void unlock_subtree(Tree* node);
+
+/**
+ * Locks a descendant of a directory locked by `lock_subtree`, while its parent is held.
+ * @param node : descendant to lock
+ */
+void subtree_lock(Tree* node);
+
+/**
+ * Releases a descendant locked by `subtree_lock`.
+ * @param node : locked descendant
+ */
+void subtree_unlock(Tree* node);
+
+/**
+ * Callback of `walk_subtree`: as `TreeVisitor`, but also receiving the visited directory itself.
+ * The directory is reader-locked, together with its ancestors up to the root of the walk.
+ */
+typedef bool (*NodeVisitor)(const char* path, const char* name, Tree* node, void* ctx);
+
+/**
+ * Walks the subtree of `start` depth-first, reporting every directory to the `visitor`.
+ * `start` has to be locked by `lock_subtree`. The locks of the directories on the current
+ * path are held from `start` down, so the walk can only block on descendants of the nodes it holds.
+ * @param start : locked root of the walk
+ * @param path : path of `start`
+ * @param visitor : callback receiving the visited directories
+ * @param ctx : user context passed to `visitor`
+ */
+void walk_subtree(Tree* start, const char* path, NodeVisitor visitor, void* ctx);
+
+/* Implementations of the timed operations for TREE_ENGINE_INTENTION, see `Tree.h` for their contracts. */
+
+int intention_list(Tree* tree, const char* path, const struct timespec* deadline, char** result);
+
+int intention_create(Tree* tree, const char* path, const struct timespec* deadline);
+
+int intention_remove(Tree* tree, const char* path, const struct timespec* deadline);
+
+int intention_move(Tree* tree, const char* s_path, const char* t_path, const struct timespec* deadline);
+
+/**
+ * Locks the directory specified by the `path` in `mode` and its ancestors in the matching intention mode.
+ * @param tree : file tree
+ * @param path : valid file path
+ * @param mode : mode for the directory itself
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @param result : where to store the locked directory
+ * @return : SUCCESS, ENOENT if the directory doesn't exist, ETIMEDOUT if the deadline passed
+ */
+int intention_lock_path(Tree* tree, const char* path, LockMode mode, const struct timespec* deadline, Tree** result);
+
+/**
+ * Releases a directory locked by `intention_lock_path` together with its ancestors.
+ * @param node : locked directory
+ * @param mode : mode the directory is held in
+ */
+void intention_unlock_path(Tree* node, LockMode mode);
+
+/**
+ * Walks the subtree of `start` as `walk_subtree` does, for the TREE_ENGINE_INTENTION engine,
+ * holding every directory on the current path in LOCK_IS instead of the whole subtree in LOCK_S.
+ * Modifications inside the subtree go on meanwhile, so each directory is seen as it is when visited,
+ * not as the whole subtree was at a single point in time. The visitor receives the directory in LOCK_IS
+ * and has to read its subdirectory map under `var_protection`.
+ * @param start : root of the walk, held in LOCK_IS
+ * @param path : path of `start`
+ * @param visitor : callback receiving the visited directories
+ * @param ctx : user context passed to `visitor`
+ */
+void intention_walk_shared(Tree* start, const char* path, NodeVisitor visitor, void* ctx);
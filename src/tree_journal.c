@@ -0,0 +1,555 @@
+#include "tree_journal.h"
+#include "tree_internal.h"
+#include "tree_snapshot.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Size of the journal's header **/
+#define JOURNAL_HEADER (sizeof(JOURNAL_MAGIC) - 1 + sizeof(uint64_t))
+
+struct TreeJournal {
+    Tree* tree;              /** Journaled tree **/
+    char* filename;          /** Path of the journal file **/
+    int fd;                  /** The journal file, open for appending **/
+    pthread_mutex_t mutex;   /** Protects the fields below **/
+    pthread_cond_t flushed;  /** Signalled whenever a batch of records gets on disk **/
+    unsigned char* pending;  /** Records appended since the last batch was taken **/
+    size_t size, capacity;   /** Bytes used and allocated in `pending` **/
+    unsigned char* batch;    /** Records being written by the flushing thread **/
+    size_t batch_capacity;   /** Bytes allocated in `batch` **/
+    uint64_t appended;       /** Sequence number of the last appended record **/
+    uint64_t durable;        /** Sequence number of the last record on disk **/
+    bool flushing;           /** Whether a thread is writing a batch or the file is being compacted **/
+    int error;               /** Error of the first failed write or sync, SUCCESS if none failed **/
+};
+
+/** Journal of the record last appended by the calling thread, NULL if it has nothing to wait for **/
+static _Thread_local TreeJournal* local_journal = NULL;
+/** Sequence number of that record **/
+static _Thread_local uint64_t local_sequence = 0;
+
+/**
+ * Computes the checksum of a record.
+ * @param record : record followed by its paths, not necessarily aligned
+ * @param length : length of the whole record
+ * @return : FNV-1a hash of everything after the `checksum` field
+ */
+static uint32_t record_checksum(const unsigned char* record, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = sizeof(uint32_t); i < length; i++)
+        hash = (hash ^ record[i]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Checks a record read from a journal file.
+ * @param data : start of the record
+ * @param available : bytes left in the file from `data`
+ * @param sequence : sequence number the record should have
+ * @return : whether the record is complete and intact
+ */
+static bool record_valid(const unsigned char* data, size_t available, uint64_t sequence) {
+    JournalRecord record;
+    if (available < sizeof(record))
+        return false;
+    memcpy(&record, data, sizeof(record));
+    return record.length == sizeof(record) + record.path_len + record.target_len && record.length <= available
+        && record.sequence == sequence && record.path_len <= MAX_PATH_LENGTH && record.target_len <= MAX_PATH_LENGTH
+        && record.op >= JOURNAL_CREATE && record.op <= JOURNAL_COMMIT && (record.op == JOURNAL_MOVE) == (record.target_len > 0)
+        && (record.op >= JOURNAL_BEGIN) == (record.path_len == 0)
+        && record_checksum(data, record.length) == record.checksum;
+}
+
+/**
+ * Writes a whole buffer to a file descriptor.
+ * @param fd : descriptor open for writing
+ * @param data : bytes to write
+ * @param size : their number
+ * @return : error code / success
+ */
+static int write_all(int fd, const void* data, size_t size) {
+    for (size_t written = 0; written < size;) {
+        ssize_t n = write(fd, (const unsigned char*) data + written, size - written);
+        if (n < 0 && errno != EINTR)
+            return errno;
+        if (n > 0)
+            written += n;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Reads a whole file.
+ * @param fd : descriptor of the file, at its start
+ * @param data : where to store the heap-allocated contents
+ * @param size : where to store their size
+ * @return : error code / success
+ */
+static int read_all(int fd, unsigned char** data, size_t* size) {
+    size_t capacity = 4096;
+    *data = safe_malloc(capacity);
+    *size = 0;
+    while (true) {
+        if (*size == capacity)
+            *data = safe_realloc(*data, capacity *= 2);
+        ssize_t n = read(fd, *data + *size, capacity - *size);
+        if (n == 0)
+            return SUCCESS;
+        if (n < 0 && errno != EINTR) {
+            free(*data);
+            return errno;
+        }
+        if (n > 0)
+            *size += n;
+    }
+}
+
+/**
+ * Syncs the directory holding a file, making a rename or creation of the file durable.
+ * @param filename : path of the file
+ * @return : error code / success
+ */
+static int sync_directory(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    char* directory = slash ? strndup(filename, slash == filename ? 1 : (size_t) (slash - filename)) : strdup(".");
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    free(directory);
+    if (fd < 0)
+        return errno;
+    int err = fsync(fd) == 0 ? SUCCESS : errno;
+    close(fd);
+    return err;
+}
+
+/**
+ * Finds the intact records of a journal file, leaving out a group whose JOURNAL_COMMIT is missing.
+ * @param data : contents of the file
+ * @param size : their size
+ * @param base : where to store the position of the last checkpoint
+ * @param last : where to store the sequence number of the last intact record, `base` if there is none
+ * @return : length of the intact part of the file, 0 if it isn't a journal
+ */
+static size_t scan(const unsigned char* data, size_t size, uint64_t* base, uint64_t* last) {
+    if (size < JOURNAL_HEADER || memcmp(data, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) - 1) != 0)
+        return 0;
+    memcpy(base, data + sizeof(JOURNAL_MAGIC) - 1, sizeof(*base));
+    *last = *base;
+
+    size_t offset = JOURNAL_HEADER, intact = offset;
+    uint64_t sequence = *base;
+    bool grouped = false;
+    while (record_valid(data + offset, size - offset, sequence + 1)) {
+        uint32_t length;
+        uint8_t op;
+        memcpy(&length, data + offset + offsetof(JournalRecord, length), sizeof(length));
+        memcpy(&op, data + offset + offsetof(JournalRecord, op), sizeof(op));
+        if (grouped ? op == JOURNAL_BEGIN : op == JOURNAL_COMMIT)
+            break; // Groups don't nest, so the file can't go on from here
+        grouped = grouped ? op != JOURNAL_COMMIT : op == JOURNAL_BEGIN;
+        offset += length;
+        sequence++;
+        if (!grouped) {
+            intact = offset;
+            *last = sequence;
+        }
+    }
+    return intact;
+}
+
+/**
+ * Creates a file holding just a journal header, open for appending.
+ * @param filename : path of the file, replaced if it exists
+ * @param base : position of the last checkpoint
+ * @param fd : where to store the descriptor
+ * @return : error code / success
+ */
+static int create_journal_file(const char* filename, uint64_t base, int* fd) {
+    unsigned char header[JOURNAL_HEADER];
+    memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) - 1);
+    memcpy(header + sizeof(JOURNAL_MAGIC) - 1, &base, sizeof(base));
+
+    *fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (*fd < 0)
+        return errno;
+    int err = write_all(*fd, header, sizeof(header));
+    if (err == SUCCESS && fsync(*fd) != 0)
+        err = errno;
+    if (err != SUCCESS) {
+        close(*fd);
+        *fd = -1;
+    }
+    return err;
+}
+
+int tree_journal_open(Tree* tree, const char* filename, TreeJournal** result) {
+    uint64_t base = 0, last = 0;
+    int err = SUCCESS, fd = open(filename, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT)
+        return errno;
+
+    if (fd < 0) {
+        if ((err = create_journal_file(filename, 0, &fd)) != SUCCESS || (err = sync_directory(filename)) != SUCCESS) {
+            if (fd >= 0)
+                close(fd);
+            return err;
+        }
+    }
+    else {
+        unsigned char* data = NULL;
+        size_t size = 0, intact = 0;
+        if ((err = read_all(fd, &data, &size)) != SUCCESS) {
+            close(fd);
+            return err;
+        }
+        intact = scan(data, size, &base, &last);
+        free(data);
+        if (intact == 0) {
+            close(fd);
+            return EINVAL; // Not a journal
+        }
+        if (intact < size && (ftruncate(fd, intact) != 0 || fsync(fd) != 0)) {
+            err = errno; // Cutting off the torn tail failed
+            close(fd);
+            return err;
+        }
+    }
+
+    TreeJournal* journal = safe_calloc(1, sizeof(TreeJournal));
+    journal->tree = tree;
+    journal->filename = strdup(filename);
+    journal->fd = fd;
+    PTHREAD_CHECK(pthread_mutex_init(&journal->mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&journal->flushed, NULL));
+    journal->capacity = journal->batch_capacity = 4096;
+    journal->pending = safe_malloc(journal->capacity);
+    journal->batch = safe_malloc(journal->batch_capacity);
+    journal->appended = journal->durable = last;
+
+    tree->context->journal = journal;
+    *result = journal;
+    return SUCCESS;
+}
+
+/**
+ * Waits until a record is on disk, writing the pending records if no other thread is doing it.
+ * The caller has to hold the journal's mutex.
+ * @param journal : the journal
+ * @param sequence : sequence number of the record
+ * @return : SUCCESS once the record is on disk, the journal's error if it never will be
+ */
+static int flush_until(TreeJournal* journal, uint64_t sequence) {
+    while (journal->durable < sequence && journal->error == SUCCESS) {
+        if (journal->flushing) {
+            PTHREAD_CHECK(pthread_cond_wait(&journal->flushed, &journal->mutex));
+            continue;
+        }
+
+        // Take everything appended so far as one batch, letting others append to a fresh buffer meanwhile
+        unsigned char* batch = journal->pending;
+        size_t size = journal->size, capacity = journal->capacity;
+        uint64_t last = journal->appended;
+        journal->pending = journal->batch;
+        journal->capacity = journal->batch_capacity;
+        journal->size = 0;
+        journal->flushing = true;
+        PTHREAD_CHECK(pthread_mutex_unlock(&journal->mutex));
+
+        int err = write_all(journal->fd, batch, size);
+        if (err == SUCCESS && fdatasync(journal->fd) != 0)
+            err = errno;
+
+        PTHREAD_CHECK(pthread_mutex_lock(&journal->mutex));
+        journal->batch = batch;
+        journal->batch_capacity = capacity;
+        if (err == SUCCESS)
+            journal->durable = last;
+        else
+            journal->error = err; // The file may end with a part of the batch, nothing can follow it
+        journal->flushing = false;
+        PTHREAD_CHECK(pthread_cond_broadcast(&journal->flushed));
+    }
+    return journal->durable >= sequence ? SUCCESS : journal->error;
+}
+
+/**
+ * Adds a record to the pending ones. The caller has to hold the journal's mutex.
+ * @param journal : journal that hasn't stopped
+ * @param op : the modification
+ * @param path : its path, NULL for a group marker
+ * @param target : target of a move, NULL otherwise
+ */
+static void append_record(TreeJournal* journal, JournalOp op, const char* path, const char* target) {
+    JournalRecord record = {0};
+    record.path_len = path ? (uint16_t) strlen(path) : 0;
+    record.target_len = target ? (uint16_t) strlen(target) : 0;
+    record.length = sizeof(record) + record.path_len + record.target_len;
+    record.sequence = ++journal->appended;
+    record.op = (uint8_t) op;
+
+    while (journal->size + record.length > journal->capacity)
+        journal->pending = safe_realloc(journal->pending, journal->capacity *= 2);
+    unsigned char* stored = journal->pending + journal->size;
+    memcpy(stored + sizeof(record), path, record.path_len);
+    memcpy(stored + sizeof(record) + record.path_len, target, record.target_len);
+    memcpy(stored, &record, sizeof(record));
+    record.checksum = record_checksum(stored, record.length);
+    memcpy(stored, &record.checksum, sizeof(record.checksum));
+    journal->size += record.length;
+}
+
+void journal_append(Tree* node, JournalOp op, const char* path, const char* target) {
+    JournalEntry entry = {op, path, target};
+    journal_append_group(node, &entry, 1);
+}
+
+void journal_append_group(Tree* node, const JournalEntry* entries, size_t count) {
+    TreeJournal* journal = node->context->journal;
+    if (!journal || count == 0)
+        return;
+
+    uint64_t sequence;
+    UNDER_MUTEX(&journal->mutex,
+        if (journal->error == SUCCESS) { // Otherwise nothing is written and the wait reports the error
+            if (count > 1)
+                append_record(journal, JOURNAL_BEGIN, NULL, NULL);
+            for (size_t i = 0; i < count; i++)
+                append_record(journal, entries[i].op, entries[i].path, entries[i].target);
+            if (count > 1)
+                append_record(journal, JOURNAL_COMMIT, NULL, NULL);
+            sequence = journal->appended;
+        }
+        else {
+            sequence = journal->appended + 1;
+        }
+    );
+    local_journal = journal;
+    local_sequence = sequence;
+}
+
+int journal_wait(void) {
+    TreeJournal* journal = local_journal;
+    if (!journal)
+        return SUCCESS;
+
+    int err;
+    local_journal = NULL;
+    UNDER_MUTEX(&journal->mutex, err = flush_until(journal, local_sequence));
+    return err;
+}
+
+void tree_journal_close(TreeJournal* journal) {
+    UNDER_MUTEX(&journal->mutex, flush_until(journal, journal->appended));
+    journal->tree->context->journal = NULL;
+
+    close(journal->fd);
+    PTHREAD_CHECK(pthread_cond_destroy(&journal->flushed));
+    PTHREAD_CHECK(pthread_mutex_destroy(&journal->mutex));
+    free(journal->pending);
+    free(journal->batch);
+    free(journal->filename);
+    free(journal);
+}
+
+/* A checkpoint in progress. */
+typedef struct Checkpoint {
+    TreeJournal* journal; /** Journal of the saved tree **/
+    uint64_t position;    /** Position stored in the image **/
+} Checkpoint;
+
+/**
+ * Gets the position a checkpoint image corresponds to. Called by `snapshot_save` while no modification is in progress.
+ * @param ctx : the checkpoint
+ * @return : sequence number of the last appended record
+ */
+static uint64_t checkpoint_position(void* ctx) {
+    Checkpoint* checkpoint = ctx;
+    UNDER_MUTEX(&checkpoint->journal->mutex, checkpoint->position = checkpoint->journal->appended);
+    return checkpoint->position;
+}
+
+/**
+ * Replaces the journal file with one starting at a checkpoint. The records after the checkpoint
+ * that are already on disk are copied over, the pending ones go to the new file with the next batch.
+ * The records the checkpoint covers are written out first, so the new file continues right after them.
+ * @param journal : the journal
+ * @param position : position of the checkpoint
+ * @return : error code / success
+ */
+static int compact(TreeJournal* journal, uint64_t position) {
+    // Get the covered records on disk and keep the file to ourselves, so that it holds exactly the records up to `durable`
+    int err;
+    UNDER_MUTEX(&journal->mutex,
+        if ((err = flush_until(journal, position)) == SUCCESS) {
+            while (journal->flushing)
+                PTHREAD_CHECK(pthread_cond_wait(&journal->flushed, &journal->mutex));
+            journal->flushing = true;
+        }
+    );
+    if (err != SUCCESS)
+        return err; // The journal can't continue the image
+
+    size_t length = strlen(journal->filename);
+    char* temporary = safe_malloc(length + sizeof(".tmp"));
+    memcpy(temporary, journal->filename, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+    unsigned char* data = NULL;
+    size_t size = 0, offset = JOURNAL_HEADER;
+    uint64_t base = 0, last = 0, sequence = 0;
+    int fd = -1, old = open(journal->filename, O_RDONLY | O_CLOEXEC);
+    if (old < 0) {
+        err = errno;
+        goto done;
+    }
+    err = read_all(old, &data, &size);
+    close(old);
+    if (err != SUCCESS)
+        goto done;
+    if ((size = scan(data, size, &base, &last)) == 0) {
+        err = EINVAL;
+        goto done;
+    }
+    sequence = base;
+    while (sequence < position && offset < size) {
+        uint32_t record_length;
+        memcpy(&record_length, data + offset + offsetof(JournalRecord, length), sizeof(record_length));
+        offset += record_length;
+        sequence++;
+    }
+
+    if ((err = create_journal_file(temporary, position, &fd)) != SUCCESS)
+        goto done;
+    if ((err = write_all(fd, data + offset, size - offset)) != SUCCESS || (fsync(fd) != 0 && (err = errno))
+        || (rename(temporary, journal->filename) != 0 && (err = errno))) {
+        close(fd);
+        unlink(temporary);
+        goto done;
+    }
+    err = sync_directory(journal->filename);
+    close(journal->fd);
+    journal->fd = fd;
+
+done:
+    UNDER_MUTEX(&journal->mutex,
+        journal->flushing = false;
+        PTHREAD_CHECK(pthread_cond_broadcast(&journal->flushed));
+    );
+    free(data);
+    free(temporary);
+    return err;
+}
+
+int tree_journal_checkpoint(TreeJournal* journal, const char* snapshot) {
+    size_t length = strlen(snapshot);
+    char* temporary = safe_malloc(length + sizeof(".tmp"));
+    memcpy(temporary, snapshot, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+    Checkpoint checkpoint = {journal, 0};
+    int err, fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        err = errno;
+        free(temporary);
+        return err;
+    }
+    err = snapshot_save(journal->tree, fd, checkpoint_position, &checkpoint);
+    if (err == SUCCESS && fsync(fd) != 0)
+        err = errno;
+    close(fd);
+    if (err == SUCCESS && rename(temporary, snapshot) != 0)
+        err = errno;
+    if (err != SUCCESS) {
+        unlink(temporary);
+        free(temporary);
+        return err;
+    }
+    free(temporary);
+    if ((err = sync_directory(snapshot)) != SUCCESS)
+        return err;
+
+    return compact(journal, checkpoint.position); // The image is durable, so the records it covers can go
+}
+
+/**
+ * Applies a journal record to a tree being recovered.
+ * @param tree : the tree
+ * @param data : the record, checked by `record_valid`
+ * @return : whether the modification succeeded again
+ */
+static bool replay(Tree* tree, const unsigned char* data) {
+    JournalRecord record;
+    char path[MAX_PATH_LENGTH + 1], target[MAX_PATH_LENGTH + 1];
+    memcpy(&record, data, sizeof(record));
+    memcpy(path, data + sizeof(record), record.path_len);
+    path[record.path_len] = '\0';
+    memcpy(target, data + sizeof(record) + record.path_len, record.target_len);
+    target[record.target_len] = '\0';
+
+    switch (record.op) {
+        case JOURNAL_CREATE:
+            return tree_create(tree, path) == SUCCESS;
+        case JOURNAL_REMOVE:
+            return tree_remove(tree, path) == SUCCESS;
+        case JOURNAL_MOVE:
+            return tree_move(tree, path, target) == SUCCESS;
+        default:
+            return true; // The group markers change nothing
+    }
+}
+
+int tree_recover(const char* snapshot, const char* journal, const TreeOptions* options, Tree** result) {
+    Tree* tree = NULL;
+    uint64_t position = 0;
+    int err = SUCCESS, fd = snapshot ? open(snapshot, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 && snapshot && errno != ENOENT)
+        return errno;
+    if (fd >= 0) {
+        err = snapshot_load(fd, options, &tree, &position);
+        close(fd);
+        if (err != SUCCESS)
+            return err;
+    }
+    else {
+        tree = tree_new_with_options(options);
+    }
+
+    fd = journal ? open(journal, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 && journal && errno != ENOENT) {
+        err = errno;
+        tree_free(tree);
+        return err;
+    }
+    if (fd >= 0) {
+        unsigned char* data = NULL;
+        size_t size = 0;
+        uint64_t base = 0, last = 0, sequence = 0;
+        err = read_all(fd, &data, &size);
+        close(fd);
+        if (err != SUCCESS) {
+            tree_free(tree);
+            return err;
+        }
+        size = scan(data, size, &base, &last);
+        if (size == 0 || base > position)
+            err = EINVAL; // Not a journal, or the records right after the image are gone
+        for (size_t offset = JOURNAL_HEADER; err == SUCCESS && offset < size; sequence++) {
+            uint32_t length;
+            memcpy(&length, data + offset + offsetof(JournalRecord, length), sizeof(length));
+            if (base + sequence + 1 > position && !replay(tree, data + offset))
+                err = EINVAL; // The journal doesn't belong to the image
+            offset += length;
+        }
+        free(data);
+        if (err != SUCCESS) {
+            tree_free(tree);
+            return err;
+        }
+    }
+
+    *result = tree;
+    return SUCCESS;
+}
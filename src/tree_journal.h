@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Tree.h"
+#include <stdint.h>
+
+/*
+ * Write-ahead journal of the successful modifications of a tree, for recovering it after a restart.
+ *
+ * A modification appends its record while it still holds its locks, so the records of dependent
+ * modifications are in the order they took effect, and then waits for the record to reach the disk
+ * after releasing them. Records of concurrent modifications are written and synced together:
+ * the first waiter writes everything appended so far with a single fdatasync, while the others wait
+ * for it, and records appended in the meantime go out with the next batch.
+ * Records carry the paths the modifications found their directories at: the modifications check that
+ * no move has displaced their directories meanwhile, and moves publish their records while no other
+ * modification does, see `publish_begin` in `tree_internal.h`.
+ *
+ * If writing or syncing a batch fails, the journal stops: no more records are written, and every
+ * modification waiting for a record that isn't on disk returns the error of the failed write,
+ * e.g. EIO or ENOSPC. Such a modification has taken effect in the tree, but may be lost by a restart.
+ * So do all the modifications after it, until the journal is closed. A checkpoint of a stopped journal
+ * returns its error too.
+ *
+ * A checkpoint saves an image of the tree (see `tree_snapshot.h`) storing the journal position
+ * it corresponds to, and drops the records it covers from the journal. Recovery loads the image
+ * and replays the records after its position.
+ *
+ * A journal file starts with JOURNAL_MAGIC and the position of its last checkpoint as a 64-bit integer,
+ * followed by `JournalRecord`s, each with its `path_len` + `target_len` bytes of paths.
+ * Integers are stored in the byte order of the writing machine. A torn record at the end, left by a crash,
+ * is ignored by recovery and cut off when the journal is opened.
+ *
+ * The records of a transaction are appended together, between a JOURNAL_BEGIN and a JOURNAL_COMMIT record
+ * without paths, see `journal_append_group`. A crash may leave only a part of such a group on disk:
+ * recovery ignores, and opening cuts off, a group without its JOURNAL_COMMIT, so that a transaction
+ * is recovered either whole or not at all.
+ */
+
+/** First bytes of a journal **/
+#define JOURNAL_MAGIC "FTJRNL01"
+
+/* Journaled modifications. */
+typedef enum JournalOp {
+    JOURNAL_CREATE = 1,
+    JOURNAL_REMOVE,
+    JOURNAL_MOVE,
+    JOURNAL_BEGIN,  /** Start of the records of a transaction **/
+    JOURNAL_COMMIT, /** End of the records of a transaction **/
+} JournalOp;
+
+/* A modification journaled as a part of a group. */
+typedef struct JournalEntry {
+    JournalOp op;       /** The modification **/
+    const char* path;   /** Its path **/
+    const char* target; /** Target of a move, NULL otherwise **/
+} JournalEntry;
+
+/* Fixed-size part of a journal record. */
+typedef struct JournalRecord {
+    uint32_t checksum;   /** FNV-1a hash of the rest of the record, paths included **/
+    uint32_t length;     /** Length of the whole record in bytes **/
+    uint64_t sequence;   /** Position of the record: 1 + the position of the previous one **/
+    uint16_t path_len;   /** Length of the path, which follows the record **/
+    uint16_t target_len; /** Length of the move target, which follows the path **/
+    uint8_t op;          /** Journaled modification, as `JournalOp` **/
+    uint8_t padding[3];  /** Zeros **/
+} JournalRecord;
+
+typedef struct TreeJournal TreeJournal;
+
+/**
+ * Opens a journal file, creating it if needed, and starts journaling the modifications of the tree.
+ * The tree has to be in the state the journal describes: empty for a new journal, or recovered from it
+ * by `tree_recover`. Has to be called before the tree is shared.
+ * @param tree : file tree
+ * @param filename : path of the journal file
+ * @param result : where to store the journal
+ * @return : error code / success, EINVAL if the file isn't a journal
+ */
+int tree_journal_open(Tree* tree, const char* filename, TreeJournal** result);
+
+/**
+ * Stops journaling, once every record is on disk or the journal has stopped, and closes the journal.
+ * Has to be called while no modification of the tree is running.
+ * @param journal : journal to close
+ */
+void tree_journal_close(TreeJournal* journal);
+
+/**
+ * Saves an image of the tree and drops the records it covers from the journal. The image is written
+ * next to `snapshot` first and renamed over it once it's on disk, so a crash leaves the old image intact.
+ * Modifications of the tree wait while the image is being encoded, as in `tree_save`.
+ * Only one checkpoint may run at a time.
+ * @param journal : journal of the tree
+ * @param snapshot : path of the image
+ * @return : error code / success
+ */
+int tree_journal_checkpoint(TreeJournal* journal, const char* snapshot);
+
+/**
+ * Rebuilds a tree from its latest checkpoint image and the journal records after it.
+ * @param snapshot : path of the image, NULL or a missing file to start from an empty tree
+ * @param journal : path of the journal, NULL or a missing file if there is none
+ * @param options : settings of the new tree, NULL for the defaults
+ * @param result : where to store the new tree
+ * @return : error code / success, EINVAL if the files are corrupted or don't belong together
+ */
+int tree_recover(const char* snapshot, const char* journal, const TreeOptions* options, Tree** result);
+
+/**
+ * Appends a record of a successful modification if the tree is journaled.
+ * Called by the modifications while they hold their locks.
+ * @param node : any directory of the tree
+ * @param op : the modification
+ * @param path : its path
+ * @param target : target of a move, NULL otherwise
+ */
+void journal_append(Tree* node, JournalOp op, const char* path, const char* target);
+
+/**
+ * Appends the records of modifications that have to be recovered all or none, if the tree is journaled.
+ * The records go out in a single batch, enclosed in JOURNAL_BEGIN and JOURNAL_COMMIT, and no record
+ * of another modification comes between them. A single modification is appended as by `journal_append`.
+ * Called by transactions while they hold their locks.
+ * @param node : any directory of the tree
+ * @param entries : the modifications, in order
+ * @param count : their number
+ */
+void journal_append_group(Tree* node, const JournalEntry* entries, size_t count);
+
+/**
+ * Waits until the record last appended by the calling thread is on disk, if there is one.
+ * Called by the modifications after releasing their locks.
+ * @return : SUCCESS, or the error of the failed write if the record never gets on disk
+ */
+int journal_wait(void);
@@ -0,0 +1,220 @@
+#include "tree_parallel.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/** Initial number of slots in a worker's deque **/
+#define DEQUE_INITIAL_CAPACITY 64
+
+/** A locked directory waiting to be expanded **/
+typedef struct Task {
+    Tree* node;   /** Directory, locked by the traversal **/
+    size_t depth; /** Depth of the directory relative to the root of the traversal **/
+} Task;
+
+/** Double-ended queue of tasks. The owner works at the bottom, thieves take from the top **/
+typedef struct Deque {
+    pthread_mutex_t lock; /** Mutual exclusion between the owner and the thieves **/
+    Task* tasks;          /** Ring buffer of tasks **/
+    size_t capacity;      /** Number of slots in `tasks` **/
+    size_t top;           /** Index of the oldest task **/
+    size_t size;          /** Number of tasks in the deque **/
+} Deque;
+
+typedef struct Worker Worker;
+
+/** State shared by all workers of a single traversal **/
+typedef struct Engine {
+    Worker* workers;       /** Array of all workers **/
+    size_t num_workers;    /** Size of `workers` **/
+    atomic_size_t pending; /** Number of tasks pushed, but not yet expanded **/
+} Engine;
+
+struct Worker {
+    Engine* engine;        /** Traversal the worker belongs to **/
+    Deque deque;           /** Tasks owned by the worker **/
+    size_t victim;         /** Next worker to steal from **/
+    TreeAggregate partial; /** Reductions over the tasks expanded by the worker **/
+};
+
+static void deque_init(Deque* deque) {
+    PTHREAD_CHECK(pthread_mutex_init(&deque->lock, NULL));
+    deque->tasks = safe_malloc(DEQUE_INITIAL_CAPACITY * sizeof(Task));
+    deque->capacity = DEQUE_INITIAL_CAPACITY;
+    deque->top = deque->size = 0;
+}
+
+static void deque_destroy(Deque* deque) {
+    PTHREAD_CHECK(pthread_mutex_destroy(&deque->lock));
+    free(deque->tasks);
+}
+
+/**
+ * Pushes a task at the bottom of the `deque`, growing it if needed.
+ * @param deque : deque of the calling worker
+ * @param task : task to push
+ */
+static void deque_push(Deque* deque, Task task) {
+    UNDER_MUTEX(&deque->lock,
+        if (deque->size == deque->capacity) {
+            Task* tasks = safe_malloc(2 * deque->capacity * sizeof(Task));
+            for (size_t i = 0; i < deque->size; i++)
+                tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+            free(deque->tasks);
+            deque->tasks = tasks;
+            deque->capacity *= 2;
+            deque->top = 0;
+        }
+        deque->tasks[(deque->top + deque->size) % deque->capacity] = task;
+        deque->size++;
+    );
+}
+
+/**
+ * Takes a task from the `deque`.
+ * @param deque : any worker's deque
+ * @param task : where to store the task
+ * @param steal : whether to take the oldest task (as a thief) or the newest one (as the owner)
+ * @return : false if the deque was empty
+ */
+static bool deque_take(Deque* deque, Task* task, bool steal) {
+    bool found = false;
+    UNDER_MUTEX(&deque->lock,
+        if (deque->size > 0) {
+            found = true;
+            deque->size--;
+            if (steal) {
+                *task = deque->tasks[deque->top];
+                deque->top = (deque->top + 1) % deque->capacity;
+            }
+            else {
+                *task = deque->tasks[(deque->top + deque->size) % deque->capacity];
+            }
+        }
+    );
+    return found;
+}
+
+/**
+ * Gets the fan-out histogram bucket of a directory.
+ * @param fanout : number of the directory's subdirectories
+ * @return : index of the bucket
+ */
+static inline size_t fanout_bucket(size_t fanout) {
+    size_t bucket = 0;
+    while (fanout > 0 && bucket < TREE_FANOUT_BUCKETS - 1) {
+        fanout >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * Expands a task: locks and pushes all of its subdirectories, then reduces and unlocks it.
+ * The children are locked while the parent is still held, as in `get_node`.
+ * The root of the traversal stays locked until all workers finish.
+ * @param worker : worker owning the task
+ * @param task : task to expand
+ */
+static void expand(Worker* worker, Task task) {
+    const char* name = NULL;
+    void* value = NULL;
+    HashMap* subdirectories = task.node->subdirectories;
+    HashMapIterator it = hmap_iterator(subdirectories);
+
+    while (hmap_next(subdirectories, &it, &name, &value)) {
+        Tree* child = value;
+        subtree_lock(child);
+        atomic_fetch_add(&worker->engine->pending, 1);
+        deque_push(&worker->deque, (Task) {child, task.depth + 1});
+    }
+
+    worker->partial.node_count++;
+    if (task.depth > worker->partial.max_depth)
+        worker->partial.max_depth = task.depth;
+    worker->partial.fanout_histogram[fanout_bucket(hmap_size(subdirectories))]++;
+
+    if (task.depth > 0)
+        subtree_unlock(task.node);
+    atomic_fetch_sub(&worker->engine->pending, 1);
+}
+
+/**
+ * Tries to steal a task from other workers, visiting them round-robin.
+ * @param worker : stealing worker
+ * @param task : where to store the stolen task
+ * @return : false if all deques were empty
+ */
+static bool steal(Worker* worker, Task* task) {
+    Engine* engine = worker->engine;
+    for (size_t i = 0; i < engine->num_workers; i++) {
+        Worker* victim = &engine->workers[worker->victim];
+        worker->victim = (worker->victim + 1) % engine->num_workers;
+        if (victim != worker && deque_take(&victim->deque, task, true))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Worker thread: expands its own tasks depth-first and steals when out of work,
+ * until no task is left anywhere.
+ * @param data : the worker
+ * @return : NULL
+ */
+static void* worker_run(void* data) {
+    Worker* worker = data;
+    Task task;
+
+    while (atomic_load(&worker->engine->pending) > 0) {
+        if (deque_take(&worker->deque, &task, false) || steal(worker, &task))
+            expand(worker, task);
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+int tree_aggregate(Tree* tree, const char* path, size_t num_threads, TreeAggregate* result) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t) online : 1;
+    }
+
+    Tree* dir = lock_subtree(tree, path);
+    if (!dir) {
+        return ENOENT; // The directory doesn't exist
+    }
+
+    Engine engine = {.num_workers = num_threads};
+    engine.workers = safe_calloc(num_threads, sizeof(Worker));
+    atomic_init(&engine.pending, 1);
+    for (size_t i = 0; i < num_threads; i++) {
+        engine.workers[i].engine = &engine;
+        engine.workers[i].victim = (i + 1) % num_threads;
+        deque_init(&engine.workers[i].deque);
+    }
+    deque_push(&engine.workers[0].deque, (Task) {dir, 0});
+
+    run_parallel(worker_run, engine.workers, num_threads, sizeof(Worker));
+
+    memset(result, 0, sizeof(TreeAggregate));
+    for (size_t i = 0; i < num_threads; i++) {
+        TreeAggregate* partial = &engine.workers[i].partial;
+        result->node_count += partial->node_count;
+        if (partial->max_depth > result->max_depth)
+            result->max_depth = partial->max_depth;
+        for (size_t b = 0; b < TREE_FANOUT_BUCKETS; b++)
+            result->fanout_histogram[b] += partial->fanout_histogram[b];
+        deque_destroy(&engine.workers[i].deque);
+    }
+    free(engine.workers);
+    unlock_subtree(dir);
+    return SUCCESS;
+}
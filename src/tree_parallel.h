@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Tree.h"
+#include <stddef.h>
+
+/** Number of buckets in the fan-out histogram of `TreeAggregate` **/
+#define TREE_FANOUT_BUCKETS 16
+
+/* Reductions computed over a subtree by `tree_aggregate`. */
+typedef struct TreeAggregate {
+    size_t node_count;                            /** Number of directories in the subtree, including its root **/
+    size_t max_depth;                             /** Depth of the deepest directory, the root having depth 0 **/
+    size_t fanout_histogram[TREE_FANOUT_BUCKETS]; /** Bucket 0 counts leaves, bucket i > 0 counts directories
+                                                      with [2^(i-1), 2^i) subdirectories. The last bucket is open-ended **/
+} TreeAggregate;
+
+/**
+ * Scans the subtree rooted at `path` with a pool of worker threads and reduces it into `result`.
+ * Every worker owns a work-stealing deque of directories left to expand; idle workers steal
+ * the oldest entries of the others. Directories are locked as in `tree_walk`.
+ * Subtrees moved while the scan is in progress may be observed at their old or new location.
+ * @param tree : file tree
+ * @param path : root of the scanned subtree
+ * @param num_threads : number of workers, including the calling thread. 0 means one per online CPU
+ * @param result : where to store the reductions
+ * @return : error code / success
+ */
+int tree_aggregate(Tree* tree, const char* path, size_t num_threads, TreeAggregate* result);
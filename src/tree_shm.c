@@ -0,0 +1,636 @@
+#define _GNU_SOURCE // memfd_create
+
+#include "tree_shm.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Position of a block in the region, counted from its start. */
+typedef uint64_t ShmOffset;
+
+/** Offset standing for no block **/
+#define SHM_NULL 0
+/** Table entry left by a removed subdirectory, for the probes to go on past it **/
+#define SHM_TOMBSTONE 1
+/** Size of the smallest blocks **/
+#define SHM_MIN_BLOCK 32
+/** Number of block sizes, each twice the previous one **/
+#define SHM_CLASSES 48
+/** Number of entries of a new directory's table **/
+#define SHM_MIN_TABLE 8
+
+/* Start of the region. */
+typedef struct ShmHeader {
+    char magic[8];                       /** TREE_SHM_MAGIC, written last when the region is ready **/
+    uint64_t size;                       /** Size of the region **/
+    pthread_mutex_t allocator;           /** Protects the fields below **/
+    uint64_t used;                       /** End of the part of the region blocks have been cut off from **/
+    ShmOffset free_lists[SHM_CLASSES];   /** Freed blocks of each size, linked through their first bytes **/
+    ShmOffset root;                      /** Root directory **/
+} ShmHeader;
+
+/* Subdirectories of a directory, replaced as a whole when it grows. */
+typedef struct ShmTable {
+    uint64_t capacity;    /** Number of entries, a power of two **/
+    ShmOffset entries[];  /** Subdirectories, SHM_NULL or SHM_TOMBSTONE for unused entries **/
+} ShmTable;
+
+/* A directory. */
+typedef struct ShmNode {
+    pthread_mutex_t mutex; /** Robust, process-shared lock of the directory and its table **/
+    ShmOffset name;        /** Name of the directory, protected by its parent's mutex. SHM_NULL for the root **/
+    ShmOffset table;       /** Its `ShmTable` **/
+    uint64_t count;        /** Number of subdirectories **/
+    uint64_t tombstones;   /** Number of SHM_TOMBSTONE entries **/
+} ShmNode;
+
+struct TreeShm {
+    int fd;             /** Descriptor of the region **/
+    size_t size;        /** Size of the mapping **/
+    unsigned char* base; /** Start of the mapping **/
+    ShmHeader* header;  /** Same as `base` **/
+};
+
+/** Translates an offset into an address in the calling process **/
+#define SHM_AT(shm, offset) ((void*) ((shm)->base + (offset)))
+
+/**
+ * Initializes a mutex that can be shared by processes and recovered after its owner's death.
+ * @param mutex : mutex in the region
+ */
+static void init_robust_mutex(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attr;
+    PTHREAD_CHECK(pthread_mutexattr_init(&attr));
+    PTHREAD_CHECK(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+    PTHREAD_CHECK(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+    PTHREAD_CHECK(pthread_mutex_init(mutex, &attr));
+    PTHREAD_CHECK(pthread_mutexattr_destroy(&attr));
+}
+
+/**
+ * Recounts the subdirectories of a directory whose lock's owner died while changing them.
+ * Entries are published with single stores, only the counters may lag behind.
+ * @param shm : handle of the tree
+ * @param node : the directory
+ */
+static void repair(TreeShm* shm, ShmNode* node) {
+    ShmTable* table = SHM_AT(shm, node->table);
+    node->count = node->tombstones = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->entries[i] == SHM_TOMBSTONE)
+            node->tombstones++;
+        else if (table->entries[i] != SHM_NULL)
+            node->count++;
+    }
+}
+
+/**
+ * Takes a robust mutex, recovering it if its owner died.
+ * @param shm : handle of the tree
+ * @param mutex : the mutex
+ * @param node : directory the mutex protects, to be repaired after a death. NULL for the allocator
+ */
+static void lock_robust(TreeShm* shm, pthread_mutex_t* mutex, ShmNode* node) {
+    int status = pthread_mutex_lock(mutex);
+    if (status == EOWNERDEAD) {
+        if (node)
+            repair(shm, node);
+        PTHREAD_CHECK(pthread_mutex_consistent(mutex));
+    }
+    else {
+        PTHREAD_CHECK(status);
+    }
+}
+
+/**
+ * Gets the size class of a block.
+ * @param size : requested size of the block
+ * @return : index of the smallest class holding it
+ */
+static inline size_t size_class(size_t size) {
+    size_t class = 0;
+    while (((size_t) SHM_MIN_BLOCK << class) < size)
+        class++;
+    return class;
+}
+
+/**
+ * Allocates a block of the region.
+ * @param shm : handle of the tree
+ * @param size : size of the block
+ * @return : offset of the block, SHM_NULL if the region is full
+ */
+static ShmOffset shm_alloc(TreeShm* shm, size_t size) {
+    ShmHeader* header = shm->header;
+    size_t class = size_class(size), block = (size_t) SHM_MIN_BLOCK << class;
+    ShmOffset result = SHM_NULL;
+    if (class >= SHM_CLASSES)
+        return SHM_NULL;
+    lock_robust(shm, &header->allocator, NULL);
+    if (header->free_lists[class] != SHM_NULL) {
+        result = header->free_lists[class];
+        header->free_lists[class] = *(ShmOffset*) SHM_AT(shm, result);
+    }
+    else if (header->used + block <= header->size) {
+        result = header->used;
+        header->used += block;
+    }
+    PTHREAD_CHECK(pthread_mutex_unlock(&header->allocator));
+    return result;
+}
+
+/**
+ * Returns a block to the free list of its size.
+ * @param shm : handle of the tree
+ * @param offset : offset of the block
+ * @param size : size it was allocated with
+ */
+static void shm_free(TreeShm* shm, ShmOffset offset, size_t size) {
+    ShmHeader* header = shm->header;
+    size_t class = size_class(size);
+    lock_robust(shm, &header->allocator, NULL);
+    *(ShmOffset*) SHM_AT(shm, offset) = header->free_lists[class];
+    header->free_lists[class] = offset;
+    PTHREAD_CHECK(pthread_mutex_unlock(&header->allocator));
+}
+
+/** Size of a table block with the given number of entries **/
+static inline size_t table_size(size_t capacity) {
+    return sizeof(ShmTable) + capacity * sizeof(ShmOffset);
+}
+
+/**
+ * Allocates an empty table.
+ * @param shm : handle of the tree
+ * @param capacity : number of entries, a power of two
+ * @return : offset of the table, SHM_NULL if the region is full
+ */
+static ShmOffset table_new(TreeShm* shm, size_t capacity) {
+    ShmOffset offset = shm_alloc(shm, table_size(capacity));
+    if (offset != SHM_NULL) {
+        ShmTable* table = SHM_AT(shm, offset);
+        table->capacity = capacity;
+        memset(table->entries, 0, capacity * sizeof(ShmOffset));
+    }
+    return offset;
+}
+
+/**
+ * Allocates an unlinked directory without subdirectories.
+ * @param shm : handle of the tree
+ * @param name : its name, NULL for the root
+ * @return : offset of the directory, SHM_NULL if the region is full
+ */
+static ShmOffset shm_node_new(TreeShm* shm, const char* name) {
+    ShmOffset offset = shm_alloc(shm, sizeof(ShmNode)), name_offset = SHM_NULL, table = SHM_NULL;
+    size_t name_size = name ? strlen(name) + 1 : 0;
+    if (offset != SHM_NULL && name)
+        name_offset = shm_alloc(shm, name_size);
+    if (offset != SHM_NULL && (!name || name_offset != SHM_NULL))
+        table = table_new(shm, SHM_MIN_TABLE);
+    if (table == SHM_NULL) {
+        if (name_offset != SHM_NULL)
+            shm_free(shm, name_offset, name_size);
+        if (offset != SHM_NULL)
+            shm_free(shm, offset, sizeof(ShmNode));
+        return SHM_NULL; // The region is full
+    }
+
+    ShmNode* node = SHM_AT(shm, offset);
+    init_robust_mutex(&node->mutex);
+    if (name)
+        memcpy(SHM_AT(shm, name_offset), name, name_size);
+    node->name = name_offset;
+    node->table = table;
+    node->count = node->tombstones = 0;
+    return offset;
+}
+
+/**
+ * Frees an unlinked directory without subdirectories.
+ * @param shm : handle of the tree
+ * @param offset : offset of the directory
+ */
+static void shm_node_free(TreeShm* shm, ShmOffset offset) {
+    ShmNode* node = SHM_AT(shm, offset);
+    ShmTable* table = SHM_AT(shm, node->table);
+    PTHREAD_CHECK(pthread_mutex_destroy(&node->mutex));
+    shm_free(shm, node->table, table_size(table->capacity));
+    shm_free(shm, node->name, strlen(SHM_AT(shm, node->name)) + 1);
+    shm_free(shm, offset, sizeof(ShmNode));
+}
+
+/** FNV-1a hash of a name **/
+static inline uint64_t hash_name(const char* name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 1099511628211ULL;
+    return hash;
+}
+
+/**
+ * Looks up a subdirectory of a locked directory.
+ * @param shm : handle of the tree
+ * @param node : the directory
+ * @param name : name of the subdirectory
+ * @param slot : where to store the index of its entry if it exists, or of the entry it would be inserted at.
+ *               May be NULL
+ * @return : offset of the subdirectory, SHM_NULL if it doesn't exist
+ */
+static ShmOffset lookup(TreeShm* shm, ShmNode* node, const char* name, size_t* slot) {
+    ShmTable* table = SHM_AT(shm, node->table);
+    size_t mask = table->capacity - 1, free_slot = SIZE_MAX, i = hash_name(name) & mask;
+    for (size_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+        ShmOffset entry = table->entries[i];
+        if (entry == SHM_NULL) {
+            break;
+        }
+        else if (entry == SHM_TOMBSTONE) {
+            if (free_slot == SIZE_MAX)
+                free_slot = i;
+        }
+        else if (strcmp(SHM_AT(shm, ((ShmNode*) SHM_AT(shm, entry))->name), name) == 0) {
+            if (slot)
+                *slot = i;
+            return entry;
+        }
+    }
+    if (slot)
+        *slot = free_slot != SIZE_MAX ? free_slot : i;
+    return SHM_NULL;
+}
+
+/**
+ * Makes sure that a subdirectory can be inserted into a locked directory without exceeding the load factor,
+ * replacing its table with a larger one, without tombstones, if needed.
+ * @param shm : handle of the tree
+ * @param node : the directory
+ * @return : false if the region is full
+ */
+static bool reserve(TreeShm* shm, ShmNode* node) {
+    ShmTable* old = SHM_AT(shm, node->table);
+    if ((node->count + node->tombstones + 1) * 4 <= old->capacity * 3)
+        return true;
+
+    size_t capacity = SHM_MIN_TABLE;
+    while ((node->count + 1) * 2 > capacity)
+        capacity *= 2;
+    ShmOffset offset = table_new(shm, capacity), old_offset = node->table;
+    if (offset == SHM_NULL)
+        return false; // The region is full
+    ShmTable* table = SHM_AT(shm, offset);
+    for (size_t i = 0; i < old->capacity; i++) {
+        ShmOffset entry = old->entries[i];
+        if (entry == SHM_NULL || entry == SHM_TOMBSTONE)
+            continue;
+        size_t j = hash_name(SHM_AT(shm, ((ShmNode*) SHM_AT(shm, entry))->name)) & (capacity - 1);
+        while (table->entries[j] != SHM_NULL)
+            j = (j + 1) & (capacity - 1);
+        table->entries[j] = entry;
+    }
+    node->table = offset; // Publishes the new table
+    node->tombstones = 0;
+    shm_free(shm, old_offset, table_size(old->capacity));
+    return true;
+}
+
+/**
+ * Links a subdirectory into a locked directory, which has room for it after `reserve`.
+ * @param shm : handle of the tree
+ * @param node : the directory
+ * @param child : offset of the subdirectory, whose name the directory doesn't have yet
+ */
+static void insert(TreeShm* shm, ShmNode* node, ShmOffset child) {
+    size_t slot;
+    lookup(shm, node, SHM_AT(shm, ((ShmNode*) SHM_AT(shm, child))->name), &slot);
+    ShmTable* table = SHM_AT(shm, node->table);
+    if (table->entries[slot] == SHM_TOMBSTONE)
+        node->tombstones--;
+    table->entries[slot] = child; // Publishes the subdirectory
+    node->count++;
+}
+
+/**
+ * Unlinks a subdirectory from a locked directory.
+ * @param shm : handle of the tree
+ * @param node : the directory
+ * @param slot : index of the subdirectory's entry
+ */
+static void unlink_entry(TreeShm* shm, ShmNode* node, size_t slot) {
+    ShmTable* table = SHM_AT(shm, node->table);
+    table->entries[slot] = SHM_TOMBSTONE;
+    node->count--;
+    node->tombstones++;
+}
+
+/**
+ * Gets a pointer to the directory specified by the path, locking it.
+ * The mutexes are taken hand-over-hand, each one while still holding its parent's.
+ * @param shm : handle of the tree
+ * @param start : directory the path is relative to
+ * @param path : file path
+ * @param start_locked : whether the caller holds `start`, which then stays locked
+ * @param result : where to store the locked directory
+ * @return : SUCCESS, or ENOENT if the directory doesn't exist, with nothing locked but a held `start`
+ */
+static int descend(TreeShm* shm, ShmNode* start, const char* path, bool start_locked, ShmNode** result) {
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* subpath = path;
+    ShmNode* node = start;
+    if (!start_locked)
+        lock_robust(shm, &node->mutex, node);
+    while ((subpath = split_path(subpath, component))) {
+        ShmOffset child = lookup(shm, node, component, NULL);
+        if (child != SHM_NULL)
+            lock_robust(shm, &((ShmNode*) SHM_AT(shm, child))->mutex, SHM_AT(shm, child));
+        if (node != start || !start_locked)
+            PTHREAD_CHECK(pthread_mutex_unlock(&node->mutex));
+        if (child == SHM_NULL)
+            return ENOENT; // The directory doesn't exist
+        node = SHM_AT(shm, child);
+    }
+    *result = node;
+    return SUCCESS;
+}
+
+/**
+ * Maps a region and checks that it holds a shared tree, unless it's being created.
+ * @param fd : descriptor of the region, owned by the handle from now on
+ * @param size : size of the region
+ * @param created : whether the region is new and empty
+ * @param result : where to store the handle
+ * @return : error code / success
+ */
+static int map_region(int fd, size_t size, bool created, TreeShm** result) {
+    if (size < sizeof(ShmHeader)) {
+        close(fd);
+        return EINVAL; // Too small for a shared tree
+    }
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    ShmHeader* header = base;
+    if (!created && (memcmp(header->magic, TREE_SHM_MAGIC, sizeof(header->magic)) != 0 || header->size != size)) {
+        munmap(base, size);
+        close(fd);
+        return EINVAL; // Not a shared tree, or not initialized yet
+    }
+    atomic_thread_fence(memory_order_acquire); // Pairs with the release in `tree_shm_new`
+
+    TreeShm* shm = safe_malloc(sizeof(TreeShm));
+    *shm = (TreeShm) {fd, size, base, header};
+    *result = shm;
+    return SUCCESS;
+}
+
+int tree_shm_new(const char* name, size_t size, TreeShm** result) {
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600) : memfd_create("file_tree", MFD_CLOEXEC);
+    if (fd < 0)
+        return errno; // The region can't be created
+    int err = ftruncate(fd, (off_t) size) == 0 ? SUCCESS : errno;
+    if (err == SUCCESS)
+        err = map_region(fd, size, true, result);
+    else
+        close(fd);
+    if (err != SUCCESS) {
+        if (name)
+            shm_unlink(name);
+        return err;
+    }
+
+    TreeShm* shm = *result;
+    ShmHeader* header = shm->header;
+    header->size = size;
+    header->used = (sizeof(ShmHeader) + SHM_MIN_BLOCK - 1) / SHM_MIN_BLOCK * SHM_MIN_BLOCK;
+    init_robust_mutex(&header->allocator);
+    if ((header->root = shm_node_new(shm, NULL)) == SHM_NULL) {
+        tree_shm_close(shm);
+        if (name)
+            shm_unlink(name);
+        return EINVAL; // Too small for an empty tree
+    }
+    atomic_thread_fence(memory_order_release); // Everything else is in place before the magic
+    memcpy(header->magic, TREE_SHM_MAGIC, sizeof(header->magic));
+    return SUCCESS;
+}
+
+/**
+ * Maps a shared tree from a descriptor of its region.
+ * @param fd : descriptor of the region, owned by the handle from now on
+ * @param result : where to store the handle
+ * @return : error code / success
+ */
+static int attach_owned(int fd, TreeShm** result) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    return map_region(fd, (size_t) st.st_size, false, result);
+}
+
+int tree_shm_open(const char* name, TreeShm** result) {
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return errno; // No such region, or no access to it
+    return attach_owned(fd, result);
+}
+
+int tree_shm_attach(int fd, TreeShm** result) {
+    int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own < 0)
+        return errno;
+    return attach_owned(own, result);
+}
+
+int tree_shm_fd(TreeShm* shm) {
+    return shm->fd;
+}
+
+void tree_shm_close(TreeShm* shm) {
+    munmap(shm->base, shm->size);
+    close(shm->fd);
+    free(shm);
+}
+
+/** Compares names for sorting them with `qsort` **/
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+char* tree_shm_list(TreeShm* shm, const char* path) {
+    if (!is_valid_path(path))
+        return NULL; // Invalid path
+    ShmNode* node = NULL;
+    if (descend(shm, SHM_AT(shm, shm->header->root), path, false, &node) != SUCCESS)
+        return NULL; // The directory doesn't exist
+
+    // Join the sorted names, as `make_map_contents_string` does
+    ShmTable* table = SHM_AT(shm, node->table);
+    const char** names = safe_malloc((node->count + 1) * sizeof(char*));
+    size_t count = 0, length = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        ShmOffset entry = table->entries[i];
+        if (entry == SHM_NULL || entry == SHM_TOMBSTONE)
+            continue;
+        names[count] = SHM_AT(shm, ((ShmNode*) SHM_AT(shm, entry))->name);
+        length += strlen(names[count++]) + 1;
+    }
+    qsort(names, count, sizeof(char*), compare_names);
+    char* result = safe_malloc(length ? length : 1);
+    char* position = result;
+    for (size_t i = 0; i < count; i++) {
+        size_t name_len = strlen(names[i]);
+        memcpy(position, names[i], name_len);
+        position += name_len;
+        *position++ = ',';
+    }
+    *(count ? position - 1 : position) = '\0';
+    PTHREAD_CHECK(pthread_mutex_unlock(&node->mutex));
+    free(names);
+    return result;
+}
+
+int tree_shm_create(TreeShm* shm, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EEXIST; // The root always exists
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, name, parent_path);
+    ShmNode* parent = NULL;
+    int err = descend(shm, SHM_AT(shm, shm->header->root), parent_path, false, &parent);
+    if (err != SUCCESS)
+        return err; // The directory's parent doesn't exist
+
+    ShmOffset child = SHM_NULL;
+    if (lookup(shm, parent, name, NULL) != SHM_NULL)
+        err = EEXIST; // The directory already exists
+    else if ((child = shm_node_new(shm, name)) == SHM_NULL)
+        err = ENOSPC; // The region is full
+    else if (!reserve(shm, parent))
+        err = ENOSPC;
+    else
+        insert(shm, parent, child);
+    PTHREAD_CHECK(pthread_mutex_unlock(&parent->mutex));
+    if (err == ENOSPC && child != SHM_NULL)
+        shm_node_free(shm, child);
+    return err;
+}
+
+int tree_shm_remove(TreeShm* shm, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EBUSY; // Cannot remove the root
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, name, parent_path);
+    ShmNode* parent = NULL;
+    int err = descend(shm, SHM_AT(shm, shm->header->root), parent_path, false, &parent);
+    if (err != SUCCESS)
+        return err; // The directory's parent doesn't exist
+
+    size_t slot;
+    ShmOffset offset = lookup(shm, parent, name, &slot);
+    if (offset == SHM_NULL) {
+        PTHREAD_CHECK(pthread_mutex_unlock(&parent->mutex));
+        return ENOENT; // The directory doesn't exist
+    }
+    // Wait for whoever is inside. Nobody else can get there, as we hold the parent
+    ShmNode* child = SHM_AT(shm, offset);
+    lock_robust(shm, &child->mutex, child);
+    if (child->count > 0) {
+        PTHREAD_CHECK(pthread_mutex_unlock(&child->mutex));
+        PTHREAD_CHECK(pthread_mutex_unlock(&parent->mutex));
+        return ENOTEMPTY; // The directory is not empty
+    }
+    unlink_entry(shm, parent, slot);
+    PTHREAD_CHECK(pthread_mutex_unlock(&child->mutex));
+    PTHREAD_CHECK(pthread_mutex_unlock(&parent->mutex));
+    shm_node_free(shm, offset);
+    return SUCCESS;
+}
+
+int tree_shm_move(TreeShm* shm, const char* s_path, const char* t_path) {
+    if (!is_valid_path(s_path) || !is_valid_path(t_path))
+        return EINVAL; // Invalid path names
+    if (IS_ROOT(s_path))
+        return EBUSY; // Can't move the root
+    if (IS_ROOT(t_path))
+        return EEXIST; // Can't assign a new root
+    if (is_ancestor(s_path, t_path))
+        return EMOVINGANCESTOR; // No directory can be moved to its descendant
+
+    char s_name[MAX_FOLDER_NAME_LENGTH + 1], t_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char s_parent_path[MAX_PATH_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1], lca_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(s_path, s_name, s_parent_path);
+    make_path_to_parent(t_path, t_name, t_parent_path);
+    make_path_to_LCA(s_path, t_path, lca_path);
+    size_t index_after_lca = strlen(lca_path) - 1;
+
+    // Hold the LCA while descending to both parents. Their paths below it branch off, so neither passes the other
+    ShmNode *lca = NULL, *s_parent = NULL, *t_parent = NULL;
+    int err = descend(shm, SHM_AT(shm, shm->header->root), lca_path, false, &lca);
+    if (err != SUCCESS)
+        return err; // Non-existent paths
+    if ((err = descend(shm, lca, s_parent_path + index_after_lca, true, &s_parent)) != SUCCESS) {
+        PTHREAD_CHECK(pthread_mutex_unlock(&lca->mutex));
+        return err; // The source's parent doesn't exist
+    }
+    if ((err = descend(shm, lca, t_parent_path + index_after_lca, true, &t_parent)) != SUCCESS) {
+        if (s_parent != lca)
+            PTHREAD_CHECK(pthread_mutex_unlock(&s_parent->mutex));
+        PTHREAD_CHECK(pthread_mutex_unlock(&lca->mutex));
+        return err; // The target's parent doesn't exist
+    }
+
+    size_t slot;
+    ShmOffset offset = SHM_NULL, old_name = SHM_NULL, new_name = SHM_NULL;
+    if (lookup(shm, s_parent, s_name, NULL) == SHM_NULL) {
+        err = ENOENT; // The source doesn't exist
+    }
+    else if (lookup(shm, t_parent, t_name, NULL) != SHM_NULL) {
+        err = strcmp(s_path, t_path) == 0 ? SUCCESS : EEXIST; // Nothing to move, or the target exists
+    }
+    else if (strcmp(s_name, t_name) != 0 && (new_name = shm_alloc(shm, strlen(t_name) + 1)) == SHM_NULL) {
+        err = ENOSPC; // The region is full
+    }
+    else if (!reserve(shm, t_parent)) {
+        err = ENOSPC;
+    }
+    else {
+        // Looked up again, as reserving may have rebuilt the table if both parents are the same
+        offset = lookup(shm, s_parent, s_name, &slot);
+        ShmNode* s_dir = SHM_AT(shm, offset);
+        unlink_entry(shm, s_parent, slot);
+        if (new_name != SHM_NULL) {
+            memcpy(SHM_AT(shm, new_name), t_name, strlen(t_name) + 1);
+            old_name = s_dir->name;
+            s_dir->name = new_name;
+        }
+        insert(shm, t_parent, offset);
+    }
+
+    if (t_parent != lca)
+        PTHREAD_CHECK(pthread_mutex_unlock(&t_parent->mutex));
+    if (s_parent != lca && s_parent != t_parent)
+        PTHREAD_CHECK(pthread_mutex_unlock(&s_parent->mutex));
+    PTHREAD_CHECK(pthread_mutex_unlock(&lca->mutex));
+    if (old_name != SHM_NULL)
+        shm_free(shm, old_name, strlen(s_name) + 1);
+    else if (new_name != SHM_NULL && offset == SHM_NULL)
+        shm_free(shm, new_name, strlen(t_name) + 1);
+    return err;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * A file tree living in a shared memory region, operated on by several processes at once.
+ *
+ * The region holds all the directories, linked by offsets from its start, so that every process
+ * can map it at its own address, and allocates them from itself: freed blocks are kept on a free list
+ * per power-of-two size, and new ones are cut off the unused rest of the region. The subdirectories
+ * of a directory are kept in an open-addressing table of offsets, hashed by name.
+ *
+ * Every directory has a process-shared robust mutex. Operations take them hand-over-hand from the root,
+ * holding the lowest common ancestor of a move and the paths below it to both parents, as the
+ * reader/writer locks of `Tree` do. Plain mutexes are used instead of reader/writer locks because
+ * they can be recovered: if a process dies while holding one, the next process to take it repairs
+ * the directory's counters and carries on. Every modification publishes its change with a single store,
+ * so the tree stays consistent after such a death, except that a move interrupted between unlinking
+ * the source and linking it under the target loses the moved subtree, and that blocks allocated
+ * by an interrupted operation may leak.
+ *
+ * The region has a fixed size, chosen when it is created. Journaling, snapshots, watches
+ * and the other facilities of `Tree` are not available for shared trees.
+ */
+
+/** First bytes of a shared tree region **/
+#define TREE_SHM_MAGIC "FTSHM001"
+
+/* A process's handle of a shared tree. */
+typedef struct TreeShm TreeShm;
+
+/**
+ * Creates a shared region with an empty tree and maps it.
+ * @param name : name of the region for `shm_open`, starting with '/',
+ *               or NULL for an anonymous `memfd` region, to be shared through `tree_shm_fd`
+ * @param size : size of the region in bytes, bounding the size of the tree
+ * @param result : where to store the handle
+ * @return : error code / success: EINVAL if the size is too small for an empty tree,
+ *           or the error of creating the region, EEXIST if the name is taken
+ */
+int tree_shm_new(const char* name, size_t size, TreeShm** result);
+
+/**
+ * Maps a shared tree created by another process under a name.
+ * @param name : name of the region passed to `tree_shm_new`
+ * @param result : where to store the handle
+ * @return : error code / success: EINVAL if the region doesn't hold a shared tree,
+ *           or the error of opening it, ENOENT if there is no such region
+ */
+int tree_shm_open(const char* name, TreeShm** result);
+
+/**
+ * Maps a shared tree from a file descriptor of its region, received from another process.
+ * The descriptor is duplicated, the caller keeps its own.
+ * @param fd : descriptor of the region
+ * @param result : where to store the handle
+ * @return : error code / success: EINVAL if the region doesn't hold a shared tree
+ */
+int tree_shm_attach(int fd, TreeShm** result);
+
+/**
+ * Gets the file descriptor of the region, for passing it to other processes.
+ * @param shm : handle of the tree
+ * @return : descriptor owned by the handle
+ */
+int tree_shm_fd(TreeShm* shm);
+
+/**
+ * Unmaps the tree from the calling process. The tree lives on as long as some process maps it
+ * or, for a named region, until the name is unlinked with `shm_unlink`.
+ * Has to be called while the process runs no operation on the tree.
+ * @param shm : handle of the tree
+ */
+void tree_shm_close(TreeShm* shm);
+
+/**
+ * Lists the subdirectories of a directory, as `tree_list`.
+ * @param shm : handle of the tree
+ * @param path : file path
+ * @return : comma-separated names of the subdirectories, NULL if the path is invalid or doesn't exist
+ */
+char* tree_shm_list(TreeShm* shm, const char* path);
+
+/**
+ * Creates a directory, as `tree_create`.
+ * @param shm : handle of the tree
+ * @param path : directory to create
+ * @return : as `tree_create`, or ENOSPC if the region is full
+ */
+int tree_shm_create(TreeShm* shm, const char* path);
+
+/**
+ * Removes an empty directory, as `tree_remove`.
+ * @param shm : handle of the tree
+ * @param path : directory to remove
+ * @return : as `tree_remove`
+ */
+int tree_shm_remove(TreeShm* shm, const char* path);
+
+/**
+ * Moves a directory with its subtree, as `tree_move`.
+ * @param shm : handle of the tree
+ * @param s_path : source directory
+ * @param t_path : target directory
+ * @return : as `tree_move`, or ENOSPC if the region is full
+ */
+int tree_shm_move(TreeShm* shm, const char* s_path, const char* t_path);
@@ -0,0 +1,285 @@
+#include "tree_snapshot.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Offset of the number of directories in an image **/
+#define SNAPSHOT_COUNT (sizeof(SNAPSHOT_MAGIC) - 1)
+/** Offset of the journal position in an image **/
+#define SNAPSHOT_POSITION (SNAPSHOT_COUNT + sizeof(uint64_t))
+/** Size of the image's header **/
+#define SNAPSHOT_HEADER (SNAPSHOT_POSITION + sizeof(uint64_t))
+
+/* An image being encoded. */
+typedef struct Image {
+    unsigned char* data; /** Encoded bytes **/
+    size_t size;         /** Bytes used in `data` **/
+    size_t capacity;     /** Bytes allocated for `data` **/
+} Image;
+
+/* A directory whose subdirectories are being visited. */
+typedef struct SaveFrame {
+    Tree* node;         /** Pinned directory **/
+    HashMapIterator it; /** Position among its subdirectories **/
+} SaveFrame;
+
+/**
+ * Appends bytes to an image.
+ * @param image : image being encoded
+ * @param bytes : bytes to append
+ * @param length : their number
+ */
+static void image_put(Image* image, const void* bytes, size_t length) {
+    reserve_buffer((void**) &image->data, &image->capacity, image->size + length);
+    memcpy(image->data + image->size, bytes, length);
+    image->size += length;
+}
+
+/**
+ * Appends a directory's record to an image.
+ * @param image : image being encoded
+ * @param name : name of the directory, "" for the root
+ * @param node : the directory
+ */
+static void image_put_node(Image* image, const char* name, Tree* node) {
+    unsigned char record[1 + MAX_FOLDER_NAME_LENGTH + 10];
+    size_t length = strlen(name), size = 0;
+    record[size++] = (unsigned char) length;
+    memcpy(record + size, name, length);
+    size += length;
+    for (uint64_t count = hmap_size(node->subdirectories); ; count >>= 7) {
+        if (count < 0x80) {
+            record[size++] = (unsigned char) count;
+            break;
+        }
+        record[size++] = (unsigned char) (count & 0x7f) | 0x80;
+    }
+    image_put(image, record, size);
+}
+
+/**
+ * Encodes the directories below a locked root in pre-order. Every directory stays locked
+ * until `unpin` is called, so modifications of the parts already encoded wait for the encoding to finish.
+ * @param root : locked root of the tree
+ * @param image : image to append to
+ * @return : number of directories encoded, the root included
+ */
+static uint64_t encode_pinned(Tree* root, Image* image) {
+    size_t stack_capacity = 16 * sizeof(SaveFrame), depth = 0;
+    SaveFrame* stack = safe_malloc(stack_capacity);
+    uint64_t count = 1;
+    const char* name = NULL;
+    void* value = NULL;
+
+    image_put_node(image, "", root);
+    stack[0] = (SaveFrame) {root, hmap_iterator(root->subdirectories)};
+    while (true) {
+        SaveFrame* top = &stack[depth];
+        if (!hmap_next(top->node->subdirectories, &top->it, &name, &value)) {
+            if (depth == 0)
+                break;
+            depth--;
+            continue;
+        }
+        Tree* child = value;
+        subtree_lock(child); // Released by `unpin`
+        image_put_node(image, name, child);
+        count++;
+        reserve_buffer((void**) &stack, &stack_capacity, (depth + 2) * sizeof(SaveFrame));
+        stack[++depth] = (SaveFrame) {child, hmap_iterator(child->subdirectories)};
+    }
+
+    free(stack);
+    return count;
+}
+
+/**
+ * Releases the descendants of the root locked by `encode_pinned`, in post-order.
+ * @param root : locked root of the tree
+ */
+static void unpin(Tree* root) {
+    size_t stack_capacity = 16 * sizeof(SaveFrame), depth = 0;
+    SaveFrame* stack = safe_malloc(stack_capacity);
+    const char* name = NULL;
+    void* value = NULL;
+
+    stack[0] = (SaveFrame) {root, hmap_iterator(root->subdirectories)};
+    while (true) {
+        SaveFrame* top = &stack[depth];
+        if (!hmap_next(top->node->subdirectories, &top->it, &name, &value)) {
+            if (depth == 0)
+                break;
+            subtree_unlock(top->node);
+            depth--;
+            continue;
+        }
+        reserve_buffer((void**) &stack, &stack_capacity, (depth + 2) * sizeof(SaveFrame));
+        stack[++depth] = (SaveFrame) {value, hmap_iterator(((Tree*) value)->subdirectories)};
+    }
+
+    free(stack);
+}
+
+int tree_save(Tree* tree, int fd) {
+    return snapshot_save(tree, fd, NULL, NULL);
+}
+
+int snapshot_save(Tree* tree, int fd, uint64_t (*position)(void* ctx), void* ctx) {
+    Image image = {safe_malloc(4096), 0, 4096};
+    uint64_t count = 0, at = 0;
+    image_put(&image, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+    image_put(&image, &count, sizeof(count)); // Filled in below
+    image_put(&image, &at, sizeof(at));
+
+    Tree* root = lock_subtree(tree, "/");
+    count = encode_pinned(root, &image);
+    if (position)
+        at = position(ctx); // Every directory is pinned, so no modification can be half-done
+    unpin(root);
+    unlock_subtree(root);
+    memcpy(image.data + SNAPSHOT_COUNT, &count, sizeof(count));
+    memcpy(image.data + SNAPSHOT_POSITION, &at, sizeof(at));
+
+    int err = SUCCESS;
+    for (size_t written = 0; written < image.size;) {
+        ssize_t n = write(fd, image.data + written, image.size - written);
+        if (n < 0 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+        if (n > 0)
+            written += n;
+    }
+    free(image.data);
+    return err;
+}
+
+/* A directory whose subdirectories are being decoded. */
+typedef struct LoadFrame {
+    Tree* node;         /** The directory **/
+    uint64_t remaining; /** Subdirectories still to be decoded **/
+    size_t path_len;    /** Length of the directory's path **/
+} LoadFrame;
+
+/**
+ * Reads a directory's record from an image.
+ * @param pos : position in the image, moved past the record
+ * @param end : end of the image
+ * @param name : buffer of MAX_FOLDER_NAME_LENGTH + 1 bytes to store the name in
+ * @param children : where to store the number of subdirectories
+ * @return : false if the record is malformed
+ */
+static bool read_node(const unsigned char** pos, const unsigned char* end, char* name, uint64_t* children) {
+    const unsigned char* p = *pos;
+    if (p == end)
+        return false;
+    size_t length = *p++;
+    if ((size_t) (end - p) < length)
+        return false;
+    for (size_t i = 0; i < length; i++) {
+        if (!islower(p[i]))
+            return false;
+        name[i] = (char) p[i];
+    }
+    name[length] = '\0';
+    p += length;
+
+    *children = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        if (p == end || shift > 63)
+            return false;
+        unsigned char byte = *p++;
+        *children |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    *pos = p;
+    return true;
+}
+
+/**
+ * Decodes the directories of an image into an empty tree.
+ * @param root : root of the empty tree
+ * @param data : the image
+ * @param size : its size
+ * @return : whether the image is valid
+ */
+static bool decode(Tree* root, const unsigned char* data, size_t size) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    const unsigned char *pos = data + SNAPSHOT_HEADER, *end = data + size;
+    uint64_t expected, decoded = 1, children;
+    memcpy(&expected, data + SNAPSHOT_COUNT, sizeof(expected));
+    if (!read_node(&pos, end, name, &children) || name[0] != '\0')
+        return false;
+
+    // A valid path has at most MAX_PATH_LENGTH / 2 components
+    LoadFrame* stack = safe_malloc((MAX_PATH_LENGTH / 2 + 1) * sizeof(LoadFrame));
+    size_t depth = 0;
+    bool valid = true;
+    stack[0] = (LoadFrame) {root, children, 1};
+    while (valid) {
+        LoadFrame* top = &stack[depth];
+        if (top->remaining == 0) {
+            if (depth == 0)
+                break;
+            stack[depth - 1].node->descendants += top->node->descendants + 1;
+            depth--;
+            continue;
+        }
+        top->remaining--;
+        // Every record takes at least 2 bytes
+        if (!read_node(&pos, end, name, &children) || name[0] == '\0' || children > (size_t) (end - pos) / 2
+            || top->path_len + strlen(name) + 1 > MAX_PATH_LENGTH) {
+            valid = false;
+            break;
+        }
+        Tree* child = node_new(top->node);
+        if (!hmap_insert(top->node->subdirectories, name, child)) {
+            tree_free(child);
+            valid = false; // Duplicate name
+            break;
+        }
+        decoded++;
+        stack[depth + 1] = (LoadFrame) {child, children, top->path_len + strlen(name) + 1};
+        depth++;
+    }
+
+    free(stack);
+    return valid && pos == end && decoded == expected;
+}
+
+int tree_load(int fd, const TreeOptions* options, Tree** result) {
+    uint64_t position;
+    return snapshot_load(fd, options, result, &position);
+}
+
+int snapshot_load(int fd, const TreeOptions* options, Tree** result, uint64_t* position) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return errno;
+    if (st.st_size < (off_t) SNAPSHOT_HEADER)
+        return EINVAL; // Too short to be an image
+
+    size_t size = st.st_size;
+    unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return errno;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    Tree* tree = tree_new_with_options(options);
+    bool valid = memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) == 0 && decode(tree, data, size);
+    memcpy(position, data + SNAPSHOT_POSITION, sizeof(*position));
+    munmap(data, size);
+    if (!valid) {
+        tree_free(tree);
+        return EINVAL; // Not an image, or a corrupted one
+    }
+    *result = tree;
+    return SUCCESS;
+}
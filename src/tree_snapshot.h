@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Tree.h"
+#include <stdint.h>
+
+/*
+ * Binary images of whole trees, for restarting without replaying the creation of every directory.
+ *
+ * An image starts with SNAPSHOT_MAGIC, the number of directories, root included, and the position
+ * of the journal the image corresponds to (0 if it wasn't taken by a journal checkpoint), as 64-bit integers
+ * in the byte order of the saving machine. Then come the directories in depth-first pre-order, each
+ * as its name's length (one byte, 0 for the root), the name and its number of subdirectories
+ * as a LEB128 varint. Subdirectories are listed in no particular order.
+ */
+
+/** First bytes of an image **/
+#define SNAPSHOT_MAGIC "FTSNAP02"
+
+/**
+ * Writes an image of the tree to a file descriptor, at its current offset.
+ * The image is consistent: the encoding takes a reader lock on every directory as it reaches it and holds
+ * all of them until the whole tree is encoded. Listings keep running, but every modification blocks,
+ * for a time proportional to the size of the tree; a modification of a part not reached yet blocks
+ * the encoding instead, until it's done. Writing the image to the descriptor happens after the locks
+ * are released. For a view which never blocks writers, see `tree_snapshot` in `tree_cow.h`.
+ * @param tree : file tree
+ * @param fd : descriptor open for writing
+ * @return : error code / success
+ */
+int tree_save(Tree* tree, int fd);
+
+/**
+ * Builds a tree from an image written by `tree_save`. The file is memory-mapped and decoded
+ * in a single pass, without any locking or path lookups.
+ * @param fd : descriptor of a regular file holding just the image, open for reading
+ * @param options : settings of the new tree, NULL for the defaults
+ * @param result : where to store the new tree
+ * @return : error code / success, EINVAL if the file isn't a valid image
+ */
+int tree_load(int fd, const TreeOptions* options, Tree** result);
+
+/**
+ * As `tree_save`, but stores a position of a journal in the image. Used by journal checkpoints.
+ * @param tree : file tree
+ * @param fd : descriptor open for writing
+ * @param position : called once the whole tree is pinned, while no modification is in progress,
+ *                   to get the position to store
+ * @param ctx : context passed to `position`
+ * @return : error code / success
+ */
+int snapshot_save(Tree* tree, int fd, uint64_t (*position)(void* ctx), void* ctx);
+
+/**
+ * As `tree_load`, but also reads the position of the journal stored in the image.
+ * @param fd : descriptor of a regular file holding just the image, open for reading
+ * @param options : settings of the new tree, NULL for the defaults
+ * @param result : where to store the new tree
+ * @param position : where to store the position
+ * @return : error code / success
+ */
+int snapshot_load(int fd, const TreeOptions* options, Tree** result, uint64_t* position);
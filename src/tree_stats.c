@@ -0,0 +1,204 @@
+#include "tree_stats.h"
+#include "tree_internal.h"
+#include "safe_allocations.h"
+#include <errno.h>
+
+#ifdef TREE_STATS
+
+/**
+ * Raises an atomic maximum.
+ * @param max : the maximum
+ * @param value : candidate value
+ */
+static inline void raise_max(atomic_uint_fast64_t* max, uint64_t value) {
+    uint_fast64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (seen < value && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed,
+                                                                 memory_order_relaxed));
+}
+
+void stats_acquired(Tree* node, uint64_t since) {
+    NodeStats* stats = &node->stats;
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (since == 0)
+        return;
+    uint64_t waited = monotonic_ns() - since;
+    atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->wait_ns, waited, memory_order_relaxed);
+    raise_max(&stats->max_wait_ns, waited);
+}
+
+void stats_stalled(Tree* node, uint64_t since) {
+    if (since != 0)
+        atomic_fetch_add_explicit(&node->stats.stall_ns, monotonic_ns() - since, memory_order_relaxed);
+}
+
+/**
+ * Takes a snapshot of the counters of a node.
+ * @param node : directory
+ * @param stats : where to store the counters
+ */
+static void read_node(Tree* node, TreeLockStats* stats) {
+    stats->acquisitions = atomic_load_explicit(&node->stats.acquisitions, memory_order_relaxed);
+    stats->contended = atomic_load_explicit(&node->stats.contended, memory_order_relaxed);
+    stats->wait_ns = atomic_load_explicit(&node->stats.wait_ns, memory_order_relaxed);
+    stats->max_wait_ns = atomic_load_explicit(&node->stats.max_wait_ns, memory_order_relaxed);
+    stats->stall_ns = atomic_load_explicit(&node->stats.stall_ns, memory_order_relaxed);
+}
+
+/**
+ * Adds one set of counters to another.
+ * @param into : counters to add to
+ * @param from : counters to add
+ */
+static void add_stats(TreeLockStats* into, const TreeLockStats* from) {
+    into->acquisitions += from->acquisitions;
+    into->contended += from->contended;
+    into->wait_ns += from->wait_ns;
+    if (from->max_wait_ns > into->max_wait_ns)
+        into->max_wait_ns = from->max_wait_ns;
+    into->stall_ns += from->stall_ns;
+}
+
+void stats_retire(Tree* node) {
+    TreeLockStats stats;
+    read_node(node, &stats);
+    UNDER_MUTEX(&node->context->retired_lock, add_stats(&node->context->retired, &stats));
+}
+
+/* State of a `tree_stats` walk. */
+typedef struct StatsWalk {
+    TreeLockStats total;  /** Counters summed up so far **/
+    TreeContention* top;  /** Min-heap of the most contended directories by `wait_ns` **/
+    size_t k;             /** Capacity of `top` **/
+    size_t count;         /** Size of the heap **/
+} StatsWalk;
+
+/** Orders directories by contention **/
+static inline bool less_contended(const TreeLockStats* a, const TreeLockStats* b) {
+    return a->wait_ns != b->wait_ns ? a->wait_ns < b->wait_ns : a->contended < b->contended;
+}
+
+/**
+ * Restores the heap property below a position of the heap.
+ * @param top : the heap
+ * @param count : its size
+ * @param i : position whose entry may be more contended than its children
+ */
+static void sift_down(TreeContention* top, size_t count, size_t i) {
+    while (true) {
+        size_t least = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && less_contended(&top[left].stats, &top[least].stats))
+            least = left;
+        if (right < count && less_contended(&top[right].stats, &top[least].stats))
+            least = right;
+        if (least == i)
+            return;
+        TreeContention swap = top[i];
+        top[i] = top[least];
+        top[least] = swap;
+        i = least;
+    }
+}
+
+/**
+ * Offers a directory to the heap of the most contended ones.
+ * @param walk : state of the walk
+ * @param path : path of the directory's parent, or the directory's own path if `name` is NULL
+ * @param name : name of the directory, NULL for the root of the walk
+ * @param stats : counters of the directory
+ */
+static void offer(StatsWalk* walk, const char* path, const char* name, const TreeLockStats* stats) {
+    if (stats->wait_ns == 0 || walk->k == 0)
+        return;
+    if (walk->count == walk->k && !less_contended(&walk->top[0].stats, stats))
+        return;
+
+    size_t path_len = strlen(path), name_len = name ? strlen(name) : 0;
+    char* full = safe_malloc(path_len + name_len + 2);
+    memcpy(full, path, path_len);
+    if (name) {
+        memcpy(full + path_len, name, name_len);
+        full[path_len + name_len] = '/';
+        full[path_len + name_len + 1] = '\0';
+    }
+    else {
+        full[path_len] = '\0';
+    }
+
+    if (walk->count == walk->k) {
+        free(walk->top[0].path); // Evicts the least contended one
+        walk->top[0] = (TreeContention) {full, *stats};
+        sift_down(walk->top, walk->count, 0);
+        return;
+    }
+    size_t i = walk->count++;
+    walk->top[i] = (TreeContention) {full, *stats};
+    while (i > 0 && less_contended(&walk->top[i].stats, &walk->top[(i - 1) / 2].stats)) {
+        TreeContention swap = walk->top[i];
+        walk->top[i] = walk->top[(i - 1) / 2];
+        walk->top[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+}
+
+/** Collects the counters of a directory visited by `walk_subtree` **/
+static bool visit_stats(const char* path, const char* name, Tree* node, void* ctx) {
+    StatsWalk* walk = ctx;
+    TreeLockStats stats;
+    read_node(node, &stats);
+    add_stats(&walk->total, &stats);
+    offer(walk, path, name, &stats);
+    return true;
+}
+
+int tree_stats(Tree* tree, TreeLockStats* total, TreeContention* top, size_t k, size_t* count) {
+    StatsWalk walk = {.top = top, .k = k};
+    Tree* root = lock_subtree(tree, "/");
+
+    TreeLockStats stats;
+    read_node(root, &stats);
+    add_stats(&walk.total, &stats);
+    offer(&walk, "/", NULL, &stats);
+    walk_subtree(root, "/", visit_stats, &walk);
+    unlock_subtree(root);
+
+    UNDER_MUTEX(&tree->context->retired_lock, add_stats(&walk.total, &tree->context->retired));
+    // Heap order to most contended first: repeatedly moves the least contended one past the heap's end
+    for (size_t n = walk.count; n > 1; n--) {
+        TreeContention swap = top[0];
+        top[0] = top[n - 1];
+        top[n - 1] = swap;
+        sift_down(top, n - 1, 0);
+    }
+    if (total)
+        *total = walk.total;
+    *count = walk.count;
+    return SUCCESS;
+}
+
+#else
+
+void stats_acquired(Tree* node, uint64_t since) {
+    (void) node;
+    (void) since;
+}
+
+void stats_stalled(Tree* node, uint64_t since) {
+    (void) node;
+    (void) since;
+}
+
+void stats_retire(Tree* node) {
+    (void) node;
+}
+
+int tree_stats(Tree* tree, TreeLockStats* total, TreeContention* top, size_t k, size_t* count) {
+    (void) tree;
+    (void) total;
+    (void) top;
+    (void) k;
+    *count = 0;
+    return ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Tree.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock contention counters of every directory and of the whole tree. They are only kept when
+ * the library is compiled with TREE_STATS defined; otherwise the hooks in the locking code
+ * compile to nothing and `tree_stats` fails with ENOTSUP.
+ *
+ * Every node counts its own acquisitions with relaxed atomics next to its lock, and only
+ * contended acquisitions read the clock. The totals of the tree are summed up on read,
+ * including the counters of directories removed in the meantime.
+ */
+
+/* Lock counters of a directory, or of a whole tree. */
+typedef struct TreeLockStats {
+    uint64_t acquisitions; /** Locks taken on the directory, in any mode **/
+    uint64_t contended;    /** Acquisitions which had to wait for other threads **/
+    uint64_t wait_ns;      /** Total time spent in the contended acquisitions **/
+    uint64_t max_wait_ns;  /** Longest single wait **/
+    uint64_t stall_ns;     /** Time removals and moves of the directory waited for the operations
+                               inside of it to finish, included in `wait_ns` with TREE_ENGINE_INTENTION **/
+} TreeLockStats;
+
+/* A directory reported by `tree_stats`. */
+typedef struct TreeContention {
+    char* path;          /** Path of the directory, to be freed by the caller **/
+    TreeLockStats stats; /** Its counters **/
+} TreeContention;
+
+/**
+ * Reads the lock counters of the tree and finds its most contended directories, by total wait time.
+ * The tree is read-locked while it's walked, so the counters of different directories
+ * may be taken at slightly different moments.
+ * @param tree : file tree
+ * @param total : where to store the counters of the whole tree, NULL if not needed
+ * @param top : where to store up to `k` most contended directories, most contended first
+ * @param k : capacity of `top`
+ * @param count : where to store the number of directories stored in `top`, which never wait 0 ns
+ * @return : error code / success, ENOTSUP if the library was built without TREE_STATS
+ */
+int tree_stats(Tree* tree, TreeLockStats* total, TreeContention* top, size_t k, size_t* count);
+
+/**
+ * Counts an acquired lock. Used by the hooks in the locking code.
+ * @param node : locked directory
+ * @param since : when the caller started waiting, from `WAIT_CLOCK`, 0 if it didn't
+ */
+void stats_acquired(Tree* node, uint64_t since);
+
+/**
+ * Counts time a removal or move waited for the operations inside the directory to finish.
+ * @param node : directory being removed or moved
+ * @param since : when the waiting started, from `WAIT_CLOCK`, 0 if it didn't
+ */
+void stats_stalled(Tree* node, uint64_t since);
+
+/**
+ * Adds the counters of a directory being freed to the totals of its tree.
+ * @param node : unlinked directory, not the root
+ */
+void stats_retire(Tree* node);
+
+#ifdef TREE_STATS
+/** Counts an acquired lock, see `stats_acquired` **/
+#define STATS_ACQUIRED(node, since) stats_acquired(node, since)
+/** Counts a stall, see `stats_stalled` **/
+#define STATS_STALLED(node, since) stats_stalled(node, since)
+/** Keeps the counters of a freed directory, see `stats_retire` **/
+#define STATS_RETIRE(node) stats_retire(node)
+#else
+#define STATS_ACQUIRED(node, since) ((void) (since))
+#define STATS_STALLED(node, since) ((void) (since))
+#define STATS_RETIRE(node) do {} while (0)
+#endif
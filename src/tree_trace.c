@@ -0,0 +1,117 @@
+#include "tree_trace.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+/** Initial size of a thread's buffer in bytes **/
+#define TRACE_BUFFER_INITIAL 65536
+
+typedef struct TraceBuffer TraceBuffer;
+
+/* Calls recorded by a single thread. */
+struct TraceBuffer {
+    uint32_t thread_id;  /** Identifier stored in the thread's records **/
+    unsigned char* data; /** Encoded records **/
+    size_t size;         /** Bytes used in `data` **/
+    size_t capacity;     /** Bytes allocated for `data` **/
+    TraceBuffer* next;   /** Next buffer in the registry **/
+};
+
+/** Buffers of all threads that ever recorded a call. They live until the process exits **/
+static TraceBuffer* registry = NULL;
+/** Protects `registry` and `next_thread_id` **/
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_thread_id = 0;
+/** Whether calls are being recorded **/
+static atomic_bool recording = false;
+/** Buffer of the calling thread, NULL until it records its first call **/
+static _Thread_local TraceBuffer* local_buffer = NULL;
+
+uint64_t trace_clock(void) {
+    return monotonic_ns();
+}
+
+/**
+ * Gets the calling thread's buffer, registering a new one on its first call.
+ * @return : the buffer
+ */
+static TraceBuffer* thread_buffer(void) {
+    if (!local_buffer) {
+        TraceBuffer* buffer = safe_calloc(1, sizeof(TraceBuffer));
+        buffer->data = safe_malloc(TRACE_BUFFER_INITIAL);
+        buffer->capacity = TRACE_BUFFER_INITIAL;
+        UNDER_MUTEX(&registry_mutex,
+            buffer->thread_id = next_thread_id++;
+            buffer->next = registry;
+            registry = buffer;
+        );
+        local_buffer = buffer;
+    }
+    return local_buffer;
+}
+
+void trace_record(TraceOp op, uint64_t timestamp, const char* path, const char* target, int result) {
+    if (!atomic_load_explicit(&recording, memory_order_relaxed))
+        return;
+
+    TraceBuffer* buffer = thread_buffer();
+    size_t path_len = path ? strlen(path) : 0, target_len = target ? strlen(target) : 0;
+    if (path_len > UINT16_MAX)
+        path_len = UINT16_MAX; // Longer than any valid path anyway
+    if (target_len > UINT16_MAX)
+        target_len = UINT16_MAX;
+
+    size_t needed = buffer->size + sizeof(TraceRecord) + path_len + target_len;
+    if (needed > buffer->capacity) {
+        while (buffer->capacity < needed)
+            buffer->capacity *= 2;
+        buffer->data = safe_realloc(buffer->data, buffer->capacity);
+    }
+
+    TraceRecord record = {
+        .timestamp = timestamp,
+        .thread_id = buffer->thread_id,
+        .result = result,
+        .path_len = (uint16_t) path_len,
+        .target_len = (uint16_t) target_len,
+        .op = (uint8_t) op,
+    };
+    unsigned char* out = buffer->data + buffer->size;
+    memcpy(out, &record, sizeof(TraceRecord));
+    if (path_len)
+        memcpy(out + sizeof(TraceRecord), path, path_len);
+    if (target_len)
+        memcpy(out + sizeof(TraceRecord) + path_len, target, target_len);
+    buffer->size = needed;
+}
+
+void tree_trace_start(void) {
+    UNDER_MUTEX(&registry_mutex,
+        for (TraceBuffer* buffer = registry; buffer; buffer = buffer->next)
+            buffer->size = 0;
+    );
+    atomic_store(&recording, true);
+}
+
+void tree_trace_stop(void) {
+    atomic_store(&recording, false);
+}
+
+int tree_trace_dump(const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+        return errno;
+
+    bool written = fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file) == strlen(TRACE_MAGIC);
+    UNDER_MUTEX(&registry_mutex,
+        for (TraceBuffer* buffer = registry; buffer && written; buffer = buffer->next)
+            written = fwrite(buffer->data, 1, buffer->size, file) == buffer->size;
+    );
+    int err = written ? 0 : EIO;
+    if (fclose(file) != 0 && err == 0)
+        err = errno;
+    return err;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recorder of the calls of `tree_list`, `tree_create`, `tree_remove` and `tree_move` (and their
+ * timed variants). The operations only call it when the library is compiled with TREE_TRACE defined;
+ * otherwise the hooks compile to nothing and traces stay empty.
+ *
+ * Every thread appends to its own buffer, so recording takes no locks. A trace file starts with
+ * TRACE_MAGIC, followed by records: a `TraceRecord` and then its `path_len` + `target_len` bytes
+ * of paths. Records of a single thread are in the order of their calls; the file is not sorted
+ * by time across threads. Integers are stored in the byte order of the recording machine.
+ */
+
+/** First bytes of a trace file **/
+#define TRACE_MAGIC "FTTRACE1"
+
+/* Traced operations. */
+typedef enum TraceOp {
+    TRACE_LIST = 0,
+    TRACE_CREATE,
+    TRACE_REMOVE,
+    TRACE_MOVE,
+
+    TRACE_OPS
+} TraceOp;
+
+/* Fixed-size part of a recorded call. */
+typedef struct TraceRecord {
+    uint64_t timestamp;  /** CLOCK_MONOTONIC time of the call in nanoseconds **/
+    uint32_t thread_id;  /** Small number identifying the calling thread within the trace **/
+    int32_t result;      /** Error code / success returned by the call **/
+    uint16_t path_len;   /** Length of the path, which follows the record **/
+    uint16_t target_len; /** Length of the move target, which follows the path **/
+    uint8_t op;          /** Traced operation, as `TraceOp` **/
+    uint8_t padding[3];  /** Zeros **/
+} TraceRecord;
+
+/**
+ * Starts recording, discarding everything recorded before.
+ * Has to be called while no traced operation is running.
+ */
+void tree_trace_start(void);
+
+/**
+ * Stops recording. Calls already in progress may still be recorded.
+ */
+void tree_trace_stop(void);
+
+/**
+ * Writes all recorded calls to a file.
+ * Has to be called after `tree_trace_stop`, while no traced operation is running.
+ * @param filename : path of the trace file
+ * @return : error code / success
+ */
+int tree_trace_dump(const char* filename);
+
+/**
+ * Records a finished call. Used by the hooks in the operations.
+ * @param op : traced operation
+ * @param timestamp : time of the call, from `trace_clock`
+ * @param path : path argument, NULL counting as empty
+ * @param target : move target, NULL for other operations
+ * @param result : error code / success returned by the call
+ */
+void trace_record(TraceOp op, uint64_t timestamp, const char* path, const char* target, int result);
+
+/**
+ * Reads the clock used for timestamps.
+ * @return : CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t trace_clock(void);
+
+#ifdef TREE_TRACE
+/** Notes the start time of a traced call in a new variable `var` **/
+#define TRACE_BEGIN(var) uint64_t var = trace_clock()
+/** Records a traced call started by `TRACE_BEGIN(var)` **/
+#define TRACE_END(var, op, path, target, result) trace_record(op, var, path, target, result)
+#else
+#define TRACE_BEGIN(var) do {} while (0)
+#define TRACE_END(var, op, path, target, result) do {} while (0)
+#endif
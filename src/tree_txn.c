@@ -0,0 +1,523 @@
+#include "tree_txn.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+
+/* A recorded modification. */
+typedef struct TxnOp {
+    JournalOp op;  /** The modification **/
+    char* path;    /** Directory it creates, removes or moves **/
+    char* target;  /** Target of a move, NULL otherwise **/
+} TxnOp;
+
+struct TreeTxn {
+    Tree* tree;              /** File tree **/
+    TxnOp* ops;              /** Recorded modifications, in order **/
+    size_t count, capacity;  /** Number of recorded and allocated modifications **/
+};
+
+/* What an applied modification did, for undoing it and for finishing the commit. */
+typedef struct TxnUndo {
+    Tree* node;      /** The created, removed or moved directory, NULL if the modification changed nothing **/
+    Tree* parent;    /** Its parent before the modification, or the parent it was created in **/
+    Tree* t_parent;  /** Its parent after a move **/
+    ssize_t moved;   /** Size of a moved subtree, including its root **/
+} TxnUndo;
+
+/* State of a commit. */
+typedef struct TxnCommit {
+    TreeTxn* txn;       /** The transaction **/
+    Tree* lca;          /** Locked common ancestor of everything the transaction touches **/
+    size_t lca_length;  /** Length of its path, without the trailing '/' **/
+    Tree** held;        /** Directories write-locked below the ancestor, for TREE_ENGINE_RW **/
+    size_t held_count;
+    TxnUndo* undo;      /** What each applied modification did **/
+} TxnCommit;
+
+/* A directory on the path being locked by `lock_paths`. */
+typedef struct TxnFrame {
+    Tree* node;        /** The directory, write-locked **/
+    const char* path;  /** Path it was reached by, relative to the ancestor **/
+    size_t length;     /** Length of the directory's part of `path` **/
+} TxnFrame;
+
+TreeTxn* tree_txn_begin(Tree* tree) {
+    TreeTxn* txn = safe_calloc(1, sizeof(TreeTxn));
+    txn->tree = tree;
+    return txn;
+}
+
+/**
+ * Appends a modification to a transaction.
+ * @param txn : transaction
+ * @param op : the modification
+ * @param path : directory it creates, removes or moves
+ * @param target : target of a move, NULL otherwise
+ */
+static void record(TreeTxn* txn, JournalOp op, const char* path, const char* target) {
+    if (txn->count == txn->capacity) {
+        txn->capacity = txn->capacity ? 2 * txn->capacity : 8;
+        txn->ops = safe_realloc(txn->ops, txn->capacity * sizeof(TxnOp));
+    }
+    txn->ops[txn->count++] = (TxnOp) {op, strdup(path), target ? strdup(target) : NULL};
+}
+
+int tree_txn_create(TreeTxn* txn, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EEXIST; // The root always exists
+    record(txn, JOURNAL_CREATE, path, NULL);
+    return SUCCESS;
+}
+
+int tree_txn_remove(TreeTxn* txn, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EBUSY; // Cannot remove the root
+    record(txn, JOURNAL_REMOVE, path, NULL);
+    return SUCCESS;
+}
+
+int tree_txn_move(TreeTxn* txn, const char* s_path, const char* t_path) {
+    if (!is_valid_path(s_path) || !is_valid_path(t_path))
+        return EINVAL; // Invalid path names
+    if (IS_ROOT(s_path))
+        return EBUSY; // Can't move the root
+    if (IS_ROOT(t_path))
+        return EEXIST; // Can't assign a new root
+    if (is_ancestor(s_path, t_path))
+        return EMOVINGANCESTOR; // No directory can be moved to its descendant
+    record(txn, JOURNAL_MOVE, s_path, t_path);
+    return SUCCESS;
+}
+
+void tree_txn_abort(TreeTxn* txn) {
+    for (size_t i = 0; i < txn->count; i++) {
+        free(txn->ops[i].path);
+        free(txn->ops[i].target);
+    }
+    free(txn->ops);
+    free(txn);
+}
+
+/**
+ * Widens a common ancestor so that it also holds the parent of a directory.
+ * @param lca_path : path of the ancestor so far, updated
+ * @param length : its length, 0 if there is no ancestor yet
+ * @param path : path of the directory
+ * @return : length of the new ancestor's path
+ */
+static size_t include_parent(char lca_path[MAX_PATH_LENGTH + 1], size_t length, const char* path) {
+    char parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, NULL, parent_path);
+    if (length == 0) {
+        strcpy(lca_path, parent_path);
+        return strlen(lca_path);
+    }
+
+    size_t i = 0;
+    while (i < length && lca_path[i] == parent_path[i])
+        i++;
+    // The paths may diverge in the middle of a component - drop its common prefix
+    while (lca_path[i - 1] != '/')
+        i--;
+    lca_path[i] = '\0';
+    return i;
+}
+
+/**
+ * Finds the deepest directory whose subtree holds the parents of all the directories the transaction
+ * creates, removes or moves, as `make_path_to_LCA` does for a single move.
+ * @param txn : non-empty transaction
+ * @param lca_path : where to store the path of the directory
+ */
+static void find_lca(TreeTxn* txn, char lca_path[MAX_PATH_LENGTH + 1]) {
+    size_t length = 0;
+    for (size_t i = 0; i < txn->count; i++) {
+        length = include_parent(lca_path, length, txn->ops[i].path);
+        if (txn->ops[i].target)
+            length = include_parent(lca_path, length, txn->ops[i].target);
+    }
+}
+
+/**
+ * Translates the path a modification refers to a directory by into the path the directory had
+ * before the transaction, undoing the renames of the moves recorded before the modification.
+ * @param txn : transaction
+ * @param index : index of the modification
+ * @param path : path of a directory as the modification sees it
+ * @return : the directory's path before the transaction, to be freed by the caller
+ */
+static char* path_before(TreeTxn* txn, size_t index, const char* path) {
+    char* current = strdup(path);
+    for (size_t i = index; i-- > 0;) {
+        TxnOp* op = &txn->ops[i];
+        size_t t_length = op->op == JOURNAL_MOVE ? strlen(op->target) : 0;
+        if (t_length == 0 || strncmp(current, op->target, t_length) != 0)
+            continue; // Not inside the moved subtree
+        size_t s_length = strlen(op->path);
+        char* renamed = safe_malloc(s_length + strlen(current) - t_length + 1);
+        memcpy(renamed, op->path, s_length);
+        strcpy(renamed + s_length, current + t_length);
+        free(current);
+        current = renamed;
+    }
+    return current;
+}
+
+/** Compares two paths by `strcmp`, for `qsort` **/
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Lists the directories below the ancestor that the reader/writer locks have to be taken on:
+ * the ones whose maps are modified and the removed ones, which have to be drained.
+ * Directories the transaction itself reaches by new paths are listed by their paths before it.
+ * @param commit : commit with the ancestor's path length set
+ * @param count : where to store the number of listed paths
+ * @return : sorted array of distinct paths relative to the ancestor, to be freed by the caller with the paths
+ */
+static char** list_lock_paths(TxnCommit* commit, size_t* count) {
+    TreeTxn* txn = commit->txn;
+    char parent_path[MAX_PATH_LENGTH + 1];
+    char** paths = safe_malloc(2 * txn->count * sizeof(char*));
+    size_t n = 0;
+
+    for (size_t i = 0; i < txn->count; i++) {
+        TxnOp* op = &txn->ops[i];
+        if (op->op == JOURNAL_REMOVE) {
+            paths[n++] = path_before(txn, i, op->path);
+        }
+        else {
+            make_path_to_parent(op->path, NULL, parent_path);
+            paths[n++] = path_before(txn, i, parent_path);
+        }
+        if (op->op == JOURNAL_MOVE) {
+            make_path_to_parent(op->target, NULL, parent_path);
+            paths[n++] = path_before(txn, i, parent_path);
+        }
+    }
+    // Make them relative to the ancestor, keeping its trailing '/'
+    for (size_t i = 0; i < n; i++)
+        memmove(paths[i], paths[i] + commit->lca_length, strlen(paths[i] + commit->lca_length) + 1);
+
+    // The pre-order of the tree is the `strcmp` order of the paths, as '/' sorts before letters
+    qsort(paths, n, sizeof(char*), compare_paths);
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (distinct > 0 && strcmp(paths[distinct - 1], paths[i]) == 0)
+            free(paths[i]);
+        else
+            paths[distinct++] = paths[i];
+    }
+    *count = distinct;
+    return paths;
+}
+
+/**
+ * Write-locks the directories on the listed paths below the locked ancestor, in pre-order,
+ * keeping every one of them until the commit ends. A path that doesn't exist is locked as far as it does:
+ * whatever the transaction creates below it is out of others' reach anyway.
+ * @param commit : commit with the ancestor locked
+ * @param paths : sorted paths relative to the ancestor
+ * @param count : number of paths
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : SUCCESS, or ETIMEDOUT with the directories locked so far in `commit->held`
+ */
+static int lock_paths(TxnCommit* commit, char** paths, size_t count, const struct timespec* deadline) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    size_t capacity = 16, depth = 0, held_capacity = 16;
+    TxnFrame* stack = safe_malloc(capacity * sizeof(TxnFrame));
+    commit->held = safe_malloc(held_capacity * sizeof(Tree*));
+    stack[0] = (TxnFrame) {commit->lca, "/", 1};
+    int err = SUCCESS;
+
+    for (size_t i = 0; i < count && err == SUCCESS; i++) {
+        const char* path = paths[i];
+        // Keep the directories on the way to this one
+        while (depth > 0 && strncmp(path, stack[depth].path, stack[depth].length) != 0)
+            depth--;
+
+        const char* rest = path + stack[depth].length - 1;
+        while ((rest = split_path(rest, name))) {
+            Tree* child = hmap_get(stack[depth].node->subdirectories, name);
+            if (!child)
+                break;
+            if ((err = writer_lock_until(child, deadline)) != SUCCESS)
+                break;
+            if (commit->held_count == held_capacity) {
+                held_capacity *= 2;
+                commit->held = safe_realloc(commit->held, held_capacity * sizeof(Tree*));
+            }
+            commit->held[commit->held_count++] = child;
+            if (depth + 2 > capacity) {
+                capacity *= 2;
+                stack = safe_realloc(stack, capacity * sizeof(TxnFrame));
+            }
+            stack[depth + 1] = (TxnFrame) {child, path, rest - path + 1};
+            depth++;
+        }
+    }
+
+    free(stack);
+    return err;
+}
+
+/**
+ * Finds a directory below the locked ancestor, as the transaction has changed the tree so far.
+ * @param commit : commit in progress
+ * @param path : absolute path inside the ancestor's subtree
+ * @return : the directory, NULL if it doesn't exist
+ */
+static Tree* resolve(TxnCommit* commit, const char* path) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* rest = path + commit->lca_length;
+    Tree* node = commit->lca;
+    while (node && (rest = split_path(rest, name)))
+        node = hmap_get(node->subdirectories, name);
+    return node;
+}
+
+/**
+ * Applies a recorded modification, checking it as the matching `tree_*` function would.
+ * @param commit : commit in progress
+ * @param op : the modification
+ * @param undo : where to store what it did
+ * @return : error code / success
+ */
+static int apply(TxnCommit* commit, TxnOp* op, TxnUndo* undo) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(op->path, name, parent_path);
+    Tree* parent = resolve(commit, parent_path);
+    if (!parent)
+        return ENOENT; // The directory's parent doesn't exist
+    Tree* node = hmap_get(parent->subdirectories, name);
+    *undo = (TxnUndo) {NULL, parent, NULL, 0};
+
+    if (op->op == JOURNAL_CREATE) {
+        if (node)
+            return EEXIST; // The directory already exists
+        undo->node = node_new(parent);
+        UNDER_MUTEX(&parent->var_protection,
+            cow_preserve(parent);
+            hmap_insert(parent->subdirectories, name, undo->node);
+        );
+        return SUCCESS;
+    }
+    if (op->op == JOURNAL_REMOVE) {
+        if (!node)
+            return ENOENT; // The directory doesn't exist
+        if (hmap_size(node->subdirectories) > 0)
+            return ENOTEMPTY; // The directory is not empty
+        UNDER_MUTEX(&parent->var_protection,
+            cow_preserve(parent);
+            hmap_remove(parent->subdirectories, name);
+        );
+        undo->node = node;
+        return SUCCESS;
+    }
+
+    char t_name[MAX_FOLDER_NAME_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(op->target, t_name, t_parent_path);
+    Tree* t_parent = resolve(commit, t_parent_path);
+    if (!t_parent)
+        return ENOENT; // The target's parent doesn't exist
+    if (!node)
+        return ENOENT; // The source doesn't exist
+    if (hmap_get(t_parent->subdirectories, t_name))
+        return strcmp(op->path, op->target) == 0 ? SUCCESS : EEXIST; // Nothing to move, or the target exists
+
+    UNDER_MUTEX(&parent->var_protection,
+        cow_preserve(parent);
+        hmap_remove(parent->subdirectories, name);
+    );
+    UNDER_MUTEX(&t_parent->var_protection,
+        cow_preserve(t_parent);
+        hmap_insert(t_parent->subdirectories, t_name, node);
+    );
+    UNDER_MUTEX(&node->var_protection,
+        undo->moved = node->descendants + 1;
+        node->parent = t_parent;
+        mark_moved(node);
+    );
+    undo->node = node;
+    undo->t_parent = t_parent;
+    return SUCCESS;
+}
+
+/**
+ * Reverts an applied modification. The maps it changed have been preserved for snapshots already.
+ * @param op : the modification
+ * @param undo : what it did
+ */
+static void revert(TxnOp* op, TxnUndo* undo) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1], t_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    if (!undo->node)
+        return;
+    make_path_to_parent(op->path, name, parent_path);
+
+    if (op->op == JOURNAL_CREATE) {
+        UNDER_MUTEX(&undo->parent->var_protection, hmap_remove(undo->parent->subdirectories, name));
+        tree_free(undo->node);
+    }
+    else if (op->op == JOURNAL_REMOVE) {
+        UNDER_MUTEX(&undo->parent->var_protection, hmap_insert(undo->parent->subdirectories, name, undo->node));
+    }
+    else {
+        make_path_to_parent(op->target, t_name, parent_path);
+        UNDER_MUTEX(&undo->t_parent->var_protection, hmap_remove(undo->t_parent->subdirectories, t_name));
+        UNDER_MUTEX(&undo->parent->var_protection, hmap_insert(undo->parent->subdirectories, name, undo->node));
+        UNDER_MUTEX(&undo->node->var_protection, undo->node->parent = undo->parent);
+    }
+}
+
+/**
+ * Publishes the applied modifications: updates the directory counters, which readers would otherwise
+ * see changing one modification at a time, and journals the modifications as one group, all while the locks are held.
+ * @param commit : commit whose every modification succeeded
+ */
+static void finish(TxnCommit* commit) {
+    TreeTxn* txn = commit->txn;
+    JournalEntry* entries = safe_malloc(txn->count * sizeof(JournalEntry));
+    size_t journaled = 0;
+    for (size_t i = 0; i < txn->count; i++) {
+        TxnOp* op = &txn->ops[i];
+        TxnUndo* undo = &commit->undo[i];
+        if (!undo->node)
+            continue;
+        if (op->op == JOURNAL_CREATE) {
+            propagate_size(undo->parent, 1);
+        }
+        else if (op->op == JOURNAL_REMOVE) {
+            propagate_size(undo->parent, -1);
+            UNDER_MUTEX(&undo->parent->var_protection, cow_unlinked(undo->node));
+        }
+        else {
+            // Nobody waits for the source: with intention locks, whoever would holds the LCA as well
+            if (undo->parent != undo->t_parent) {
+                propagate_size(undo->parent, -undo->moved);
+                propagate_size(undo->t_parent, undo->moved);
+            }
+        }
+        entries[journaled++] = (JournalEntry) {op->op, op->path, op->target};
+        watch_notify(commit->lca, op->op, op->path, op->target);
+    }
+    journal_append_group(commit->lca, entries, journaled);
+    free(entries);
+}
+
+/**
+ * Frees the directories removed by a finished commit once the locks are released.
+ * Their own locks are left alone: nobody can hold or wait for them without holding the LCA.
+ * @param commit : finished commit
+ */
+static void retire_removed(TxnCommit* commit) {
+    for (size_t i = 0; i < commit->txn->count; i++) {
+        if (commit->txn->ops[i].op != JOURNAL_REMOVE || !commit->undo[i].node)
+            continue;
+        cow_retire(commit->undo[i].node);
+    }
+}
+
+/**
+ * Releases the locks taken by a commit.
+ * @param commit : commit holding its locks
+ */
+static void unlock_all(TxnCommit* commit) {
+    if (USES_INTENTION_LOCKS(commit->txn->tree)) {
+        intention_unlock_path(commit->lca, LOCK_X);
+        return;
+    }
+    while (commit->held_count > 0)
+        writer_unlock(commit->held[--commit->held_count]);
+    writer_unlock(commit->lca);
+}
+
+/** Performs `tree_txn_commit_timed` on a non-empty transaction, leaving the transaction to the caller **/
+static int commit_until(TreeTxn* txn, const struct timespec* deadline, size_t* failed) {
+    Tree* tree = txn->tree;
+    char lca_path[MAX_PATH_LENGTH + 1];
+    bool moves = false;
+    for (size_t i = 0; i < txn->count; i++)
+        moves |= txn->ops[i].op == JOURNAL_MOVE;
+    find_lca(txn, lca_path);
+    TxnCommit commit = {txn, NULL, strlen(lca_path) - 1, NULL, 0, NULL};
+    uint64_t epoch = 0;
+    PublishMode published = PUBLISH_NONE;
+
+    *failed = txn->count;
+
+    int err;
+    if (USES_INTENTION_LOCKS(tree)) {
+        // Drains the whole subtree, so nothing below needs locking
+        err = intention_lock_path(tree, lca_path, LOCK_X, deadline, &commit.lca);
+    }
+    else if ((err = get_node_since(tree, lca_path, WRITER, deadline, &epoch, &commit.lca)) == SUCCESS) {
+        size_t count = 0;
+        char** paths = list_lock_paths(&commit, &count);
+        if ((err = lock_paths(&commit, paths, count, deadline)) == SUCCESS)
+            err = publish_begin(commit.lca, epoch, moves, &published);
+        if (err != SUCCESS)
+            unlock_all(&commit);
+        for (size_t i = 0; i < count; i++)
+            free(paths[i]);
+        free(paths);
+    }
+    if (err == SUCCESS && (err = cow_enter(tree, deadline)) != SUCCESS) {
+        publish_end(commit.lca, published);
+        unlock_all(&commit); // A snapshot being taken held the commit off until the deadline
+    }
+    if (err == ENOENT)
+        *failed = 0; // The ancestor holds the parent of the first modification's directory
+    if (err != SUCCESS) {
+        free(commit.held);
+        return err; // The ancestor doesn't exist, was moved or the deadline passed
+    }
+
+    commit.undo = safe_malloc(txn->count * sizeof(TxnUndo));
+    size_t applied = 0;
+    while (applied < txn->count && (err = apply(&commit, &txn->ops[applied], &commit.undo[applied])) == SUCCESS)
+        applied++;
+    if (err == SUCCESS) {
+        finish(&commit);
+    }
+    else {
+        *failed = applied;
+        while (applied-- > 0)
+            revert(&txn->ops[applied], &commit.undo[applied]);
+    }
+
+    cow_leave(tree);
+    publish_end(commit.lca, published);
+    unlock_all(&commit);
+    if (err == SUCCESS)
+        retire_removed(&commit);
+    if (err == SUCCESS)
+        err = journal_wait(); // After releasing every lock, so that others can join the same batch
+
+    free(commit.undo);
+    free(commit.held);
+    return err;
+}
+
+int tree_txn_commit(TreeTxn* txn, size_t* failed) {
+    return tree_txn_commit_timed(txn, NULL, failed);
+}
+
+int tree_txn_commit_timed(TreeTxn* txn, const struct timespec* deadline, size_t* failed) {
+    size_t index = 0;
+    int err = SUCCESS;
+    if (txn->count > 0) {
+        do {
+            err = commit_until(txn, deadline, &index);
+        } while (err == EPATHMOVED); // The ancestor was moved since it was found
+    }
+    if (failed && err != SUCCESS)
+        *failed = index;
+    tree_txn_abort(txn);
+    return err;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Tree.h"
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Groups of modifications applied atomically: other operations see either all of them or none.
+ *
+ * The modifications are only recorded until the commit. The commit locks the last common ancestor
+ * of everything they touch: with reader/writer locks it write-locks the ancestor and the paths below it
+ * to the touched directories, in the pre-order of the tree, and with intention locks it takes LOCK_X
+ * on the ancestor. Then it applies the modifications in order, undoing the applied ones if any fails.
+ * Transactions touching disjoint subtrees commit concurrently. A journaled transaction is recovered
+ * whole or not at all, see `tree_journal.h`.
+ */
+
+typedef struct TreeTxn TreeTxn;
+
+/**
+ * Starts recording a transaction.
+ * @param tree : file tree
+ * @return : empty transaction, to be finished with `tree_txn_commit` or `tree_txn_abort`
+ */
+TreeTxn* tree_txn_begin(Tree* tree);
+
+/**
+ * Records the creation of a directory, as `tree_create`.
+ * @param txn : transaction
+ * @param path : directory to create
+ * @return : SUCCESS, or the error `tree_create` would report regardless of the tree's contents,
+ *           in which case nothing is recorded
+ */
+int tree_txn_create(TreeTxn* txn, const char* path);
+
+/**
+ * Records the removal of a directory, as `tree_remove`.
+ * @param txn : transaction
+ * @param path : directory to remove
+ * @return : SUCCESS, or the error `tree_remove` would report regardless of the tree's contents,
+ *           in which case nothing is recorded
+ */
+int tree_txn_remove(TreeTxn* txn, const char* path);
+
+/**
+ * Records a move of a directory, as `tree_move`.
+ * @param txn : transaction
+ * @param s_path : source directory
+ * @param t_path : target directory
+ * @return : SUCCESS, or the error `tree_move` would report regardless of the tree's contents,
+ *           in which case nothing is recorded
+ */
+int tree_txn_move(TreeTxn* txn, const char* s_path, const char* t_path);
+
+/**
+ * Applies the recorded modifications in order, all of them or none, and frees the transaction.
+ * @param txn : transaction
+ * @param failed : where to store the index of the modification that failed, or the number of
+ *                 modifications if the whole transaction did. Left as is on success, may be NULL
+ * @return : SUCCESS, or the error of the failed modification as `tree_create` / `tree_remove` / `tree_move`
+ *           would report it at that point of the transaction
+ */
+int tree_txn_commit(TreeTxn* txn, size_t* failed);
+
+/**
+ * As `tree_txn_commit`, but gives up waiting for the locks at the `deadline`, with nothing applied.
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : as `tree_txn_commit`, or ETIMEDOUT if the deadline passed
+ */
+int tree_txn_commit_timed(TreeTxn* txn, const struct timespec* deadline, size_t* failed);
+
+/**
+ * Frees a transaction without applying anything.
+ * @param txn : transaction
+ */
+void tree_txn_abort(TreeTxn* txn);
@@ -0,0 +1,329 @@
+#include "tree_watch.h"
+#include "tree_internal.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+
+/* A place for a single event in the ring of a watch. */
+typedef struct WatchSlot {
+    atomic_size_t sequence; /** Position the slot is ready to be written at, or that position + 1 once written **/
+    TreeWatchKind kind;     /** Kind of the event written into the slot **/
+    char* path;             /** Path of the event written into the slot **/
+} WatchSlot;
+
+struct TreeWatch {
+    TreeWatches* watches;            /** Bookkeeping of the watched tree **/
+    char* path;                      /** Watched path **/
+    size_t length;                   /** Length of `path` **/
+    bool recursive;                  /** Whether changes anywhere below the path are reported **/
+    WatchSlot* slots;                /** Ring of the events **/
+    size_t mask;                     /** Number of slots - 1, the number being a power of two **/
+    _Alignas(64) atomic_size_t tail; /** Position the next event is pushed at **/
+    _Alignas(64) size_t head;        /** Position the next event is taken from, only used by the subscriber **/
+    atomic_bool overflowed;          /** Set when an event was dropped, until the subscriber is told **/
+    atomic_bool waiting;             /** Set while the subscriber waits in `tree_watch_wait` **/
+    pthread_mutex_t mutex;           /** For waiting in `tree_watch_wait` **/
+    pthread_cond_t delivered;        /** Signalled when an event is pushed while the subscriber waits **/
+};
+
+/* The watches of a tree at some point in time. Never changed once published, only replaced as a whole. */
+typedef struct WatchList {
+    size_t count;         /** Number of watches **/
+    TreeWatch* watches[]; /** The watches **/
+} WatchList;
+
+/*
+ * The modifications delivering events read the current list without any lock. Adding or removing a watch
+ * publishes a new list and waits until no modification can still be reading the old one before freeing it,
+ * together with the removed watch. The modifications count themselves in one of two counters, chosen by
+ * the phase they start in; the update flips the phase, so it only waits for the modifications that started
+ * before the flip, while the ones starting meanwhile count themselves in the other counter.
+ */
+struct TreeWatches {
+    _Atomic(WatchList*) list;                /** Current watches, NULL if there are none **/
+    atomic_uint phase;                       /** Counter the modifications starting now count themselves in **/
+    _Alignas(64) atomic_size_t readers[2];   /** Modifications delivering events, by the phase they started in **/
+    pthread_mutex_t lock;                    /** Serializes adding and removing watches **/
+};
+
+TreeWatches* watch_new(void) {
+    TreeWatches* watches = safe_calloc(1, sizeof(TreeWatches));
+    atomic_init(&watches->list, NULL);
+    atomic_init(&watches->phase, 0);
+    atomic_init(&watches->readers[0], 0);
+    atomic_init(&watches->readers[1], 0);
+    PTHREAD_CHECK(pthread_mutex_init(&watches->lock, NULL));
+    return watches;
+}
+
+void watch_free(TreeWatches* watches) {
+    assert(atomic_load(&watches->list) == NULL);
+    PTHREAD_CHECK(pthread_mutex_destroy(&watches->lock));
+    free(watches);
+}
+
+/**
+ * Replaces the list of watches and frees the old one once no modification can be reading it anymore.
+ * The caller has to hold the bookkeeping's lock.
+ * @param watches : bookkeeping of the tree
+ * @param list : new list, NULL if there are no watches left
+ */
+static void replace_list(TreeWatches* watches, WatchList* list) {
+    WatchList* old = atomic_exchange(&watches->list, list);
+    unsigned phase = atomic_load(&watches->phase);
+    atomic_store(&watches->phase, phase ^ 1);
+    // Whoever counted itself in the old phase may have read the old list; whoever starts now reads the new one
+    while (atomic_load(&watches->readers[phase]) > 0)
+        sched_yield();
+    free(old);
+}
+
+int tree_watch(Tree* tree, const char* path, bool recursive, size_t capacity, TreeWatch** result) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    size_t slots = 2;
+    while (slots < (capacity ? capacity : TREE_WATCH_DEFAULT_CAPACITY))
+        slots *= 2;
+
+    TreeWatch* watch = safe_calloc(1, sizeof(TreeWatch));
+    watch->watches = tree->context->watches;
+    watch->path = strdup(path);
+    watch->length = strlen(path);
+    watch->recursive = recursive;
+    watch->slots = safe_malloc(slots * sizeof(WatchSlot));
+    watch->mask = slots - 1;
+    for (size_t i = 0; i < slots; i++)
+        atomic_init(&watch->slots[i].sequence, i);
+    atomic_init(&watch->tail, 0);
+    atomic_init(&watch->overflowed, false);
+    atomic_init(&watch->waiting, false);
+    PTHREAD_CHECK(pthread_mutex_init(&watch->mutex, NULL));
+    cond_init_monotonic(&watch->delivered);
+
+    TreeWatches* watches = watch->watches;
+    PTHREAD_CHECK(pthread_mutex_lock(&watches->lock));
+    WatchList* old = atomic_load(&watches->list);
+    size_t count = old ? old->count : 0;
+    WatchList* list = safe_malloc(sizeof(WatchList) + (count + 1) * sizeof(TreeWatch*));
+    list->count = count + 1;
+    for (size_t i = 0; i < count; i++)
+        list->watches[i] = old->watches[i];
+    list->watches[count] = watch;
+    replace_list(watches, list);
+    PTHREAD_CHECK(pthread_mutex_unlock(&watches->lock));
+
+    *result = watch;
+    return SUCCESS;
+}
+
+void tree_unwatch(TreeWatch* watch) {
+    TreeWatches* watches = watch->watches;
+    PTHREAD_CHECK(pthread_mutex_lock(&watches->lock));
+    WatchList* old = atomic_load(&watches->list);
+    WatchList* list = NULL;
+    if (old->count > 1) {
+        list = safe_malloc(sizeof(WatchList) + (old->count - 1) * sizeof(TreeWatch*));
+        list->count = 0;
+        for (size_t i = 0; i < old->count; i++) {
+            if (old->watches[i] != watch)
+                list->watches[list->count++] = old->watches[i];
+        }
+    }
+    replace_list(watches, list);
+    PTHREAD_CHECK(pthread_mutex_unlock(&watches->lock));
+
+    // Nobody pushes anymore, so every claimed slot has been written
+    for (size_t position = watch->head; position != atomic_load(&watch->tail); position++)
+        free(watch->slots[position & watch->mask].path);
+    PTHREAD_CHECK(pthread_cond_destroy(&watch->delivered));
+    PTHREAD_CHECK(pthread_mutex_destroy(&watch->mutex));
+    free(watch->slots);
+    free(watch->path);
+    free(watch);
+}
+
+/**
+ * Wakes the subscriber of a watch if it waits for an event that has just been delivered.
+ * @param watch : the watch
+ */
+static void wake(TreeWatch* watch) {
+    // Pairs with the fence in `tree_watch_wait`: either the subscriber sees the event or we see it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&watch->waiting, memory_order_relaxed))
+        UNDER_MUTEX(&watch->mutex, PTHREAD_CHECK(pthread_cond_signal(&watch->delivered)));
+}
+
+/**
+ * Pushes an event into the ring of a watch, or notes the overflow if the ring is full.
+ * @param watch : the watch
+ * @param kind : kind of the event
+ * @param path : path of the event
+ */
+static void push(TreeWatch* watch, TreeWatchKind kind, const char* path) {
+    size_t position = atomic_load_explicit(&watch->tail, memory_order_relaxed);
+    WatchSlot* slot;
+    while (true) {
+        slot = &watch->slots[position & watch->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == position) {
+            // The slot is free, claim it unless another modification was faster
+            if (atomic_compare_exchange_weak_explicit(&watch->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if ((ptrdiff_t) (sequence - position) < 0) {
+            atomic_store(&watch->overflowed, true); // The slot still holds the event pushed a lap ago
+            wake(watch);
+            return;
+        }
+        else {
+            position = atomic_load_explicit(&watch->tail, memory_order_relaxed); // Somebody claimed the slot
+        }
+    }
+    slot->kind = kind;
+    slot->path = strdup(path);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    wake(watch);
+}
+
+/**
+ * Takes the oldest event out of the ring of a watch. Called by the subscriber.
+ * @param watch : the watch
+ * @param event : where to store the event
+ * @return : false if there is no event ready
+ */
+static bool take(TreeWatch* watch, TreeWatchEvent* event) {
+    WatchSlot* slot = &watch->slots[watch->head & watch->mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != watch->head + 1)
+        return false;
+    event->kind = slot->kind;
+    event->path = slot->path;
+    atomic_store_explicit(&slot->sequence, watch->head + watch->mask + 1, memory_order_release); // Free for the next lap
+    watch->head++;
+    return true;
+}
+
+/**
+ * Checks whether two paths lie on the same path in the tree, one of them being the other or its ancestor.
+ * @param path1 : first path
+ * @param path2 : second path
+ * @return : whether the paths are related
+ */
+static inline bool related(const char* path1, const char* path2) {
+    size_t length1 = strlen(path1), length2 = strlen(path2);
+    return strncmp(path1, path2, length1 < length2 ? length1 : length2) == 0;
+}
+
+/**
+ * Drops the pairs of events in a batch which undo each other, see `tree_watch_poll`.
+ * @param events : the batch, oldest first
+ * @param count : number of events in the batch
+ * @return : number of events left, moved to the front of the batch in the same order
+ */
+static size_t coalesce(TreeWatchEvent* events, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        TreeWatchKind undone;
+        if (events[i].kind == TREE_WATCH_REMOVED)
+            undone = TREE_WATCH_CREATED;
+        else if (events[i].kind == TREE_WATCH_MOVED_OUT)
+            undone = TREE_WATCH_MOVED_IN;
+        else
+            continue;
+        // Find the latest event still left on the same path, above or below it
+        size_t j = i;
+        while (j-- > 0 && !(events[j].path && related(events[j].path, events[i].path)));
+        if (j < i && events[j].kind == undone && strcmp(events[j].path, events[i].path) == 0) {
+            free(events[j].path);
+            free(events[i].path);
+            events[j].path = events[i].path = NULL;
+        }
+    }
+    size_t left = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].path)
+            events[left++] = events[i];
+    }
+    return left;
+}
+
+size_t tree_watch_poll(TreeWatch* watch, TreeWatchEvent* events, size_t max) {
+    size_t count = 0;
+    while (count < max && take(watch, &events[count]))
+        count++;
+    count = coalesce(events, count);
+    // Report the overflow after the events pushed before it, once there is room
+    if (count < max && atomic_load(&watch->overflowed) && atomic_exchange(&watch->overflowed, false))
+        events[count++] = (TreeWatchEvent) {TREE_WATCH_OVERFLOW, NULL};
+    return count;
+}
+
+/**
+ * Checks whether the subscriber of a watch has something to poll.
+ * @param watch : the watch
+ * @return : whether there is an event or an overflow to report
+ */
+static inline bool pending(TreeWatch* watch) {
+    WatchSlot* slot = &watch->slots[watch->head & watch->mask];
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) == watch->head + 1
+        || atomic_load(&watch->overflowed);
+}
+
+int tree_watch_wait(TreeWatch* watch, const struct timespec* deadline) {
+    int err = SUCCESS;
+    PTHREAD_CHECK(pthread_mutex_lock(&watch->mutex));
+    atomic_store_explicit(&watch->waiting, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst); // Pairs with the fence in `wake`
+    while (!pending(watch) && err == SUCCESS)
+        err = cond_wait_until(&watch->delivered, &watch->mutex, deadline);
+    atomic_store_explicit(&watch->waiting, false, memory_order_relaxed);
+    PTHREAD_CHECK(pthread_mutex_unlock(&watch->mutex));
+    return pending(watch) ? SUCCESS : err;
+}
+
+/**
+ * Checks whether a watch reports the changes of a directory.
+ * @param watch : the watch
+ * @param path : path of the directory
+ * @return : whether the directory is below the watched path, right below it if the watch isn't recursive
+ */
+static inline bool watches_path(TreeWatch* watch, const char* path) {
+    if (!is_ancestor(watch->path, path))
+        return false;
+    return watch->recursive || strchr(path + watch->length, '/') == path + strlen(path) - 1;
+}
+
+bool watch_active(TreeWatches* watches) {
+    return atomic_load(&watches->list) != NULL;
+}
+
+void watch_notify(Tree* node, JournalOp op, const char* path, const char* target) {
+    TreeWatches* watches = node->context->watches;
+    if (!watch_active(watches))
+        return;
+
+    // Count ourselves in the current phase, trying again if an update flipped it meanwhile
+    unsigned phase;
+    while (true) {
+        phase = atomic_load(&watches->phase);
+        atomic_fetch_add(&watches->readers[phase], 1);
+        if (atomic_load(&watches->phase) == phase)
+            break;
+        atomic_fetch_sub(&watches->readers[phase], 1);
+    }
+    WatchList* list = atomic_load(&watches->list);
+    for (size_t i = 0; list && i < list->count; i++) {
+        TreeWatch* watch = list->watches[i];
+        if (op == JOURNAL_MOVE) {
+            if (watches_path(watch, path))
+                push(watch, TREE_WATCH_MOVED_OUT, path);
+            if (watches_path(watch, target))
+                push(watch, TREE_WATCH_MOVED_IN, target);
+        }
+        else if (watches_path(watch, path)) {
+            push(watch, op == JOURNAL_CREATE ? TREE_WATCH_CREATED : TREE_WATCH_REMOVED, path);
+        }
+    }
+    atomic_fetch_sub(&watches->readers[phase], 1);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "Tree.h"
+#include "tree_journal.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Subscriptions to the changes of a directory, as an alternative to polling `tree_list`.
+ *
+ * A watch follows a path rather than a directory: it reports the modifications of the subdirectories
+ * found at that path, or anywhere below it if the watch is recursive, whichever directory the path
+ * leads to at the time. Each modification delivers its events while it still holds its locks, so the
+ * events of dependent modifications arrive in the order the modifications took effect.
+ *
+ * Events go through a bounded ring owned by the watch. The modifications push them without any lock,
+ * reading a copy of the tree's list of watches that adding or removing a watch replaces, and never wait
+ * for the subscriber, who takes the events out without any lock either. When the ring is full, the event is dropped and the subscriber later gets
+ * TREE_WATCH_OVERFLOW, after which it has to list the directory again.
+ *
+ * A directory arriving together with its subtree, moved in or imported, is reported once for its root.
+ */
+
+/* Kinds of watch events. */
+typedef enum TreeWatchKind {
+    TREE_WATCH_CREATED = 0, /** The directory was created, or imported **/
+    TREE_WATCH_REMOVED,     /** The directory was removed **/
+    TREE_WATCH_MOVED_IN,    /** A directory was moved to the path **/
+    TREE_WATCH_MOVED_OUT,   /** The directory was moved away from the path **/
+    TREE_WATCH_OVERFLOW,    /** Some events were dropped, because the ring was full **/
+} TreeWatchKind;
+
+/* A change reported by a watch. */
+typedef struct TreeWatchEvent {
+    TreeWatchKind kind; /** What happened **/
+    char* path;         /** Path of the directory, to be freed by the caller. NULL for TREE_WATCH_OVERFLOW **/
+} TreeWatchEvent;
+
+typedef struct TreeWatch TreeWatch;
+
+/* Watches of a tree, owned by its context. */
+typedef struct TreeWatches TreeWatches;
+
+/** Ring size used when none is given **/
+#define TREE_WATCH_DEFAULT_CAPACITY 1024
+
+/**
+ * Subscribes to the changes below a path. The path doesn't have to exist yet.
+ * Events of the modifications starting after the call returns are delivered.
+ * @param tree : file tree
+ * @param path : watched path
+ * @param recursive : whether to report changes anywhere below the path, not only of its subdirectories
+ * @param capacity : number of events the ring holds, rounded up to a power of two. 0 for TREE_WATCH_DEFAULT_CAPACITY
+ * @param result : where to store the watch, to be removed with `tree_unwatch`
+ * @return : error code / success: EINVAL for an invalid path
+ */
+int tree_watch(Tree* tree, const char* path, bool recursive, size_t capacity, TreeWatch** result);
+
+/**
+ * Takes the delivered events out of the ring, without waiting for new ones. Only one thread may poll a watch.
+ * Changes undone by the same batch are coalesced: a directory created or moved in and then removed or
+ * moved out again, with nothing else happening on its path in between, is left out together with both events.
+ * @param watch : the watch
+ * @param events : where to store the events, oldest first
+ * @param max : room in `events`
+ * @return : number of stored events, 0 if there were none
+ */
+size_t tree_watch_poll(TreeWatch* watch, TreeWatchEvent* events, size_t max);
+
+/**
+ * Waits until the watch has something to poll.
+ * @param watch : the watch
+ * @param deadline : absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return : SUCCESS, or ETIMEDOUT if the deadline passed with nothing delivered
+ */
+int tree_watch_wait(TreeWatch* watch, const struct timespec* deadline);
+
+/**
+ * Unsubscribes and frees the watch, with the events it still holds, once the modifications delivering
+ * events at the moment are done. All watches have to be removed before the tree is freed.
+ * @param watch : watch to remove
+ */
+void tree_unwatch(TreeWatch* watch);
+
+/**
+ * Creates the watch bookkeeping of a new tree.
+ * @return : bookkeeping without any watches
+ */
+TreeWatches* watch_new(void);
+
+/**
+ * Frees the watch bookkeeping of a tree being freed.
+ * @param watches : bookkeeping of the tree
+ */
+void watch_free(TreeWatches* watches);
+
+/**
+ * Checks whether a tree has any watches, which have to get the events of its modifications in order.
+ * @param watches : bookkeeping of the tree
+ * @return : whether there is a watch
+ */
+bool watch_active(TreeWatches* watches);
+
+/**
+ * Delivers the events of a successful modification to the matching watches.
+ * Called by the modifications while they hold their locks, next to `journal_append`.
+ * @param node : any directory of the tree
+ * @param op : the modification, as in the journal
+ * @param path : its path
+ * @param target : target of a move, NULL otherwise
+ */
+void watch_notify(Tree* node, JournalOp op, const char* path, const char* target);